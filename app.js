@@ -2,6 +2,8 @@ var express = require('express');
 var path = require('path');
 var split = require('split');
 var net = require('net');
+var dgram = require('dgram');
+var udpFrames = require('./server/udpFrames.js');
 
 var app = express();
 app.use("/css", express.static(__dirname + '/css'));
@@ -28,6 +30,31 @@ wss.on( "connection", function ( client ) {
 
 	wssConnections.push( client );
 
+	/* the browser reports where its virtual objects are as {roi: [x, y, w, h]} */
+	client.on( "message", function ( msg ) {
+
+		if ( typeof msg !== "string" || msg[ 0 ] !== "{" ) return;
+
+		try {
+
+			var control = JSON.parse( msg );
+			if ( control.roi ) {
+				client.roi = control.roi;
+				sendRoi();
+			}
+			if ( control.depths ) {
+				client.depths = control.depths;
+				sendDepths();
+			}
+
+		} catch ( e ) {
+
+			console.log( "Bad control message: " + msg );
+
+		}
+
+	} );
+
 	client.on( "close", function () {
 
 		console.log( "The connection to the browser is closed." );
@@ -36,11 +63,83 @@ wss.on( "connection", function ( client ) {
 
 		wssConnections.splice( idx, 1 );
 
+		sendRoi();
+		sendDepths();
+
 	} );
 
 } );
 
 
+// Forward the union of every browser's region of interest to the camera.
+// A browser that has not reported one needs the full frame.
+function sendRoi() {
+
+	var x0 = Infinity, y0 = Infinity, x1 = -Infinity, y1 = -Infinity;
+	var full = wssConnections.length == 0;
+	var empty = true;
+
+	wssConnections.forEach( function ( client ) {
+
+		if ( !client.roi ) {
+			full = true;
+			return;
+		}
+		if ( client.roi[ 2 ] <= 0 || client.roi[ 3 ] <= 0 ) return;
+		empty = false;
+		x0 = Math.min( x0, client.roi[ 0 ] );
+		y0 = Math.min( y0, client.roi[ 1 ] );
+		x1 = Math.max( x1, client.roi[ 0 ] + client.roi[ 2 ] );
+		y1 = Math.max( y1, client.roi[ 1 ] + client.roi[ 3 ] );
+
+	} );
+
+	// nothing virtual on screen: a 1 pixel ROI keeps the background streaming
+	var line = full ? "ROI 0 0 0 0\n" :
+		empty ? "ROI 0 0 1 1\n" :
+		"ROI " + Math.round( x0 ) + " " + Math.round( y0 ) + " " +
+			Math.round( x1 - x0 ) + " " + Math.round( y1 - y0 ) + "\n";
+
+	cameraSockets.forEach( function ( socket ) {
+		socket.write( line );
+	} );
+
+}
+
+
+// Forward the virtual object depths per grid cell for the occlusion mask
+// (realsense/occlusion_mask.hpp). Where several browsers report a depth for
+// the same cell the nearest one wins, so no virtual object is hidden wrongly;
+// browsers on a different grid than the first are left out.
+function sendDepths() {
+
+	var merged = null;
+
+	wssConnections.forEach( function ( client ) {
+
+		var depths = client.depths;
+		if ( !depths ) return;
+		if ( !merged ) {
+			merged = { cols: depths.cols, rows: depths.rows, values: depths.values.slice() };
+			return;
+		}
+		if ( depths.cols != merged.cols || depths.rows != merged.rows ) return;
+		depths.values.forEach( function ( d, i ) {
+			if ( d > 0 && ( merged.values[ i ] == 0 || d < merged.values[ i ] ) ) merged.values[ i ] = d;
+		} );
+
+	} );
+
+	var line = merged ? "DEPTHS " + merged.cols + " " + merged.rows + " " + merged.values.join( " " ) + "\n" :
+		"DEPTHS 0 0\n";
+
+	cameraSockets.forEach( function ( socket ) {
+		socket.write( line );
+	} );
+
+}
+
+
 var wss2 = new WebSocketServer( {port: 8082});
 var wss2Connections = [];
 
@@ -64,60 +163,209 @@ wss2.on( "connection", function ( client ) {
 
 
 
-// Establish socket for camera image data
-var rgbBufs = [];
-var rgbLen = 0;
-var server = net.createServer(function(socket) {
-	socket.binaryType = "arraybuffer";
-	socket.on("data", function(data){
-		if (data.length > 0)
+var wss3 = new WebSocketServer( {port: 8083});
+var wss3Connections = [];
+
+wss3.on( "connection", function ( client ) {
+
+	console.log( "The browser is connected to 8083." );
+
+	wss3Connections.push( client );
+
+	client.on( "close", function () {
+
+		console.log( "The connection to the browser is closed." );
+
+		var idx = wss3Connections.indexOf( client );
+
+		wss3Connections.splice( idx, 1 );
+
+	} );
+
+} );
+
+
+
+// Split a TCP byte stream into packets. headerSize bytes are buffered first,
+// then packetLength(header) tells how long the whole packet is, or 0 if the
+// header is not valid; the reader then skips a byte at a time until one is.
+function packetReader(headerSize, packetLength, onPacket) {
+	var bufs = [];
+	var len = 0;
+	var skipped = 0;
+	return function(data) {
+		bufs.push(data);
+		len += data.length;
+		while (len >= headerSize)
 		{
-			rgbLen += data.length;
-			rgbBufs.push(data);
-			if (rgbLen > 480*640*3) {
-			    // once we have a full frame, concatenate and send to front end
-                wssConnections.forEach( function ( socket ) {
-					socket.send(Buffer.concat(rgbBufs, 480*640*3));
-					rgbBufs = [];
-					rgbLen = 0;
-				} );
+			var pending = bufs.length == 1 ? bufs[0] : Buffer.concat(bufs, len);
+			var packetLen = packetLength(pending);
+			if (packetLen == 0) {
+				bufs = [pending.slice(1)];
+				len -= 1;
+				skipped += 1;
+				continue;
+			}
+			if (skipped) {
+				console.log("skipped " + skipped + " bytes of a bad packet");
+				skipped = 0;
 			}
+			if (len < packetLen) {
+				bufs = [pending];
+				break;
+			}
+			onPacket(pending.slice(0, packetLen));
+			bufs = [pending.slice(packetLen)];
+			len -= packetLen;
 		}
+	};
+}
+
+// Image tiles start with a frame header (see server/frame_header.h): magic,
+// header size (uint16 at 4), channels (byte 7), frame width and height
+// (uint16 at 12 and 14) and payload size (uint32 at 28). A tile holds at most
+// the whole frame, 4/3 of it as base64 text; a header outside that is not a
+// frame header.
+var FRAME_HEADER_MIN_SIZE = 32;
+var FRAME_HEADER_MAX_SIZE = 1024;
+var FRAME_MAGIC = 0x314d5246;
+var FRAME_MAX_PAYLOAD = 32 << 20;
+function frameLength(header) {
+	var headerSize = header.readUInt16LE(4);
+	var payloadSize = header.readUInt32LE(28);
+	var frameBytes = header.readUInt16LE(12) * header.readUInt16LE(14) * Math.max(header.readUInt8(7), 1);
+	if (header.readUInt32LE(0) != FRAME_MAGIC || headerSize < FRAME_HEADER_MIN_SIZE ||
+		headerSize > FRAME_HEADER_MAX_SIZE || payloadSize > FRAME_MAX_PAYLOAD ||
+		payloadSize > Math.ceil(frameBytes / 3) * 4) {
+		return 0;
+	}
+	return headerSize + payloadSize;
+}
+
+// Tiles sent in base64 debug mode (flag 4, flags are at byte 25) carry base64
+// text; the browser gets the decoded bytes with the flag cleared.
+var FRAME_TILE_BASE64 = 4;
+function decodeTile(tile) {
+	var flags = tile.readUInt8(25);
+	if (!(flags & FRAME_TILE_BASE64)) {
+		return tile;
+	}
+	var headerSize = tile.readUInt16LE(4);
+	var payload = Buffer.from(tile.slice(headerSize).toString("ascii"), "base64");
+	var header = Buffer.from(tile.slice(0, headerSize));
+	header.writeUInt8(flags & ~FRAME_TILE_BASE64, 25);
+	header.writeUInt32LE(payload.length, 28);
+	return Buffer.concat([header, payload]);
+}
+
+function broadcast(connections, packet) {
+	connections.forEach( function ( socket ) {
+		socket.send(packet);
+	} );
+}
+
+// Camera sockets on 3490; the browser's region of interest is written back
+// to them (see realsense/roi_stream.hpp)
+var cameraSockets = [];
+
+// Establish socket for camera image data
+var server = net.createServer(function(socket) {
+	cameraSockets.push(socket);
+	socket.on("data", packetReader(FRAME_HEADER_MIN_SIZE, frameLength, function(tile) {
+		// tiles are composited into whole frames by the front end
+		broadcast(wssConnections, decodeTile(tile));
+	}));
+	socket.on("close", function() {
+		cameraSockets.splice(cameraSockets.indexOf(socket), 1);
+	});
+	socket.on("error", function(err) {
+		console.log("camera socket error: " + err);
 	});
+	sendRoi();
+	sendDepths();
 });
 
 
 
 // Establish socket to for camera depth data
-var depthBufs = [];
 var server2 = net.createServer(function(socket) {
-	socket.binaryType = "arraybuffer";
-	var totalLength = 0;
-	socket.on("data", function(data){
-		if (data.length > 0)
-		{
-			totalLength += data.length;
-			depthBufs.push(data);
-			if (totalLength > 640*480) {
-				wss2Connections.forEach( function ( socket ) {
-				    // once we have a full frame, concatenate and send to front end
-                    socket.send(Buffer.concat(depthBufs, 640*480));
-					depthBufs = [];
-					totalLength = 0;
-				} );
+	socket.on("data", packetReader(FRAME_HEADER_MIN_SIZE, frameLength, function(tile) {
+		broadcast(wss2Connections, decodeTile(tile));
+	}));
+});
+
+
+
+// Establish socket for the occlusion mesh. Mesh packets vary in size, so
+// each one starts with a 16 byte header (see realsense/depth_mesh.hpp):
+// magic, width, height (uint16), vertex count, index count (uint32). Indices
+// are 16-bit, so there are at most 65536 vertices and two triangles per
+// lattice cell; a header outside that is not a mesh header.
+var MESH_HEADER_SIZE = 16;
+var DEPTH_MESH_MAGIC = 0x3148534d;
+var MESH_MAX_VERTICES = 65536;
+function meshLength(header) {
+	var vertices = header.readUInt32LE(8);
+	var indices = header.readUInt32LE(12);
+	if (header.readUInt32LE(0) != DEPTH_MESH_MAGIC || vertices > MESH_MAX_VERTICES ||
+		indices % 3 != 0 || indices > MESH_MAX_VERTICES * 6) {
+		return 0;
+	}
+	return MESH_HEADER_SIZE + vertices * 6 + indices * 2;
+}
+
+var server3 = net.createServer(function(socket) {
+	socket.on("data", packetReader(MESH_HEADER_SIZE, meshLength, function(packet) {
+		broadcast(wss3Connections, packet);
+	}));
+});
+
+
+
+// Frames from cpp-headless --udp, on the same port numbers over UDP. Each
+// frame is the tiles of one stream back to back; a frame that does not come
+// in complete within UDP_DEADLINE_MS is dropped (see server/udpFrames.js).
+var UDP_DEADLINE_MS = 50;
+function udpCamera(port, connections) {
+	var socket = dgram.createSocket('udp4');
+	var frames = new udpFrames.Reassembler(UDP_DEADLINE_MS, function(frame) {
+		for (var offset = 0; offset + FRAME_HEADER_MIN_SIZE <= frame.length; ) {
+			var length = frameLength(frame.slice(offset));
+			if (length == 0 || offset + length > frame.length) {
+				console.log("dropped the rest of a udp frame after a bad tile header");
+				break;
 			}
+			broadcast(connections, decodeTile(frame.slice(offset, offset + length)));
+			offset += length;
 		}
 	});
-});
+	socket.on("message", frames.push);
+	socket.on("error", function(err) {
+		console.log("camera udp socket error: " + err);
+	});
+	socket.bind(port, CAMERA_HOST, function() {
+		socket.setRecvBufferSize(4 << 20);
+	});
+	return frames;
+}
 
+// Only a camera on this machine can connect, unless CAMERA_HOST says
+// otherwise, e.g. 0.0.0.0 for a camera on the other end of a Wi-Fi link.
+var CAMERA_HOST = process.env.CAMERA_HOST || '127.0.0.1';
 
+udpCamera(3490, wssConnections);
+udpCamera(3491, wss2Connections);
 
-server.listen(3490, '127.0.0.1', function(){
+server.listen(3490, CAMERA_HOST, function(){
 	console.log("listening on 3490");
 });
 
 
-server2.listen(3491, '127.0.0.1', function(){
+server2.listen(3491, CAMERA_HOST, function(){
 	console.log("listening on 3491");
 });
 
+
+server3.listen(3492, CAMERA_HOST, function(){
+	console.log("listening on 3492");
+});
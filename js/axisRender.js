@@ -50,6 +50,16 @@ socket.onopen = openSocket;
 socket.onmessage = updateRotation;
 
 
+/**
+ * Show the predicted pose (QP lines, streaming mode 9) instead of the
+ * estimate (QC lines) once the sketch sends it; the prediction covers the
+ * latency from the IMU to the screen.
+ */
+var usePrediction = true;
+
+var havePrediction = false;
+
+
 /* Start rendering */
 animate();
 
@@ -61,9 +71,17 @@ function openSocket() {
 }
 
 
+/* one line per message from server.js, several from server/imubridge */
 function updateRotation( result ) {
 
-	var data = result.data.replace( /"/g, "" ).split( " " );
+	result.data.replace( /"/g, "" ).split( "\n" ).forEach( applyLine );
+
+}
+
+
+function applyLine( line ) {
+
+	var data = line.split( " " );
 
 	if ( data[ 0 ] == "EC" ) {
 
@@ -73,9 +91,21 @@ function updateRotation( result ) {
 				data[ 2 ] * THREE.Math.DEG2RAD, data[ 3 ] * THREE.Math.DEG2RAD, "YXZ" )
 		);
 
-	} else 	if ( data[ 0 ] == "QC" ) {
+	} else 	if ( data[ 0 ] == "QC" || data[ 0 ] == "QP" ) {
+
+		/* data: QC q[0] q[1] q[2] q[3], or QP with the predicted pose */
+		if ( data[ 0 ] == "QP" ) {
+
+			havePrediction = true;
+
+			if ( ! usePrediction ) return;
+
+		} else if ( usePrediction && havePrediction ) {
+
+			return;
+
+		}
 
-		/* data: QC q[0] q[1] q[2] q[3] */
 		var q = new THREE.Quaternion(
 			data[ 2 ], data[ 3 ], data[ 4 ], data[ 1 ] );
 
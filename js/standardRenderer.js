@@ -136,6 +136,37 @@ var StandardRenderer = function ( webglRenderer, teapots, sc, dispParams ) {
     // add occluding blocks 
     var occludingBlocks = [];
     addBlocksToScene();
+
+    // occlusion mesh streamed from the camera; replaces the blocks once the
+    // first mesh arrives
+    var occluderMaterial = new THREE.MeshBasicMaterial( { side: THREE.DoubleSide } );
+    occluderMaterial.color.set(0x0000ff);
+    occluderMaterial.colorWrite = false; // make invisible
+    var occluderMesh = new THREE.Mesh(new THREE.BufferGeometry(), occluderMaterial);
+    occluderMesh.renderOrder = 2; // render before the waddle dees
+    occluderMesh.frustumCulled = false;
+    occluderMesh.visible = false;
+    scene.add(occluderMesh);
+
+    // per-pixel occlusion mask from the camera (realsense/occlusion_mask.hpp):
+    // a plane in front of the waddle dees that only writes depth where the
+    // mask is set. Replaces the mesh and the blocks once the first mask arrives.
+    var maskTexture = new THREE.DataTexture(
+            sc.state.occlusionMask,
+            imageWidth,
+            imageHeight,
+            THREE.LuminanceFormat,
+            THREE.UnsignedByteType,
+            THREE.UVMapping);
+    maskTexture.needsUpdate = true;
+    var maskMaterial = new THREE.MeshBasicMaterial( { alphaMap: maskTexture, alphaTest: 0.5, side: THREE.DoubleSide } );
+    maskMaterial.color.set(0x0000ff);
+    maskMaterial.colorWrite = false; // make invisible
+    var maskOccluder = new THREE.Mesh(new THREE.PlaneGeometry(imageWidth, imageHeight), maskMaterial);
+    maskOccluder.renderOrder = 2; // render before the waddle dees
+    maskOccluder.position.z = -240;
+    maskOccluder.visible = false;
+    scene.add(maskOccluder);
 	console.log(occludingBlocks);
     // add the waddle dees! 
     var waddleDees = [];
@@ -249,6 +280,8 @@ var StandardRenderer = function ( webglRenderer, teapots, sc, dispParams ) {
             }
 
         }
+        reportWaddleDeeRoi();
+        reportWaddleDeeDepths();
 
 
 		/**
@@ -303,6 +336,8 @@ var StandardRenderer = function ( webglRenderer, teapots, sc, dispParams ) {
 	
         updateDataTexture();
         updateDepthArray();
+        updateOccluderMesh();
+        updateOcclusionMask();
         
 		/***
 		 * Render the scene!
@@ -353,6 +388,109 @@ var StandardRenderer = function ( webglRenderer, teapots, sc, dispParams ) {
 		
 	}
 
+    // The image plane spans x in [-320, 320], y in [-240, 240] right behind the
+    // waddle dees, so their bounding boxes map straight onto image pixels.
+    var roiBox = new THREE.Box3();
+    function reportWaddleDeeRoi() {
+        if (waddleDees.length == 0) return;
+
+        var x0 = Infinity, y0 = Infinity, x1 = -Infinity, y1 = -Infinity;
+        for (var i = 0; i < waddleDees.length; i++) {
+            roiBox.setFromObject(waddleDees[i].obj);
+            x0 = Math.min(x0, roiBox.min.x + imageWidth/2);
+            x1 = Math.max(x1, roiBox.max.x + imageWidth/2);
+            y0 = Math.min(y0, imageHeight/2 - roiBox.max.y);
+            y1 = Math.max(y1, imageHeight/2 - roiBox.min.y);
+        }
+        x0 = Math.max(0, Math.floor(x0));
+        y0 = Math.max(0, Math.floor(y0));
+        x1 = Math.min(imageWidth, Math.ceil(x1));
+        y1 = Math.min(imageHeight, Math.ceil(y1));
+        sc.reportRoi([x0, y0, Math.max(0, x1 - x0), Math.max(0, y1 - y0)]);
+    }
+
+    // The depth of the nearest waddle dee in each cell of the block grid, in
+    // the camera's 8-bit units, so the camera can test every pixel against it.
+    var cellDepths = new Array(coarseness * coarseness);
+    function reportWaddleDeeDepths() {
+        cellDepths.fill(0);
+        for (var i = 0; i < waddleDees.length; i++) {
+            roiBox.setFromObject(waddleDees[i].obj);
+            var d = zToDepth(roiBox.max.z);
+            var c0 = Math.max(0, Math.floor((roiBox.min.x + imageWidth/2) / blockWidth));
+            var c1 = Math.min(coarseness - 1, Math.floor((roiBox.max.x + imageWidth/2) / blockWidth));
+            var r0 = Math.max(0, Math.floor((imageHeight/2 - roiBox.max.y) / blockHeight));
+            var r1 = Math.min(coarseness - 1, Math.floor((imageHeight/2 - roiBox.min.y) / blockHeight));
+            for (var r = r0; r <= r1; r++) {
+                for (var c = c0; c <= c1; c++) {
+                    var k = r*coarseness + c;
+                    if (cellDepths[k] == 0 || d < cellDepths[k]) cellDepths[k] = d;
+                }
+            }
+        }
+        sc.reportDepths(coarseness, coarseness, cellDepths);
+    }
+
+    // inverse of depthToZ below: a waddle dee at z = -245 is at depth 30
+    function zToDepth(z) {
+        return Math.round(Math.max(1, Math.min(59, 1 + 58 * (-240 - z) / 10)));
+    }
+
+    // map 8-bit depth onto the z range used by the occluding blocks: anything
+    // closer than 30 ends up in front of the waddle dees at z = -245
+    function depthToZ(d) {
+        if (d == 0) return -250;
+        return -240 - 10 * Math.min(1, (d - 1) / 58);
+    }
+
+    // rebuild the occluder from the latest mesh packet (see realsense/depth_mesh.hpp)
+    function updateOccluderMesh() {
+        if (sc.state.meshBuffer.byteLength == 0 || !sc.state.meshBufferUpdated) return;
+
+        var header = new DataView(sc.state.meshBuffer, 0, 16);
+        var vertexCount = header.getUint32(8, true);
+        var indexCount = header.getUint32(12, true);
+        var verts = new Uint16Array(sc.state.meshBuffer, 16, vertexCount * 3);
+        var indices = new Uint16Array(sc.state.meshBuffer, 16 + vertexCount * 6, indexCount);
+
+        var positions = new Float32Array(vertexCount * 3);
+        for (var i = 0; i < vertexCount; i++) {
+            positions[3*i + 0] = verts[3*i + 0] - imageWidth/2;
+            positions[3*i + 1] = imageHeight/2 - verts[3*i + 1];
+            positions[3*i + 2] = depthToZ(verts[3*i + 2]);
+        }
+
+        var geometry = new THREE.BufferGeometry();
+        geometry.setIndex(new THREE.BufferAttribute(new Uint16Array(indices), 1));
+        geometry.addAttribute('position', new THREE.BufferAttribute(positions, 3));
+        occluderMesh.geometry.dispose();
+        occluderMesh.geometry = geometry;
+
+        if (!occluderMesh.visible && !maskOccluder.visible) {
+            occluderMesh.visible = true;
+            for (var b = 0; b < occludingBlocks.length; b++) {
+                occludingBlocks[b].visible = false;
+            }
+        }
+        sc.state.meshBufferUpdated = false;
+    }
+
+    // upload the latest occlusion mask; the first one takes over from the
+    // mesh and the blocks
+    function updateOcclusionMask() {
+        if (!sc.state.occlusionMaskUpdated) return;
+
+        maskTexture.needsUpdate = true;
+        if (!maskOccluder.visible) {
+            maskOccluder.visible = true;
+            occluderMesh.visible = false;
+            for (var b = 0; b < occludingBlocks.length; b++) {
+                occludingBlocks[b].visible = false;
+            }
+        }
+        sc.state.occlusionMaskUpdated = false;
+    }
+
     function addOccludingBlock() {
         var box = new THREE.BoxGeometry(100, 100, 1);
         var mesh = new THREE.Mesh(box, new THREE.MeshBasicMaterial());
@@ -397,6 +535,10 @@ var StandardRenderer = function ( webglRenderer, teapots, sc, dispParams ) {
                 thisBlock.material.needsUpdate = true;
             }
         }
+        occluderMaterial.colorWrite = !occluderMaterial.colorWrite;
+        occluderMaterial.needsUpdate = true;
+        maskMaterial.colorWrite = !maskMaterial.colorWrite;
+        maskMaterial.needsUpdate = true;
 	}
     
     
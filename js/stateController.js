@@ -39,6 +39,9 @@ var StateController = function ( dispParams ) {
 	 * used in stereoUnwarpRenderer. [K_1, K_2] in the lecture slide.
 	 * @property {THREE.Quaternion} viewerQuaternion the quaternion representation
 	 * of the viewer's rotation streamed from the Teensy
+	 * @property {THREE.Quaternion} rgbPose the viewer's rotation when the
+	 * current RGB frame was captured, for reprojection; rgbPoseValid is false
+	 * while the camera has no IMU poses
 	 */
 
 
@@ -77,13 +80,25 @@ var StateController = function ( dispParams ) {
 
 		viewerQuaternion: new THREE.Quaternion(),
 
-		rgbBuffer: [],
+		rgbBuffer: new Uint8Array( 640 * 480 * 3 ),
 
         rgbBufferUpdate: false,
+
+        rgbPose: new THREE.Quaternion(),
+
+        rgbPoseValid: false,
         
-        depthBuffer: [],
+        depthBuffer: new Uint8Array( 640 * 480 ),
+
+        depthBufferUpdate: false,
+
+        occlusionMask: new Uint8Array( 640 * 480 ),
+
+        occlusionMaskUpdated: false,
 
-        depthBufferUpdate: false
+        meshBuffer: [],
+
+        meshBufferUpdated: false
 
 	};
 
@@ -119,8 +134,59 @@ var StateController = function ( dispParams ) {
 
 	socket.onmessage = function ( data ) {
         // keep track of when we've updated for the front end 
-        state.rgbBuffer = data.data;
-        state.rgbBufferUpdated = true; 
+        var pose = { valid: false };
+        if ( applyFrameTile( state.rgbBuffer, data.data, pose ) ) {
+            state.rgbBufferUpdated = true;
+            state.rgbPoseValid = pose.valid;
+            if ( pose.valid ) state.rgbPose.set( pose.x, pose.y, pose.z, pose.w );
+        }
+	};
+
+	var lastRoi = null;
+
+	/**
+	 * reportRoi - tell the camera which part of the image the virtual objects
+	 * cover, so it only streams that part at full resolution.
+	 *
+	 * @memberof StateController
+	 * @param  {Array.<Number>} roi [x, y, width, height] in image pixels
+	 */
+	this.reportRoi = function ( roi ) {
+
+		if ( socket.readyState !== WebSocket.OPEN ) return;
+
+		/* ignore jitter of a few pixels */
+		if ( lastRoi && roi.every( function ( v, i ) {
+			return Math.abs( v - lastRoi[ i ] ) < 4;
+		} ) ) return;
+
+		lastRoi = roi;
+		socket.send( JSON.stringify( { roi: roi } ) );
+
+	};
+
+	var lastDepths = null;
+
+	/**
+	 * reportDepths - tell the camera how far away the virtual objects are
+	 * across the image, for the per-pixel occlusion mask.
+	 *
+	 * @memberof StateController
+	 * @param  {Number} cols columns of the grid over the image
+	 * @param  {Number} rows rows of the grid
+	 * @param  {Array.<Number>} depths row by row, the 8-bit depth of the
+	 * nearest virtual object in each cell; 0 where there is none
+	 */
+	this.reportDepths = function ( cols, rows, depths ) {
+
+		if ( socket.readyState !== WebSocket.OPEN ) return;
+
+		var key = cols + " " + rows + " " + depths.join( " " );
+		if ( key === lastDepths ) return;
+
+		lastDepths = key;
+		socket.send( JSON.stringify( { depths: { cols: cols, rows: rows, values: depths } } ) );
+
 	};
 
 
@@ -138,9 +204,32 @@ var StateController = function ( dispParams ) {
 		console.log( "WebSocket2 is closed." );
 	};
 
+	/* the 8-bit depth map, or with --occlusion-mask the per-pixel mask */
 	socket2.onmessage = function ( data ) {
-        state.depthBuffer = data.data;
-        state.depthBufferUpdated = true; 
+        if ( new DataView( data.data ).getUint8( 6 ) == 3 ) {
+            if ( applyMaskTile( state.occlusionMask, data.data ) ) {
+                state.occlusionMaskUpdated = true;
+            }
+        } else if ( applyFrameTile( state.depthBuffer, data.data ) ) {
+            state.depthBufferUpdated = true;
+        }
+	};
+
+	var socket3 = new WebSocket( "ws://localhost:8083" );
+	socket3.binaryType = "arraybuffer";
+	socket3.onopen = function () {
+
+		console.log( "WebSocket3 is opened." );
+	};
+
+	socket3.onclose = function () {
+
+		console.log( "WebSocket3 is closed." );
+	};
+
+	socket3.onmessage = function ( data ) {
+        state.meshBuffer = data.data;
+        state.meshBufferUpdated = true;
 	};
 
 	/**
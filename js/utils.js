@@ -56,3 +56,161 @@ function quaternionToString( q ) {
 			   + "," + q.z.toFixed( 3 ).toString() + ")";
 
 }
+
+
+/**
+ * applyFrameTile - composite an image tile streamed by the camera into a
+ * full-resolution frame. Tiles carry the header described in
+ * server/frame_header.h and may be subsampled by header.scale.
+ *
+ * @param  {Uint8Array} frame full frame, frameWidth * frameHeight * channels
+ * @param  {ArrayBuffer} buffer tile as received from the socket
+ * @param  {Object} [pose] receives the head pose at capture time as
+ * { valid, w, x, y, z }; valid is false if the tile has none
+ * @return {Boolean}   true if this was the last tile of its frame
+ */
+function applyFrameTile( frame, buffer, pose ) {
+
+	var header = new DataView( buffer );
+	var headerSize = header.getUint16( 4, true );
+	var channels = header.getUint8( 7 );
+	var frameWidth = header.getUint16( 12, true );
+	var x = header.getUint16( 16, true );
+	var y = header.getUint16( 18, true );
+	var width = header.getUint16( 20, true );
+	var height = header.getUint16( 22, true );
+	var scale = header.getUint8( 24 );
+	var flags = header.getUint8( 25 );
+
+	/* FRAME_TILE_POSE; older cameras send a 40 byte header without it */
+	if ( pose ) {
+
+		pose.valid = headerSize >= 64 && ( flags & 8 ) != 0;
+		if ( pose.valid ) {
+
+			pose.w = header.getFloat32( 40, true );
+			pose.x = header.getFloat32( 44, true );
+			pose.y = header.getFloat32( 48, true );
+			pose.z = header.getFloat32( 52, true );
+
+		}
+
+	}
+
+	var payload = new Uint8Array( buffer, headerSize );
+	var rowBytes = width * channels;
+
+	if ( scale == 1 ) {
+
+		for ( var row = 0; row < height; row ++ ) {
+
+			var dst = ( ( y + row ) * frameWidth + x ) * channels;
+			frame.set( payload.subarray( row * rowBytes, ( row + 1 ) * rowBytes ), dst );
+
+		}
+
+	} else {
+
+		/* nearest-neighbour upsampling of a subsampled tile */
+		var tileWidth = Math.ceil( width / scale );
+		for ( var row = 0; row < height; row ++ ) {
+
+			var src = Math.floor( row / scale ) * tileWidth * channels;
+			var dst = ( ( y + row ) * frameWidth + x ) * channels;
+			for ( var col = 0; col < width; col ++ ) {
+
+				var s = src + Math.floor( col / scale ) * channels;
+				for ( var c = 0; c < channels; c ++ ) frame[ dst ++ ] = payload[ s + c ];
+
+			}
+
+		}
+
+	}
+
+	return ( flags & 1 ) != 0;
+
+}
+
+
+/**
+ * applyMaskTile - unpack an occlusion mask tile (FRAME_STREAM_OCCLUSION in
+ * server/frame_header.h, built by realsense/occlusion_mask.hpp) into a
+ * full-resolution mask. Each frame is a single tile; everything outside of
+ * it is not occluded.
+ *
+ * @param  {Uint8Array} mask full mask, frameWidth * frameHeight, 255 where
+ * the camera is in front of the virtual objects and 0 elsewhere
+ * @param  {ArrayBuffer} buffer tile as received from the socket
+ * @return {Boolean}   true if this was the last tile of its frame
+ */
+function applyMaskTile( mask, buffer ) {
+
+	var header = new DataView( buffer );
+	var headerSize = header.getUint16( 4, true );
+	var frameWidth = header.getUint16( 12, true );
+	var x = header.getUint16( 16, true );
+	var y = header.getUint16( 18, true );
+	var width = header.getUint16( 20, true );
+	var height = header.getUint16( 22, true );
+	var flags = header.getUint8( 25 );
+	var payload = new Uint8Array( buffer, headerSize, header.getUint32( 28, true ) );
+
+	mask.fill( 0 );
+
+	if ( flags & 16 ) {
+
+		/* FRAME_TILE_RLE: alternating clear and set runs as LEB128 varints */
+		var value = 0, row = 0, col = 0, i = 0;
+		while ( i < payload.length && row < height ) {
+
+			var run = 0, shift = 0, b;
+			do {
+
+				b = payload[ i ++ ];
+				run += ( b & 0x7f ) * Math.pow( 2, shift );
+				shift += 7;
+
+			} while ( b & 0x80 );
+
+			while ( run > 0 && row < height ) {
+
+				var n = Math.min( run, width - col );
+				var dst = ( y + row ) * frameWidth + x + col;
+				if ( value ) mask.fill( value, dst, dst + n );
+				col += n;
+				run -= n;
+				if ( col == width ) {
+
+					col = 0;
+					row ++;
+
+				}
+
+			}
+
+			value ^= 255;
+
+		}
+
+	} else {
+
+		/* one bit per pixel, rows padded to whole bytes */
+		var rowBytes = Math.ceil( width / 8 );
+		for ( var row = 0; row < height; row ++ ) {
+
+			var dst = ( y + row ) * frameWidth + x;
+			for ( var col = 0; col < width; col ++ ) {
+
+				if ( payload[ row * rowBytes + ( col >> 3 ) ] & ( 1 << ( col & 7 ) ) ) mask[ dst + col ] = 255;
+
+			}
+
+		}
+
+	}
+
+	return ( flags & 1 ) != 0;
+
+}
+
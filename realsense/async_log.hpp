@@ -0,0 +1,446 @@
+///////////////////
+// async_log     //
+///////////////////
+
+// Logging that never blocks the capture loop on stdout or the terminal.
+//
+//     ALOG_INFO("client: connected on port %s", port);
+//
+// A call copies its format pointer, its arguments and its timestamp into a
+// ring of its own thread and returns; a background thread formats and writes
+// the lines every few milliseconds. The format must be a string literal;
+// string arguments are copied (up to LOG_TEXT bytes in all), so they may
+// point into buffers that change right after the call. Supported
+// conversions are those of printf without '*' widths and %n.
+//
+// Lines below the level set with set_level() cost a load and a compare. Each
+// call site writes at most set_rate() lines per second; the next line that
+// gets through says how many were suppressed. When a ring is full (the
+// writer is stuck on a slow terminal), lines are dropped and counted instead
+// of waiting.
+
+#ifndef ASYNC_LOG_HPP
+#define ASYNC_LOG_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+enum log_level
+{
+    log_debug,
+    log_info,
+    log_warn,
+    log_error,
+    log_off
+};
+
+// levels by name, as in --log-level; -1 if there is no such level
+static inline int log_level_by_name(const std::string & name)
+{
+    static const char *names[] = { "debug", "info", "warn", "error", "off" };
+    for (int i = 0; i <= log_off; ++i)
+        if (name == names[i]) return i;
+    return -1;
+}
+
+static const int LOG_MAX_ARGS = 8;
+static const int LOG_TEXT = 96;
+
+struct log_arg
+{
+    enum { SIGNED, UNSIGNED, DOUBLE, STRING, POINTER } type;
+    union
+    {
+        long long i;
+        unsigned long long u;
+        double d;
+        size_t text;        // offset into log_record::text
+        const void *p;
+    };
+};
+
+struct log_record
+{
+    uint64_t time_us;
+    const char *format;
+    uint32_t suppressed;    // lines of this call site left out before this one
+    uint8_t level;
+    uint8_t argc;
+    uint16_t text_used;
+    log_arg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT];
+};
+
+// Single producer, single consumer: the thread that logs and the writer.
+class log_ring
+{
+public:
+    static const uint32_t SIZE = 512;
+
+    log_ring() : head(0), tail(0), dropped(0) {}
+
+    // the slot for the next record, or NULL (and counted) if the ring is full
+    log_record * reserve()
+    {
+        const uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == SIZE)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        return &slots[h % SIZE];
+    }
+
+    void commit() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // writer side
+    const log_record * front() const
+    {
+        const uint32_t t = tail.load(std::memory_order_relaxed);
+        return t == head.load(std::memory_order_acquire) ? NULL : &slots[t % SIZE];
+    }
+
+    void pop() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    unsigned long long take_dropped() { return dropped.exchange(0, std::memory_order_relaxed); }
+
+private:
+    log_record slots[SIZE];
+    std::atomic<uint32_t> head, tail;
+    std::atomic<unsigned long long> dropped;
+};
+
+// Rate limit state of one call site, a static in the ALOG_ macros.
+struct log_site
+{
+    std::atomic<uint64_t> window_us;
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> suppressed;
+
+    log_site() : window_us(0), count(0), suppressed(0) {}
+};
+
+static inline uint64_t log_clock_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Argument capture, by type; the writer applies the conversion of the format.
+template <typename T>
+static inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+log_put(log_record & r, log_arg & a, T v)
+{
+    (void)r;
+    if (std::is_signed<T>::value) { a.type = log_arg::SIGNED; a.i = (long long)v; }
+    else { a.type = log_arg::UNSIGNED; a.u = (unsigned long long)v; }
+}
+
+static inline void log_put(log_record &, log_arg & a, double v) { a.type = log_arg::DOUBLE; a.d = v; }
+
+static inline void log_put(log_record & r, log_arg & a, const char *s)
+{
+    // text_used stays below LOG_TEXT; once it is full, later strings are empty
+    if (!s) s = "(null)";
+    const size_t n = strnlen(s, LOG_TEXT - 1 - r.text_used);
+    a.type = log_arg::STRING;
+    a.text = r.text_used;
+    memcpy(r.text + r.text_used, s, n);
+    r.text[r.text_used + n] = 0;
+    r.text_used = (uint16_t)std::min<size_t>(r.text_used + n + 1, LOG_TEXT - 1);
+}
+
+static inline void log_put(log_record & r, log_arg & a, char *s) { log_put(r, a, (const char *)s); }
+static inline void log_put(log_record & r, log_arg & a, const std::string & s) { log_put(r, a, s.c_str()); }
+
+template <typename T>
+static inline void log_put(log_record &, log_arg & a, T *p) { a.type = log_arg::POINTER; a.p = p; }
+
+static inline void log_capture(log_record &) {}
+
+template <typename T, typename... Rest>
+static inline void log_capture(log_record & r, const T & v, const Rest &... rest)
+{
+    if (r.argc < LOG_MAX_ARGS) log_put(r, r.args[r.argc++], v);
+    log_capture(r, rest...);
+}
+
+class async_logger
+{
+public:
+    static async_logger & instance()
+    {
+        static async_logger logger;
+        return logger;
+    }
+
+    bool enabled(int level) const { return level >= min_level.load(std::memory_order_relaxed); }
+
+    void set_level(int level) { min_level.store(level, std::memory_order_relaxed); }
+
+    // lines per second per call site; 0 for no limit
+    void set_rate(uint32_t lines_per_second) { rate.store(lines_per_second, std::memory_order_relaxed); }
+
+    // Where lines go: debug and info to out, warnings and errors to err.
+    // For benchmarks; the default is stdout and stderr.
+    void set_output(FILE *out_file, FILE *err_file)
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        out = out_file;
+        err = err_file;
+    }
+
+    template <typename... Args>
+    void log(log_site & site, int level, const char *format, const Args &... args)
+    {
+        const uint64_t now = log_clock_us();
+        uint32_t suppressed = 0;
+        if (!admit(site, now, suppressed)) return;
+
+        log_ring & ring = local_ring();
+        log_record *r = ring.reserve();
+        if (!r) return;
+        r->time_us = now;
+        r->format = format;
+        r->suppressed = suppressed;
+        r->level = (uint8_t)level;
+        r->argc = 0;
+        r->text_used = 0;
+        log_capture(*r, args...);
+        ring.commit();
+    }
+
+    // the writer thread, for thread_placement.hpp
+    std::thread::native_handle_type native_handle() { return writer.native_handle(); }
+
+    // lines lost to full rings so far
+    unsigned long long dropped() const { return dropped_total.load(std::memory_order_relaxed); }
+
+    // Write out everything logged so far; for exit paths and benchmarks.
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        drain();
+    }
+
+    ~async_logger()
+    {
+        running.store(false);
+        if (writer.joinable()) writer.join();
+        flush();
+    }
+
+private:
+    std::atomic<int> min_level;
+    std::atomic<uint32_t> rate;
+    std::atomic<bool> running;
+    std::atomic<unsigned long long> dropped_total;
+    FILE *out, *err;
+    const uint64_t start_us;
+
+    // Rings live as long as the logger. The ring of a thread that exits goes
+    // to free_rings, and the next new thread takes it over along with any
+    // lines still in it, so short-lived threads (a resolve per connect
+    // attempt) do not add a ring each.
+    std::mutex rings_mutex, write_mutex;
+    std::vector<std::unique_ptr<log_ring>> rings;
+    std::vector<log_ring *> free_rings;
+    std::thread writer;
+
+    async_logger() : min_level(log_info), rate(20), running(true), dropped_total(0), out(stdout), err(stderr), start_us(log_clock_us())
+    {
+        writer = std::thread(&async_logger::run, this);
+    }
+
+    bool admit(log_site & site, uint64_t now, uint32_t & suppressed)
+    {
+        const uint32_t limit = rate.load(std::memory_order_relaxed);
+        if (!limit) return true;
+        if (now - site.window_us.load(std::memory_order_relaxed) >= 1000000)
+        {
+            site.window_us.store(now, std::memory_order_relaxed);
+            site.count.store(0, std::memory_order_relaxed);
+        }
+        if (site.count.fetch_add(1, std::memory_order_relaxed) >= limit)
+        {
+            site.suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    // the calling thread's ring, handed back when the thread exits
+    struct ring_owner
+    {
+        async_logger *logger = NULL;
+        log_ring *ring = NULL;
+
+        ~ring_owner()
+        {
+            if (!ring) return;
+            std::lock_guard<std::mutex> lock(logger->rings_mutex);
+            logger->free_rings.push_back(ring);
+        }
+    };
+
+    log_ring & local_ring()
+    {
+        static thread_local ring_owner owner;
+        if (!owner.ring)
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            if (!free_rings.empty())
+            {
+                owner.ring = free_rings.back();
+                free_rings.pop_back();
+            }
+            else
+            {
+                rings.emplace_back(new log_ring());
+                owner.ring = rings.back().get();
+            }
+            owner.logger = this;
+        }
+        return *owner.ring;
+    }
+
+    void run()
+    {
+        while (running.load())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            flush();
+        }
+    }
+
+    // with write_mutex held
+    void drain()
+    {
+        std::vector<log_ring *> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            for (auto & ring : rings) snapshot.push_back(ring.get());
+        }
+
+        bool wrote_out = false, wrote_err = false;
+        char line[1024];
+        for (log_ring *ring : snapshot)
+        {
+            while (const log_record *r = ring->front())
+            {
+                FILE *f = r->level >= log_warn ? err : out;
+                size_t n = format_record(*r, line, sizeof line);
+                fwrite(line, 1, n, f);
+                (f == err ? wrote_err : wrote_out) = true;
+                ring->pop();
+            }
+            if (unsigned long long dropped = ring->take_dropped())
+            {
+                dropped_total.fetch_add(dropped, std::memory_order_relaxed);
+                fprintf(err, "log: dropped %llu lines, the output could not keep up\n", dropped);
+                wrote_err = true;
+            }
+        }
+        if (wrote_out) fflush(out);
+        if (wrote_err) fflush(err);
+    }
+
+    size_t format_record(const log_record & r, char *line, size_t size) const
+    {
+        static const char levels[] = "DIWE";
+        size_t n = snprintf(line, size, "%10.6f %c ", (r.time_us - start_us) / 1e6, levels[r.level & 3]);
+
+        int arg = 0;
+        for (const char *p = r.format; *p && n < size - 1; )
+        {
+            if (*p != '%' || p[1] == '%')
+            {
+                line[n++] = *p;
+                p += *p == '%' ? 2 : 1;
+                continue;
+            }
+
+            // flags, width and precision as given, the length replaced to
+            // suit the captured argument
+            char spec[32];
+            size_t s = 0;
+            const char *q = p + 1;
+            while (*q && strchr("-+ #0123456789.", *q) && s < sizeof spec - 8) spec[s++] = *q++;
+            while (*q && strchr("hlLqjzt", *q)) ++q;
+            const char conversion = *q ? *q++ : 0;
+            if (!conversion || arg >= r.argc)
+            {
+                // not enough arguments: leave the conversion as it was
+                while (p < q && n < size - 1) line[n++] = *p++;
+                continue;
+            }
+
+            char fmt[40];
+            const log_arg & a = r.args[arg++];
+            int written = 0;
+            const size_t room = size - n;
+            if (strchr("diouxXc", conversion))
+            {
+                long long v = a.type == log_arg::DOUBLE ? (long long)a.d : a.type == log_arg::UNSIGNED ? (long long)a.u : a.i;
+                if (conversion == 'c') snprintf(fmt, sizeof fmt, "%%%.*sc", (int)s, spec);
+                else snprintf(fmt, sizeof fmt, "%%%.*sll%c", (int)s, spec, conversion);
+                written = conversion == 'c' ? snprintf(line + n, room, fmt, (int)v) : snprintf(line + n, room, fmt, v);
+            }
+            else if (strchr("feEgGaA", conversion))
+            {
+                double v = a.type == log_arg::DOUBLE ? a.d : a.type == log_arg::UNSIGNED ? (double)a.u : (double)a.i;
+                snprintf(fmt, sizeof fmt, "%%%.*s%c", (int)s, spec, conversion);
+                written = snprintf(line + n, room, fmt, v);
+            }
+            else if (conversion == 's')
+            {
+                snprintf(fmt, sizeof fmt, "%%%.*ss", (int)s, spec);
+                written = snprintf(line + n, room, fmt, a.type == log_arg::STRING ? r.text + a.text : "?");
+            }
+            else if (conversion == 'p')
+            {
+                written = snprintf(line + n, room, "%p", a.type == log_arg::POINTER ? a.p : NULL);
+            }
+            n += written < 0 ? 0 : std::min((size_t)written, room - 1);
+            p = q;
+        }
+
+        // the format's own newline, if any, is replaced by ours
+        while (n > 0 && line[n - 1] == '\n') --n;
+        if (r.suppressed && n < size)
+            n += std::min((size_t)snprintf(line + n, size - n, " (%u more suppressed)", r.suppressed), size - n - 1);
+        if (n > size - 2) n = size - 2;
+        line[n++] = '\n';
+        return n;
+    }
+};
+
+#define ALOG(level, ...) \
+    do \
+    { \
+        if (async_logger::instance().enabled(level)) \
+        { \
+            static log_site alog_site; \
+            async_logger::instance().log(alog_site, level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define ALOG_DEBUG(...) ALOG(log_debug, __VA_ARGS__)
+#define ALOG_INFO(...) ALOG(log_info, __VA_ARGS__)
+#define ALOG_WARN(...) ALOG(log_warn, __VA_ARGS__)
+#define ALOG_ERROR(...) ALOG(log_error, __VA_ARGS__)
+
+#endif // ASYNC_LOG_HPP
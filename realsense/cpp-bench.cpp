@@ -0,0 +1,1304 @@
+///////////////////
+// cpp-bench     //
+///////////////////
+
+// Timing harness for the capture-side processing stages. It runs on synthetic
+// frames, so no camera is needed: './cpp-bench' runs everything, './cpp-bench mesh'
+// runs a single stage. Stages that check their results as well print what
+// failed, and the exit status is 1 if anything did.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <math.h>
+#include <fcntl.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "async_log.hpp"
+#include "depth_mesh.hpp"
+#include "metrics.hpp"
+#include "occlusion_mask.hpp"
+#include "pose_sync.hpp"
+#include "pubsub_server.hpp"
+#include "roi_stream.hpp"
+#include "stream_link.hpp"
+#include "thread_placement.hpp"
+#include "udp_transport.hpp"
+#include "server/libb64-1.2/include/b64/span.h"
+extern "C" {
+#include "server/base64_simd.h"
+}
+
+#define WIDTH 640
+#define HEIGHT 480
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+// A sloped floor with a disc in front of it and a band of invalid pixels,
+// roughly what the SR300 sees with a hand in front of a table.
+static void synthetic_depth(uint8_t depth[], int frame)
+{
+    int cx = WIDTH / 2 + (frame % 64) - 32;
+    for (int y = 0; y < HEIGHT; ++y)
+    {
+        for (int x = 0; x < WIDTH; ++x)
+        {
+            uint8_t d = 60 + y / 8;
+            if ((x - cx) * (x - cx) + (y - 240) * (y - 240) < 120 * 120) d = 20;
+            if (x < 16) d = 0;
+            depth[y * WIDTH + x] = d;
+        }
+    }
+}
+
+static bool bench_mesh(int frames)
+{
+    std::vector<uint8_t> depth(WIDTH * HEIGHT);
+    std::vector<uint8_t> packet;
+    depth_mesh_builder mesh(WIDTH, HEIGHT);
+
+    double total = 0, worst = 0;
+    for (int i = 0; i < frames; ++i)
+    {
+        synthetic_depth(depth.data(), i);
+        bench_clock::time_point start = bench_clock::now();
+        mesh.build(depth.data());
+        mesh.serialize(packet);
+        double ms = elapsed_ms(start);
+        total += ms;
+        if (ms > worst) worst = ms;
+    }
+
+    printf("mesh: %.3f ms/frame (worst %.3f), %zu vertices, %zu triangles, %zu bytes vs %d raw\n",
+           total / frames, worst, mesh.vertex_count(), mesh.index_count() / 3,
+           packet.size(), WIDTH * HEIGHT);
+
+    // a 1080p gradient just steep enough that every 4x4 cell is emitted:
+    // more lattice points than 16-bit indices reach, so cells get coarser
+    const int big_width = 1920, big_height = 1080;
+    std::vector<uint8_t> big(big_width * big_height);
+    for (int y = 0; y < big_height; ++y)
+        for (int x = 0; x < big_width; ++x)
+            big[y * big_width + x] = (uint8_t)(1 + (x * 3 + y * 5) / 4 % 200);
+    depth_mesh_builder big_mesh(big_width, big_height);
+    big_mesh.build(big.data());
+    bool ok = big_mesh.vertex_count() <= 65536;
+    for (uint16_t index : big_mesh.triangle_indices()) ok = ok && index < big_mesh.vertex_count();
+    printf("mesh %dx%d: %d pixel cells, %zu vertices, %zu triangles, indices %s\n", big_width, big_height,
+           big_mesh.cell_params().min_cell, big_mesh.vertex_count(), big_mesh.index_count() / 3, ok ? "ok" : "OVERFLOW");
+    return ok;
+}
+
+// A simulated browser moves a 160x160 ROI around the frame over a socketpair,
+// the same way app.js forwards it up the RGB socket.
+static bool bench_roi(int frames)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        perror("socketpair");
+        return false;
+    }
+
+    std::vector<uint8_t> rgb(WIDTH * HEIGHT * 3, 128);
+    roi_control_channel control(fds[0]);
+    roi_tile_writer rgb_tiles(FRAME_STREAM_RGB, 3, WIDTH, HEIGHT);
+    roi_tile_writer depth_tiles(FRAME_STREAM_DEPTH, 1, WIDTH, HEIGHT);
+    const roi_policy rgb_policy(4), depth_policy(0);
+
+    size_t rgb_bytes = 0, depth_bytes = 0;
+    int missed = 0;
+    double total = 0;
+    for (int i = 0; i < frames; ++i)
+    {
+        const int x = (i * 7) % (WIDTH - 160), y = (i * 3) % (HEIGHT - 160);
+        char line[64];
+        int n = snprintf(line, sizeof line, "ROI %d %d 160 160\n", x, y);
+        if (write(fds[1], line, n) != n) break;
+
+        bench_clock::time_point start = bench_clock::now();
+        control.poll();
+        if (control.roi().x != x || control.roi().y != y) ++missed;
+        rgb_tiles.build(rgb.data(), control.roi(), rgb_policy, i, 0);
+        depth_tiles.build(rgb.data(), control.roi(), depth_policy, i, 0);
+        total += elapsed_ms(start);
+
+        rgb_bytes += rgb_tiles.size();
+        depth_bytes += depth_tiles.size();
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+
+    if (missed) printf("roi: %d of %d ROI updates were not picked up\n", missed, frames);
+    printf("roi: %.3f ms/frame, rgb %zu bytes/frame (%d full), depth %zu bytes/frame (%d full)\n",
+           total / frames, rgb_bytes / frames, WIDTH * HEIGHT * 3, depth_bytes / frames, WIDTH * HEIGHT);
+    return missed == 0;
+}
+
+// Occlusion mask from raw depth against per-cell virtual depths, which come in
+// over the control channel like app.js sends them: a 160x160 object in front
+// of the floor moves around, and in every other frame the whole image has
+// something virtual at depth 30. Checks the mask against the blocks' rule
+// (8-bit depth below the object's) for every pixel and the RLE round trip.
+static bool bench_mask(int frames)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        perror("socketpair");
+        return false;
+    }
+
+    std::vector<uint8_t> depth8(WIDTH * HEIGHT);
+    std::vector<uint16_t> raw(WIDTH * HEIGHT);
+    std::vector<uint8_t> decoded(frame_mask_row_bytes(WIDTH) * HEIGHT);
+    std::vector<uint16_t> threshold(WIDTH);
+    roi_control_channel control(fds[0]);
+    occlusion_mask_writer occlusion(WIDTH, HEIGHT);
+    const int cols = 20, rows = 20;
+
+    size_t packed_bytes = 0, sent_bytes = 0;
+    int wrong = 0, bad_rle = 0;
+    double total = 0, scalar = 0, simd = 0;
+    for (int i = 0; i < frames; ++i)
+    {
+        synthetic_depth(depth8.data(), i);
+        // raw depth that lands on the same 8-bit values, with the low bits in use
+        for (int p = 0; p < WIDTH * HEIGHT; ++p)
+            raw[p] = depth8[p] ? (uint16_t)(depth8[p] * 257 + (p * 31 + i) % 257) : 0;
+
+        const int x = (i * 7) % (WIDTH - 160), y = (i * 3) % (HEIGHT - 160);
+        std::string line = "DEPTHS 20 20";
+        for (int r = 0; r < rows; ++r)
+        {
+            for (int c = 0; c < cols; ++c)
+            {
+                const int cx = c * WIDTH / cols, cy = r * HEIGHT / rows;
+                bool covered = i % 2 || (cx + WIDTH / cols > x && cx < x + 160 && cy + HEIGHT / rows > y && cy < y + 160);
+                line += covered ? " 30" : " 0";
+            }
+        }
+        line += "\n";
+        if (write(fds[1], line.data(), line.size()) != (ssize_t)line.size()) break;
+        const roi_rect roi = i % 2 ? roi_rect() : roi_rect(x, y, 160, 160).padded(16, WIDTH, HEIGHT);
+
+        bench_clock::time_point start = bench_clock::now();
+        control.poll();
+        occlusion.build(raw.data(), control.region_depth(), roi, true, i, 0);
+        total += elapsed_ms(start);
+
+        packed_bytes += occlusion.packed_size();
+        sent_bytes += occlusion.size();
+
+        struct frame_header header;
+        memcpy(&header, occlusion.data(), sizeof header);
+        const uint8_t *mask = occlusion.mask();
+        if (header.flags & FRAME_TILE_RLE)
+        {
+            if (!occlusion_rle_decode(occlusion.data() + sizeof header, header.payload_size, header.width, header.height, decoded.data()) ||
+                memcmp(decoded.data(), mask, occlusion.packed_size()))
+                ++bad_rle;
+        }
+
+        const region_depths & regions = control.region_depth();
+        const size_t row_bytes = frame_mask_row_bytes(header.width);
+        for (int ty = 0; ty < header.height; ++ty)
+        {
+            for (int tx = 0; tx < header.width; ++tx)
+            {
+                const int px = header.x + tx, py = header.y + ty;
+                const uint8_t d = (uint8_t)(raw[py * WIDTH + px] * 255 / 65535);
+                const bool occluded = d && d < regions.at(px * cols / WIDTH, py * rows / HEIGHT);
+                if (occluded != ((mask[ty * row_bytes + tx / 8] >> (tx % 8)) & 1)) ++wrong;
+            }
+        }
+
+        // the compare on its own, full frame, against the scalar loop
+        for (int p = 0; p < WIDTH; ++p) threshold[p] = occlusion_threshold(30);
+        start = bench_clock::now();
+        for (int r = 0; r < HEIGHT; ++r)
+            occlusion_mask_row_scalar(&raw[r * WIDTH], threshold.data(), WIDTH, &decoded[r * WIDTH / 8]);
+        scalar += elapsed_ms(start);
+        start = bench_clock::now();
+        for (int r = 0; r < HEIGHT; ++r)
+            occlusion_mask_row(&raw[r * WIDTH], threshold.data(), WIDTH, &decoded[r * WIDTH / 8]);
+        simd += elapsed_ms(start);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+
+    if (wrong || bad_rle) printf("mask: %d pixels wrong, %d bad RLE tiles\n", wrong, bad_rle);
+    printf("mask: %.3f ms/frame, compare %.3f ms/frame (scalar %.3f), packed %zu bytes/frame, sent %zu bytes/frame (%d depth map)\n",
+           total / frames, simd / frames, scalar / frames, packed_bytes / frames, sent_bytes / frames, WIDTH * HEIGHT);
+    return !wrong && !bad_rle;
+}
+
+// Base64 round trip of lengths 1-200 and a whole frame, output ending at a PROT_NONE page.
+static bool exact_size_round_trip()
+{
+    const long page = sysconf(_SC_PAGESIZE);
+    const size_t frame_size = WIDTH * HEIGHT * 3;
+    const size_t pages = (base64::encoded_size(frame_size) + page - 1) / page + 1;
+    char *area = (char *)mmap(NULL, pages * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED || mprotect(area + (pages - 1) * page, page, PROT_NONE) == -1) return false;
+    char *const end = area + (pages - 1) * page;
+
+    std::vector<char> plain(frame_size), code(base64::encoded_size(frame_size));
+    for (size_t i = 0; i < plain.size(); ++i) plain[i] = (char)(i * 7 + i / 640);
+    bool ok = true;
+    for (size_t length = 1; length <= 200 + 1 && ok; ++length)
+    {
+        const size_t size = length > 200 ? frame_size : length;
+        const base64::const_span in = { plain.data(), size };
+        const size_t code_size = base64::encoded_size(size);
+        base64::span code_out = { end - code_size, code_size };
+        ok = base64::encode(in, code_out) == (long)code_size;
+        memcpy(code.data(), code_out.data, code_size);
+
+        const base64::const_span code_in = { code.data(), code_size };
+        base64::span plain_out = { end - base64::decoded_size(code_size), base64::decoded_size(code_size) };
+        ok = ok && base64::decode(code_in, plain_out) == (long)size && !memcmp(plain_out.data, plain.data(), size);
+    }
+    munmap(area, pages * page);
+    return ok;
+}
+
+// Base64 debug mode: time from having a frame to its last byte being written
+// to a socket, encoding the whole frame first vs streaming chunks from the
+// parallel encoder. A thread drains the other end like the node server would.
+static bool bench_base64(int frames)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        perror("socketpair");
+        return false;
+    }
+    std::thread reader([&] {
+        static char sink[1 << 16];
+        while (read(fds[1], sink, sizeof sink) > 0) {}
+    });
+
+    std::vector<char> rgb(WIDTH * HEIGHT * 3);
+    for (size_t i = 0; i < rgb.size(); ++i) rgb[i] = (char)(i * 7 + i / 640);
+    const base64::const_span frame = { rgb.data(), rgb.size() };
+    auto send = [&](const char *data, size_t size) { return send_all(fds[0], data, size) == 0; };
+
+    // with the vectorised encoder, then with the scalar one
+    bool ok = true;
+    for (int simd = 1; simd >= 0; --simd)
+    {
+        base64_simd_enable(simd);
+        const char *name = base64_simd_name();
+        const bool round_trip = exact_size_round_trip();
+        printf("base64 %s: round trip into exact-size buffers %s\n", name, round_trip ? "ok" : "FAILED");
+        ok = ok && round_trip;
+
+        std::vector<char> staged(base64::encoded_size(frame.size));
+        double total = 0;
+        for (int i = 0; i < frames; ++i)
+        {
+            bench_clock::time_point start = bench_clock::now();
+            base64::span out = { staged.data(), staged.size() };
+            send(staged.data(), base64::encode(frame, out));
+            total += elapsed_ms(start);
+        }
+        printf("base64 %s: staged %.3f ms/frame, %zu bytes buffered\n", name, total / frames, staged.size());
+
+        const int thread_counts[] = { 0, 2, 4 };
+        for (int threads : thread_counts)
+        {
+            base64::parallel_encoder encoder(threads);
+            total = 0;
+            for (int i = 0; i < frames; ++i)
+            {
+                bench_clock::time_point start = bench_clock::now();
+                encoder.encode(frame, send);
+                total += elapsed_ms(start);
+            }
+            printf("base64 %s: %d threads %.3f ms/frame\n", name, threads, total / frames);
+        }
+    }
+    base64_simd_enable(1);
+
+    close(fds[0]);
+    reader.join();
+    close(fds[1]);
+    return ok;
+}
+
+// head motion for the pose bench: yaw and pitch in degrees at time t in seconds
+static void head_pose(double t, float q[4])
+{
+    const double yaw = 60 * sin(2 * M_PI * 0.5 * t) * M_PI / 180;
+    const double pitch = 20 * sin(2 * M_PI * 1.3 * t) * M_PI / 180;
+    // yaw about y, then pitch about x
+    const double cy = cos(yaw / 2), sy = sin(yaw / 2), cp = cos(pitch / 2), sp = sin(pitch / 2);
+    q[0] = (float)(cy * cp);
+    q[1] = (float)(cy * sp);
+    q[2] = (float)(sy * cp);
+    q[3] = (float)(-sy * sp);
+}
+
+static double pose_error_deg(const float a[4], const float b[4])
+{
+    double dot = fabs(a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3]);
+    return 2 * acos(dot > 1 ? 1 : dot) * 180 / M_PI;
+}
+
+// A minute of VRduino samples at 1 kHz on a clock 40 ppm fast, starting just
+// before micros() wraps, sent in packets of 4 that reach the host 0.5 ms
+// plus an exponential delay (mean 1 ms) later, and 10 to 30 ms later for 2%
+// of the packets. 30 Hz frames captured 30 ms before they are stamped look
+// up their pose at capture time. Compared against the pose that arrived
+// last, which is what a renderer without timestamps would use.
+static bool bench_pose()
+{
+    const double seconds = 60, drift = 40e-6, latency_us = 30000;
+    const uint32_t device_start = 0xffffffffu - 200000;
+    std::mt19937 rng(3);
+    std::exponential_distribution<double> delay(1 / 1000.0);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    pose_feed feed("localhost", "0", 5, 32);
+    std::vector<float> arrived;  // the latest pose to arrive, as a renderer would see it
+    float last[4] = { 1, 0, 0, 0 };
+
+    double sync_squares = 0, held_squares = 0, stale_squares = 0, worst = 0;
+    int frames = 0, missing = 0;
+    double lookup_ns = 0;
+    uint64_t next_frame = 1000000;
+
+    // packets in arrival order: (arrival, first sample index)
+    struct packet { uint64_t arrival; int first; };
+    std::vector<packet> packets;
+    const int samples = (int)(seconds * 1000);
+    for (int i = 0; i < samples; i += 4)
+    {
+        double arrival = (i + 3) * 1000.0 + 500 + delay(rng);
+        if (uniform(rng) < 0.02) arrival += 10000 + 20000 * uniform(rng);
+        packets.push_back(packet{ (uint64_t)arrival + 1000000, i });
+    }
+    // a late packet holds back the ones behind it on the serial link
+    for (size_t i = 1; i < packets.size(); ++i)
+        packets[i].arrival = std::max(packets[i].arrival, packets[i - 1].arrival);
+
+    for (size_t p = 0; p < packets.size(); ++p)
+    {
+        // frames stamped before this packet arrived
+        while (next_frame < packets[p].arrival)
+        {
+            const uint64_t capture = next_frame - (uint64_t)latency_us;
+            float truth[4];
+            head_pose((capture - 1000000) / 1e6, truth);
+
+            struct frame_pose pose;
+            bench_clock::time_point start = bench_clock::now();
+            bool ok = feed.pose_at(capture, pose);
+            lookup_ns += std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+
+            if (ok)
+            {
+                double e = pose_error_deg(pose.q, truth);
+                held_squares += e * e;
+                if (e > worst) worst = e;
+            }
+            else ++missing;
+            double stale = pose_error_deg(last, truth);
+            stale_squares += stale * stale;
+            ++frames;
+            next_frame += 33333;
+        }
+
+        for (int i = packets[p].first; i < packets[p].first + 4 && i < samples; ++i)
+        {
+            const double t = i / 1000.0;
+            const uint32_t device = device_start + (uint32_t)(uint64_t)(i * 1000.0 * (1 + drift));
+            float q[4];
+            head_pose(t, q);
+            feed.add(device, packets[p].arrival, q);
+            memcpy(last, q, sizeof last);
+
+            // the fit against the true host time of the sample plus the
+            // smallest possible delay
+            if (t > 20)
+            {
+                double e = (double)feed.clock().to_host(device) - (1000000 + i * 1000.0 + 500);
+                sync_squares += e * e;
+            }
+        }
+    }
+    const int synced = (int)(samples - 20000);
+
+    printf("pose: clock fit %.1f us rms, drift %.1f ppm (true %.1f), residual %.1f us, %lu resets\n",
+           sqrt(sync_squares / synced), feed.clock().drift_ppm(), drift * 1e6,
+           feed.clock().residual_us(), feed.clock().reset_count());
+    printf("pose: at capture %.3f deg rms (worst %.3f), latest arrived %.3f deg rms, "
+           "%d of %d frames without a pose, %.0f ns/lookup\n",
+           sqrt(held_squares / (frames - missing)), worst, sqrt(stale_squares / frames), missing, frames,
+           lookup_ns / frames);
+
+    // a reader racing the writer must never see a torn pose
+    std::atomic<bool> done(false);
+    std::atomic<int> torn(0), lookups(0);
+    pose_feed raced("localhost", "0", 5, 32);
+    std::thread reader([&] {
+        while (!done.load())
+        {
+            struct frame_pose pose;
+            if (!raced.pose_at(monotonic_us() - 200, pose)) continue;
+            double n = 0;
+            for (int k = 0; k < 4; ++k) n += pose.q[k] * pose.q[k];
+            if (fabs(n - 1) > 1e-3) ++torn;
+            ++lookups;
+        }
+    });
+    for (int i = 0; i < 2000000; ++i)
+    {
+        float q[4];
+        head_pose(i / 1000.0, q);
+        const uint64_t now = monotonic_us();
+        raced.add((uint32_t)now, now, q);
+    }
+    done = true;
+    reader.join();
+    printf("pose: %d lookups racing 2000000 pushes, %d torn\n", lookups.load(), torn.load());
+    return torn.load() == 0;
+}
+
+// The per-frame log line of the capture loop: filtered out, through the
+// async logger, with printf and fflush, and as std::cout << std::endl used
+// to write it, all into /dev/null. Then with the logger's output stuck on a
+// full pipe, like a terminal nobody reads, where printf would block.
+static bool bench_log()
+{
+    const int calls = 100000, batch = 256;
+    async_logger & logger = async_logger::instance();
+    FILE *null = fopen("/dev/null", "w");
+    std::ofstream null_stream("/dev/null");
+    logger.set_output(null, null);
+    logger.set_rate(0);
+
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < calls; ++i) ALOG_DEBUG("sent rgb frame %u, %zu bytes", (unsigned)i, (size_t)167569);
+    const double filtered = elapsed_ms(start) * 1e6 / calls;
+
+    // in batches the ring holds, flushed outside the clock, so none is
+    // dropped; the first call sets up the thread's ring
+    ALOG_INFO("bench: warming up");
+    logger.flush();
+    std::vector<double> each(calls);
+    for (int i = 0; i < calls; i += batch)
+    {
+        start = bench_clock::now();
+        for (int j = 0; j < batch; ++j)
+            ALOG_INFO("sent rgb frame %u, %zu bytes", (unsigned)(i + j), (size_t)167569);
+        each[i / batch] = elapsed_ms(start);
+        logger.flush();
+    }
+    double total = 0;
+    for (int i = 0; i < calls / batch; ++i) total += each[i];
+    const double async = total * 1e6 / (calls / batch * batch);
+
+    // single calls, for the tail; a clock read on either side of each
+    for (int i = 0; i < calls; ++i)
+    {
+        if (i % batch == 0) logger.flush();
+        start = bench_clock::now();
+        ALOG_INFO("sent rgb frame %u, %zu bytes", (unsigned)i, (size_t)167569);
+        each[i] = elapsed_ms(start) * 1000;
+    }
+    std::sort(each.begin(), each.end());
+    const double p99 = each[calls * 99 / 100], p999 = each[calls * 999 / 1000];
+    logger.flush();
+
+    start = bench_clock::now();
+    for (int i = 0; i < calls; ++i)
+    {
+        fprintf(null, "sent rgb frame %u, %zu bytes\n", (unsigned)i, (size_t)167569);
+        fflush(null);
+    }
+    const double direct = elapsed_ms(start) * 1e6 / calls;
+
+    start = bench_clock::now();
+    for (int i = 0; i < calls; ++i) null_stream << "sent rgb data" << std::endl;
+    const double stream = elapsed_ms(start) * 1e6 / calls;
+
+    printf("log: filtered %.1f ns/call, async %.1f ns/call (p99 %.2f us, p99.9 %.2f us), fprintf+fflush %.1f ns, cout<<endl %.1f ns\n",
+           filtered, async, p99, p999, direct, stream);
+
+    // a full pipe: the writer thread blocks in fwrite, the callers must not
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        perror("pipe");
+        return false;
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    char junk[4096] = { 0 };
+    while (write(fds[1], junk, sizeof junk) > 0) {}
+    fcntl(fds[1], F_SETFL, 0);
+    FILE *stuck = fdopen(fds[1], "w");
+    logger.set_output(stuck, stuck);
+
+    const unsigned long long dropped_before = logger.dropped();
+    for (int i = 0; i < calls; ++i)
+    {
+        start = bench_clock::now();
+        ALOG_INFO("sent rgb frame %u, %zu bytes", (unsigned)i, (size_t)167569);
+        each[i] = elapsed_ms(start) * 1000;
+        if (i % batch == 0) std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    std::sort(each.begin(), each.end());
+
+    // unblock the writer; what it still had goes into the pipe
+    std::thread reader([&] { while (read(fds[0], junk, sizeof junk) > 0) {} });
+    logger.flush();
+    logger.set_output(stdout, stderr);
+    fclose(stuck);
+    reader.join();
+    close(fds[0]);
+    fclose(null);
+
+    printf("log: output blocked: median %.2f us/call, p99 %.2f us, %llu of %d lines dropped\n",
+           each[calls / 2], each[calls * 99 / 100], logger.dropped() - dropped_before, calls);
+    return true;
+}
+
+static double thread_cpu_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// A gigabyte of 1.2 MB frames (an RGB and a depth frame) over loopback TCP
+// through stream_link::send_frame, copied and with MSG_ZEROCOPY. Reports the
+// sending thread's CPU time per gigabyte and the throughput, and checks what
+// arrives against a checksum of what was sent, which catches a buffer reused
+// while the kernel still sends from it. On loopback the kernel copies
+// zerocopy frames anyway, on the receiving side (it reports so, and that is
+// counted), so part of what send saves is spent there; on a real NIC it is
+// not.
+static bool bench_send()
+{
+    const size_t frame_size = WIDTH * HEIGHT * 4;
+    const int frames = (int)((1ull << 30) / frame_size);
+    bool ok = true;
+
+    for (int zerocopy = 0; zerocopy <= 1; ++zerocopy)
+    {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof addr;
+        if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(listener, 1) == -1 ||
+            getsockname(listener, (struct sockaddr *)&addr, &len) == -1)
+        {
+            perror("send: listen");
+            return false;
+        }
+        const std::string port = std::to_string(ntohs(addr.sin_port));
+
+        uint64_t received = 0, received_sum = 0;
+        std::thread reader([&] {
+            int fd = accept(listener, NULL, NULL);
+            static uint8_t sink[1 << 18];
+            ssize_t n;
+            while ((n = read(fd, sink, sizeof sink)) > 0)
+            {
+                received += n;
+                for (ssize_t i = 0; i < n; ++i) received_sum += sink[i];
+            }
+            close(fd);
+        });
+
+        async_logger::instance().set_level(log_warn);
+        stream_link link("127.0.0.1", port.c_str(), 100, 1000);
+        link.use_zerocopy(zerocopy);
+        link.connect_now();
+        async_logger::instance().flush();
+
+        std::vector<uint8_t> frame;
+        uint64_t sent_sum = 0, sent_frames = 0;
+        double cpu = 0;
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < frames && link.connected(); ++i)
+        {
+            // the capture loop writes every byte of a frame; here only a
+            // buffer the link has not had before is filled, the rest gets a
+            // new sequence number
+            if (frame.size() != frame_size)
+            {
+                frame.resize(frame_size);
+                for (size_t k = 0; k < frame_size; ++k) frame[k] = (uint8_t)(k * 7 + k / 640);
+            }
+            memcpy(frame.data(), &i, sizeof i);
+            uint64_t frame_sum = 0;
+            for (size_t k = 0; k < frame_size; ++k) frame_sum += frame[k];
+
+            // a frame is sent whole or, while the socket is backed up,
+            // dropped whole
+            const unsigned long long dropped = link.dropped();
+            const double before = thread_cpu_ms();
+            link.send_frame(frame);
+            cpu += thread_cpu_ms() - before;
+            if (link.dropped() == dropped)
+            {
+                sent_sum += frame_sum;
+                ++sent_frames;
+            }
+        }
+        while (link.connected() && !link.drained()) usleep(1000);
+        const bool attached = link.zerocopy_stats().attached();
+        link.disconnect();
+        const zerocopy_tx & stats = link.zerocopy_stats();
+        reader.join();
+        const double seconds = elapsed_ms(start) / 1000;
+        close(listener);
+
+        const double gb = received / (double)(1 << 30);
+        const bool intact = received == sent_frames * frame_size && received_sum == sent_sum;
+        printf("send %s: %.0f ms CPU/GB in send, %.2f GB/s, %llu of %d frames dropped while backed up, %s",
+               zerocopy ? "zerocopy" : "copy", cpu / gb, gb / seconds, link.dropped(), frames,
+               intact ? "data intact" : "DATA CORRUPT");
+        ok = ok && intact;
+        if (zerocopy && attached)
+            printf(", %llu of %llu sends copied by the kernel", stats.copied(), stats.completed());
+        else if (zerocopy)
+            printf(", no MSG_ZEROCOPY here");
+        printf("\n");
+    }
+
+    // a server that accepts and then never reads: the link must drop
+    // frames rather than hold up the loop, and with zerocopy, where every
+    // buffer stays with the kernel, copy rather than wait for one, and
+    // disconnect without waiting for them either. Then the
+    // zerocopy link is reset and reconnected a few times; what it keeps of
+    // the buffers the kernel never gave back must not grow with them.
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof addr;
+    if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(listener, 1) == -1 ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) == -1)
+    {
+        perror("send: listen");
+        return false;
+    }
+    const std::string port = std::to_string(ntohs(addr.sin_port));
+    async_logger::instance().set_level(log_error);
+    for (int zerocopy = 0; zerocopy <= 1; ++zerocopy)
+    {
+        stream_link link("127.0.0.1", port.c_str(), 100, 1000);
+        link.use_zerocopy(zerocopy);
+        const int connections = zerocopy ? 5 : 1;
+        double longest = 0;
+        bool blocked = false;
+        size_t most_kept = 0;
+        for (int c = 0; c < connections; ++c)
+        {
+            link.connect_now();
+            int stalled = accept(listener, NULL, NULL);
+            std::vector<uint8_t> frame;
+            for (int i = 0; i < 100 && link.connected(); ++i)
+            {
+                frame.resize(frame_size, 1);
+                bench_clock::time_point start = bench_clock::now();
+                link.send_frame(frame);
+                longest = std::max(longest, elapsed_ms(start));
+            }
+            const bool sent_all = link.connected();
+            bench_clock::time_point start = bench_clock::now();
+            link.disconnect();
+            longest = std::max(longest, elapsed_ms(start));
+            blocked = blocked || !sent_all || link.dropped() == 0 || longest >= 20;
+            most_kept = std::max(most_kept, link.zerocopy_stats().buffers_abandoned());
+            close(stalled);
+        }
+        printf("send stalled server%s: %llu of %d frames dropped, longest send or disconnect %.2f ms, %s",
+               zerocopy ? " zerocopy" : "", link.dropped(), 100 * connections, longest,
+               blocked ? "BLOCKED" : "never blocked");
+        if (zerocopy)
+            printf(", %zu buffers kept after %d resets, %s", link.zerocopy_stats().buffers_abandoned(), connections,
+                   most_kept <= 4 ? "bounded" : "LEAKING");
+        printf("\n");
+        ok = ok && !blocked && most_kept <= 4;
+    }
+    close(listener);
+    async_logger::instance().set_level(log_info);
+    return ok;
+}
+
+// RGB frames over the UDP transport on loopback, through the impairment
+// model: how many arrive, how many needed parity, how many were given up,
+// and how long a frame takes from the first datagram sent to delivery.
+// Every frame delivered is compared with what was sent.
+static bool bench_udp()
+{
+    const size_t frame_size = WIDTH * HEIGHT * 3 + sizeof(frame_header);
+    const int frames = 100;
+
+    struct scenario
+    {
+        const char *name;
+        double loss, burst, reorder;
+        int fec_group;
+    };
+    static const scenario scenarios[] =
+    {
+        { "no loss",                    0,    1, 0,   0 },
+        { "1% loss",                    0.01, 1, 0,   0 },
+        { "1% loss, parity/8",          0.01, 1, 0,   8 },
+        { "1% in bursts of 4, parity/8", 0.01, 4, 0,  8 },
+        { "5% loss, parity/4",          0.05, 1, 0,   4 },
+        { "10% reordered, parity/8",    0,    1, 0.1, 8 },
+    };
+
+    std::vector<uint8_t> pattern(frame_size);
+    for (size_t k = 0; k < frame_size; ++k) pattern[k] = (uint8_t)(k * 7 + k / 640);
+
+    bool ok = true;
+    for (const scenario & sc : scenarios)
+    {
+        udp_frame_receiver receiver(50);
+        if (!receiver.open("0", "127.0.0.1"))
+        {
+            perror("udp: bind");
+            return false;
+        }
+        struct sockaddr_in addr;
+        socklen_t len = sizeof addr;
+        getsockname(receiver.fd(), (struct sockaddr *)&addr, &len);
+        const std::string port = std::to_string(ntohs(addr.sin_port));
+
+        std::vector<double> latency_ms;
+        int wrong = 0;
+        std::atomic<bool> running(true);
+        std::thread reader([&] {
+            std::vector<uint8_t> expected(frame_size);
+            while (running)
+            {
+                receiver.poll(5, [&](const uint8_t *data, size_t size, uint32_t id) {
+                    const uint64_t now = udp_now_us();
+                    uint64_t sent_us;
+                    memcpy(&sent_us, data, sizeof sent_us);
+                    latency_ms.push_back((now - sent_us) / 1000.0);
+                    for (size_t k = 0; k < frame_size; ++k) expected[k] = pattern[k] ^ (uint8_t)id;
+                    if (size != frame_size || memcmp(data + sizeof sent_us, &expected[sizeof sent_us], size - sizeof sent_us))
+                        ++wrong;
+                });
+            }
+        });
+
+        async_logger::instance().set_level(log_warn);
+        udp_frame_sender sender(sc.fec_group);
+        udp_impairment impairment;
+        impairment.loss = sc.loss;
+        impairment.burst = sc.burst;
+        impairment.reorder = sc.reorder;
+        sender.set_impairment(impairment);
+        sender.open("127.0.0.1", port.c_str());
+
+        std::vector<uint8_t> frame(frame_size);
+        for (int i = 0; i < frames; ++i)
+        {
+            for (size_t k = 0; k < frame_size; ++k) frame[k] = pattern[k] ^ (uint8_t)i;
+            const uint64_t now = udp_now_us();
+            memcpy(frame.data(), &now, sizeof now);
+            sender.send_frame(frame.data(), frame.size());
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        running = false;
+        reader.join();
+        async_logger::instance().set_level(log_info);
+
+        const udp_frame_receiver::stats & c = receiver.counters();
+        std::sort(latency_ms.begin(), latency_ms.end());
+        const size_t n = latency_ms.size();
+        printf("udp %-28s %3llu/%d frames, %3llu by parity, %3llu late, %3llu superseded, p50 %.2f ms, p99 %.2f ms, %d wrong\n",
+               sc.name, c.delivered, frames, c.recovered, c.late, c.superseded,
+               n ? latency_ms[n / 2] : 0.0, n ? latency_ms[n * 99 / 100] : 0.0, wrong);
+        ok = ok && wrong == 0;
+    }
+    return ok;
+}
+
+// GET the metrics over a connected socket; the body, or "" on failure
+static std::string scrape(int fd)
+{
+    std::string response;
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (fd == -1 || send_all(fd, request, sizeof request - 1) != 0) return response;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) > 0) response.append(buf, n);
+    close(fd);
+    const size_t body = response.find("\r\n\r\n");
+    return response.compare(0, 15, "HTTP/1.0 200 OK") == 0 && body != std::string::npos ? response.substr(body + 4) : "";
+}
+
+// What the metrics of the capture loop cost a frame: every update it makes,
+// timers included, against the 33 ms of a 30 fps frame (the budget is 1%)
+// and against building the RGB and depth tiles. Then scrapes the registry
+// over HTTP and the Unix socket while it is being updated.
+static bool bench_metrics()
+{
+    metrics_registry registry("cpp_headless_");
+    capture_metrics m(registry);
+    const int frames = 200000;
+
+    bench_clock::time_point start = bench_clock::now();
+    uint64_t last_us = 0;
+    for (int i = 0; i < frames; ++i)
+    {
+        // the updates of one frame in cpp-headless's loop, in order
+        const uint64_t frame_us = monotonic_us();
+        if (last_us) m.interval.observe((frame_us - last_us) * 1e-6);
+        last_us = frame_us;
+        m.frames.add();
+        m.links_connected.set(2);
+        m.zerocopy_in_flight.set(0);
+        { metric_timer t(m.convert); }
+        { metric_timer t(m.send); }
+        m.rgb_bytes.add(167569);
+        { metric_timer t(m.send); }
+        m.depth_bytes.add(20586);
+        m.mesh_bytes.add(12000);
+    }
+    const double per_frame_us = elapsed_ms(start) * 1000 / frames;
+
+    std::vector<uint8_t> rgb(WIDTH * HEIGHT * 3, 128);
+    roi_tile_writer rgb_tiles(FRAME_STREAM_RGB, 3, WIDTH, HEIGHT);
+    roi_tile_writer depth_tiles(FRAME_STREAM_DEPTH, 1, WIDTH, HEIGHT);
+    start = bench_clock::now();
+    for (int i = 0; i < 100; ++i)
+    {
+        rgb_tiles.build(rgb.data(), roi_rect(), roi_policy(0), i, 0);
+        depth_tiles.build(rgb.data(), roi_rect(), roi_policy(0), i, 0);
+    }
+    const double build_us = elapsed_ms(start) * 1000 / 100;
+
+    const double share = per_frame_us / 33333 * 100;
+    printf("metrics: %.3f us/frame, %.4f%% of a 30 fps frame (budget 1%%: %s), %.2f%% of building its tiles\n",
+           per_frame_us, share, share < 1 ? "ok" : "OVER", per_frame_us / build_us * 100);
+
+    // scrapes while the loop runs
+    metrics_server server(registry);
+    const std::string path = "/tmp/cpp-bench-metrics.sock";
+    if (!server.listen_tcp(0) || !server.listen_unix(path)) return false;
+    server.start();
+    std::atomic<bool> running(true);
+    std::thread loop([&] {
+        while (running) m.frames.add();
+    });
+
+    int tcp = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof in);
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in.sin_port = htons((uint16_t)server.port());
+    if (connect(tcp, (struct sockaddr *)&in, sizeof in) == -1) tcp = -1;
+    const std::string over_tcp = scrape(tcp);
+
+    int unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof un);
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, path.c_str());
+    if (connect(unix_fd, (struct sockaddr *)&un, sizeof un) == -1) unix_fd = -1;
+    const std::string over_unix = scrape(unix_fd);
+
+    running = false;
+    loop.join();
+    server.stop();
+
+    auto check = [](const std::string & body) {
+        return body.find("# TYPE cpp_headless_frames_total counter\n") != std::string::npos &&
+               body.find("cpp_headless_bytes_sent_total{stream=\"rgb\"} ") != std::string::npos &&
+               body.find("cpp_headless_send_seconds_bucket{le=\"+Inf\"} 400000\n") != std::string::npos;
+    };
+    printf("metrics: scrape over http %s (%zu bytes), over unix socket %s\n",
+           check(over_tcp) ? "ok" : "FAILED", over_tcp.size(), check(over_unix) ? "ok" : "FAILED");
+    return share < 1 && check(over_tcp) && check(over_unix);
+}
+
+// Connect to the server's Unix socket and subscribe; the socket once the
+// server has answered OK, or -1.
+static int subscribe(const std::string & path, const char *request)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof un);
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, path.c_str());
+    if (connect(fd, (struct sockaddr *)&un, sizeof un) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    const std::string line = std::string(request) + "\n";
+    send_all(fd, line.data(), line.size());
+    std::string answer;
+    char c;
+    while (read(fd, &c, 1) == 1 && c != '\n') answer += c;
+    if (answer.compare(0, 3, "OK ") != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool read_exactly(int fd, void *buf, size_t size)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// A subscriber in a process of its own, so that what it spends reading is
+// not counted as the server's. Writes a byte to report once subscribed, and
+// when the server hangs up, how many packets it got and how many of them were
+// not what was published (see bench_pubsub).
+static pid_t spawn_subscriber(const std::string & path, const char *request, int report)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int fd = subscribe(path, request);
+    uint32_t counts[2] = { 0, 0 };
+    if (write(report, "r", 1) != 1 || fd == -1) _exit(1);
+
+    const size_t frame_size = WIDTH * HEIGHT * 3;
+    std::vector<uint8_t> payload;
+    struct frame_header header;
+    uint32_t last = 0;
+    while (read_exactly(fd, &header, sizeof header))
+    {
+        if (header.magic != FRAME_MAGIC || header.header_size != sizeof header || header.payload_size > 2 * frame_size)
+        {
+            ++counts[1];
+            break;
+        }
+        payload.resize(header.payload_size);
+        if (!read_exactly(fd, payload.data(), payload.size())) break;
+
+        // the payload starts with the sequence number
+        uint8_t first[6];
+        bool ok;
+        if (header.flags & FRAME_TILE_BASE64)
+        {
+            base64::const_span code = { (const char *)payload.data(), 8 };
+            base64::span out = { (char *)first, sizeof first };
+            ok = payload.size() == base64::encoded_size(frame_size) && base64::decode(code, out) == 6;
+        }
+        else
+        {
+            memcpy(first, payload.data(), sizeof first);
+            ok = payload.size() == frame_size && payload[frame_size / 2] == (uint8_t)(frame_size / 2 * 7) &&
+                 payload[frame_size - 1] == (uint8_t)((frame_size - 1) * 7);
+        }
+        ok = ok && !memcmp(first, &header.sequence, 4) && (!counts[0] || header.sequence > last);
+        last = header.sequence;
+        ++counts[0];
+        if (!ok) ++counts[1];
+    }
+    if (write(report, counts, sizeof counts) != sizeof counts) _exit(1);
+    _exit(0);
+}
+
+static double process_cpu_ms()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+}
+
+// Server mode: 100 RGB frames at 100 fps published to subscribers on the Unix
+// socket, each in a process of its own. Reports the capture thread's CPU time
+// in publish and the CPU time of the whole server process per frame (capture
+// loop and I/O thread) as subscribers are added, how many of
+// the packets due (every Nth frame with every=N) arrived, and how many were
+// wrong. One case adds a subscriber that never reads: it should be skipping
+// frames and then be disconnected, without the others losing any.
+static bool bench_pubsub()
+{
+    const size_t frame_size = WIDTH * HEIGHT * 3;
+    const int frames = 100;
+    const std::string path = "/tmp/cpp-bench-pubsub.sock";
+
+    struct scenario
+    {
+        const char *name;
+        std::vector<const char *> requests;
+        bool stalled;
+    };
+    const std::vector<const char *> four(4, "streams=rgb"), sixteen(16, "streams=rgb");
+    const scenario scenarios[] =
+    {
+        { "no subscribers", std::vector<const char *>(), false },
+        { "1 subscriber", std::vector<const char *>(1, "streams=rgb"), false },
+        { "4 subscribers", four, false },
+        { "16 subscribers", sixteen, false },
+        { "4 + 1 not reading", four, true },
+        { "raw, every=3, base64, depth", { "streams=rgb", "streams=rgb every=3", "format=base64", "streams=depth" }, false },
+    };
+
+    bool ok = true;
+    for (const scenario & sc : scenarios)
+    {
+        async_logger::instance().set_level(log_warn);
+        metrics_registry registry("bench_");
+        pubsub_server server(registry, 1, 500);
+        if (!server.listen_unix(path))
+        {
+            perror("pubsub: listen");
+            return false;
+        }
+        server.start();
+
+        std::vector<pid_t> children;
+        std::vector<int> reports;
+        std::vector<uint32_t> due;
+        for (const char *request : sc.requests)
+        {
+            int fds[2];
+            if (pipe(fds) == -1) break;
+            children.push_back(spawn_subscriber(path, request, fds[1]));
+            close(fds[1]);
+            reports.push_back(fds[0]);
+            pubsub_request r;
+            std::string error;
+            r.parse(request, error);
+            due.push_back(r.wants(PUBSUB_RGB) ? (frames + r.every - 1) / r.every : 0);
+        }
+        for (int fd : reports)
+        {
+            char ready;
+            if (read(fd, &ready, 1) != 1) perror("pubsub: subscriber");
+        }
+
+        // subscribed, and then never reads; the socket buffer is full
+        // after the first packet
+        const int stalled = sc.stalled ? subscribe(path, "streams=rgb") : -1;
+
+        std::vector<uint8_t> packet;
+        std::vector<double> publish_us;
+        const double cpu_before = process_cpu_ms();
+        bench_clock::time_point next = bench_clock::now();
+        for (uint32_t i = 0; i < (uint32_t)frames; ++i)
+        {
+            // as in bench_send, only a buffer not seen before is filled
+            // completely; the rest get a new sequence number
+            if (packet.size() != sizeof(frame_header) + frame_size)
+            {
+                packet.resize(sizeof(frame_header) + frame_size);
+                for (size_t k = 0; k < frame_size; ++k) packet[sizeof(frame_header) + k] = (uint8_t)(k * 7);
+            }
+            struct frame_header header;
+            frame_header_init(&header, FRAME_STREAM_RGB, 3, WIDTH, HEIGHT);
+            header.sequence = i;
+            memcpy(packet.data(), &header, sizeof header);
+            memcpy(packet.data() + sizeof header, &i, sizeof i);
+
+            const double before = thread_cpu_ms();
+            if (server.wants(PUBSUB_RGB)) server.publish(PUBSUB_RGB, packet);
+            publish_us.push_back((thread_cpu_ms() - before) * 1000);
+
+            next += std::chrono::milliseconds(10);
+            std::this_thread::sleep_until(next);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        const double cpu_ms = process_cpu_ms() - cpu_before;
+        const uint64_t skipped = server.skipped(), disconnected = server.stalled();
+        server.stop();
+        if (stalled != -1) close(stalled);
+
+        uint32_t got = 0, expected = 0, wrong = 0;
+        for (size_t i = 0; i < children.size(); ++i)
+        {
+            uint32_t counts[2] = { 0, 0 };
+            if (!read_exactly(reports[i], counts, sizeof counts)) ++wrong;
+            close(reports[i]);
+            waitpid(children[i], NULL, 0);
+            got += counts[0];
+            wrong += counts[1];
+            expected += due[i];
+        }
+        async_logger::instance().set_level(log_info);
+
+        // slow subscribers may skip frames; none may get a wrong one, and
+        // one that never reads must not cost the others any
+        const bool passed = wrong == 0 && (!sc.stalled || (disconnected > 0 && got == expected));
+        std::sort(publish_us.begin(), publish_us.end());
+        printf("pubsub %-28s publish %5.1f us (p99 %5.1f), process CPU %.2f ms/frame, %u of %u packets, "
+               "%llu skipped, %llu disconnected, %u wrong%s\n",
+               sc.name, publish_us[frames / 2], publish_us[frames * 99 / 100], cpu_ms / frames, got, expected,
+               (unsigned long long)skipped, (unsigned long long)disconnected, wrong, passed ? "" : ", FAILED");
+        ok = ok && passed;
+    }
+    async_logger::instance().flush();
+    return ok;
+}
+
+// Wake-up latency of a 1 kHz loop placed with a profile, cyclictest style:
+// how late past its deadline each clock_nanosleep returns, in microseconds.
+static std::vector<double> wake_latencies(const thread_profile & profile, int cycles, bool & placed)
+{
+    std::vector<double> late;
+    std::thread timer([&]
+    {
+        placed = place_thread(pthread_self(), "bench", profile);
+        async_logger::instance().flush();
+        struct timespec due;
+        clock_gettime(CLOCK_MONOTONIC, &due);
+        for (int i = 0; i < cycles; ++i)
+        {
+            due.tv_nsec += 1000000;
+            if (due.tv_nsec >= 1000000000)
+            {
+                due.tv_nsec -= 1000000000;
+                ++due.tv_sec;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            late.push_back((now.tv_sec - due.tv_sec) * 1e6 + (now.tv_nsec - due.tv_nsec) / 1e3);
+        }
+    });
+    timer.join();
+    return late;
+}
+
+// The capture loop's problem on the TX1 in miniature: a periodic thread
+// sharing a core with busy ones. Runs the loop on the last CPU alone, with two
+// spinning threads pinned there too, then the same with SCHED_FIFO (root or
+// CAP_SYS_NICE), and with the load moved off to another core when there is
+// one. Also checks the CPU list parser.
+static bool bench_placement()
+{
+    static const struct { const char *list, *parsed; } lists[] =
+    {
+        { "0", "0" }, { "0-1,3", "0-1,3" }, { "3,1,2", "1-3" }, { "0,0-2", "0-2" },
+        { "", NULL }, { "1-", NULL }, { "2-1", NULL }, { "a", NULL }, { "1,,2", NULL },
+    };
+    int wrong = 0;
+    for (auto & l : lists)
+    {
+        cpu_set_t set;
+        const bool ok = parse_cpu_list(l.list, set);
+        if (ok != (l.parsed != NULL) || (ok && cpu_list(set) != l.parsed))
+        {
+            printf("placement: '%s' parsed wrong\n", l.list);
+            ++wrong;
+        }
+    }
+    printf("placement: %d of %zu cpu lists parsed wrong\n", wrong, sizeof lists / sizeof lists[0]);
+
+    const int cpus = (int)std::thread::hardware_concurrency();
+    const std::string last = std::to_string(cpus > 0 ? cpus - 1 : 0);
+    const int cycles = 2000;
+
+    std::atomic<bool> spinning(false);
+    std::vector<std::thread> load;
+    auto start_load = [&](const std::string & on)
+    {
+        spinning = true;
+        for (int i = 0; i < 2; ++i)
+            load.push_back(std::thread([&, on]
+            {
+                place_thread(pthread_self(), "load", thread_profile(on.c_str(), 0));
+                volatile unsigned long n = 0;
+                while (spinning.load(std::memory_order_relaxed)) ++n;
+            }));
+    };
+    auto stop_load = [&]
+    {
+        spinning = false;
+        for (auto & t : load) t.join();
+        load.clear();
+    };
+    auto report = [&](const char *name, const thread_profile & profile)
+    {
+        bool placed = false;
+        std::vector<double> late = wake_latencies(profile, cycles, placed);
+        if (!placed)
+        {
+            printf("placement: %-34s not permitted here\n", name);
+            return;
+        }
+        std::sort(late.begin(), late.end());
+        printf("placement: %-34s wake-up late p50 %7.1f us, p99 %8.1f us, max %8.1f us\n", name,
+               late[cycles / 2], late[cycles * 99 / 100], late.back());
+    };
+
+    // the reports of place_thread are part of the output
+    async_logger::instance().set_level(log_info);
+    report(("alone on cpu " + last).c_str(), thread_profile(last.c_str(), 0));
+    start_load(last);
+    report("sharing with 2 spinning threads", thread_profile(last.c_str(), 0));
+    report("sharing, SCHED_FIFO 50", thread_profile(last.c_str(), 50));
+    stop_load();
+    if (cpus > 1)
+    {
+        start_load("0");
+        report(("load pinned to cpu 0, loop on " + last).c_str(), thread_profile(last.c_str(), 0));
+        stop_load();
+    }
+    async_logger::instance().flush();
+    return wrong == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *only = argc > 1 ? argv[1] : NULL;
+    const int frames = 300;
+
+    // every stage runs even after one failed; any failure fails the run
+    bool ok = true;
+    if (!only || !strcmp(only, "mesh")) ok = bench_mesh(frames) && ok;
+    if (!only || !strcmp(only, "roi")) ok = bench_roi(frames) && ok;
+    if (!only || !strcmp(only, "mask")) ok = bench_mask(frames) && ok;
+    if (!only || !strcmp(only, "base64")) ok = bench_base64(frames) && ok;
+    if (!only || !strcmp(only, "pose")) ok = bench_pose() && ok;
+    if (!only || !strcmp(only, "log")) ok = bench_log() && ok;
+    if (!only || !strcmp(only, "placement")) ok = bench_placement() && ok;
+    if (!only || !strcmp(only, "send")) ok = bench_send() && ok;
+    if (!only || !strcmp(only, "udp")) ok = bench_udp() && ok;
+    if (!only || !strcmp(only, "metrics")) ok = bench_metrics() && ok;
+    if (!only || !strcmp(only, "pubsub")) ok = bench_pubsub() && ok;
+
+    return ok ? 0 : 1;
+}
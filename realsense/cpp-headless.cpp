@@ -16,6 +16,9 @@
 #include <map>
 #include <limits>
 #include <iostream>
+#include <chrono>
+#include <thread>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -25,128 +28,42 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <signal.h>
 
-#include "server/libb64-1.2/include/b64/cencode.h"
-#include "server/libb64-1.2/include/b64/cdecode.h"
+// Base64 is only used for debugging the channels (--base64); it costs 4/3
+// the bandwidth. The library (libb64.a, built in server/) has vectorised paths.
+#include "server/libb64-1.2/include/b64/span.h"
 
 #include <arpa/inet.h>
 #define IMAGE_SIZE (640*480*3)
 #define PORT "3490" // the port client will be connecting to
+#define DEPTH_PORT "3491"
+#define MESH_PORT "3492" // occlusion mesh generated from the depth stream
+#define POSE_PORT "3493" // head poses from server.js, see pose_sync.hpp
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "third_party/stb_image_write.h"
-
-const int CHARS_PER_LINE = 10000000;
-
-
-
-/* begin Base64 library implementation. The Base64 library is not used, however,
- * it was used initially for debugging and setting up the channels. Base64 allows raw bytes
- * to be sent as ASCII strings that are universal across platforms by encoding the data
- * in the 64 alphanumeric characters plus some symbols. However, this requires 4/3 the memory
- * and so should only be used for debugging purposes.
- */
-
-void base64_init_encodestate(base64_encodestate* state_in)
-{
-	state_in->step = step_A;
-	state_in->result = 0;
-	state_in->stepcount = 0;
-}
-
-char base64_encode_value(char value_in)
-{
-	static const char* encoding = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-	if (value_in > 63) return '=';
-	return encoding[(int)value_in];
-}
-
-int base64_encode_block(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
-{
-	const char* plainchar = plaintext_in;
-	const char* const plaintextend = plaintext_in + length_in;
-	char* codechar = code_out;
-	char result;
-	char fragment;
-
-	result = state_in->result;
-
-	switch (state_in->step)
-	{
-		while (1)
-		{
-	case step_A:
-			if (plainchar == plaintextend)
-			{
-				state_in->result = result;
-				state_in->step = step_A;
-				return codechar - code_out;
-			}
-			fragment = *plainchar++;
-			result = (fragment & 0x0fc) >> 2;
-			*codechar++ = base64_encode_value(result);
-			result = (fragment & 0x003) << 4;
-	case step_B:
-			if (plainchar == plaintextend)
-			{
-				state_in->result = result;
-				state_in->step = step_B;
-				return codechar - code_out;
-			}
-			fragment = *plainchar++;
-			result |= (fragment & 0x0f0) >> 4;
-			*codechar++ = base64_encode_value(result);
-			result = (fragment & 0x00f) << 2;
-	case step_C:
-			if (plainchar == plaintextend)
-			{
-				state_in->result = result;
-				state_in->step = step_C;
-				return codechar - code_out;
-			}
-			fragment = *plainchar++;
-			result |= (fragment & 0x0c0) >> 6;
-			*codechar++ = base64_encode_value(result);
-			result  = (fragment & 0x03f) >> 0;
-			*codechar++ = base64_encode_value(result);
-
-			++(state_in->stepcount);
-			if (state_in->stepcount == CHARS_PER_LINE/4)
-			{
-				*codechar++ = '\n';
-				state_in->stepcount = 0;
-			}
-		}
-	}
-	/* control should not reach here */
-	printf("HERE AND ITS BAD\n");
-	return codechar - code_out;
-}
+// Whether or not we build and send the occlusion mesh
+#define SEND_OCCLUSION_MESH 1
 
-int base64_encode_blockend(char* code_out, base64_encodestate* state_in)
-{
-	char* codechar = code_out;
-
-	switch (state_in->step)
-	{
-	case step_B:
-		*codechar++ = base64_encode_value(state_in->result);
-		*codechar++ = '=';
-		*codechar++ = '=';
-		break;
-	case step_C:
-		*codechar++ = base64_encode_value(state_in->result);
-		*codechar++ = '=';
-		break;
-	case step_A:
-		break;
-	}
-	*codechar++ = '\n';
-
-	return codechar - code_out;
-}
+// Subsampling outside the client's region of interest; 0 drops everything
+// outside of it. See roi_stream.hpp.
+#define ROI_RGB_OUTSIDE_SCALE 4
+#define ROI_DEPTH_OUTSIDE_SCALE 0
 
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "third_party/stb_image_write.h"
 
+#include "async_log.hpp"
+#include "depth_mesh.hpp"
+#include "roi_stream.hpp"
+#include "headless_options.hpp"
+#include "stream_link.hpp"
+#include "exposure_settle.hpp"
+#include "pose_sync.hpp"
+#include "occlusion_mask.hpp"
+#include "metrics.hpp"
+#include "thread_placement.hpp"
+#include "udp_transport.hpp"
+#include "pubsub_server.hpp"
 
 // Convert the depth image from uint16 to uint8. While we lose precision, this saves
 // network bandwidth and also is not required for occlusion.
@@ -166,6 +83,20 @@ void normalize_depth_to_rgb(uint8_t rgb_image[], const uint16_t depth_image[], i
     }
 }
 
+// Same as above, restricted to a region of the image. Pixels outside of it are
+// left untouched.
+void normalize_depth_region(uint8_t rgb_image[], const uint16_t depth_image[], int width, const roi_rect & r)
+{
+    for (int y = r.y; y < r.y + r.h; ++y)
+    {
+        for (int i = y * width + r.x; i < y * width + r.x + r.w; ++i)
+        {
+            auto d = depth_image[i];
+            rgb_image[i] = d ? d * 255 / std::numeric_limits<uint16_t>::max() : 0;
+        }
+    }
+}
+
 // setup number of channels for each stream
 std::map<rs::stream,int> components_map =
 {
@@ -189,121 +120,210 @@ struct stream_record
 };
 
 
-// networking helper function to get in_addr
-void *get_in_addr(struct sockaddr *sa)
+// Send a buffer of tiles as is, or in base64 debug mode with each payload
+// encoded chunk by chunk straight into the socket, without staging the
+// encoded frame. As is, the link may swap the buffer for another one. With a
+// UDP sender the tiles go out as one UDP frame instead, never as base64.
+// Either way the link drops the whole frame while its socket is backed up.
+static bool send_tiles(stream_link & link, udp_frame_sender *udp, std::vector<uint8_t> & tiles,
+                       base64::parallel_encoder *encoder)
 {
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-    }
+    if (udp) return udp->send_frame(tiles.data(), tiles.size());
+    if (!encoder) return link.send_frame(tiles);
+    if (!link.begin_packet()) return link.connected();
 
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+    const uint8_t *data = tiles.data();
+    size_t size = tiles.size();
+    while (size >= sizeof(frame_header))
+    {
+        struct frame_header header;
+        memcpy(&header, data, sizeof header);
+        base64::const_span payload = { (const char *)data + header.header_size, header.payload_size };
+        size_t tile_size = header.header_size + header.payload_size;
+
+        header.flags |= FRAME_TILE_BASE64;
+        header.payload_size = (uint32_t)base64::encoded_size(payload.size);
+        if (!link.send(&header, sizeof header)) return false;
+        if (!encoder->encode(payload, [&](const char *code, size_t length) { return link.send(code, length); }))
+            return false;
+
+        data += tile_size;
+        size -= tile_size;
+    }
+    return true;
 }
 
+// milliseconds since start, for the startup timeline
+static std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
 
-int main(int argc, char *argv[]) try
+static double since_start_ms()
 {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+}
 
+// joins a thread however the scope is left, so a camera error while the
+// network is still connecting does not terminate the process
+struct scoped_join
+{
+    std::thread & thread;
+    explicit scoped_join(std::thread & thread) : thread(thread) {}
+    ~scoped_join() { if (thread.joinable()) thread.join(); }
+};
 
-    int sockfd, numbytes, sockfd2;
-    struct addrinfo hints, *servinfo, *p;
-    int rv;
-    char s[INET6_ADDRSTRLEN];
-
-    //================= Begin networking setup =====================
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+// log the frame intervals since the last report
+static void report_intervals(interval_stats & intervals)
+{
+    if (!intervals.count()) return;
+    const size_t n = intervals.count();
+    double mean, rms, p99, worst;
+    intervals.take(mean, rms, p99, worst);
+    ALOG_INFO("capture: %zu frame intervals, mean %.2f ms, jitter %.2f ms rms, p99 %.2f ms, worst %.2f ms",
+              n, mean / 1000, rms / 1000, p99 / 1000, worst / 1000);
+}
 
-    if ((rv = getaddrinfo(argv[1], "3490", &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
-    }
+// set from the signal handlers to leave the capture loop cleanly
+static volatile sig_atomic_t stop_requested = 0;
 
-    // loop through all the results and connect to the first we can to get rgb socket
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype,
-                p->ai_protocol)) == -1) {
-            perror("client: socket");
-            continue;
-        }
+static void request_stop(int)
+{
+    stop_requested = 1;
+}
 
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("client: connect");
-            continue;
-        }
 
-        break;
+int main(int argc, char *argv[]) try
+{
+    headless_options options;
+    if (!options.parse(argc, argv))
+    {
+        fprintf(stderr, "usage: %s <host> [--daemon] [--frames=N] [--base64] [--config=file]\n"
+                        "       %s --serve-port=N [--serve-socket=path] [--daemon] [--frames=N] [--config=file]\n",
+                argv[0], argv[0]);
+        return 1;
     }
 
-    if (p == NULL) {
-        fprintf(stderr, "client: failed to connect\n");
-        return 2;
-    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
 
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
-            s, sizeof s);
-    printf("client: connecting to %s\n", s);
+    // nothing on the capture path writes to the terminal itself
+    async_logger::instance().set_level(log_level_by_name(options.log_level));
+    async_logger::instance().set_rate(options.log_rate);
 
-    freeaddrinfo(servinfo);
+    // the frame buffers allocated further down are locked as they come in
+    const thread_placement & placement = options.placement;
+    if (placement.lock_memory) lock_memory();
+    if (!placement.log.cpus.empty() || placement.log.fifo)
+        place_thread(async_logger::instance().native_handle(), "log", placement.log);
 
-    /* First socket for RGB is now saved in sockfd */
+    // numbers for the metrics endpoint and the summary line
+    metrics_registry registry("cpp_headless_");
+    capture_metrics metrics(registry);
 
+    //================= Begin networking setup =====================
 
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    // In server mode subscribers come to us (see pubsub_server.hpp), and
+    // the links below are never connected. Listening starts right away so
+    // that they can connect while the camera comes up.
+    const bool serving = options.serving();
+    pubsub_server server(registry, options.serve_queue, options.serve_stall_ms);
+    if (serving)
+    {
+        if (options.serve_port > 0 && !server.listen_tcp(options.serve_port)) return 2;
+        if (!options.serve_socket.empty() && !server.listen_unix(options.serve_socket)) return 2;
+        server.start();
+        if (!placement.io.cpus.empty() || placement.io.fifo)
+            place_thread(server.native_handle(), "serve", placement.io);
+    }
 
-    if ((rv = getaddrinfo(argv[1], "3491", &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+    // first socket for RGB, second socket for depth
+    stream_link rgb_link(options.host, PORT, options.reconnect_min_ms, options.reconnect_max_ms);
+    stream_link depth_link(options.host, DEPTH_PORT, options.reconnect_min_ms, options.reconnect_max_ms);
+#if SEND_OCCLUSION_MESH
+    stream_link mesh_link(options.host, MESH_PORT, options.reconnect_min_ms, options.reconnect_max_ms);
+    mesh_link.use_zerocopy(options.zerocopy);
+#endif
+    rgb_link.use_zerocopy(options.zerocopy);
+    depth_link.use_zerocopy(options.zerocopy);
+
+    // with --udp the frames take the same port numbers over UDP, and the
+    // links above only carry the control channel
+    udp_frame_sender rgb_udp(options.udp_fec), depth_udp(options.udp_fec);
+    if (options.udp && serving)
+    {
+        ALOG_WARN("udp: subscribers get frames over their own connection, --udp is ignored");
+    }
+    else if (options.udp)
+    {
+        udp_impairment impairment;
+        impairment.loss = options.udp_loss;
+        impairment.burst = options.udp_burst;
+        impairment.reorder = options.udp_reorder;
+        rgb_udp.set_impairment(impairment);
+        depth_udp.set_impairment(impairment);
+        if (!rgb_udp.open(options.host, PORT) || !depth_udp.open(options.host, DEPTH_PORT)) return 2;
+        if (options.base64) ALOG_WARN("udp: frames are sent as binary, --base64 only applies to TCP");
     }
 
-    // Get second Socket for depth
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sockfd2 = socket(p->ai_family, p->ai_socktype,
-                p->ai_protocol)) == -1) {
-            perror("client: socket");
-            continue;
+    // Connecting and bringing up the camera both take a while, so they run
+    // side by side. Outside of daemon mode the server has to be up before we
+    // start; in daemon mode the links connect in the background anyway, this
+    // just gets the first attempt going early.
+    bool network_ok = true;
+    double network_ready_ms = 0;
+    std::thread network_setup([&]()
+    {
+        if (serving)
+        {
+            // nothing to connect
         }
-
-        if (connect(sockfd2, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd2);
-            perror("client: connect");
-            continue;
+        else if (options.daemon)
+        {
+            rgb_link.poll_connect();
+            depth_link.poll_connect();
+#if SEND_OCCLUSION_MESH
+            mesh_link.poll_connect();
+#endif
         }
-
-        break;
-    }
-
-    if (p == NULL) {
-        fprintf(stderr, "client: failed to connect\n");
-        return 2;
+        else
+        {
+            network_ok = rgb_link.connect_now() && depth_link.connect_now();
+#if SEND_OCCLUSION_MESH
+            network_ok = network_ok && mesh_link.connect_now();
+#endif
+        }
+        network_ready_ms = since_start_ms();
+    });
+    scoped_join network_join(network_setup);
+
+    // head poses arrive on a thread of their own, whenever server.js is up
+    pose_feed poses(options.host, POSE_PORT, options.reconnect_min_ms, options.reconnect_max_ms,
+                    (uint32_t)options.pose_max_hold_ms * 1000);
+    if (options.poses)
+    {
+        poses.start();
+        if (!placement.pose.cpus.empty() || placement.pose.fifo)
+            place_thread(poses.native_handle(), "pose", placement.pose);
     }
 
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
-            s, sizeof s);
-    printf("client: connecting to %s\n", s);
-
-    freeaddrinfo(servinfo); // all done with this structure
-
-
-
     //=================== End networking setup ========================
 
 
     rs::log_to_console(rs::log_severity::warn);
 
+    // librealsense starts its USB and conversion threads from this one, and
+    // they keep the affinity it has when they start
+    if (!placement.camera.cpus.empty() || placement.camera.fifo)
+        place_thread(pthread_self(), "camera", placement.camera);
+
     // check if camera is connected!
     rs::context ctx;
-    printf("There are %d connected RealSense devices.\n", ctx.get_device_count());
+    ALOG_INFO("There are %d connected RealSense devices.", ctx.get_device_count());
     if(ctx.get_device_count() == 0) return EXIT_FAILURE;
 
     rs::device * dev = ctx.get_device(0);
-    printf("\nUsing device 0, an %s\n", dev->get_name());
-    printf("    Serial number: %s\n", dev->get_serial());
-    printf("    Firmware version: %s\n", dev->get_firmware_version());
+    ALOG_INFO("Using device 0, an %s", dev->get_name());
+    ALOG_INFO("    Serial number: %s", dev->get_serial());
+    ALOG_INFO("    Firmware version: %s", dev->get_firmware_version());
 
 
     // get what streams camera supports. This changes based on whether we are using
@@ -321,37 +341,203 @@ int main(int argc, char *argv[]) try
     // activate video streaming
     dev->start();
 
+    // the rest of this thread is the capture loop; without a profile of
+    // its own it stays where the camera threads are
+    place_thread(pthread_self(), "capture", placement.capture);
+
     // retrieve actual frame size for each enabled stream
     for (auto & stream_record : supported_streams)
         stream_record.intrinsics = dev->get_stream_intrinsics(stream_record.stream);
 
-    // Capture 30 frames to give autoexposure, etc. a chance to settle
-    for (int i = 0; i < 30; ++i) dev->wait_for_frames();
+    const double streaming_ms = since_start_ms();
+
+    // Give autoexposure, etc. a chance to settle: wait until the brightness
+    // of the colour stream stops changing, bounded by settle_max_frames
+    exposure_settle_params settle_params;
+    settle_params.tolerance = options.settle_tolerance;
+    settle_params.stable_frames = options.settle_stable_frames;
+    settle_params.max_frames = options.settle_max_frames;
+    settle_params.min_brightness = options.settle_min_brightness;
+    exposure_settle settle(settle_params);
+    const rs::intrinsics & color_intrinsics = supported_streams[(int)rs::stream::color].intrinsics;
+    // each frame is stamped as soon as wait_for_frames() returns, before any
+    // link polling or bookkeeping, and dated back by the camera latency, so
+    // the pose it is matched with and the latency the receiver measures
+    // start from its capture
+    const uint64_t camera_latency_us = (uint64_t)std::max(options.camera_latency_ms, 0) * 1000;
+    uint64_t frame_us;
+    do
+    {
+        dev->wait_for_frames();
+        frame_us = monotonic_us() - camera_latency_us;
+    }
+    while (!settle.update((const uint8_t *)dev->get_frame_data(rs::stream::color),
+                          color_intrinsics.width, color_intrinsics.height));
+
+    const double settled_ms = since_start_ms();
+
+    network_setup.join();
+    if (!network_ok) return 2;
+
+    ALOG_INFO("startup: network ready %.0f ms, camera streaming %.0f ms, exposure %s after %d frames %.0f ms",
+           network_ready_ms, streaming_ms, settle.has_converged() ? "settled" : "timed out",
+           settle.frame_count(), settled_ms);
 
 
     // Create buffers the RGB and depth images
 	char *img_out_rgb = new char [640*480*3];
 	char *img_out = new char [640*640];
 
+#if SEND_OCCLUSION_MESH
+    // occluder mesh, rebuilt from the 8-bit depth map every frame
+    depth_mesh_builder mesh(640, 480);
+    std::vector<uint8_t> mesh_packet;
+#endif
+
+    // the browser reports where its virtual objects are on the RGB socket
+    roi_control_channel control;
+    const roi_policy rgb_policy(ROI_RGB_OUTSIDE_SCALE), depth_policy(ROI_DEPTH_OUTSIDE_SCALE);
+    roi_tile_writer rgb_tiles(FRAME_STREAM_RGB, 3, 640, 480);
+    roi_tile_writer depth_tiles(FRAME_STREAM_DEPTH, 1, 640, 480);
+    occlusion_mask_writer occlusion(640, 480);
+    std::vector<uint8_t> coloredDepth(640 * 480);
+
+    metrics_server metrics_endpoint(registry);
+    if (options.metrics_port > 0) metrics_endpoint.listen_tcp(options.metrics_port);
+    if (!options.metrics_socket.empty()) metrics_endpoint.listen_unix(options.metrics_socket);
+    if (options.metrics_port > 0 || !options.metrics_socket.empty() || options.metrics_summary_s > 0)
+    {
+        metrics_endpoint.start(options.metrics_summary_s, [&metrics] { metrics.summarize(); });
+        if (!placement.io.cpus.empty() || placement.io.fifo)
+            place_thread(metrics_endpoint.native_handle(), "metrics", placement.io);
+    }
+
+    std::unique_ptr<base64::parallel_encoder> base64_encoder;
+    if (options.base64 && serving)
+    {
+        ALOG_WARN("serve: subscribers ask for base64 with format=base64, --base64 is ignored");
+    }
+    else if (options.base64)
+    {
+        base64_encoder.reset(new base64::parallel_encoder(options.base64_threads));
+        if (!placement.base64.cpus.empty() || placement.base64.fifo)
+            for (size_t i = 0; i < base64_encoder->thread_count(); ++i)
+                place_thread(base64_encoder->native_handle(i), "base64", placement.base64);
+    }
+
+    // frames captured while a link was down
+    uint64_t dropped = 0;
+    bool first_frame_sent = false;
+
+    // set once any send of a frame has succeeded, for the startup log
+    bool frame_sent = false;
+
+    // how evenly frames reach the loop: scheduling jitter on top of the
+    // camera's own
+    interval_stats frame_intervals;
+    uint64_t last_frame_us = 0;
 
-    // for testing, we use 2000 frames. If this condition is made infinite,
-    // we will stream indefinitely.
+    // send one stream's tiles, or publish them to the subscribers, counting
+    // the time and bytes, and the frames a backed-up link dropped
+    auto send_stream = [&](int stream, stream_link & link, udp_frame_sender *udp, std::vector<uint8_t> & tiles, metric_counter & bytes)
+    {
+        const size_t size = tiles.size();
+        const unsigned long long link_dropped = link.dropped();
+        bool ok = true, delivered;
+        {
+            metric_timer timer(metrics.send);
+            if (serving) delivered = server.publish(stream, tiles) > 0;
+            else delivered = ok = send_tiles(link, udp, tiles, base64_encoder.get());
+        }
+        if (link.dropped() != link_dropped)
+        {
+            metrics.backlog_dropped.add();
+            delivered = false;
+        }
+        else if (ok) bytes.add(size);
+        if (!ok) metrics.send_failures.add();
+        if (delivered) frame_sent = true;
+        return ok;
+    };
 
-	for (int test = 0; test<2000; test++)
+
+    // Outside of daemon mode we stream options.frames frames (2000 by
+    // default). In daemon mode we stream until we are told to stop; the
+    // camera keeps running while the server comes and goes.
+
+	for (uint32_t frame = 0; !stop_requested && (options.daemon || frame < options.frames); frame++)
 	{
 
+    frame_intervals.add(frame_us);
+    if (frame_intervals.count() == 300) report_intervals(frame_intervals);
+    if (last_frame_us) metrics.interval.observe((frame_us - last_frame_us) * 1e-6);
+    last_frame_us = frame_us;
+    metrics.frames.add();
+
+    if (options.daemon && !serving)
+    {
+        rgb_link.poll_connect();
+        depth_link.poll_connect();
+#if SEND_OCCLUSION_MESH
+        mesh_link.poll_connect();
+#endif
+    }
+
+    // a new RGB connection means a new browser-side control channel
+    if (rgb_link.take_fresh())
+    {
+        control.reset(rgb_link.fd());
+        if (dropped) ALOG_INFO("client: dropped %llu frames while disconnected", (unsigned long long)dropped);
+        dropped = 0;
+    }
+
+    metrics.links_connected.set(serving ? server.subscribed() : rgb_link.connected() + depth_link.connected());
+    metrics.zerocopy_in_flight.set(rgb_link.zerocopy_stats().buffers_in_flight() + depth_link.zerocopy_stats().buffers_in_flight());
+
+    // what to build this frame: what has a link connected, or a subscriber
+    const bool want_rgb = serving ? server.wants(PUBSUB_RGB) : rgb_link.connected();
+    const bool want_depth = serving ? server.wants(PUBSUB_DEPTH) : depth_link.connected();
+#if SEND_OCCLUSION_MESH
+    const bool want_mesh = serving ? server.wants(PUBSUB_MESH) : depth_link.connected() && mesh_link.connected();
+#else
+    const bool want_mesh = false;
+#endif
+
+    // nobody to send to: skip the conversion work and wait for the next frame
+    if (!want_rgb && !want_depth && !want_mesh)
+    {
+        ++dropped;
+        metrics.dropped.add();
+        dev->wait_for_frames();
+        frame_us = monotonic_us() - camera_latency_us;
+        continue;
+    }
 
+    struct frame_pose pose;
+    const bool have_pose = options.poses && poses.pose_at(frame_us, pose);
+    control.poll();
+    const roi_rect depth_roi = control.roi().padded(depth_policy.margin, 640, 480);
 
     // Retrieve data from all the enabled streams
     for (auto & stream_record : supported_streams)
         stream_record.frame_data = const_cast<uint8_t *>((const uint8_t*)dev->get_frame_data(stream_record.stream));
 
-    // Transform Depth range map into uint8 map
+    // Transform Depth range map into uint8 map. The occlusion mask is
+    // computed from the raw depth, which depth.frame_data keeps pointing to.
     stream_record depth = supported_streams[(int)rs::stream::depth];
-    std::vector<uint8_t> coloredDepth(depth.intrinsics.width * depth.intrinsics.height);
 
-    // Encode depth data into uint8 image
-    normalize_depth_to_rgb(coloredDepth.data(), (const uint16_t *)depth.frame_data, depth.intrinsics.width, depth.intrinsics.height);
+    // Encode depth data into uint8 image. If only the ROI is sent there is
+    // no point converting the rest of it.
+    {
+        metric_timer timer(metrics.convert);
+        if (depth_roi.empty() || depth_policy.outside_scale > 0)
+            normalize_depth_to_rgb(coloredDepth.data(), (const uint16_t *)depth.frame_data, depth.intrinsics.width, depth.intrinsics.height);
+        else
+        {
+            std::fill(coloredDepth.begin(), coloredDepth.end(), 0);
+            normalize_depth_region(coloredDepth.data(), (const uint16_t *)depth.frame_data, depth.intrinsics.width, depth_roi);
+        }
+    }
 
     // Update captured data
     supported_streams[(int)rs::stream::depth].frame_data = coloredDepth.data();
@@ -359,26 +545,64 @@ int main(int argc, char *argv[]) try
 
     for (auto & captured : supported_streams)
     {
-					std::stringstream ss;
-
-
-		if (captured.stream == rs::stream::color){
-
-			if ((numbytes = send(sockfd, captured.frame_data, 3*640*480, 0)) == -1) {
-				perror("send");
+		if (captured.stream == rs::stream::color && want_rgb)
+		{
+			rgb_tiles.build(captured.frame_data, control.roi(), rgb_policy, frame, frame_us, have_pose ? &pose : NULL);
+			const size_t rgb_bytes = rgb_tiles.size();
+			if (!send_stream(PUBSUB_RGB, rgb_link, options.udp ? &rgb_udp : NULL, rgb_tiles.packet(), metrics.rgb_bytes) && !options.daemon) {
+				ALOG_ERROR("send: %s", strerror(errno));
 				exit(1);
 			}
-			send(sockfd,"\n", 1, 0);
-			std::cout << "sent rgb data" << std::endl;
+			ALOG_DEBUG("sent rgb frame %u, %zu bytes", frame, rgb_bytes);
 		}
-		if (captured.stream == rs::stream::depth)
+		if (captured.stream == rs::stream::depth && (want_depth || want_mesh))
 		{
-			if ((numbytes = send(sockfd2, captured.frame_data, 640*480, 0)) == -1) {
-				perror("send");
-				exit(1);
+			if (want_depth && options.occlusion_mask)
+			{
+				occlusion.build((const uint16_t *)depth.frame_data, control.region_depth(), depth_roi, options.occlusion_rle,
+				                frame, frame_us, have_pose ? &pose : NULL);
+				if (!send_stream(PUBSUB_DEPTH, depth_link, options.udp ? &depth_udp : NULL, occlusion.packet(), metrics.depth_bytes) && !options.daemon) {
+					ALOG_ERROR("send: %s", strerror(errno));
+					exit(1);
+				}
+			}
+			else if (want_depth)
+			{
+				depth_tiles.build(captured.frame_data, control.roi(), depth_policy, frame, frame_us, have_pose ? &pose : NULL);
+				if (!send_stream(PUBSUB_DEPTH, depth_link, options.udp ? &depth_udp : NULL, depth_tiles.packet(), metrics.depth_bytes) && !options.daemon) {
+					ALOG_ERROR("send: %s", strerror(errno));
+					exit(1);
+				}
 			}
-			send(sockfd2,"\n", 1, 0);
-			std::cout << "sent depth data" << std::endl;
+			if (want_depth) ALOG_DEBUG("sent depth frame %u", frame);
+
+#if SEND_OCCLUSION_MESH
+            if (want_mesh)
+            {
+                mesh.build(captured.frame_data);
+                mesh.serialize(mesh_packet);
+                const size_t mesh_bytes = mesh_packet.size();
+                const unsigned long long mesh_dropped = mesh_link.dropped();
+                if (serving)
+                {
+                    if (server.publish(PUBSUB_MESH, mesh_packet)) frame_sent = true;
+                    metrics.mesh_bytes.add(mesh_bytes);
+                }
+                else if (mesh_link.send_frame(mesh_packet))
+                {
+                    if (mesh_link.dropped() != mesh_dropped) metrics.backlog_dropped.add();
+                    else
+                    {
+                        frame_sent = true;
+                        metrics.mesh_bytes.add(mesh_bytes);
+                    }
+                }
+                else if (!options.daemon) {
+                    ALOG_ERROR("send: %s", strerror(errno));
+                    exit(1);
+                }
+            }
+#endif
 
             // for testing purposes, writeout depthmap so that a user can check against
             // what is captured by the camera.
@@ -398,14 +622,25 @@ int main(int argc, char *argv[]) try
 
 
     }
+        // time-to-first-frame is the startup latency the user sees on the
+        // headset, so it counts from the first frame that actually went out
+        if (!first_frame_sent && frame_sent)
+        {
+            first_frame_sent = true;
+            ALOG_INFO("startup: first frame sent after %.0f ms", since_start_ms());
+        }
+
         // wait for frames to be ready
 		dev->wait_for_frames();
+		frame_us = monotonic_us() - camera_latency_us;
 	}
 
     // clean up
-    close(sockfd);
-    close(sockfd2);
-
+    report_intervals(frame_intervals);
+    metrics_endpoint.stop();
+    server.stop();
+    poses.stop();
+    dev->stop();
 
     delete [] img_out_rgb;
 	delete [] img_out;
@@ -413,11 +648,13 @@ int main(int argc, char *argv[]) try
 }
 catch(const rs::error & e)
 {
+    async_logger::instance().flush();
     std::cerr << "RealSense error calling " << e.get_failed_function() << "(" << e.get_failed_args() << "):\n    " << e.what() << std::endl;
     return EXIT_FAILURE;
 }
 catch(const std::exception & e)
 {
+    async_logger::instance().flush();
     std::cerr << e.what() << std::endl;
     return EXIT_FAILURE;
 }
@@ -0,0 +1,297 @@
+///////////////////
+// depth_mesh    //
+///////////////////
+
+// Turns an 8-bit depth image into a decimated, indexed triangle mesh that the
+// renderer uses as an occluder. The image is covered by a quadtree: cells whose
+// depth range is within a tolerance are emitted as a single quad, everything
+// else is subdivided down to the minimum cell size. At the bottom of the tree
+// triangles that straddle a depth jump (or touch invalid pixels) are dropped,
+// so foreground and background come apart instead of being joined by long
+// stretched triangles.
+//
+// Vertices live on the min-cell lattice and are shared between neighbouring
+// cells. Where a large cell meets smaller ones there is a T-junction; since a
+// large cell is only emitted when it is flat, the resulting crack is bounded
+// by the flatness tolerance. Indices are 16-bit, so the lattice has at most
+// 65536 points; images too large for min_cell get coarser cells instead.
+
+#ifndef DEPTH_MESH_HPP
+#define DEPTH_MESH_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#define DEPTH_MESH_MAGIC 0x3148534d // "MSH1", little endian
+
+// Wire format: header followed by vertex_count * {uint16 x, uint16 y, uint16 depth}
+// and index_count uint16 indices (three per triangle).
+struct depth_mesh_header
+{
+    uint32_t magic;
+    uint16_t width;
+    uint16_t height;
+    uint32_t vertex_count;
+    uint32_t index_count;
+};
+
+struct depth_mesh_params
+{
+    int min_cell        = 4;    // smallest quadtree cell, in pixels (power of two)
+    int max_cell        = 32;   // largest quadtree cell, in pixels (power of two)
+    int flat_tolerance  = 3;    // max depth range (8-bit units) for a cell to be merged
+    int jump_threshold  = 12;   // max depth range inside a single emitted triangle
+};
+
+class depth_mesh_builder
+{
+public:
+    depth_mesh_builder(int width, int height, const depth_mesh_params & requested = depth_mesh_params())
+        : width(width), height(height), params(fit_lattice(width, height, requested))
+    {
+        levels = 0;
+        while ((params.min_cell << levels) < params.max_cell) ++levels;
+
+        cols = (width  + params.min_cell - 1) / params.min_cell;
+        rows = (height + params.min_cell - 1) / params.min_cell;
+
+        level_cols.resize(levels + 1);
+        level_rows.resize(levels + 1);
+        level_min.resize(levels + 1);
+        level_max.resize(levels + 1);
+        for (int l = 0, c = cols, r = rows; l <= levels; ++l, c = (c + 1) / 2, r = (r + 1) / 2)
+        {
+            level_cols[l] = c;
+            level_rows[l] = r;
+            level_min[l].resize(c * r);
+            level_max[l].resize(c * r);
+        }
+
+        lattice.resize((cols + 1) * (rows + 1));
+        verts.reserve(lattice.size() * 3);
+        indices.reserve(cols * rows * 6);
+    }
+
+    // Rebuild the mesh from a width x height depth image. 0 marks invalid depth.
+    void build(const uint8_t depth[])
+    {
+        image = depth;
+        verts.clear();
+        indices.clear();
+        std::fill(lattice.begin(), lattice.end(), -1);
+
+        build_pyramid();
+
+        for (int cy = 0; cy < level_rows[levels]; ++cy)
+            for (int cx = 0; cx < level_cols[levels]; ++cx)
+                subdivide(levels, cx, cy);
+    }
+
+    // Triangles are listed as index triples into vertices(), three uint16 per vertex.
+    const std::vector<uint16_t> & vertices() const { return verts; }
+    const std::vector<uint16_t> & triangle_indices() const { return indices; }
+
+    size_t vertex_count() const { return verts.size() / 3; }
+    size_t index_count() const { return indices.size(); }
+
+    // Write header + buffers into out, reusing its storage. Returns the packet size.
+    size_t serialize(std::vector<uint8_t> & out) const
+    {
+        depth_mesh_header header;
+        header.magic = DEPTH_MESH_MAGIC;
+        header.width = (uint16_t)width;
+        header.height = (uint16_t)height;
+        header.vertex_count = (uint32_t)vertex_count();
+        header.index_count = (uint32_t)index_count();
+
+        size_t vbytes = verts.size() * sizeof(uint16_t);
+        size_t ibytes = indices.size() * sizeof(uint16_t);
+        out.resize(sizeof header + vbytes + ibytes);
+        memcpy(out.data(), &header, sizeof header);
+        if (vbytes) memcpy(out.data() + sizeof header, verts.data(), vbytes);
+        if (ibytes) memcpy(out.data() + sizeof header + vbytes, indices.data(), ibytes);
+        return out.size();
+    }
+
+    // the cell sizes in use, after fit_lattice
+    const depth_mesh_params & cell_params() const { return params; }
+
+private:
+    int width, height;
+    depth_mesh_params params;
+    int levels, cols, rows;
+
+    const uint8_t * image = nullptr;
+
+    // min/max depth per cell for every quadtree level; level 0 is the min cell
+    std::vector<int> level_cols, level_rows;
+    std::vector<std::vector<uint8_t>> level_min, level_max;
+
+    std::vector<int32_t> lattice;   // lattice point -> vertex index, -1 if unused
+    std::vector<uint16_t> verts;
+    std::vector<uint16_t> indices;
+
+    // Double min_cell (and max_cell with it, if need be) until every
+    // lattice point has a uint16_t index.
+    static depth_mesh_params fit_lattice(int width, int height, depth_mesh_params p)
+    {
+        while ((size_t)((width + p.min_cell - 1) / p.min_cell + 1) * ((height + p.min_cell - 1) / p.min_cell + 1) > 65536)
+            p.min_cell *= 2;
+        p.max_cell = std::max(p.max_cell, p.min_cell);
+        return p;
+    }
+
+    void build_pyramid()
+    {
+        const int s = params.min_cell;
+        std::vector<uint8_t> & mn = level_min[0];
+        std::vector<uint8_t> & mx = level_max[0];
+        std::fill(mn.begin(), mn.end(), 255);
+        std::fill(mx.begin(), mx.end(), 0);
+
+        // one pass over the image, folding each row into its cells
+        for (int y = 0; y < height; ++y)
+        {
+            const uint8_t * row = image + y * width;
+            uint8_t * rmn = mn.data() + (y / s) * cols;
+            uint8_t * rmx = mx.data() + (y / s) * cols;
+            for (int cx = 0; cx < cols; ++cx)
+            {
+                int x0 = cx * s, x1 = std::min(x0 + s, width);
+                uint8_t lo = rmn[cx], hi = rmx[cx];
+                for (int x = x0; x < x1; ++x)
+                {
+                    lo = std::min(lo, row[x]);
+                    hi = std::max(hi, row[x]);
+                }
+                rmn[cx] = lo;
+                rmx[cx] = hi;
+            }
+        }
+
+        for (int l = 1; l <= levels; ++l)
+        {
+            const int pc = level_cols[l - 1], pr = level_rows[l - 1];
+            for (int cy = 0; cy < level_rows[l]; ++cy)
+            {
+                for (int cx = 0; cx < level_cols[l]; ++cx)
+                {
+                    uint8_t lo = 255, hi = 0;
+                    for (int dy = 0; dy < 2; ++dy)
+                    {
+                        for (int dx = 0; dx < 2; ++dx)
+                        {
+                            int px = 2 * cx + dx, py = 2 * cy + dy;
+                            if (px >= pc || py >= pr) continue;
+                            lo = std::min(lo, level_min[l - 1][py * pc + px]);
+                            hi = std::max(hi, level_max[l - 1][py * pc + px]);
+                        }
+                    }
+                    level_min[l][cy * level_cols[l] + cx] = lo;
+                    level_max[l][cy * level_cols[l] + cx] = hi;
+                }
+            }
+        }
+    }
+
+    void subdivide(int level, int cx, int cy)
+    {
+        if (cx >= level_cols[level] || cy >= level_rows[level]) return;
+
+        const int i = cy * level_cols[level] + cx;
+        const uint8_t lo = level_min[level][i], hi = level_max[level][i];
+
+        // nothing valid in here at all
+        if (hi == 0) return;
+
+        // valid and flat: a single quad covers the whole cell
+        if (lo != 0 && hi - lo <= params.flat_tolerance)
+        {
+            int span = 1 << level;
+            int lx0 = cx * span, ly0 = cy * span;
+            int lx1 = std::min(lx0 + span, cols), ly1 = std::min(ly0 + span, rows);
+            emit_quad(lx0, ly0, lx1, ly1);
+            return;
+        }
+
+        if (level > 0)
+        {
+            for (int dy = 0; dy < 2; ++dy)
+                for (int dx = 0; dx < 2; ++dx)
+                    subdivide(level - 1, 2 * cx + dx, 2 * cy + dy);
+            return;
+        }
+
+        emit_quad(cx, cy, cx + 1, cy + 1);
+    }
+
+    // Emit the two triangles of a lattice-aligned quad, picking the diagonal
+    // with the smaller depth difference and dropping triangles that cross a
+    // discontinuity or an invalid corner.
+    void emit_quad(int lx0, int ly0, int lx1, int ly1)
+    {
+        int v00 = vertex(lx0, ly0), v10 = vertex(lx1, ly0);
+        int v01 = vertex(lx0, ly1), v11 = vertex(lx1, ly1);
+
+        int d00 = verts[3 * v00 + 2], d10 = verts[3 * v10 + 2];
+        int d01 = verts[3 * v01 + 2], d11 = verts[3 * v11 + 2];
+
+        bool main_diagonal = std::abs(d00 - d11) <= std::abs(d10 - d01);
+        if (main_diagonal)
+        {
+            emit_triangle(v00, v01, v11);
+            emit_triangle(v00, v11, v10);
+        }
+        else
+        {
+            emit_triangle(v00, v01, v10);
+            emit_triangle(v10, v01, v11);
+        }
+    }
+
+    void emit_triangle(int a, int b, int c)
+    {
+        int da = verts[3 * a + 2], db = verts[3 * b + 2], dc = verts[3 * c + 2];
+        if (da == 0 || db == 0 || dc == 0) return;
+        int lo = std::min(da, std::min(db, dc));
+        int hi = std::max(da, std::max(db, dc));
+        if (hi - lo > params.jump_threshold) return;
+
+        indices.push_back((uint16_t)a);
+        indices.push_back((uint16_t)b);
+        indices.push_back((uint16_t)c);
+    }
+
+    int vertex(int lx, int ly)
+    {
+        int32_t & slot = lattice[ly * (cols + 1) + lx];
+        if (slot >= 0) return slot;
+
+        int x = std::min(lx * params.min_cell, width);
+        int y = std::min(ly * params.min_cell, height);
+
+        slot = (int32_t)(verts.size() / 3);
+        verts.push_back((uint16_t)x);
+        verts.push_back((uint16_t)y);
+        verts.push_back(sample(x, y));
+        return slot;
+    }
+
+    // Depth at a lattice point; falls back to the other pixels touching the
+    // point so a single dropped pixel does not punch a hole in the mesh.
+    uint16_t sample(int x, int y) const
+    {
+        const int xs[2] = { std::min(x, width - 1), std::max(std::min(x, width) - 1, 0) };
+        const int ys[2] = { std::min(y, height - 1), std::max(std::min(y, height) - 1, 0) };
+        for (int j = 0; j < 2; ++j)
+            for (int i = 0; i < 2; ++i)
+                if (uint8_t d = image[ys[j] * width + xs[i]])
+                    return d;
+        return 0;
+    }
+};
+
+#endif // DEPTH_MESH_HPP
@@ -0,0 +1,80 @@
+///////////////////////
+// exposure_settle   //
+///////////////////////
+
+// Decides when the camera's auto-exposure has settled, instead of always
+// throwing away a fixed 30 frames. Exposure is judged from the mean brightness
+// of the colour frame, sampled on a sparse grid: once it changes by less than
+// a relative tolerance for a few frames in a row, the image is considered
+// stable. Frames darker than a minimum brightness never count as stable: the
+// first frames out of the camera are black or nearly so, and would otherwise
+// look settled before the exposure has even started to move. A frame limit
+// bounds the wait for scenes that never settle, e.g. flickering lights or a
+// covered lens.
+
+#ifndef EXPOSURE_SETTLE_HPP
+#define EXPOSURE_SETTLE_HPP
+
+#include <stdint.h>
+#include <math.h>
+
+struct exposure_settle_params
+{
+    double tolerance   = 0.02;  // max relative change of mean brightness per frame
+    int stable_frames  = 3;     // consecutive frames within tolerance
+    int max_frames     = 30;    // give up waiting after this many frames
+    int sample_step    = 8;     // sample every n-th pixel on every n-th row
+    double min_brightness = 16; // mean luma (0-255) below which a frame is not stable
+};
+
+class exposure_settle
+{
+public:
+    explicit exposure_settle(const exposure_settle_params & params = exposure_settle_params())
+        : params(params) {}
+
+    // Feed one RGB frame. Returns true once the exposure has settled or the
+    // frame limit is hit.
+    bool update(const uint8_t rgb[], int width, int height)
+    {
+        ++frames;
+        double mean = mean_brightness(rgb, width, height);
+        if (frames > 1 && mean >= params.min_brightness &&
+            fabs(mean - previous) <= params.tolerance * fmax(previous, 1.0))
+            ++stable;
+        else
+            stable = 0;
+        previous = mean;
+
+        if (stable >= params.stable_frames) converged = true;
+        return converged || frames >= params.max_frames;
+    }
+
+    int frame_count() const { return frames; }
+    bool has_converged() const { return converged; }
+    double brightness() const { return previous; }
+
+private:
+    exposure_settle_params params;
+    int frames = 0, stable = 0;
+    double previous = 0;
+    bool converged = false;
+
+    double mean_brightness(const uint8_t rgb[], int width, int height) const
+    {
+        uint64_t sum = 0, count = 0;
+        for (int y = 0; y < height; y += params.sample_step)
+        {
+            const uint8_t * row = rgb + (size_t)y * width * 3;
+            for (int x = 0; x < width; x += params.sample_step)
+            {
+                // integer approximation of Rec. 601 luma
+                sum += (77 * row[3 * x] + 150 * row[3 * x + 1] + 29 * row[3 * x + 2]) >> 8;
+                ++count;
+            }
+        }
+        return count ? (double)sum / count : 0;
+    }
+};
+
+#endif // EXPOSURE_SETTLE_HPP
@@ -0,0 +1,283 @@
+///////////////////////
+// headless_options  //
+///////////////////////
+
+// Command line and config file options for cpp-headless.
+//
+//     cpp-headless <host> [--key=value | --flag ...] [--config=file]
+//     cpp-headless --serve-port=N [--key=value | --flag ...]
+//
+// A config file holds the same keys, one "key = value" per line; '#' starts a
+// comment. Options are applied in order, so later ones override earlier ones.
+
+#ifndef HEADLESS_OPTIONS_HPP
+#define HEADLESS_OPTIONS_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <string>
+
+#include "async_log.hpp"
+#include "thread_placement.hpp"
+
+struct headless_options
+{
+    std::string host = "localhost";
+
+    // run until killed, reconnecting to the server whenever it goes away
+    bool daemon = false;
+
+    // frames to stream before exiting; ignored in daemon mode
+    long frames = 2000;
+
+    // reconnection backoff, doubling from min to max after every failed attempt
+    int reconnect_min_ms = 5;
+    int reconnect_max_ms = 32;
+
+    // auto-exposure warm-up, see exposure_settle.hpp
+    double settle_tolerance = 0.02;
+    int settle_stable_frames = 3;
+    int settle_max_frames = 30;
+    double settle_min_brightness = 16;
+
+    // debug mode: send tile payloads as base64 text, encoded in chunks on
+    // this many threads (0 encodes on the capture thread)
+    bool base64 = false;
+    int base64_threads = 2;
+
+    // attach the head pose at capture time to every frame, from the pose
+    // feed of server.js (see pose_sync.hpp); a pose further than
+    // pose_max_hold_ms from the IMU samples is left out
+    bool poses = true;
+    int pose_max_hold_ms = 50;
+
+    // time from exposure to wait_for_frames() returning the frame (exposure,
+    // USB transfer and librealsense); frames are stamped this long before
+    // they arrive, so their pose is the one the image was taken at
+    int camera_latency_ms = 30;
+
+    // send a per-pixel occlusion mask on the depth socket instead of the
+    // 8-bit depth map (see occlusion_mask.hpp), run-length coded where that
+    // is smaller
+    bool occlusion_mask = false;
+    bool occlusion_rle = true;
+
+    // log lines below this level are dropped (debug, info, warn, error or
+    // off), and each place that logs writes at most log_rate lines per
+    // second; 0 is no limit. See async_log.hpp.
+    std::string log_level = "info";
+    int log_rate = 20;
+
+    // send frames with MSG_ZEROCOPY straight from the frame buffers instead
+    // of copying them into the socket (see zerocopy_tx.hpp); frames are
+    // copied anyway on kernels that do not have it
+    bool zerocopy = false;
+
+    // send frames over UDP (see udp_transport.hpp); the RGB and depth links
+    // then only carry the control channel. A parity datagram follows every
+    // udp_fec fragments (0 for none). udp_loss and udp_reorder are the
+    // fractions of datagrams to drop and to send late on purpose, with
+    // losses in runs of udp_burst on average, to try it out on loopback.
+    bool udp = false;
+    int udp_fec = 8;
+    double udp_loss = 0;
+    double udp_burst = 1;
+    double udp_reorder = 0;
+
+    // serve metrics in the Prometheus text format on 127.0.0.1:metrics_port
+    // and/or the Unix socket metrics_socket (see metrics.hpp), and log a
+    // summary line every metrics_summary_s seconds; 0 and "" turn them off
+    int metrics_port = 0;
+    std::string metrics_socket;
+    int metrics_summary_s = 10;
+
+    // server mode (see pubsub_server.hpp): instead of connecting to <host>,
+    // take subscribers on serve_port and/or the Unix socket serve_socket;
+    // 0 and "" leave it off. A subscriber that falls behind has at most
+    // serve_queue packets per stream waiting, newer ones replacing older
+    // ones, and is disconnected after serve_stall_ms without progress.
+    int serve_port = 0;
+    std::string serve_socket;
+    int serve_queue = 1;
+    int serve_stall_ms = 5000;
+
+    bool serving() const { return serve_port > 0 || !serve_socket.empty(); }
+
+    // where the pipeline threads run and how they are scheduled, see
+    // thread_placement.hpp: --placement=tx1 picks a preset, --cpus-<stage>
+    // and --fifo-<stage> set a stage, --mlockall locks the process in memory
+    thread_placement placement;
+
+    bool parse(int argc, char *argv[])
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                host = arg;
+                continue;
+            }
+
+            size_t eq = arg.find('=');
+            std::string key = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+            std::string value = eq == std::string::npos ? "1" : arg.substr(eq + 1);
+            if (!set(key, value)) return false;
+        }
+        return true;
+    }
+
+    bool load_config(const std::string & path)
+    {
+        std::ifstream in(path.c_str());
+        if (!in)
+        {
+            fprintf(stderr, "options: cannot open config file %s\n", path.c_str());
+            return false;
+        }
+
+        std::string line;
+        for (int n = 1; std::getline(in, line); ++n)
+        {
+            line = line.substr(0, line.find('#'));
+            size_t eq = line.find('=');
+            if (trim(line).empty()) continue;
+            if (eq == std::string::npos)
+            {
+                fprintf(stderr, "options: %s:%d: expected key = value\n", path.c_str(), n);
+                return false;
+            }
+            if (!set(trim(line.substr(0, eq)), trim(line.substr(eq + 1)))) return false;
+        }
+        return true;
+    }
+
+    bool set(const std::string & key, const std::string & value)
+    {
+        if (key == "config") return load_config(value);
+        if (key == "host") { host = value; return true; }
+        if (key == "daemon") return parse_bool(key, value, daemon);
+        if (key == "frames") return parse_long(key, value, frames);
+        if (key == "reconnect-min-ms") return parse_int(key, value, reconnect_min_ms);
+        if (key == "reconnect-max-ms") return parse_int(key, value, reconnect_max_ms);
+        if (key == "settle-tolerance") return parse_double(key, value, settle_tolerance);
+        if (key == "settle-stable-frames") return parse_int(key, value, settle_stable_frames);
+        if (key == "settle-max-frames") return parse_int(key, value, settle_max_frames);
+        if (key == "settle-min-brightness") return parse_double(key, value, settle_min_brightness);
+        if (key == "base64") return parse_bool(key, value, base64);
+        if (key == "base64-threads") return parse_int(key, value, base64_threads);
+        if (key == "poses") return parse_bool(key, value, poses);
+        if (key == "pose-max-hold-ms") return parse_int(key, value, pose_max_hold_ms);
+        if (key == "camera-latency-ms") return parse_int(key, value, camera_latency_ms);
+        if (key == "occlusion-mask") return parse_bool(key, value, occlusion_mask);
+        if (key == "occlusion-rle") return parse_bool(key, value, occlusion_rle);
+        if (key == "zerocopy") return parse_bool(key, value, zerocopy);
+        if (key == "metrics-port") return parse_int(key, value, metrics_port);
+        if (key == "metrics-summary-s") return parse_int(key, value, metrics_summary_s);
+        if (key == "metrics-socket")
+        {
+            metrics_socket = value;
+            return true;
+        }
+        if (key == "serve-port") return parse_int(key, value, serve_port);
+        if (key == "serve-socket")
+        {
+            serve_socket = value;
+            return true;
+        }
+        if (key == "serve-queue") return parse_int(key, value, serve_queue);
+        if (key == "serve-stall-ms") return parse_int(key, value, serve_stall_ms);
+        if (key == "udp") return parse_bool(key, value, udp);
+        if (key == "udp-fec") return parse_int(key, value, udp_fec);
+        if (key == "udp-loss") return parse_double(key, value, udp_loss);
+        if (key == "udp-burst") return parse_double(key, value, udp_burst);
+        if (key == "udp-reorder") return parse_double(key, value, udp_reorder);
+        if (key == "log-level")
+        {
+            if (log_level_by_name(value) < 0)
+            {
+                fprintf(stderr, "options: log-level expects debug, info, warn, error or off, got '%s'\n", value.c_str());
+                return false;
+            }
+            log_level = value;
+            return true;
+        }
+        if (key == "log-rate") return parse_int(key, value, log_rate);
+        if (key == "placement")
+        {
+            if (placement.set_preset(value)) return true;
+            fprintf(stderr, "options: unknown placement '%s' (none, tx1)\n", value.c_str());
+            return false;
+        }
+        if (key == "mlockall") return parse_bool(key, value, placement.lock_memory);
+        if (key.compare(0, 5, "cpus-") == 0 && placement.stage(key.substr(5)))
+        {
+            cpu_set_t set;
+            if (!value.empty() && !parse_cpu_list(value, set))
+            {
+                fprintf(stderr, "options: %s expects a CPU list like 0-1,3, got '%s'\n", key.c_str(), value.c_str());
+                return false;
+            }
+            placement.stage(key.substr(5))->cpus = value;
+            return true;
+        }
+        if (key.compare(0, 5, "fifo-") == 0 && placement.stage(key.substr(5)))
+            return parse_int(key, value, placement.stage(key.substr(5))->fifo);
+
+        fprintf(stderr, "options: unknown option '%s'\n", key.c_str());
+        return false;
+    }
+
+private:
+    static std::string trim(const std::string & s)
+    {
+        size_t b = s.find_first_not_of(" \t\r\n");
+        if (b == std::string::npos) return "";
+        return s.substr(b, s.find_last_not_of(" \t\r\n") - b + 1);
+    }
+
+    static bool parse_long(const std::string & key, const std::string & value, long & out)
+    {
+        char *end;
+        long v = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end)
+        {
+            fprintf(stderr, "options: %s expects a number, got '%s'\n", key.c_str(), value.c_str());
+            return false;
+        }
+        out = v;
+        return true;
+    }
+
+    static bool parse_int(const std::string & key, const std::string & value, int & out)
+    {
+        long v;
+        if (!parse_long(key, value, v)) return false;
+        out = (int)v;
+        return true;
+    }
+
+    static bool parse_double(const std::string & key, const std::string & value, double & out)
+    {
+        char *end;
+        double v = strtod(value.c_str(), &end);
+        if (value.empty() || *end)
+        {
+            fprintf(stderr, "options: %s expects a number, got '%s'\n", key.c_str(), value.c_str());
+            return false;
+        }
+        out = v;
+        return true;
+    }
+
+    static bool parse_bool(const std::string & key, const std::string & value, bool & out)
+    {
+        if (value == "1" || value == "true" || value == "yes" || value == "on") { out = true; return true; }
+        if (value == "0" || value == "false" || value == "no" || value == "off") { out = false; return true; }
+        fprintf(stderr, "options: %s expects true or false, got '%s'\n", key.c_str(), value.c_str());
+        return false;
+    }
+};
+
+#endif // HEADLESS_OPTIONS_HPP
@@ -0,0 +1,465 @@
+///////////////////
+// metrics       //
+///////////////////
+
+// Live numbers of a running cpp-headless: counters, gauges and histograms
+// the capture loop updates as it goes, served in the Prometheus text format
+// on a local HTTP port or Unix socket (curl --unix-socket works too), plus a
+// summary line in the log every few seconds.
+//
+// Updating a metric is a relaxed atomic add or store, with no locks and no
+// allocation; metrics are only ever created at startup and live as long as
+// the registry. Names follow Prometheus: a family name, optionally followed
+// by labels, e.g. registry.counter("bytes_sent_total", "...", "stream=\"rgb\"").
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_log.hpp"
+
+class metric_counter
+{
+public:
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+class metric_gauge
+{
+public:
+    void set(double v) { value.store(v, std::memory_order_relaxed); }
+    double get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value{0};
+};
+
+// Observations counted into buckets with fixed upper bounds, cumulative on
+// output like Prometheus wants them.
+class metric_histogram
+{
+public:
+    explicit metric_histogram(const std::vector<double> & bounds) : bounds(bounds), buckets(bounds.size() + 1) {}
+
+    void observe(double v)
+    {
+        size_t i = 0;
+        while (i < bounds.size() && v > bounds[i]) ++i;
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        // one writer per histogram in practice, so this hardly ever loops
+        double s = sum.load(std::memory_order_relaxed);
+        while (!sum.compare_exchange_weak(s, s + v, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const
+    {
+        uint64_t n = 0;
+        for (const std::atomic<uint64_t> & b : buckets) n += b.load(std::memory_order_relaxed);
+        return n;
+    }
+    double total() const { return sum.load(std::memory_order_relaxed); }
+
+    const std::vector<double> & upper_bounds() const { return bounds; }
+    uint64_t bucket(size_t i) const { return buckets[i].load(std::memory_order_relaxed); }
+
+private:
+    const std::vector<double> bounds;
+    std::deque<std::atomic<uint64_t>> buckets;
+    std::atomic<double> sum{0};
+};
+
+// 0.1 ms to 100 ms, for stage times in seconds
+static inline std::vector<double> metric_time_buckets()
+{
+    return { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1 };
+}
+
+static inline uint64_t metric_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Observes the seconds from construction to destruction.
+class metric_timer
+{
+public:
+    explicit metric_timer(metric_histogram & h) : h(h), start(metric_clock_ns()) {}
+    ~metric_timer() { h.observe((metric_clock_ns() - start) * 1e-9); }
+
+private:
+    metric_histogram & h;
+    uint64_t start;
+};
+
+class metrics_registry
+{
+public:
+    // names are prefixed with this, e.g. "cpp_headless_"
+    explicit metrics_registry(const std::string & prefix = "") : prefix(prefix) {}
+
+    metric_counter & counter(const std::string & family, const std::string & help, const std::string & labels = "")
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.emplace_back();
+        add(family, help, "counter", labels, counters.size() - 1);
+        return counters.back();
+    }
+
+    metric_gauge & gauge(const std::string & family, const std::string & help, const std::string & labels = "")
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        gauges.emplace_back();
+        add(family, help, "gauge", labels, gauges.size() - 1);
+        return gauges.back();
+    }
+
+    metric_histogram & histogram(const std::string & family, const std::string & help,
+                                 const std::vector<double> & bounds, const std::string & labels = "")
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        histograms.emplace_back(bounds);
+        add(family, help, "histogram", labels, histograms.size() - 1);
+        return histograms.back();
+    }
+
+    // everything in the Prometheus text exposition format, version 0.0.4
+    std::string render() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string out;
+        char line[256];
+        for (const family & f : families)
+        {
+            out += "# HELP " + prefix + f.name + " " + f.help + "\n";
+            out += "# TYPE " + prefix + f.name + " " + f.type + "\n";
+            for (const series & s : f.members)
+            {
+                const std::string name = prefix + f.name;
+                if (f.type == "counter")
+                {
+                    snprintf(line, sizeof line, "%llu", (unsigned long long)counters[s.index].get());
+                    out += name + braced(s.labels) + " " + line + "\n";
+                }
+                else if (f.type == "gauge")
+                {
+                    snprintf(line, sizeof line, "%.17g", gauges[s.index].get());
+                    out += name + braced(s.labels) + " " + line + "\n";
+                }
+                else
+                {
+                    const metric_histogram & h = histograms[s.index];
+                    const std::string sep = s.labels.empty() ? "" : s.labels + ",";
+                    uint64_t cumulative = 0;
+                    for (size_t i = 0; i <= h.upper_bounds().size(); ++i)
+                    {
+                        cumulative += h.bucket(i);
+                        if (i < h.upper_bounds().size()) snprintf(line, sizeof line, "%g", h.upper_bounds()[i]);
+                        else strcpy(line, "+Inf");
+                        out += name + "_bucket{" + sep + "le=\"" + line + "\"} " + std::to_string(cumulative) + "\n";
+                    }
+                    snprintf(line, sizeof line, "%.17g", h.total());
+                    out += name + "_sum" + braced(s.labels) + " " + line + "\n";
+                    out += name + "_count" + braced(s.labels) + " " + std::to_string(cumulative) + "\n";
+                }
+            }
+        }
+        return out;
+    }
+
+private:
+    struct series
+    {
+        std::string labels;
+        size_t index;
+    };
+
+    struct family
+    {
+        std::string name, help, type;
+        std::vector<series> members;
+    };
+
+    std::string prefix;
+    mutable std::mutex mutex;
+    // deques, so metrics handed out never move
+    std::deque<metric_counter> counters;
+    std::deque<metric_gauge> gauges;
+    std::deque<metric_histogram> histograms;
+    std::vector<family> families;
+
+    static std::string braced(const std::string & labels) { return labels.empty() ? "" : "{" + labels + "}"; }
+
+    void add(const std::string & name, const std::string & help, const char *type, const std::string & labels, size_t index)
+    {
+        series s = { labels, index };
+        for (family & f : families)
+        {
+            if (f.name == name)
+            {
+                f.members.push_back(s);
+                return;
+            }
+        }
+        family f;
+        f.name = name;
+        f.help = help;
+        f.type = type;
+        f.members.push_back(s);
+        families.push_back(f);
+    }
+};
+
+// Serves a registry over HTTP on a thread of its own: any GET gets the
+// metrics. Also calls summary every summary_s seconds, for the log line.
+class metrics_server
+{
+public:
+    explicit metrics_server(const metrics_registry & registry) : registry(registry), running(false) {}
+
+    ~metrics_server() { stop(); }
+
+    // 127.0.0.1:port; port 0 picks a free one, see port()
+    bool listen_tcp(int port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)port);
+        socklen_t len = sizeof addr;
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(fd, 4) == -1 ||
+            getsockname(fd, (struct sockaddr *)&addr, &len) == -1)
+        {
+            ALOG_WARN("metrics: cannot listen on port %d: %s", port, strerror(errno));
+            if (fd != -1) close(fd);
+            return false;
+        }
+        bound_port = ntohs(addr.sin_port);
+        listeners.push_back(fd);
+        ALOG_INFO("metrics: http://127.0.0.1:%d/metrics", bound_port);
+        return true;
+    }
+
+    bool listen_unix(const std::string & path)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof addr.sun_path)
+        {
+            ALOG_WARN("metrics: cannot listen on %s: the path is longer than %zu bytes", path, sizeof addr.sun_path - 1);
+            return false;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(fd, 4) == -1)
+        {
+            ALOG_WARN("metrics: cannot listen on %s: %s", path, strerror(errno));
+            if (fd != -1) close(fd);
+            return false;
+        }
+        unix_path = path;
+        listeners.push_back(fd);
+        ALOG_INFO("metrics: unix socket %s", path);
+        return true;
+    }
+
+    int port() const { return bound_port; }
+
+    void start(int summary_s = 0, std::function<void()> summary = std::function<void()>())
+    {
+        if (running.exchange(true)) return;
+        summary_ms = summary_s * 1000;
+        this->summary = summary;
+        thread = std::thread([this] { run(); });
+    }
+
+    void stop()
+    {
+        if (running.exchange(false)) thread.join();
+        for (int fd : listeners) close(fd);
+        listeners.clear();
+        if (!unix_path.empty()) unlink(unix_path.c_str());
+        unix_path.clear();
+    }
+
+    std::thread::native_handle_type native_handle() { return thread.native_handle(); }
+
+private:
+    static const int REQUEST_WAIT_MS = 50;
+
+    const metrics_registry & registry;
+    std::atomic<bool> running;
+    std::thread thread;
+    std::vector<int> listeners;
+    std::string unix_path;
+    int bound_port = 0;
+    int summary_ms = 0;
+    std::function<void()> summary;
+
+    void run()
+    {
+        uint64_t next_summary = metric_clock_ns() / 1000000 + summary_ms;
+        std::vector<struct pollfd> fds;
+        for (int fd : listeners)
+        {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            fds.push_back(pfd);
+        }
+        while (running)
+        {
+            if (poll(fds.data(), fds.size(), 100) > 0)
+                for (struct pollfd & pfd : fds)
+                    if (pfd.revents & POLLIN) answer(pfd.fd);
+
+            const uint64_t now = metric_clock_ns() / 1000000;
+            if (summary && summary_ms > 0 && now >= next_summary)
+            {
+                summary();
+                next_summary = now + summary_ms;
+            }
+        }
+    }
+
+    // One request per connection; whatever it asks for, it gets the metrics.
+    void answer(int listener)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd == -1) return;
+        struct timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+        // read up to the end of the request headers, for at most
+        // REQUEST_WAIT_MS in all: a client that connects and sends nothing
+        // must not hold up the other clients and the summary
+        const uint64_t deadline = metric_clock_ns() / 1000000 + REQUEST_WAIT_MS;
+        char request[2048];
+        size_t len = 0;
+        while (len < sizeof request)
+        {
+            const uint64_t now = metric_clock_ns() / 1000000;
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (now >= deadline || poll(&pfd, 1, (int)(deadline - now)) <= 0) break;
+            ssize_t n = recv(fd, request + len, sizeof request - len, MSG_DONTWAIT);
+            if (n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (n <= 0) break;
+            len += n;
+            if (len >= 4 && memmem(request, len, "\r\n\r\n", 4)) break;
+        }
+
+        const std::string body = registry.render();
+        const std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                     std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size())
+        {
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(fd);
+    }
+};
+
+// The metrics of cpp-headless's capture loop, here so that cpp-bench can
+// time exactly what a frame updates.
+struct capture_metrics
+{
+    metric_counter & frames, & dropped, & backlog_dropped, & send_failures;
+    metric_counter & rgb_bytes, & depth_bytes, & mesh_bytes;
+    metric_gauge & links_connected, & zerocopy_in_flight, & log_dropped;
+    metric_histogram & interval, & convert, & send;
+
+    explicit capture_metrics(metrics_registry & r)
+        : frames(r.counter("frames_total", "Frames the camera delivered")),
+          dropped(r.counter("frames_dropped_total", "Frames skipped with no link connected")),
+          backlog_dropped(r.counter("packets_dropped_backlog_total", "Packets a link dropped while its socket was backed up")),
+          send_failures(r.counter("send_failures_total", "Frames a link failed to send")),
+          rgb_bytes(r.counter("bytes_sent_total", "Bytes of tiles sent", "stream=\"rgb\"")),
+          depth_bytes(r.counter("bytes_sent_total", "Bytes of tiles sent", "stream=\"depth\"")),
+          mesh_bytes(r.counter("bytes_sent_total", "Bytes of tiles sent", "stream=\"mesh\"")),
+          links_connected(r.gauge("links_connected", "Stream links currently connected")),
+          zerocopy_in_flight(r.gauge("zerocopy_buffers_in_flight", "Frame buffers the kernel still sends from")),
+          log_dropped(r.gauge("log_lines_dropped", "Log lines lost to full log rings")),
+          interval(r.histogram("frame_interval_seconds", "Time between frames reaching the loop",
+                               { 0.01, 0.02, 0.03, 0.034, 0.04, 0.05, 0.067, 0.1, 0.2, 0.5 })),
+          convert(r.histogram("convert_seconds", "Depth to 8-bit conversion per frame", metric_time_buckets())),
+          send(r.histogram("send_seconds", "Building and sending the tiles of one stream", metric_time_buckets())) {}
+
+    // Rates since the last call, for the log every few seconds. Any thread.
+    void summarize()
+    {
+        log_dropped.set((double)async_logger::instance().dropped());
+
+        const uint64_t now = metric_clock_ns();
+        const snapshot s = take();
+        if (last.ns)
+        {
+            const double seconds = (now - last.ns) * 1e-9;
+            const double sends = (double)(s.sends - last.sends);
+            ALOG_INFO("metrics: %.1f fps, rgb %.2f MB/s, depth %.2f MB/s, %llu dropped, %llu send failures, "
+                      "convert %.2f ms, send %.2f ms",
+                      (s.frames - last.frames) / seconds, (s.rgb - last.rgb) / seconds / 1e6,
+                      (s.depth - last.depth) / seconds / 1e6, (unsigned long long)(s.dropped - last.dropped),
+                      (unsigned long long)(s.failures - last.failures),
+                      s.converts > last.converts ? (s.convert_sum - last.convert_sum) / (s.converts - last.converts) * 1e3 : 0.0,
+                      sends > 0 ? (s.send_sum - last.send_sum) / sends * 1e3 : 0.0);
+        }
+        last = s;
+        last.ns = now;
+    }
+
+private:
+    struct snapshot
+    {
+        uint64_t ns = 0, frames = 0, dropped = 0, failures = 0, rgb = 0, depth = 0, converts = 0, sends = 0;
+        double convert_sum = 0, send_sum = 0;
+    };
+    snapshot last;
+
+    snapshot take() const
+    {
+        snapshot s;
+        s.frames = frames.get();
+        s.dropped = dropped.get() + backlog_dropped.get();
+        s.failures = send_failures.get();
+        s.rgb = rgb_bytes.get();
+        s.depth = depth_bytes.get();
+        s.converts = convert.count();
+        s.convert_sum = convert.total();
+        s.sends = send.count();
+        s.send_sum = send.total();
+        return s;
+    }
+};
+
+#endif // METRICS_HPP
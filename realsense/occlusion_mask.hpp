@@ -0,0 +1,273 @@
+///////////////////////
+// occlusion_mask    //
+///////////////////////
+
+// Per-pixel occlusion on the capture side. The browser reports how far away
+// its virtual objects are in each cell of a grid over the image (DEPTHS lines,
+// see roi_stream.hpp); a pixel is occluded where the camera sees something
+// closer than that. This is the test the occluding blocks make from one
+// sample per block, done for every pixel against the raw 16-bit depth.
+//
+// The mask is sent as a FRAME_STREAM_OCCLUSION tile on the depth socket, one
+// bit per pixel: 38400 bytes for a full 640x480 frame instead of 307200 for
+// the 8-bit depth map. With run-length coding (FRAME_TILE_RLE) a mask made of
+// a few blobs shrinks to a few KB. The RLE payload is the lengths of
+// alternating runs of clear and set pixels, row by row across the tile,
+// starting with a clear run (which may be empty), each as a LEB128 varint.
+
+#ifndef OCCLUSION_MASK_HPP
+#define OCCLUSION_MASK_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define OCCLUSION_MASK_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "server/frame_header.h"
+#include "roi_stream.hpp"
+
+// Grid depths are in the units of the 8-bit depth map, which is the raw depth
+// times 255 / 65535 rounded down; d8 < t is exactly raw < t * 257.
+static inline uint16_t occlusion_threshold(uint8_t depth8)
+{
+    return (uint16_t)(depth8 * 257);
+}
+
+// Scalar reference of occlusion_mask_row. Zero depth is no data and never
+// occludes.
+static inline void occlusion_mask_row_scalar(const uint16_t depth[], const uint16_t threshold[], int n, uint8_t bits[])
+{
+    for (int x = 0; x < n; x += 8)
+    {
+        uint8_t b = 0;
+        for (int i = 0; i < 8 && x + i < n; ++i)
+            if (depth[x + i] && depth[x + i] < threshold[x + i]) b |= (uint8_t)(1 << i);
+        bits[x >> 3] = b;
+    }
+}
+
+// Mask bits for n pixels of a row, 16 at a time with SSE2 or NEON.
+static inline void occlusion_mask_row(const uint16_t depth[], const uint16_t threshold[], int n, uint8_t bits[])
+{
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i d0 = _mm_loadu_si128((const __m128i *)(depth + x));
+        __m128i d1 = _mm_loadu_si128((const __m128i *)(depth + x + 8));
+        __m128i t0 = _mm_loadu_si128((const __m128i *)(threshold + x));
+        __m128i t1 = _mm_loadu_si128((const __m128i *)(threshold + x + 8));
+
+        // there is no unsigned 16-bit compare: d >= t exactly when t - d
+        // saturates to zero
+        __m128i clear0 = _mm_or_si128(_mm_cmpeq_epi16(_mm_subs_epu16(t0, d0), zero), _mm_cmpeq_epi16(d0, zero));
+        __m128i clear1 = _mm_or_si128(_mm_cmpeq_epi16(_mm_subs_epu16(t1, d1), zero), _mm_cmpeq_epi16(d1, zero));
+        const unsigned set = ~(unsigned)_mm_movemask_epi8(_mm_packs_epi16(clear0, clear1));
+
+        bits[x >> 3] = (uint8_t)set;
+        bits[(x >> 3) + 1] = (uint8_t)(set >> 8);
+    }
+#elif OCCLUSION_MASK_NEON
+    // NEON has no movemask: each byte of the narrowed compare keeps its own
+    // bit, and three pairwise adds sum each half into one byte
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t weight = vld1q_u8(weights);
+    for (; x + 16 <= n; x += 16)
+    {
+        uint16x8_t d0 = vld1q_u16(depth + x);
+        uint16x8_t d1 = vld1q_u16(depth + x + 8);
+        uint16x8_t t0 = vld1q_u16(threshold + x);
+        uint16x8_t t1 = vld1q_u16(threshold + x + 8);
+
+        uint16x8_t set0 = vbicq_u16(vcltq_u16(d0, t0), vceqq_u16(d0, vdupq_n_u16(0)));
+        uint16x8_t set1 = vbicq_u16(vcltq_u16(d1, t1), vceqq_u16(d1, vdupq_n_u16(0)));
+        uint8x16_t set = vandq_u8(vcombine_u8(vmovn_u16(set0), vmovn_u16(set1)), weight);
+
+        uint8x8_t sum = vpadd_u8(vget_low_u8(set), vget_high_u8(set));
+        sum = vpadd_u8(sum, sum);
+        sum = vpadd_u8(sum, sum);
+        bits[x >> 3] = vget_lane_u8(sum, 0);
+        bits[(x >> 3) + 1] = vget_lane_u8(sum, 1);
+    }
+#endif
+    occlusion_mask_row_scalar(depth + x, threshold + x, n - x, bits + (x >> 3));
+}
+
+static inline void occlusion_put_varint(std::vector<uint8_t> & out, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+// Run-length code a bit-packed mask of width x height pixels, appending to
+// out. Gives up and returns false once the code would be longer than limit
+// bytes, leaving out as it was.
+static inline bool occlusion_rle_encode(const uint8_t bits[], int width, int height, size_t limit, std::vector<uint8_t> & out)
+{
+    const size_t start = out.size();
+    const size_t row_bytes = frame_mask_row_bytes(width);
+    uint32_t run = 0;
+    bool state = false;
+
+    for (int y = 0; y < height; ++y)
+    {
+        const uint8_t *row = bits + y * row_bytes;
+        for (int x = 0; x < width; x += 64)
+        {
+            // 64 pixels at a time; runs end at the lowest bit that differs
+            // from the current state
+            const int n = width - x < 64 ? width - x : 64;
+            uint64_t word = 0;
+            for (int i = 0; i < (n + 7) / 8; ++i) word |= (uint64_t)row[(x >> 3) + i] << (8 * i);
+            if (state) word = ~word;
+
+            int pos = 0;
+            while (pos < n)
+            {
+                const uint64_t rest = word >> pos;
+                const int change = rest ? pos + __builtin_ctzll(rest) : 64;
+                if (change >= n)
+                {
+                    run += n - pos;
+                    break;
+                }
+                run += change - pos;
+                occlusion_put_varint(out, run);
+                if (out.size() - start > limit)
+                {
+                    out.resize(start);
+                    return false;
+                }
+                run = 0;
+                state = !state;
+                word = ~word;
+                pos = change;
+            }
+        }
+    }
+    occlusion_put_varint(out, run);
+    if (out.size() - start > limit)
+    {
+        out.resize(start);
+        return false;
+    }
+    return true;
+}
+
+// Inverse of occlusion_rle_encode, into a cleared bit-packed mask. Returns
+// false if the code does not cover exactly width x height pixels.
+static inline bool occlusion_rle_decode(const uint8_t code[], size_t size, int width, int height, uint8_t bits[])
+{
+    const size_t row_bytes = frame_mask_row_bytes(width);
+    memset(bits, 0, row_bytes * height);
+
+    const uint64_t total = (uint64_t)width * height;
+    uint64_t pixel = 0;
+    bool state = false;
+    size_t i = 0;
+    while (i < size)
+    {
+        uint64_t run = 0;
+        for (int shift = 0; i < size; shift += 7)
+        {
+            const uint8_t b = code[i++];
+            run |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80) || shift > 28) break;
+        }
+        if (pixel + run > total) return false;
+        if (state)
+            for (uint64_t p = pixel; p < pixel + run; ++p)
+                bits[(p / width) * row_bytes + (p % width) / 8] |= (uint8_t)(1 << (p % width % 8));
+        pixel += run;
+        state = !state;
+    }
+    return pixel == total;
+}
+
+// Builds the occlusion tile for each frame. Buffers are reused between frames.
+class occlusion_mask_writer
+{
+public:
+    occlusion_mask_writer(int width, int height)
+        : width(width), height(height), threshold(width), bits(frame_mask_row_bytes(width) * height) {}
+
+    // Mask the region r of a raw depth frame (the whole frame if r is
+    // empty) against the grid depths; run-length code it if rle is set and
+    // that comes out smaller. data() then holds the header and payload.
+    void build(const uint16_t depth[], const region_depths & regions, const roi_rect & r, bool rle,
+               uint32_t sequence, uint64_t timestamp_us, const struct frame_pose * pose = NULL)
+    {
+        const roi_rect area = r.empty() ? roi_rect(0, 0, width, height) : r;
+        const size_t row_bytes = frame_mask_row_bytes(area.w);
+
+        int threshold_row = -1;
+        if (regions.empty()) std::fill(threshold.begin(), threshold.end(), 0);
+        for (int y = 0; y < area.h; ++y)
+        {
+            // per-pixel thresholds only change from one grid row to the next
+            const int grid_row = regions.empty() ? -1 : (area.y + y) * regions.rows / height;
+            if (grid_row != threshold_row)
+            {
+                for (int x = 0; x < area.w; ++x)
+                    threshold[x] = occlusion_threshold(regions.at((area.x + x) * regions.cols / width, grid_row));
+                threshold_row = grid_row;
+            }
+            occlusion_mask_row(depth + (size_t)(area.y + y) * width + area.x, threshold.data(), area.w, &bits[y * row_bytes]);
+        }
+
+        struct frame_header header;
+        frame_header_init(&header, FRAME_STREAM_OCCLUSION, 1, (uint16_t)width, (uint16_t)height);
+        header.sequence = sequence;
+        header.timestamp_us = timestamp_us;
+        header.x = (uint16_t)area.x;
+        header.y = (uint16_t)area.y;
+        header.width = (uint16_t)area.w;
+        header.height = (uint16_t)area.h;
+        if (pose)
+        {
+            header.pose = *pose;
+            header.flags |= FRAME_TILE_POSE;
+        }
+
+        packed = row_bytes * area.h;
+        buffer.resize(sizeof header);
+        if (rle && occlusion_rle_encode(bits.data(), area.w, area.h, packed - 1, buffer))
+            header.flags |= FRAME_TILE_RLE;
+        else
+            buffer.insert(buffer.end(), bits.begin(), bits.begin() + packed);
+
+        header.payload_size = (uint32_t)(buffer.size() - sizeof header);
+        memcpy(buffer.data(), &header, sizeof header);
+    }
+
+    const uint8_t * data() const { return buffer.data(); }
+    size_t size() const { return buffer.size(); }
+
+    // the buffer data() points into, for stream_link::send_frame to swap
+    std::vector<uint8_t> & packet() { return buffer; }
+
+    // the last mask bit-packed, before run-length coding
+    const uint8_t * mask() const { return bits.data(); }
+    size_t packed_size() const { return packed; }
+
+private:
+    int width, height;
+    std::vector<uint16_t> threshold;
+    std::vector<uint8_t> bits;
+    std::vector<uint8_t> buffer;
+    size_t packed = 0;
+};
+
+#endif // OCCLUSION_MASK_HPP
@@ -0,0 +1,454 @@
+///////////////////
+// pose_sync     //
+///////////////////
+
+// Head pose at the time a frame was captured. The VRduino stamps its samples
+// with the Teensy's micros(), the camera frames are stamped with the host's
+// CLOCK_MONOTONIC, and the two clocks have an unknown offset and drift apart
+// by tens of ppm. server.js forwards every orientation on port 3493 as
+//
+//     POSE device_us host_us w x y z\n
+//
+// with host_us the CLOCK_MONOTONIC time its serial data arrived
+// (process.hrtime). clock_sync fits the offset and drift from those pairs,
+// pose_ring keeps the last second of poses on the host clock, and pose_feed
+// runs both on a thread of its own, so the capture loop only looks up the
+// pose for its frame timestamp, interpolated between the samples around it.
+//
+// Serial latency only ever delays a sample, so the fit follows the smallest
+// delays: the lowest host - device offset in every half second, fitted with
+// a straight line over the last 16 s. What remains is the minimum latency of
+// the serial link, typically well under a millisecond over USB, which the
+// fit cannot see and which makes poses look that much older.
+
+#ifndef POSE_SYNC_HPP
+#define POSE_SYNC_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "server/frame_header.h"
+#include "async_log.hpp"
+#include "stream_link.hpp"
+
+// Maps device (Teensy micros()) time onto the host clock.
+class clock_sync
+{
+public:
+    static const int WINDOWS = 32;
+    static const int64_t WINDOW_US = 500000;
+
+    // a sample arriving this much earlier than the fit allows means the
+    // Teensy was reset; arriving late only means the host was busy
+    static const int64_t RESET_US = 100000;
+
+    // window minima this far above the fit are from a busy host, see fit()
+    static const int64_t OUTLIER_US = 2000;
+
+    clock_sync() { reset(); }
+
+    void reset()
+    {
+        count = 0;
+        have_last = false;
+        last_raw = 0;
+        device = 0;
+        resets = 0;
+        offset = slope = 0;
+        reference = 0;
+        residual = 0;
+    }
+
+    // One sample: its device time, which wraps every 71 minutes, and the
+    // host time it arrived at.
+    void add(uint32_t device_raw, uint64_t host_us)
+    {
+        const int32_t step = (int32_t)(device_raw - last_raw);
+        if (!have_last) device = 0;
+        else device += step;
+        last_raw = device_raw;
+
+        // micros() never goes backwards
+        if (have_last && (step < 0 || predicted_offset(device) - ((int64_t)host_us - device) > RESET_US))
+        {
+            // start over on the new device clock
+            ++resets;
+            count = 0;
+            device = 0;
+        }
+        have_last = true;
+
+        const int64_t d = (int64_t)host_us - device;
+        window & w = windows[(count - 1 + WINDOWS) % WINDOWS];
+        if (count == 0 || device - w.start >= WINDOW_US)
+        {
+            window & next = windows[count % WINDOWS];
+            next.start = device;
+            next.device = device;
+            next.offset = d;
+            ++count;
+        }
+        else if (d < w.offset)
+        {
+            w.device = device;
+            w.offset = d;
+        }
+        fit();
+    }
+
+    bool valid() const { return count > 0; }
+
+    // host time of a device stamp no more than half a wrap from the newest
+    uint64_t to_host(uint32_t device_raw) const
+    {
+        const int64_t t = device + (int32_t)(device_raw - last_raw);
+        return (uint64_t)(t + predicted_offset(t));
+    }
+
+    // how much faster the device clock runs than the host's, in ppm
+    double drift_ppm() const { return -slope * 1e6; }
+
+    // RMS distance of the window minima from the fit
+    double residual_us() const { return residual; }
+
+    unsigned long reset_count() const { return resets; }
+
+private:
+    struct window
+    {
+        int64_t start;   // device time the window began
+        int64_t device;  // device time of its smallest offset
+        int64_t offset;  // smallest host - device
+    };
+
+    window windows[WINDOWS];
+    int count;
+    bool have_last;
+    uint32_t last_raw;
+    int64_t device;
+    unsigned long resets;
+
+    // host - device = offset + slope * (device - reference)
+    double offset, slope;
+    int64_t reference;
+    double residual;
+
+    double predicted_offset(int64_t t) const
+    {
+        return offset + slope * (double)(t - reference);
+    }
+
+    // Least squares line through the window minima. The newest window is
+    // still filling, so its minimum may sit high; it only counts once it is
+    // the only one there is. A window the host was too busy to read the
+    // serial port in sits high as well, so windows more than OUTLIER_US
+    // above the first line are left out of a second one.
+    void fit()
+    {
+        const int n = count < WINDOWS ? count : WINDOWS;
+        const int newest = (count - 1) % WINDOWS;
+        reference = windows[newest].device;
+        if (n < 3)
+        {
+            // not enough for a slope yet
+            offset = (double)windows[n == 1 ? newest : (count - 2) % WINDOWS].offset;
+            slope = 0;
+            residual = 0;
+            return;
+        }
+
+        offset = slope = 0;
+        if (fit_line(n, newest, false)) fit_line(n, newest, true);
+    }
+
+    // false if there are no windows to fit
+    bool fit_line(int n, int newest, bool drop_outliers)
+    {
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        int m = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            const int k = (count - 1 - i + WINDOWS) % WINDOWS;
+            if (k == newest) continue;
+            if (drop_outliers && windows[k].offset - predicted_offset(windows[k].device) > OUTLIER_US) continue;
+            const double x = (double)(windows[k].device - reference);
+            const double y = (double)windows[k].offset;
+            sx += x; sy += y; sxx += x * x; sxy += x * y;
+            ++m;
+        }
+        if (m == 0) return false;
+
+        const double det = m * sxx - sx * sx;
+        const double b = det > 0 ? (m * sxy - sx * sy) / det : 0;
+        const double a = (sy - b * sx) / m;
+
+        double squares = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            const int k = (count - 1 - i + WINDOWS) % WINDOWS;
+            if (k == newest) continue;
+            if (drop_outliers && windows[k].offset - predicted_offset(windows[k].device) > OUTLIER_US) continue;
+            const double e = (double)windows[k].offset - (a + b * (double)(windows[k].device - reference));
+            squares += e * e;
+        }
+        offset = a;
+        slope = b;
+        residual = sqrt(squares / m);
+        return true;
+    }
+};
+
+// an orientation on the host clock
+struct timed_pose
+{
+    uint64_t host_us;
+    float q[4];  // w x y z
+};
+
+// The last N poses. One thread pushes, any number look up, none of them
+// blocks: every slot carries a sequence number that is odd while the slot is
+// written, and a reader gives up on a slot that changed under it, which only
+// happens to the oldest ones.
+template <size_t N>
+class pose_ring
+{
+public:
+    pose_ring() : pushed(0)
+    {
+        for (size_t i = 0; i < N; ++i) slots[i].sequence.store(0, std::memory_order_relaxed);
+    }
+
+    // writer only; host_us must not go backwards
+    void push(const timed_pose & p)
+    {
+        const uint64_t index = pushed.load(std::memory_order_relaxed);
+        slot & s = slots[index % N];
+        s.sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.host_us.store(p.host_us, std::memory_order_relaxed);
+        for (int k = 0; k < 4; ++k) s.q[k].store(p.q[k], std::memory_order_relaxed);
+        s.sequence.store(2 * index + 2, std::memory_order_release);
+        pushed.store(index + 1, std::memory_order_release);
+    }
+
+    uint64_t size() const { return pushed.load(std::memory_order_acquire); }
+
+    // Pose at host time t, interpolated between the samples on either side.
+    // Past the newest sample it is held for at most max_hold_us. span_us is
+    // the gap between the two samples, or the time since the newest. False
+    // if there is no sample, or t is older than the ring.
+    bool at(uint64_t t, timed_pose & out, uint32_t & span_us, uint64_t max_hold_us) const
+    {
+        const uint64_t end = size();
+        if (end == 0) return false;
+
+        timed_pose newer;
+        if (!read(end - 1, newer)) return false;
+        if (newer.host_us <= t)
+        {
+            if (t - newer.host_us > max_hold_us) return false;
+            out = newer;
+            out.host_us = t;
+            span_us = (uint32_t)(t - newer.host_us);
+            return true;
+        }
+
+        const uint64_t first = end > N ? end - N : 0;
+        for (uint64_t i = end - 1; i-- > first;)
+        {
+            timed_pose older;
+            if (!read(i, older)) return false;
+            if (older.host_us <= t)
+            {
+                const uint64_t gap = newer.host_us - older.host_us;
+                interpolate(older, newer, gap ? (float)(t - older.host_us) / gap : 0.f, out);
+                out.host_us = t;
+                span_us = (uint32_t)gap;
+                return true;
+            }
+            newer = older;
+        }
+        return false;
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> host_us;
+        std::atomic<float> q[4];
+    };
+
+    slot slots[N];
+    std::atomic<uint64_t> pushed;
+
+    // false if the slot no longer holds sample index
+    bool read(uint64_t index, timed_pose & p) const
+    {
+        const slot & s = slots[index % N];
+        const uint64_t expected = 2 * index + 2;
+        if (s.sequence.load(std::memory_order_acquire) != expected) return false;
+        p.host_us = s.host_us.load(std::memory_order_relaxed);
+        for (int k = 0; k < 4; ++k) p.q[k] = s.q[k].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s.sequence.load(std::memory_order_relaxed) == expected;
+    }
+
+    // Normalized linear interpolation the short way round. The samples are a
+    // few milliseconds apart, where it matches slerp to well below the IMU's
+    // noise.
+    static void interpolate(const timed_pose & a, const timed_pose & b, float t, timed_pose & out)
+    {
+        float dot = 0;
+        for (int k = 0; k < 4; ++k) dot += a.q[k] * b.q[k];
+        const float wb = dot < 0 ? -t : t, wa = 1 - t;
+        float n = 0;
+        for (int k = 0; k < 4; ++k)
+        {
+            out.q[k] = wa * a.q[k] + wb * b.q[k];
+            n += out.q[k] * out.q[k];
+        }
+        n = n > 0 ? 1 / sqrtf(n) : 0;
+        for (int k = 0; k < 4; ++k) out.q[k] *= n;
+    }
+};
+
+// The pose feed from server.js: a thread that reads POSE lines, keeps the
+// clock fit and fills the ring. The connection is retried in the background
+// like the stream links, so the camera streams without poses until server.js
+// is up.
+class pose_feed
+{
+public:
+    // a second of poses at the VRduino's 1 kHz
+    static const size_t RING = 1024;
+
+    pose_feed(const std::string & host, const char *port, int backoff_min_ms, int backoff_max_ms,
+              uint32_t max_hold_us = 50000)
+        : link(host, port, backoff_min_ms, backoff_max_ms), max_hold_us(max_hold_us), running(false),
+          sync_residual_us(0), samples(0) {}
+
+    ~pose_feed() { stop(); }
+
+    void start()
+    {
+        if (running.exchange(true)) return;
+        thread = std::thread([this] { run(); });
+    }
+
+    void stop()
+    {
+        if (!running.exchange(false)) return;
+        thread.join();
+        link.disconnect();
+    }
+
+    // One sample, as the thread adds them; for other sources and the bench.
+    // Only one thread may add.
+    void add(uint32_t device_us, uint64_t host_us, const float q[4])
+    {
+        sync.add(device_us, host_us);
+        timed_pose p;
+        p.host_us = sync.to_host(device_us);
+        memcpy(p.q, q, sizeof p.q);
+
+        // keep the ring in host order when the fit moves backwards
+        if (p.host_us < last_host_us) p.host_us = last_host_us;
+        last_host_us = p.host_us;
+
+        ring.push(p);
+        sync_residual_us.store((uint32_t)(sync.residual_us() + 0.5), std::memory_order_relaxed);
+        samples.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The pose for a frame captured at host_us (CLOCK_MONOTONIC). Any thread.
+    bool pose_at(uint64_t host_us, struct frame_pose & out) const
+    {
+        timed_pose p;
+        uint32_t span;
+        if (!ring.at(host_us, p, span, max_hold_us)) return false;
+        memcpy(out.q, p.q, sizeof out.q);
+        out.span_us = span;
+        out.sync_us = sync_residual_us.load(std::memory_order_relaxed);
+        return true;
+    }
+
+    // the feed's thread, for thread_placement.hpp; once started
+    std::thread::native_handle_type native_handle() { return thread.native_handle(); }
+
+    unsigned long sample_count() const { return samples.load(std::memory_order_relaxed); }
+
+    // the fit; only meaningful on the thread that adds, or once it stopped
+    const clock_sync & clock() const { return sync; }
+
+private:
+    stream_link link;
+    uint32_t max_hold_us;
+    std::atomic<bool> running;
+    std::thread thread;
+
+    clock_sync sync;
+    pose_ring<RING> ring;
+    std::atomic<uint32_t> sync_residual_us;
+    std::atomic<unsigned long> samples;
+    uint64_t last_host_us = 0;
+    std::string pending;
+
+    void run()
+    {
+        char buf[4096];
+        while (running.load())
+        {
+            if (!link.poll_connect())
+            {
+                usleep(10000);
+                continue;
+            }
+            if (link.take_fresh()) pending.clear();
+
+            struct pollfd pfd = { link.fd(), POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0) continue;
+
+            ssize_t n = recv(link.fd(), buf, sizeof buf, 0);
+            if (n <= 0)
+            {
+                if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+                ALOG_WARN("client: lost pose feed");
+                link.fail();
+                continue;
+            }
+            pending.append(buf, n);
+
+            size_t start = 0, eol;
+            while ((eol = pending.find('\n', start)) != std::string::npos)
+            {
+                parse(pending.c_str() + start);
+                start = eol + 1;
+            }
+            pending.erase(0, start);
+            if (pending.size() > 4096) pending.clear();
+        }
+    }
+
+    void parse(const char *line)
+    {
+        unsigned long device_us;
+        unsigned long long host_us;
+        float q[4];
+        if (sscanf(line, "POSE %lu %llu %f %f %f %f", &device_us, &host_us, &q[0], &q[1], &q[2], &q[3]) != 6)
+            return;
+        add((uint32_t)device_us, (uint64_t)host_us, q);
+    }
+};
+
+#endif // POSE_SYNC_HPP
@@ -0,0 +1,602 @@
+///////////////////
+// pubsub_server //
+///////////////////
+
+// Server mode of cpp-headless (--serve-port, --serve-socket): instead of
+// connecting out to one node server, the camera listens on TCP and/or a Unix
+// socket and any number of subscribers connect to it. A subscriber sends one
+// line saying what it wants,
+//
+//     streams=rgb,depth,mesh format=raw every=1
+//
+// (every key optional: all streams, raw, every frame by default; format=base64
+// gets tile payloads as base64 text like --base64, every=N every Nth frame of
+// each stream), is answered "OK ..." or "ERR ...", and from then on gets the
+// packets of its streams back to back, exactly as the stream links send them.
+// RGB and depth packets start with a frame_header, mesh packets with a
+// depth_mesh_header; the magic tells them apart.
+//
+// The capture loop builds each packet once and publishes it; every subscriber
+// gets a reference to the same buffer, and an I/O thread writes it out with
+// non-blocking sends. A subscriber that cannot keep up only ever holds the
+// packet being sent plus queue_depth more per stream: a newer packet pushes
+// out the oldest one waiting, so it skips frames instead of holding up the
+// capture loop or the other subscribers. One that makes no progress for
+// stall_ms is disconnected.
+
+#ifndef PUBSUB_SERVER_HPP
+#define PUBSUB_SERVER_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_log.hpp"
+#include "metrics.hpp"
+#include "server/frame_header.h"
+#include "server/libb64-1.2/include/b64/span.h"
+
+enum pubsub_stream
+{
+    PUBSUB_RGB,
+    PUBSUB_DEPTH,   // the 8-bit depth map or the occlusion mask, whichever the depth link would get
+    PUBSUB_MESH,
+    PUBSUB_STREAMS
+};
+
+static inline const char *pubsub_stream_name(int stream)
+{
+    static const char *names[PUBSUB_STREAMS] = { "rgb", "depth", "mesh" };
+    return names[stream];
+}
+
+// what a subscriber asked for
+struct pubsub_request
+{
+    unsigned streams = (1u << PUBSUB_STREAMS) - 1;  // bit per pubsub_stream
+    bool base64 = false;
+    int every = 1;
+
+    bool wants(int stream) const { return (streams >> stream) & 1; }
+
+    // "streams=rgb,mesh format=base64 every=2"; false with error set if it
+    // does not parse
+    bool parse(const std::string & line, std::string & error)
+    {
+        std::istringstream in(line);
+        std::string token;
+        while (in >> token)
+        {
+            const size_t eq = token.find('=');
+            const std::string key = token.substr(0, eq);
+            const std::string value = eq == std::string::npos ? "" : token.substr(eq + 1);
+            if (key == "streams")
+            {
+                streams = 0;
+                std::istringstream list(value);
+                std::string name;
+                while (std::getline(list, name, ','))
+                {
+                    int s = 0;
+                    while (s < PUBSUB_STREAMS && name != pubsub_stream_name(s)) ++s;
+                    if (s == PUBSUB_STREAMS)
+                    {
+                        error = "unknown stream '" + name + "'";
+                        return false;
+                    }
+                    streams |= 1u << s;
+                }
+                if (!streams)
+                {
+                    error = "no streams";
+                    return false;
+                }
+            }
+            else if (key == "format" && (value == "raw" || value == "base64"))
+            {
+                base64 = value == "base64";
+            }
+            else if (key == "every" && atoi(value.c_str()) >= 1)
+            {
+                every = atoi(value.c_str());
+            }
+            else
+            {
+                error = "bad option '" + token + "'";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string describe() const
+    {
+        std::string list;
+        for (int s = 0; s < PUBSUB_STREAMS; ++s)
+            if (wants(s)) list += (list.empty() ? "" : ",") + std::string(pubsub_stream_name(s));
+        return "streams=" + list + " format=" + (base64 ? "base64" : "raw") + " every=" + std::to_string(every);
+    }
+};
+
+class pubsub_server
+{
+public:
+    typedef std::shared_ptr<const std::vector<uint8_t>> frame_ref;
+
+    pubsub_server(metrics_registry & registry, int queue_depth = 1, int stall_ms = 5000)
+        : queue_depth(std::max(queue_depth, 1)), stall_ms(stall_ms), running(false),
+          subscriber_count(registry.gauge("subscribers", "Subscribers connected in server mode")),
+          frames_skipped(registry.counter("subscriber_frames_skipped_total", "Packets slow subscribers skipped")),
+          subscribers_dropped(registry.counter("subscribers_dropped_total", "Subscribers disconnected for stalling")),
+          bytes_sent(registry.counter("subscriber_bytes_sent_total", "Bytes written to all subscribers"))
+    {
+        for (int s = 0; s < PUBSUB_STREAMS; ++s)
+        {
+            wanted[s] = 0;
+            wanted_base64[s] = 0;
+        }
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~pubsub_server()
+    {
+        stop();
+        close(wake_fd);
+    }
+
+    // all interfaces; port 0 picks a free one, see port()
+    bool listen_tcp(int port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons((uint16_t)port);
+        socklen_t len = sizeof addr;
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(fd, 16) == -1 ||
+            getsockname(fd, (struct sockaddr *)&addr, &len) == -1)
+        {
+            ALOG_ERROR("serve: cannot listen on port %d: %s", port, strerror(errno));
+            if (fd != -1) close(fd);
+            return false;
+        }
+        bound_port = ntohs(addr.sin_port);
+        listeners.push_back(fd);
+        ALOG_INFO("serve: listening on port %d", bound_port);
+        return true;
+    }
+
+    bool listen_unix(const std::string & path)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof addr.sun_path)
+        {
+            ALOG_ERROR("serve: socket path too long: %s", path);
+            if (fd != -1) close(fd);
+            return false;
+        }
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(fd, 16) == -1)
+        {
+            ALOG_ERROR("serve: cannot listen on %s: %s", path, strerror(errno));
+            if (fd != -1) close(fd);
+            return false;
+        }
+        unix_path = path;
+        listeners.push_back(fd);
+        ALOG_INFO("serve: listening on %s", path);
+        return true;
+    }
+
+    int port() const { return bound_port; }
+
+    void start()
+    {
+        if (running.exchange(true)) return;
+        thread = std::thread([this] { run(); });
+    }
+
+    void stop()
+    {
+        if (running.exchange(false))
+        {
+            wake();
+            thread.join();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!subscribers.empty()) remove(subscribers.size() - 1);
+        for (int fd : listeners) close(fd);
+        listeners.clear();
+        if (!unix_path.empty()) unlink(unix_path.c_str());
+        unix_path.clear();
+    }
+
+    std::thread::native_handle_type native_handle() { return thread.native_handle(); }
+
+    // Whether anyone is subscribed to the stream, so the capture loop can
+    // skip building it. Lock free.
+    bool wants(int stream) const { return wanted[stream].load(std::memory_order_relaxed) > 0; }
+
+    // subscribers connected, packets they skipped falling behind, and
+    // subscribers disconnected for stalling
+    size_t subscribed() const { return (size_t)subscriber_count.get(); }
+    uint64_t skipped() const { return frames_skipped.get(); }
+    uint64_t stalled() const { return subscribers_dropped.get(); }
+
+    // Hand a packet to every subscriber of the stream that is due for one,
+    // then swap in a free buffer for the next one, like stream_link's
+    // send_frame; its contents are whatever an earlier packet left in it.
+    // The packet is encoded to base64 once if any subscriber wants that.
+    // Returns how many subscribers it was queued for.
+    size_t publish(int stream, std::vector<uint8_t> & packet)
+    {
+        if (packet.empty()) return 0;
+
+        // buffers are taken under the mutex, filled outside of it so the
+        // I/O thread is not held up by an encode
+        std::unique_lock<std::mutex> lock(mutex);
+        std::shared_ptr<std::vector<uint8_t>> raw = free_buffer(), encoded;
+        if (stream != PUBSUB_MESH && wanted_base64[stream].load(std::memory_order_relaxed) > 0) encoded = free_buffer();
+        lock.unlock();
+
+        raw->swap(packet);
+        if (encoded) encode_tiles(*raw, *encoded);
+
+        size_t queued = 0;
+        lock.lock();
+        for (std::unique_ptr<subscriber> & s : subscribers)
+        {
+            if (!s->subscribed || !s->request.wants(stream)) continue;
+            if (s->seen[stream]++ % s->request.every) continue;
+            enqueue(*s, stream, s->request.base64 && encoded ? frame_ref(encoded) : frame_ref(raw));
+            ++queued;
+        }
+        lock.unlock();
+
+        if (queued) wake();
+        return queued;
+    }
+
+private:
+    struct queued_packet
+    {
+        int stream;
+        frame_ref data;
+    };
+
+    struct subscriber
+    {
+        int fd = -1;
+        std::string name;
+        bool subscribed = false;
+        bool closing = false;
+        std::string line;               // request received so far
+        pubsub_request request;
+        uint64_t seen[PUBSUB_STREAMS] = {};
+        std::deque<queued_packet> queue;
+        size_t offset = 0;              // bytes of queue.front() already sent
+        uint64_t progress_ms = 0;       // connected, or last wrote anything
+        uint64_t skipped = 0;
+    };
+
+    // packets kept around for reuse; past this many in use they are
+    // allocated and freed as they come
+    static const size_t POOL_SIZE = 32;
+
+    // time a new connection has to send its request
+    static const int REQUEST_MS = 2000;
+
+    const int queue_depth;
+    const int stall_ms;
+    std::atomic<bool> running;
+    std::thread thread;
+    std::vector<int> listeners;
+    std::string unix_path;
+    int bound_port = 0;
+    int wake_fd = -1;
+
+    // guards everything below; the I/O thread never sends while holding it
+    std::mutex mutex;
+    std::vector<std::unique_ptr<subscriber>> subscribers;
+    std::vector<std::shared_ptr<std::vector<uint8_t>>> pool;
+    std::atomic<int> wanted[PUBSUB_STREAMS], wanted_base64[PUBSUB_STREAMS];
+
+    metric_gauge & subscriber_count;
+    metric_counter & frames_skipped, & subscribers_dropped, & bytes_sent;
+
+    static uint64_t now_ms() { return metric_clock_ns() / 1000000; }
+
+    void wake()
+    {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof one) == -1) {}
+    }
+
+    // a pooled buffer nobody holds any more. Queues only drop their
+    // references under the mutex, so use_count() is exact here.
+    std::shared_ptr<std::vector<uint8_t>> free_buffer()
+    {
+        for (std::shared_ptr<std::vector<uint8_t>> & b : pool)
+            if (b.use_count() == 1) return b;
+        std::shared_ptr<std::vector<uint8_t>> b = std::make_shared<std::vector<uint8_t>>();
+        if (pool.size() < POOL_SIZE) pool.push_back(b);
+        return b;
+    }
+
+    // the tiles of packet with their payloads as base64 text, as
+    // send_tiles sends them in --base64 mode
+    static void encode_tiles(const std::vector<uint8_t> & packet, std::vector<uint8_t> & out)
+    {
+        out.clear();
+        const uint8_t *data = packet.data();
+        size_t size = packet.size();
+        while (size >= sizeof(frame_header))
+        {
+            struct frame_header header;
+            memcpy(&header, data, sizeof header);
+            const size_t tile_size = header.header_size + header.payload_size;
+            if (header.header_size < sizeof header || tile_size > size) break;
+            base64::const_span payload = { (const char *)data + header.header_size, header.payload_size };
+
+            header.flags |= FRAME_TILE_BASE64;
+            header.payload_size = (uint32_t)base64::encoded_size(payload.size);
+            const size_t at = out.size();
+            out.resize(at + sizeof header + header.payload_size);
+            memcpy(&out[at], &header, sizeof header);
+            base64::span code = { (char *)&out[at + sizeof header], header.payload_size };
+            out.resize(at + sizeof header + base64::encode(payload, code));
+
+            data += tile_size;
+            size -= tile_size;
+        }
+    }
+
+    // The packet at the front may be half sent and always stays. Of the
+    // ones waiting behind it, the oldest of this stream gives way once there
+    // are queue_depth of them.
+    void enqueue(subscriber & s, int stream, const frame_ref & data)
+    {
+        int waiting = 0;
+        size_t oldest = 0;
+        for (size_t i = 1; i < s.queue.size(); ++i)
+            if (s.queue[i].stream == stream && waiting++ == 0) oldest = i;
+        if (waiting >= queue_depth)
+        {
+            s.queue.erase(s.queue.begin() + oldest);
+            ++s.skipped;
+            frames_skipped.add();
+        }
+        if (s.queue.empty()) s.progress_ms = now_ms();
+        queued_packet p = { stream, data };
+        s.queue.push_back(p);
+    }
+
+    // with the mutex held
+    void remove(size_t i)
+    {
+        subscriber & s = *subscribers[i];
+        if (s.subscribed)
+        {
+            for (int stream = 0; stream < PUBSUB_STREAMS; ++stream)
+            {
+                if (!s.request.wants(stream)) continue;
+                --wanted[stream];
+                if (s.request.base64) --wanted_base64[stream];
+            }
+        }
+        close(s.fd);
+        subscribers.erase(subscribers.begin() + i);
+        subscriber_count.set((double)subscribers.size());
+    }
+
+    void run()
+    {
+        std::vector<struct pollfd> fds;
+        std::vector<subscriber *> polled;
+        while (running)
+        {
+            fds.clear();
+            polled.clear();
+            struct pollfd wake_pfd = { wake_fd, POLLIN, 0 };
+            fds.push_back(wake_pfd);
+            for (int fd : listeners)
+            {
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                fds.push_back(pfd);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (std::unique_ptr<subscriber> & s : subscribers)
+                {
+                    struct pollfd pfd = { s->fd, (short)(POLLIN | (s->queue.empty() ? 0 : POLLOUT)), 0 };
+                    fds.push_back(pfd);
+                    polled.push_back(s.get());
+                }
+            }
+
+            if (poll(fds.data(), fds.size(), 100) > 0)
+            {
+                uint64_t count;
+                if (fds[0].revents & POLLIN && read(wake_fd, &count, sizeof count) == -1) {}
+                for (size_t i = 1; i <= listeners.size(); ++i)
+                    if (fds[i].revents & POLLIN) accept_subscriber(fds[i].fd);
+
+                // subscribers only ever exist or go away on this thread, so
+                // the pointers stay good until the sweep below
+                for (size_t i = 0; i < polled.size(); ++i)
+                {
+                    const short revents = fds[1 + listeners.size() + i].revents;
+                    subscriber & s = *polled[i];
+                    if (revents & POLLIN) receive(s);
+                    if (revents & (POLLERR | POLLNVAL)) s.closing = true;
+                    if (!s.closing && revents & POLLOUT) flush(s);
+                    if (revents & POLLHUP && !(revents & POLLIN)) s.closing = true;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            const uint64_t now = now_ms();
+            for (size_t i = subscribers.size(); i-- > 0; )
+            {
+                subscriber & s = *subscribers[i];
+                if (!s.subscribed && now - s.progress_ms > (uint64_t)REQUEST_MS)
+                {
+                    ALOG_WARN("serve: %s sent no request", s.name);
+                    s.closing = true;
+                }
+                else if (!s.queue.empty() && stall_ms > 0 && now - s.progress_ms > (uint64_t)stall_ms)
+                {
+                    ALOG_WARN("serve: %s stalled for %d ms, disconnecting", s.name, stall_ms);
+                    subscribers_dropped.add();
+                    s.closing = true;
+                }
+                if (!s.closing) continue;
+                ALOG_INFO("serve: %s left, %llu packets skipped", s.name, (unsigned long long)s.skipped);
+                remove(i);
+            }
+        }
+    }
+
+    void accept_subscriber(int listener)
+    {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof addr;
+        int fd = accept(listener, (struct sockaddr *)&addr, &len);
+        if (fd == -1) return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        std::unique_ptr<subscriber> s(new subscriber);
+        s->fd = fd;
+        s->progress_ms = now_ms();
+        char host[INET6_ADDRSTRLEN] = "unix";
+        if (addr.ss_family == AF_INET || addr.ss_family == AF_INET6)
+            inet_ntop(addr.ss_family, get_addr(&addr), host, sizeof host);
+        s->name = std::string(host) + "#" + std::to_string(fd);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        subscribers.push_back(std::move(s));
+        subscriber_count.set((double)subscribers.size());
+    }
+
+    static void *get_addr(struct sockaddr_storage *sa)
+    {
+        if (sa->ss_family == AF_INET) return &((struct sockaddr_in *)sa)->sin_addr;
+        return &((struct sockaddr_in6 *)sa)->sin6_addr;
+    }
+
+    // The request line while there is none yet; after that, anything a
+    // subscriber sends is ignored, and reading just notices it hang up.
+    void receive(subscriber & s)
+    {
+        char buf[512];
+        ssize_t n = recv(s.fd, buf, sizeof buf, 0);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+        {
+            s.closing = true;
+            return;
+        }
+        if (n <= 0 || s.subscribed) return;
+
+        s.line.append(buf, n);
+        const size_t end = s.line.find('\n');
+        if (end == std::string::npos)
+        {
+            if (s.line.size() > 256) reply(s, "ERR request too long");
+            return;
+        }
+
+        pubsub_request request;
+        std::string error;
+        if (!request.parse(s.line.substr(0, end), error))
+        {
+            reply(s, "ERR " + error);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        s.request = request;
+        s.subscribed = true;
+        for (int stream = 0; stream < PUBSUB_STREAMS; ++stream)
+        {
+            if (!request.wants(stream)) continue;
+            ++wanted[stream];
+            if (request.base64) ++wanted_base64[stream];
+        }
+        reply(s, "OK " + request.describe());
+        ALOG_INFO("serve: %s subscribed, %s", s.name, request.describe());
+    }
+
+    // A fresh connection has its whole send buffer free, so this never has
+    // to wait. An error closes the connection.
+    void reply(subscriber & s, const std::string & text)
+    {
+        const std::string line = text + "\n";
+        if (send(s.fd, line.data(), line.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)line.size() ||
+            text.compare(0, 3, "ERR") == 0)
+        {
+            if (text.compare(0, 3, "ERR") == 0) ALOG_WARN("serve: %s: %s", s.name, text);
+            s.closing = true;
+        }
+    }
+
+    // Write out as much of the queue as the socket takes without blocking.
+    // The front packet only ever leaves the queue here, so it can be sent
+    // without the mutex.
+    void flush(subscriber & s)
+    {
+        for (;;)
+        {
+            frame_ref data;
+            size_t offset;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (s.queue.empty()) return;
+                data = s.queue.front().data;
+                offset = s.offset;
+            }
+
+            ssize_t n = send(s.fd, data->data() + offset, data->size() - offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+            const bool failed = n == -1 && errno != EAGAIN && errno != EINTR;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            data.reset();
+            if (failed) s.closing = true;
+            if (n <= 0) return;
+            bytes_sent.add(n);
+            s.progress_ms = now_ms();
+            s.offset += n;
+            if (s.offset < s.queue.front().data->size()) return;
+            s.queue.pop_front();
+            s.offset = 0;
+        }
+    }
+};
+
+#endif // PUBSUB_SERVER_HPP
@@ -0,0 +1,255 @@
+///////////////////
+// roi_stream    //
+///////////////////
+
+// Region-of-interest streaming. The browser reports the screen-space bounds of
+// its virtual objects back up the RGB socket as text lines:
+//
+//     ROI x y w h\n      region in image pixels; w or h <= 0 clears it
+//     DEPTHS c r d...\n   depth of the nearest virtual object in each cell of
+//                        a c x r grid over the image, row by row, in the
+//                        units of the 8-bit depth map; 0 where there is none
+//
+// Only the ROI is sent at full resolution. Outside of it a stream is either
+// subsampled (RGB, so the background video keeps playing) or dropped
+// altogether (depth, which only matters where there is something to occlude).
+
+#ifndef ROI_STREAM_HPP
+#define ROI_STREAM_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "server/frame_header.h"
+
+struct roi_rect
+{
+    int x, y, w, h;
+
+    roi_rect() : x(0), y(0), w(0), h(0) {}
+    roi_rect(int x, int y, int w, int h) : x(x), y(y), w(w), h(h) {}
+
+    bool empty() const { return w <= 0 || h <= 0; }
+
+    // grow by margin pixels on every side and clip to the frame
+    roi_rect padded(int margin, int width, int height) const
+    {
+        if (empty()) return roi_rect();
+        int x0 = std::max(x - margin, 0), y0 = std::max(y - margin, 0);
+        int x1 = std::min(x + w + margin, width), y1 = std::min(y + h + margin, height);
+        if (x1 <= x0 || y1 <= y0) return roi_rect();
+        return roi_rect(x0, y0, x1 - x0, y1 - y0);
+    }
+};
+
+// Virtual object depths per cell of a grid over the image, for the occlusion
+// mask (occlusion_mask.hpp). An empty grid means nothing virtual is on screen.
+struct region_depths
+{
+    int cols, rows;
+    std::vector<uint8_t> depth;
+
+    region_depths() : cols(0), rows(0) {}
+
+    bool empty() const { return cols <= 0 || rows <= 0; }
+
+    uint8_t at(int col, int row) const { return depth[(size_t)row * cols + col]; }
+};
+
+// Reads ROI updates from the client without ever blocking the capture loop.
+class roi_control_channel
+{
+public:
+    explicit roi_control_channel(int sockfd = -1) : sockfd(sockfd) {}
+
+    void reset(int fd) { sockfd = fd; pending.clear(); current = roi_rect(); depths = region_depths(); }
+
+    // Drain whatever the client has sent since the last call. Returns true if
+    // the ROI changed.
+    bool poll()
+    {
+        if (sockfd < 0) return false;
+
+        bool changed = false;
+        char buf[512];
+        for (;;)
+        {
+            ssize_t n = recv(sockfd, buf, sizeof buf, MSG_DONTWAIT);
+            if (n <= 0) break;
+            pending.append(buf, n);
+        }
+
+        size_t eol;
+        while ((eol = pending.find('\n')) != std::string::npos)
+        {
+            changed |= parse(pending.substr(0, eol));
+            pending.erase(0, eol + 1);
+        }
+
+        // a client that never sends a newline should not grow this forever;
+        // a DEPTHS line for a 64 x 64 grid is about 16KB
+        if (pending.size() > 32768) pending.clear();
+        return changed;
+    }
+
+    const roi_rect & roi() const { return current; }
+    const region_depths & region_depth() const { return depths; }
+
+private:
+    int sockfd;
+    std::string pending;
+    roi_rect current;
+    region_depths depths;
+
+    bool parse(const std::string & line)
+    {
+        if (line.compare(0, 7, "DEPTHS ") == 0)
+        {
+            parse_depths(line.c_str() + 7);
+            return false;
+        }
+
+        int x, y, w, h;
+        if (sscanf(line.c_str(), "ROI %d %d %d %d", &x, &y, &w, &h) != 4) return false;
+        roi_rect next(x, y, w, h);
+        if (next.empty()) next = roi_rect();
+        bool changed = next.x != current.x || next.y != current.y || next.w != current.w || next.h != current.h;
+        current = next;
+        return changed;
+    }
+
+    // a malformed line leaves the previous depths in place
+    void parse_depths(const char *p)
+    {
+        char *end;
+        long cols = strtol(p, &end, 10), rows = strtol(end, &end, 10);
+        if (cols < 0 || rows < 0 || cols > 64 || rows > 64) return;
+
+        region_depths next;
+        next.cols = (int)cols;
+        next.rows = (int)rows;
+        next.depth.resize(cols * rows);
+        for (size_t i = 0; i < next.depth.size(); ++i)
+        {
+            p = end;
+            long d = strtol(p, &end, 10);
+            if (end == p || d < 0 || d > 255) return;
+            next.depth[i] = (uint8_t)d;
+        }
+        depths = next;
+    }
+};
+
+// How a stream is treated outside the ROI: subsampled by outside_scale, or not
+// sent at all when outside_scale is 0.
+struct roi_policy
+{
+    int outside_scale;
+    int margin;
+
+    roi_policy(int outside_scale = 0, int margin = 16) : outside_scale(outside_scale), margin(margin) {}
+};
+
+static inline uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Packs frames into header + payload tiles. The tile buffer is reused between
+// frames, so steady-state streaming does not allocate.
+class roi_tile_writer
+{
+public:
+    roi_tile_writer(uint8_t stream, int channels, int width, int height)
+        : stream(stream), channels(channels), width(width), height(height) {}
+
+    // Build the tiles for one frame; data() then holds them back to back in
+    // send order, each a frame_header and its payload.
+    // Every tile carries the head pose at capture time, if there is one.
+    void build(const uint8_t image[], const roi_rect & roi, const roi_policy & policy,
+               uint32_t sequence, uint64_t timestamp_us, const struct frame_pose * pose = NULL)
+    {
+        buffer.clear();
+
+        roi_rect r = roi.padded(policy.margin, width, height);
+        if (r.empty())
+        {
+            add_tile(image, roi_rect(0, 0, width, height), 1, FRAME_TILE_LAST, sequence, timestamp_us, pose);
+            return;
+        }
+
+        if (policy.outside_scale > 0)
+            add_tile(image, roi_rect(0, 0, width, height), policy.outside_scale, 0, sequence, timestamp_us, pose);
+        add_tile(image, r, 1, FRAME_TILE_LAST | FRAME_TILE_ROI, sequence, timestamp_us, pose);
+    }
+
+    const uint8_t * data() const { return buffer.data(); }
+    size_t size() const { return buffer.size(); }
+
+    // the buffer data() points into, for stream_link::send_frame to swap
+    std::vector<uint8_t> & packet() { return buffer; }
+
+private:
+    uint8_t stream;
+    int channels, width, height;
+    std::vector<uint8_t> buffer;
+
+    void add_tile(const uint8_t image[], const roi_rect & r, int scale, uint8_t flags,
+                  uint32_t sequence, uint64_t timestamp_us, const struct frame_pose * pose)
+    {
+        struct frame_header header;
+        frame_header_init(&header, stream, (uint8_t)channels, (uint16_t)width, (uint16_t)height);
+        header.sequence = sequence;
+        header.timestamp_us = timestamp_us;
+        header.x = (uint16_t)r.x;
+        header.y = (uint16_t)r.y;
+        header.width = (uint16_t)r.w;
+        header.height = (uint16_t)r.h;
+        header.scale = (uint8_t)scale;
+        header.flags = flags;
+        if (pose)
+        {
+            header.pose = *pose;
+            header.flags |= FRAME_TILE_POSE;
+        }
+
+        const int tw = frame_tile_extent(r.w, scale), th = frame_tile_extent(r.h, scale);
+        header.payload_size = (uint32_t)(tw * th * channels);
+
+        size_t start = buffer.size();
+        buffer.resize(start + sizeof header + header.payload_size);
+        memcpy(&buffer[start], &header, sizeof header);
+
+        uint8_t * out = &buffer[start + sizeof header];
+        const size_t row_bytes = (size_t)r.w * channels;
+        for (int ty = 0; ty < th; ++ty)
+        {
+            const uint8_t * row = image + ((size_t)(r.y + ty * scale) * width + r.x) * channels;
+            if (scale == 1)
+            {
+                memcpy(out, row, row_bytes);
+                out += row_bytes;
+                continue;
+            }
+            // nearest-neighbour subsampling; this is only the background around the ROI
+            for (int tx = 0; tx < tw; ++tx)
+            {
+                const uint8_t * px = row + (size_t)tx * scale * channels;
+                for (int c = 0; c < channels; ++c) *out++ = px[c];
+            }
+        }
+    }
+};
+
+#endif // ROI_STREAM_HPP
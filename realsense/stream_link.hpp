@@ -0,0 +1,437 @@
+///////////////////
+// stream_link   //
+///////////////////
+
+// One TCP connection from the camera to the node server, e.g. the RGB stream
+// on 3490. In daemon mode a link that fails is closed and reconnected in the
+// background with exponential backoff, while the capture loop keeps running
+// and drops the frames it has nowhere to send. Reconnecting never blocks: the
+// host name is resolved on a thread of its own, once, and the connect is
+// non-blocking and only checked once per frame.
+//
+// Sending never blocks either. What the socket does not take right away is
+// kept in a backlog and goes out first, the next time anything is sent; a
+// packet that comes along while the backlog is still there is dropped whole
+// (and counted), so a server that stalls costs frames, not capture time, and
+// the stream never has half a packet in it.
+
+#ifndef STREAM_LINK_HPP
+#define STREAM_LINK_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "async_log.hpp"
+#include "zerocopy_tx.hpp"
+
+// networking helper function to get in_addr
+inline void *get_in_addr(struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+// connect to host:port, trying every address it resolves to. Returns the
+// socket, or -1 if none of them accepted the connection.
+inline int connect_stream(const char *host, const char *port)
+{
+    int sockfd = -1;
+    struct addrinfo hints, *servinfo, *p;
+    int rv;
+    char s[INET6_ADDRSTRLEN];
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+        ALOG_ERROR("getaddrinfo: %s", gai_strerror(rv));
+        return -1;
+    }
+
+    // loop through all the results and connect to the first we can
+    for(p = servinfo; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype,
+                p->ai_protocol)) == -1) {
+            ALOG_ERROR("client: socket: %s", strerror(errno));
+            continue;
+        }
+
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            ALOG_WARN("client: connect: %s", strerror(errno));
+            close(sockfd);
+            continue;
+        }
+
+        break;
+    }
+
+    if (p == NULL) {
+        ALOG_WARN("client: failed to connect to port %s", port);
+        freeaddrinfo(servinfo);
+        return -1;
+    }
+
+    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
+            s, sizeof s);
+    ALOG_INFO("client: connecting to %s:%s", s, port);
+
+    freeaddrinfo(servinfo); // all done with this structure
+    return sockfd;
+}
+
+// send the whole buffer, looping over partial writes. MSG_NOSIGNAL turns a
+// vanished server into an EPIPE error instead of killing the process.
+inline int send_all(int sockfd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = send(sockfd, p, len, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// one address getaddrinfo found, kept so it does not have to be looked up
+// again
+struct link_address
+{
+    int family, socktype, protocol;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+// every address of host:port; none if it does not resolve
+inline std::vector<link_address> resolve_stream(const std::string & host, const std::string & port)
+{
+    std::vector<link_address> out;
+    struct addrinfo hints, *servinfo;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rv = getaddrinfo(host.c_str(), port.c_str(), &hints, &servinfo);
+    if (rv != 0)
+    {
+        ALOG_WARN("client: getaddrinfo %s: %s", host, gai_strerror(rv));
+        return out;
+    }
+    for (struct addrinfo *p = servinfo; p; p = p->ai_next)
+    {
+        link_address a;
+        a.family = p->ai_family;
+        a.socktype = p->ai_socktype;
+        a.protocol = p->ai_protocol;
+        memcpy(&a.addr, p->ai_addr, p->ai_addrlen);
+        a.addrlen = p->ai_addrlen;
+        out.push_back(a);
+    }
+    freeaddrinfo(servinfo);
+    return out;
+}
+
+static inline uint64_t link_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+class stream_link
+{
+public:
+    stream_link(const std::string & host, const char *port, int backoff_min_ms, int backoff_max_ms)
+        : host(host), port(port), backoff_min_ms(backoff_min_ms), backoff_max_ms(backoff_max_ms),
+          backoff_ms(backoff_min_ms) {}
+
+    ~stream_link() { disconnect(); }
+
+    // Connect right away, blocking until it succeeds or fails. Not for the
+    // capture thread.
+    bool connect_now()
+    {
+        disconnect();
+        sockfd = connect_stream(host.c_str(), port);
+        if (sockfd < 0) return false;
+        established();
+        return true;
+    }
+
+    // Advance a background (re)connection, and push out the backlog; cheap
+    // enough to call every frame. Returns true while the link is usable.
+    bool poll_connect()
+    {
+        if (state == CONNECTED) return flush() || state == CONNECTED;
+
+        if (state == DISCONNECTED)
+        {
+            if (link_now_ms() < next_attempt_ms) return false;
+            start_connect();
+            if (state != CONNECTING) return state == CONNECTED;
+        }
+
+        struct pollfd pfd = { sockfd, POLLOUT, 0 };
+        if (poll(&pfd, 1, 0) <= 0) return false;
+
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err)
+        {
+            fail();
+            return false;
+        }
+        established();
+        return true;
+    }
+
+    // Start a packet sent in parts with send(). False if the link is down,
+    // or if the backlog of the previous packets is still there, in which case
+    // this packet is to be dropped whole and is counted in dropped().
+    bool begin_packet()
+    {
+        if (state != CONNECTED) return false;
+        if (flush()) return true;
+        if (state == CONNECTED) ++packets_dropped;
+        return false;
+    }
+
+    // Send a whole packet, or drop it when the socket is still backed up.
+    // False if the link failed; it is then closed and a reconnect is
+    // scheduled, and a packet is never sent partially over a new connection.
+    bool send_packet(const void *buf, size_t len)
+    {
+        if (!begin_packet()) return state == CONNECTED;
+        return send(buf, len);
+    }
+
+    // Part of the packet begin_packet() started. Whatever the socket does not
+    // take now goes into the backlog. False if the link failed.
+    bool send(const void *buf, size_t len)
+    {
+        if (state != CONNECTED) return false;
+        if (!backlog.empty())
+        {
+            backlog.insert(backlog.end(), (const uint8_t *)buf, (const uint8_t *)buf + len);
+            return true;
+        }
+
+        const uint8_t *p = (const uint8_t *)buf;
+        while (len > 0)
+        {
+            ssize_t n = ::send(sockfd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n == -1)
+            {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    backlog.assign(p, p + len);
+                    backlog_sent = 0;
+                    return true;
+                }
+                return lost();
+            }
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // Push out as much of the backlog as the socket takes. True once it is
+    // all out; false while some is left, or if the link failed.
+    bool flush()
+    {
+        while (state == CONNECTED && backlog_sent < backlog.size())
+        {
+            ssize_t n = ::send(sockfd, backlog.data() + backlog_sent, backlog.size() - backlog_sent,
+                               MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n == -1)
+            {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) lost();
+                return false;
+            }
+            backlog_sent += n;
+        }
+        if (state != CONNECTED) return false;
+        backlog.clear();
+        backlog_sent = 0;
+        return true;
+    }
+
+    // True once the backlog is out and the kernel has given back every
+    // zerocopy buffer, so disconnect() will not reset the connection. For
+    // shutdown paths that want the last frames delivered; polls, never waits.
+    bool drained()
+    {
+        if (!flush()) return false;
+        if (tx.attached()) tx.reap();
+        return tx.buffers_in_flight() == 0;
+    }
+
+    // packets dropped because the backlog was still there
+    unsigned long long dropped() const { return packets_dropped; }
+
+    // Send frames with MSG_ZEROCOPY from now on, where the kernel has it
+    // (zerocopy_tx.hpp); takes effect with the next connection.
+    void use_zerocopy(bool on) { zerocopy = on; }
+
+    // Send a whole frame from a buffer the link may keep. With zerocopy on,
+    // the buffer stays with the kernel until it has been sent and frame comes
+    // back holding another one; build the next frame in that. Otherwise, and
+    // for small frames, this is send().
+    bool send_frame(std::vector<uint8_t> & frame)
+    {
+        if (!begin_packet()) return state == CONNECTED;
+        if (!tx.attached() || frame.size() < zerocopy_tx::MIN_SIZE) return send(frame.data(), frame.size());
+
+        // what the socket does not take now is copied into the backlog
+        if (tx.send(frame, backlog) == 0)
+        {
+            backlog_sent = 0;
+            return true;
+        }
+        return lost();
+    }
+
+    const zerocopy_tx & zerocopy_stats() const { return tx; }
+
+    bool connected() const { return state == CONNECTED; }
+    int fd() const { return state == CONNECTED ? sockfd : -1; }
+
+    // true once after every new connection
+    bool take_fresh() { bool f = fresh; fresh = false; return f; }
+
+    // Close a link whose peer went away, the way a failed send does: the
+    // next attempt waits out the backoff. disconnect() retries right away.
+    void fail()
+    {
+        // the backoff starts over after a connection that stayed up; a peer
+        // that accepts and closes straight away keeps it growing
+        if (state == CONNECTED && link_now_ms() - connected_ms > (uint64_t)backoff_max_ms)
+            backoff_ms = backoff_min_ms;
+        disconnect();
+        next_attempt_ms = link_now_ms() + backoff_ms;
+        backoff_ms = std::min(backoff_ms * 2, backoff_max_ms);
+        if (++failures >= addresses.size()) addresses.clear();
+    }
+
+    void disconnect()
+    {
+        const size_t unsent = tx.detach();
+        if (unsent > 0) ALOG_WARN("client: port %s reset with %zu zerocopy buffers unsent", port, unsent);
+        if (sockfd >= 0) close(sockfd);
+        sockfd = -1;
+        state = DISCONNECTED;
+        backlog.clear();
+        backlog_sent = 0;
+    }
+
+private:
+    enum link_state { DISCONNECTED, CONNECTING, CONNECTED };
+
+    std::string host;
+    const char *port;
+    int backoff_min_ms, backoff_max_ms, backoff_ms;
+    uint64_t next_attempt_ms = 0;
+    uint64_t connected_ms = 0;
+    int sockfd = -1;
+    link_state state = DISCONNECTED;
+    bool fresh = false;
+    int address_index = 0;
+    bool zerocopy = false;
+    zerocopy_tx tx;
+    std::vector<uint8_t> backlog;
+    size_t backlog_sent = 0;
+    unsigned long long packets_dropped = 0;
+
+    // Resolved once, in the background; looked up again after every address
+    // failed in turn. Destroying the link waits for a lookup in progress.
+    std::vector<link_address> addresses;
+    std::future<std::vector<link_address>> resolving;
+    size_t failures = 0;
+
+    bool lost()
+    {
+        ALOG_WARN("client: lost connection on port %s (%s)", port, strerror(errno));
+        fail();
+        return false;
+    }
+
+    void attach_zerocopy()
+    {
+        if (zerocopy && !tx.attach(sockfd))
+            ALOG_WARN("client: no MSG_ZEROCOPY on port %s (%s), copying", port, strerror(errno));
+    }
+
+    void start_connect()
+    {
+        // until the lookup is done, the link stays down and this is called
+        // again next frame
+        if (addresses.empty())
+        {
+            if (!resolving.valid())
+                resolving = std::async(std::launch::async, resolve_stream, host, std::string(port));
+            if (resolving.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+            addresses = resolving.get();
+            if (addresses.empty())
+            {
+                fail();
+                return;
+            }
+        }
+
+        // one address per attempt, so a dead address costs no extra wait
+        const link_address & a = addresses[address_index++ % addresses.size()];
+        sockfd = socket(a.family, a.socktype, a.protocol);
+        if (sockfd != -1)
+        {
+            fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+            if (connect(sockfd, (const struct sockaddr *)&a.addr, a.addrlen) == 0) state = CONNECTED;
+            else if (errno == EINPROGRESS) state = CONNECTING;
+        }
+
+        if (state == CONNECTED) established();
+        else if (state != CONNECTING) fail();
+    }
+
+    void established()
+    {
+        // sends stay non-blocking, see send()
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+        state = CONNECTED;
+        fresh = true;
+        connected_ms = link_now_ms();
+        failures = 0;
+        attach_zerocopy();
+        ALOG_INFO("client: connected on port %s", port);
+    }
+};
+
+#endif // STREAM_LINK_HPP
@@ -0,0 +1,226 @@
+///////////////////////
+// thread_placement  //
+///////////////////////
+
+// Which cores the stages of cpp-headless run on, and how they are scheduled.
+// On the TX1 the camera shares four cores with the node server and the OS;
+// pinning the capture loop to a core of its own and giving it SCHED_FIFO
+// keeps them from delaying a frame. The stages are
+//
+//     capture   the main loop: wait for a frame, convert, send
+//     camera    librealsense's own threads, which inherit the affinity of the
+//               thread that starts the device
+//     pose      the pose feed (pose_sync.hpp)
+//     log       the log writer (async_log.hpp)
+//     io        the server mode's I/O thread (pubsub_server.hpp) and the
+//               metrics endpoint (metrics.hpp)
+//     base64    the base64 workers of --base64
+//
+// Each takes a CPU list ("2", "0-1,3"; empty for anywhere) and a SCHED_FIFO
+// priority (0 for the normal scheduler). SCHED_FIFO and mlockall need root or
+// CAP_SYS_NICE / CAP_IPC_LOCK; without them the placement is reported and
+// the rest of it still applied.
+
+#ifndef THREAD_PLACEMENT_HPP
+#define THREAD_PLACEMENT_HPP
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "async_log.hpp"
+
+struct thread_profile
+{
+    std::string cpus;
+    int fifo;
+
+    thread_profile() : fifo(0) {}
+    thread_profile(const char *cpus, int fifo) : cpus(cpus), fifo(fifo) {}
+};
+
+// "0-1,3" into a CPU set; false if it does not parse
+static inline bool parse_cpu_list(const std::string & list, cpu_set_t & set)
+{
+    CPU_ZERO(&set);
+    const char *p = list.c_str();
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) return false;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, &set);
+        if (*end == ',') ++end;
+        else if (*end) return false;
+        p = end;
+    }
+    return CPU_COUNT(&set) > 0;
+}
+
+// the other way round, for reports
+static inline std::string cpu_list(const cpu_set_t & set)
+{
+    std::string list;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (!CPU_ISSET(cpu, &set)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set)) ++last;
+        if (!list.empty()) list += ",";
+        list += std::to_string(cpu);
+        if (last > cpu) list += "-" + std::to_string(last);
+        cpu = last;
+    }
+    return list;
+}
+
+// Apply a profile to a thread and log where it ended up. Returns false if
+// any part of it could not be applied.
+static inline bool place_thread(pthread_t thread, const char *stage, const thread_profile & profile)
+{
+    bool ok = true;
+    if (!profile.cpus.empty())
+    {
+        cpu_set_t set;
+        if (!parse_cpu_list(profile.cpus, set))
+        {
+            ALOG_WARN("placement: %s: bad CPU list '%s'", stage, profile.cpus);
+            ok = false;
+        }
+        else if (int rv = pthread_setaffinity_np(thread, sizeof set, &set))
+        {
+            ALOG_WARN("placement: %s: cannot run on cpus %s: %s", stage, profile.cpus, strerror(rv));
+            ok = false;
+        }
+    }
+    if (profile.fifo > 0)
+    {
+        struct sched_param param;
+        param.sched_priority = std::min(profile.fifo, sched_get_priority_max(SCHED_FIFO));
+        if (int rv = pthread_setschedparam(thread, SCHED_FIFO, &param))
+        {
+            ALOG_WARN("placement: %s: no SCHED_FIFO %d: %s", stage, param.sched_priority, strerror(rv));
+            ok = false;
+        }
+    }
+
+    // report what the kernel made of it
+    cpu_set_t actual;
+    int policy = SCHED_OTHER;
+    struct sched_param param;
+    param.sched_priority = 0;
+    CPU_ZERO(&actual);
+    pthread_getaffinity_np(thread, sizeof actual, &actual);
+    pthread_getschedparam(thread, &policy, &param);
+    ALOG_INFO("placement: %s on cpus %s, %s %d", stage, cpu_list(actual),
+              policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER", param.sched_priority);
+    return ok;
+}
+
+// Keep every page of the process in memory, now and later, so the capture
+// loop never waits for a page fault.
+static inline bool lock_memory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+    {
+        ALOG_WARN("placement: mlockall: %s", strerror(errno));
+        return false;
+    }
+    ALOG_INFO("placement: memory locked");
+    return true;
+}
+
+// Profiles for every stage.
+struct thread_placement
+{
+    thread_profile capture, camera, pose, log, io, base64;
+    bool lock_memory;
+
+    thread_placement() : lock_memory(false) {}
+
+    thread_profile * stage(const std::string & name)
+    {
+        if (name == "capture") return &capture;
+        if (name == "camera") return &camera;
+        if (name == "pose") return &pose;
+        if (name == "log") return &log;
+        if (name == "io") return &io;
+        if (name == "base64") return &base64;
+        return NULL;
+    }
+
+    // Presets for --placement, applied before the keys that follow it. tx1:
+    // the OS and the node server keep core 0, librealsense's USB threads get
+    // core 1, the capture loop core 2 at SCHED_FIFO 50, and the threads that
+    // only wait for I/O share core 3. Returns false for an unknown name.
+    bool set_preset(const std::string & name)
+    {
+        thread_placement preset;
+        if (name == "tx1")
+        {
+            preset.capture = thread_profile("2", 50);
+            preset.camera = thread_profile("1", 0);
+            preset.pose = thread_profile("3", 0);
+            preset.log = thread_profile("3", 0);
+            preset.io = thread_profile("3", 0);
+            preset.base64 = thread_profile("1,3", 0);
+            preset.lock_memory = true;
+        }
+        else if (name != "none")
+        {
+            return false;
+        }
+        *this = preset;
+        return true;
+    }
+};
+
+// Frame-to-frame intervals of a loop, for the jitter report.
+class interval_stats
+{
+public:
+    void add(uint64_t now_us)
+    {
+        if (last_us) intervals.push_back((double)(now_us - last_us));
+        last_us = now_us;
+    }
+
+    size_t count() const { return intervals.size(); }
+
+    // mean, RMS deviation from it, 99th percentile and worst, in microseconds;
+    // starts a new period
+    void take(double & mean, double & rms, double & p99, double & worst)
+    {
+        mean = rms = p99 = worst = 0;
+        if (intervals.empty()) return;
+        for (double v : intervals) mean += v;
+        mean /= intervals.size();
+        for (double v : intervals) rms += (v - mean) * (v - mean);
+        rms = sqrt(rms / intervals.size());
+        std::sort(intervals.begin(), intervals.end());
+        p99 = intervals[intervals.size() * 99 / 100];
+        worst = intervals.back();
+        intervals.clear();
+    }
+
+private:
+    uint64_t last_us = 0;
+    std::vector<double> intervals;
+};
+
+#endif // THREAD_PLACEMENT_HPP
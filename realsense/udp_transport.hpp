@@ -0,0 +1,506 @@
+///////////////////
+// udp_transport //
+///////////////////
+
+// Frames over UDP, for a camera on the other side of a Wi-Fi link. Over TCP
+// one lost segment stalls the whole frame, and every frame queued behind it,
+// until it is retransmitted. Here each frame is cut into numbered datagrams
+// (server/udp_fragment.h), optionally with an XOR parity datagram per group
+// of fragments. The receiver rebuilds a lost fragment from its group where
+// it can. It gives up on a frame that is not complete by its deadline, or
+// once a newer frame has come in complete, since a late frame is of no use
+// to the headset anyway.
+//
+// udp_impairment drops, bursts and reorders datagrams on the sending side,
+// so all of this can be tried on loopback (`cpp-bench udp`).
+
+#ifndef UDP_TRANSPORT_HPP
+#define UDP_TRANSPORT_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "async_log.hpp"
+#include "server/udp_fragment.h"
+
+struct udp_impairment
+{
+    double loss      = 0;   // fraction of datagrams lost
+    double burst     = 1;   // mean length of a run of lost datagrams
+    double reorder   = 0;   // fraction of datagrams sent late
+    int reorder_depth = 8;  // by up to this many datagrams
+    uint32_t seed    = 1;
+
+    bool active() const { return loss > 0 || reorder > 0; }
+};
+
+// Cuts frames into datagrams and sends them on a connected UDP socket.
+class udp_frame_sender
+{
+public:
+    // fec_group data fragments per parity fragment, 0 for none
+    explicit udp_frame_sender(int fec_group = 0, int fragment_size = UDP_FRAGMENT_PAYLOAD)
+        : fec_group(std::max(0, std::min(fec_group, 255))), fragment_size(fragment_size) {}
+
+    ~udp_frame_sender() { close(); }
+
+    bool open(const std::string & host, const char *port)
+    {
+        close();
+        struct addrinfo hints, *servinfo;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        int rv = getaddrinfo(host.c_str(), port, &hints, &servinfo);
+        if (rv != 0)
+        {
+            ALOG_ERROR("udp: getaddrinfo: %s", gai_strerror(rv));
+            return false;
+        }
+        for (struct addrinfo *p = servinfo; p && sockfd == -1; p = p->ai_next)
+        {
+            sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+            if (sockfd != -1 && ::connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) close();
+        }
+        freeaddrinfo(servinfo);
+        if (sockfd == -1)
+        {
+            ALOG_ERROR("udp: cannot send to %s:%s: %s", host, port, strerror(errno));
+            return false;
+        }
+
+        // a frame goes out as one burst of datagrams
+        int bytes = 4 << 20;
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof bytes);
+        ALOG_INFO("udp: sending frames to %s:%s, %d byte fragments, %s", host, port, fragment_size,
+                  fec_group ? "parity every " + std::to_string(fec_group) : std::string("no parity"));
+        return true;
+    }
+
+    void close()
+    {
+        if (sockfd >= 0) ::close(sockfd);
+        sockfd = -1;
+    }
+
+    void set_impairment(const udp_impairment & i)
+    {
+        impairment = i;
+        rng.seed(i.seed);
+        bad_state = false;
+    }
+
+    // Send one frame. Only fails if the socket does; datagrams the network
+    // (or the impairment) loses are the receiver's problem.
+    bool send_frame(const uint8_t *data, size_t size)
+    {
+        if (sockfd < 0) return false;
+        const uint32_t count = udp_fragment_count((uint32_t)size, fragment_size);
+        if (count > 0xffff) return false;
+        const uint32_t groups = fec_group ? (count + fec_group - 1) / fec_group : 0;
+
+        headers.resize(count + groups);
+        parity.resize((size_t)groups * fragment_size);
+        std::fill(parity.begin(), parity.end(), 0);
+        datagrams.clear();
+
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            const size_t offset = (size_t)i * fragment_size;
+            const size_t length = std::min(size - std::min(size, offset), (size_t)fragment_size);
+            add_datagram(headers[i], 0, i, count, (uint32_t)size, data + offset, length);
+            if (!fec_group) continue;
+
+            uint8_t *p = &parity[(size_t)(i / fec_group) * fragment_size];
+            for (size_t k = 0; k < length; ++k) p[k] ^= data[offset + k];
+            if ((i + 1) % fec_group == 0 || i + 1 == count)
+            {
+                const uint32_t g = i / fec_group;
+                add_datagram(headers[count + g], UDP_FRAGMENT_PARITY, g, count, (uint32_t)size, p, fragment_size);
+            }
+        }
+        ++frame_id;
+
+        if (impairment.active()) impair();
+        return transmit();
+    }
+
+    unsigned long long datagrams_sent() const { return sent; }
+    unsigned long long datagrams_impaired() const { return impaired; }
+
+private:
+    struct datagram
+    {
+        const udp_fragment_header *header;
+        const uint8_t *payload;
+        size_t length;
+    };
+
+    int fec_group, fragment_size;
+    int sockfd = -1;
+    uint32_t frame_id = 0;
+    std::vector<udp_fragment_header> headers;
+    std::vector<uint8_t> parity;
+    std::vector<datagram> datagrams;
+    std::vector<struct mmsghdr> messages;
+    std::vector<struct iovec> iovecs;
+    unsigned long long sent = 0, impaired = 0;
+
+    udp_impairment impairment;
+    std::mt19937 rng;
+    bool bad_state = false;
+
+    void add_datagram(udp_fragment_header & h, uint8_t flags, uint32_t fragment, uint32_t count, uint32_t size,
+                      const uint8_t *payload, size_t length)
+    {
+        memset(&h, 0, sizeof h);
+        h.magic = UDP_FRAGMENT_MAGIC;
+        h.header_size = sizeof h;
+        h.flags = flags;
+        h.frame_id = frame_id;
+        h.frame_size = size;
+        h.fragment = (uint16_t)fragment;
+        h.fragment_count = (uint16_t)count;
+        h.fragment_size = (uint16_t)fragment_size;
+        h.fec_group = (uint8_t)fec_group;
+        datagram d = { &h, payload, length };
+        datagrams.push_back(d);
+    }
+
+    // Gilbert-Elliott loss: the bad state loses every datagram and lasts
+    // burst datagrams on average; it is entered often enough that the
+    // overall loss comes out at impairment.loss.
+    void impair()
+    {
+        std::uniform_real_distribution<double> uniform(0, 1);
+        const double burst = std::max(1.0, impairment.burst);
+        const double leave = 1 / burst;
+        const double enter = impairment.loss < 1 ? impairment.loss * leave / (1 - impairment.loss) : 1;
+
+        size_t kept = 0;
+        for (size_t i = 0; i < datagrams.size(); ++i)
+        {
+            bad_state = bad_state ? uniform(rng) >= leave : uniform(rng) < enter;
+            if (bad_state) ++impaired;
+            else datagrams[kept++] = datagrams[i];
+        }
+        datagrams.resize(kept);
+
+        for (size_t i = 0; i < datagrams.size(); ++i)
+        {
+            if (uniform(rng) >= impairment.reorder) continue;
+            const size_t later = i + 1 + rng() % std::max(1, impairment.reorder_depth);
+            if (later < datagrams.size()) std::swap(datagrams[i], datagrams[later]);
+        }
+    }
+
+    bool transmit()
+    {
+        messages.resize(datagrams.size());
+        iovecs.resize(datagrams.size() * 2);
+        for (size_t i = 0; i < datagrams.size(); ++i)
+        {
+            iovecs[2 * i].iov_base = const_cast<udp_fragment_header *>(datagrams[i].header);
+            iovecs[2 * i].iov_len = sizeof(udp_fragment_header);
+            iovecs[2 * i + 1].iov_base = const_cast<uint8_t *>(datagrams[i].payload);
+            iovecs[2 * i + 1].iov_len = datagrams[i].length;
+            memset(&messages[i], 0, sizeof messages[i]);
+            messages[i].msg_hdr.msg_iov = &iovecs[2 * i];
+            messages[i].msg_hdr.msg_iovlen = 2;
+        }
+
+        for (size_t i = 0; i < messages.size(); )
+        {
+            int n = sendmmsg(sockfd, &messages[i], (unsigned)std::min(messages.size() - i, (size_t)1024), 0);
+            if (n == -1)
+            {
+                if (errno == EINTR) continue;
+                // nobody listening (yet): the ICMP error of an earlier
+                // datagram; or no buffer space: the datagram is lost
+                if (errno == ECONNREFUSED || errno == ENOBUFS)
+                {
+                    ++i;
+                    continue;
+                }
+                ALOG_WARN("udp: send: %s", strerror(errno));
+                return false;
+            }
+            sent += n;
+            i += n;
+        }
+        return true;
+    }
+};
+
+static inline uint64_t udp_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Reassembles frames from the datagrams of one sender, newest first.
+class udp_frame_receiver
+{
+public:
+    // frames being reassembled at once; the oldest is given up for a new one
+    static const size_t SLOTS = 4;
+    static const uint32_t MAX_FRAME = 64 << 20;
+    static const int32_t RESTART_GAP = 1000;
+
+    struct stats
+    {
+        unsigned long long delivered = 0;   // frames handed on complete
+        unsigned long long recovered = 0;   // of those, frames that needed parity
+        unsigned long long late = 0;        // frames given up at their deadline
+        unsigned long long superseded = 0;  // frames given up for a newer one
+        unsigned long long ignored = 0;     // datagrams too late, repeated or malformed
+    };
+
+    explicit udp_frame_receiver(int deadline_ms = 50) : deadline_us((uint64_t)deadline_ms * 1000), slots(SLOTS) {}
+
+    ~udp_frame_receiver() { close(); }
+
+    // Listen on port, on host's address or every address with NULL.
+    bool open(const char *port, const char *host = NULL)
+    {
+        close();
+        struct addrinfo hints, *servinfo;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host, port, &hints, &servinfo) != 0) return false;
+        sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+        if (sockfd != -1 && bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) close();
+        freeaddrinfo(servinfo);
+        if (sockfd == -1) return false;
+
+        int bytes = 4 << 20;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof bytes);
+        return true;
+    }
+
+    void close()
+    {
+        if (sockfd >= 0) ::close(sockfd);
+        sockfd = -1;
+    }
+
+    int fd() const { return sockfd; }
+
+    // Read what has arrived, waiting up to timeout_ms for the first
+    // datagram, and pass every frame completed to
+    // sink(const uint8_t *data, size_t size, uint32_t frame_id).
+    template <class Sink>
+    void poll(int timeout_ms, Sink sink)
+    {
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        if (::poll(&pfd, 1, timeout_ms) > 0)
+        {
+            ssize_t n;
+            while ((n = recv(sockfd, datagram, sizeof datagram, MSG_DONTWAIT)) >= 0)
+                add(datagram, (size_t)n, udp_now_us(), sink);
+        }
+        expire(udp_now_us());
+    }
+
+    // One datagram received at now_us. For poll, and for tests without a
+    // socket.
+    template <class Sink>
+    void add(const uint8_t *data, size_t size, uint64_t now_us, Sink sink)
+    {
+        udp_fragment_header h;
+        if (size < sizeof h)
+        {
+            ++counts.ignored;
+            return;
+        }
+        memcpy(&h, data, sizeof h);
+
+        // a sender that started over counts from 0 again
+        if (have_delivered && (int32_t)(h.frame_id - last_delivered) < -RESTART_GAP) have_delivered = false;
+
+        const uint32_t groups = h.fec_group ? (h.fragment_count + h.fec_group - 1) / h.fec_group : 0;
+        const bool is_parity = (h.flags & UDP_FRAGMENT_PARITY) != 0;
+        if (h.magic != UDP_FRAGMENT_MAGIC || h.header_size < sizeof h || h.header_size > size || !h.fragment_size ||
+            h.frame_size > MAX_FRAME ||
+            h.fragment_count != udp_fragment_count(h.frame_size, h.fragment_size) ||
+            (is_parity ? h.fragment >= groups : h.fragment >= h.fragment_count) ||
+            (have_delivered && (int32_t)(h.frame_id - last_delivered) <= 0))
+        {
+            ++counts.ignored;
+            return;
+        }
+        const uint8_t *payload = data + h.header_size;
+        const size_t length = size - h.header_size;
+
+        slot *s = find(h, now_us);
+        if (!s) return;
+        if (is_parity)
+        {
+            if (length != h.fragment_size || s->have_parity[h.fragment])
+            {
+                ++counts.ignored;
+                return;
+            }
+            memcpy(&s->parity[(size_t)h.fragment * h.fragment_size], payload, length);
+            s->have_parity[h.fragment] = 1;
+            recover(*s, h.fragment);
+        }
+        else
+        {
+            if (length != fragment_length(*s, h.fragment) || s->have[h.fragment])
+            {
+                ++counts.ignored;
+                return;
+            }
+            memcpy(&s->data[(size_t)h.fragment * h.fragment_size], payload, length);
+            s->have[h.fragment] = 1;
+            ++s->received;
+            if (s->fec_group)
+            {
+                const uint32_t g = h.fragment / s->fec_group;
+                ++s->group_received[g];
+                recover(*s, g);
+            }
+        }
+
+        if (s->received == s->count)
+        {
+            have_delivered = true;
+            last_delivered = s->id;
+            ++counts.delivered;
+            if (s->recovered) ++counts.recovered;
+            s->used = false;
+            // anything older can only come out later than this one
+            for (slot & other : slots)
+            {
+                if (other.used && (int32_t)(other.id - s->id) < 0)
+                {
+                    other.used = false;
+                    ++counts.superseded;
+                }
+            }
+            sink(s->data.data(), (size_t)s->size, s->id);
+        }
+    }
+
+    // give up on frames past their deadline
+    void expire(uint64_t now_us)
+    {
+        for (slot & s : slots)
+        {
+            if (s.used && now_us - s.first_us > deadline_us)
+            {
+                s.used = false;
+                ++counts.late;
+            }
+        }
+    }
+
+    const stats & counters() const { return counts; }
+
+private:
+    struct slot
+    {
+        bool used = false, recovered = false;
+        uint32_t id = 0, size = 0, count = 0, received = 0;
+        uint16_t fragment_size = 0;
+        uint8_t fec_group = 0;
+        uint64_t first_us = 0;
+        std::vector<uint8_t> data, parity, have, have_parity;
+        std::vector<uint32_t> group_received;
+    };
+
+    uint64_t deadline_us;
+    int sockfd = -1;
+    std::vector<slot> slots;
+    bool have_delivered = false;
+    uint32_t last_delivered = 0;
+    stats counts;
+    uint8_t datagram[65536];
+
+    static size_t fragment_length(const slot & s, uint32_t fragment)
+    {
+        return std::min((size_t)s.size - (size_t)fragment * s.fragment_size, (size_t)s.fragment_size);
+    }
+
+    // the slot of the frame h belongs to, taking a free one or the oldest
+    // one for a new frame; buffers are reused from frame to frame
+    slot * find(const udp_fragment_header & h, uint64_t now_us)
+    {
+        slot *victim = NULL;
+        for (slot & s : slots)
+        {
+            if (s.used && s.id == h.frame_id)
+            {
+                if (s.size != h.frame_size || s.fragment_size != h.fragment_size || s.fec_group != h.fec_group)
+                {
+                    ++counts.ignored;
+                    return NULL;
+                }
+                return &s;
+            }
+            if (!victim || (victim->used && (!s.used || (int32_t)(s.id - victim->id) < 0))) victim = &s;
+        }
+
+        slot & s = *victim;
+        if (s.used) ++counts.superseded;
+        const uint32_t groups = h.fec_group ? (h.fragment_count + h.fec_group - 1) / h.fec_group : 0;
+        s.used = true;
+        s.recovered = false;
+        s.id = h.frame_id;
+        s.size = h.frame_size;
+        s.count = h.fragment_count;
+        s.received = 0;
+        s.fragment_size = h.fragment_size;
+        s.fec_group = h.fec_group;
+        s.first_us = now_us;
+        s.data.resize((size_t)s.count * s.fragment_size);
+        s.have.assign(s.count, 0);
+        s.parity.resize((size_t)groups * s.fragment_size);
+        s.have_parity.assign(groups, 0);
+        s.group_received.assign(groups, 0);
+        return &s;
+    }
+
+    // With the parity of group g and all but one of its fragments, the
+    // missing one is the XOR of the others and the parity.
+    void recover(slot & s, uint32_t g)
+    {
+        const uint32_t first = g * s.fec_group, end = std::min(first + s.fec_group, s.count);
+        if (!s.have_parity[g] || s.group_received[g] + 1 != end - first) return;
+
+        uint32_t missing = first;
+        while (s.have[missing]) ++missing;
+        uint8_t *out = &s.data[(size_t)missing * s.fragment_size];
+        const size_t length = fragment_length(s, missing);
+        memcpy(out, &s.parity[(size_t)g * s.fragment_size], length);
+        for (uint32_t i = first; i < end; ++i)
+        {
+            if (i == missing) continue;
+            const uint8_t *in = &s.data[(size_t)i * s.fragment_size];
+            const size_t n = std::min(length, fragment_length(s, i));
+            for (size_t k = 0; k < n; ++k) out[k] ^= in[k];
+        }
+        s.have[missing] = 1;
+        ++s.received;
+        ++s.group_received[g];
+        s.recovered = true;
+    }
+};
+
+#endif // UDP_TRANSPORT_HPP
@@ -0,0 +1,230 @@
+///////////////////
+// zerocopy_tx   //
+///////////////////
+
+// MSG_ZEROCOPY transmit for stream_link. A plain send copies every frame into
+// socket buffers; with MSG_ZEROCOPY the kernel pins the pages of the frame
+// buffer and sends from them, and reports on the socket's error queue when it
+// is done with them. Until then the buffer belongs to the kernel, so each
+// frame sent goes into a small pool of in-flight buffers and the capture loop
+// builds the next frame in a free one (send swaps them). When every buffer is
+// still out, the frame is copied like a plain send rather than waited for.
+//
+// Notifications are numbered by the kernel, one id per successful zerocopy
+// send call on the socket, starting at 0; a notification covers a range of
+// ids. SO_EE_CODE_ZEROCOPY_COPIED in it means the kernel copied after all,
+// which it always does on loopback and for devices without scatter-gather.
+// Kernels before 4.14 have no SO_ZEROCOPY at all, and stream_link then copies.
+
+#ifndef ZEROCOPY_TX_HPP
+#define ZEROCOPY_TX_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+class zerocopy_tx
+{
+public:
+    // Below this, pinning the pages and collecting the notification costs
+    // more than the copy.
+    static const size_t MIN_SIZE = 16384;
+
+    explicit zerocopy_tx(size_t max_in_flight = 4) : max_in_flight(max_in_flight) {}
+
+    // Turn MSG_ZEROCOPY on for a new connection. False, with errno set, if
+    // the kernel does not have it.
+    bool attach(int fd)
+    {
+        detach();
+        int one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == -1) return false;
+        sockfd = fd;
+        next_id = 0;
+        return true;
+    }
+
+    // The connection is about to be closed. A close still sends what is
+    // queued, from the pinned pages, so a buffer in flight must not be
+    // reused or freed (the allocator would hand its pages out again). This
+    // runs on the capture thread and does not wait for the kernel: if
+    // buffers are still out after collecting the notifications that have
+    // arrived, the connection is reset rather than closed, so the kernel
+    // drops what is queued instead of sending it. Their buffers are kept
+    // until the next reset, for anything already handed to the device, so
+    // at most one connection's worth is ever held. Returns how many buffers
+    // were still out.
+    size_t detach()
+    {
+        if (sockfd >= 0 && !in_flight.empty()) reap();
+        const size_t unsent = in_flight.size();
+        if (unsent > 0)
+        {
+            struct linger reset = { 1, 0 };
+            setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+            abandoned.clear();
+            for (pending & p : in_flight)
+            {
+                abandoned.push_back(std::vector<uint8_t>());
+                abandoned.back().swap(p.buffer);
+            }
+            in_flight.clear();
+        }
+        sockfd = -1;
+        return unsent;
+    }
+
+    bool attached() const { return sockfd >= 0; }
+
+    // Send the frame on the non-blocking socket, then swap in a free buffer
+    // for the next one; its contents are whatever the last frame in it was.
+    // What the socket does not take right away is appended to unsent, for
+    // the caller to send later. Never waits for the kernel: with all
+    // max_in_flight buffers still out, or no option memory left for the
+    // notifications, the frame is copied and stays with the caller.
+    // Returns 0, or -1 with errno set like send_all.
+    int send(std::vector<uint8_t> & frame, std::vector<uint8_t> & unsent)
+    {
+        reap();
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT | MSG_ZEROCOPY;
+        if (free_buffers.empty() && in_flight.size() >= max_in_flight)
+        {
+            flags &= ~MSG_ZEROCOPY;
+            ++frames_copied;
+        }
+
+        const uint8_t *p = frame.data();
+        size_t len = frame.size();
+        const uint32_t first = next_id;
+        while (len > 0)
+        {
+            ssize_t n = ::send(sockfd, p, len, flags);
+            if (n == -1)
+            {
+                if (errno == EINTR) continue;
+                if (errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+                {
+                    flags &= ~MSG_ZEROCOPY;
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+                unsent.insert(unsent.end(), p, p + len);
+                break;
+            }
+            if (flags & MSG_ZEROCOPY) ++next_id;
+            p += n;
+            len -= n;
+        }
+        ++frames_sent;
+
+        if (next_id == first) return 0;
+
+        in_flight.push_back(pending());
+        in_flight.back().first = first;
+        in_flight.back().last = next_id - 1;
+        in_flight.back().remaining = next_id - first;
+        in_flight.back().buffer.swap(frame);
+
+        // with no free buffer the pool grows by this one, up to max_in_flight
+        if (!free_buffers.empty())
+        {
+            frame.swap(free_buffers.back());
+            free_buffers.pop_back();
+        }
+        return 0;
+    }
+
+    // Collect the notifications that have arrived. True if any did.
+    bool reap()
+    {
+        bool any = false;
+        for (;;)
+        {
+            char control[128];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof msg);
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof control;
+            if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) return any;
+
+            for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+            {
+                if (!(c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) &&
+                    !(c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))
+                    continue;
+                struct sock_extended_err err;
+                memcpy(&err, CMSG_DATA(c), sizeof err);
+                if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                complete(err.ee_info, err.ee_data, (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+                any = true;
+            }
+        }
+    }
+
+    // frames sent, frames copied because every buffer was still out, and
+    // zerocopy send calls the kernel reported as done and as copied anyway
+    unsigned long long frames() const { return frames_sent; }
+    unsigned long long frames_pool_full() const { return frames_copied; }
+    unsigned long long completed() const { return sends_completed; }
+    unsigned long long copied() const { return sends_copied; }
+    size_t buffers_in_flight() const { return in_flight.size(); }
+    size_t buffers_abandoned() const { return abandoned.size(); }
+
+private:
+    struct pending
+    {
+        uint32_t first, last, remaining;
+        std::vector<uint8_t> buffer;
+    };
+
+    size_t max_in_flight;
+    int sockfd = -1;
+    uint32_t next_id = 0;
+    std::deque<pending> in_flight;
+    std::vector<std::vector<uint8_t>> free_buffers, abandoned;
+    unsigned long long frames_sent = 0, frames_copied = 0, sends_completed = 0, sends_copied = 0;
+
+    // notifications for send ids lo to hi, inclusive
+    void complete(uint32_t lo, uint32_t hi, bool copied)
+    {
+        sends_completed += hi - lo + 1;
+        if (copied) sends_copied += hi - lo + 1;
+        for (size_t i = 0; i < in_flight.size(); )
+        {
+            pending & p = in_flight[i];
+            const uint32_t from = std::max(lo, p.first), to = std::min(hi, p.last);
+            if (from <= to) p.remaining -= to - from + 1;
+            if (p.remaining == 0)
+            {
+                free_buffers.push_back(std::vector<uint8_t>());
+                free_buffers.back().swap(p.buffer);
+                in_flight.erase(in_flight.begin() + i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+};
+
+#endif // ZEROCOPY_TX_HPP
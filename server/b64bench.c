@@ -0,0 +1,150 @@
+/*
+b64bench.c - scalar vs vectorised libb64 on frame-sized buffers
+
+Encodes and decodes one 640x480 RGB frame of pseudo-random bytes through the
+streaming libb64 API, first with the vectorised paths disabled and then with
+them enabled, checks that both produce identical output that round-trips,
+and prints the throughput of each.
+
+	make bench
+	./b64bench [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libb64-1.2/include/b64/cencode.h"
+#include "libb64-1.2/include/b64/cdecode.h"
+#include "base64_simd.h"
+
+#define FRAME_SIZE (640*480*3)
+/* the streaming API is fed in chunks like a socket reader would */
+#define CHUNK_SIZE 65536
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int encode(const char* in, int length, char* out)
+{
+	base64_encodestate state;
+	char* p = out;
+	int offset;
+
+	base64_init_encodestate(&state);
+	for (offset = 0; offset < length; offset += CHUNK_SIZE)
+	{
+		int n = length - offset < CHUNK_SIZE ? length - offset : CHUNK_SIZE;
+		p += base64_encode_block(in + offset, n, p, &state);
+	}
+	p += base64_encode_blockend(p, &state);
+	return p - out;
+}
+
+static int decode(const char* in, int length, char* out)
+{
+	base64_decodestate state;
+	char* p = out;
+	int offset;
+
+	base64_init_decodestate(&state);
+	for (offset = 0; offset < length; offset += CHUNK_SIZE)
+	{
+		int n = length - offset < CHUNK_SIZE ? length - offset : CHUNK_SIZE;
+		p += base64_decode_block(in + offset, n, p, &state);
+	}
+	return p - out;
+}
+
+struct result
+{
+	double encode_s, decode_s;
+	int code_length, plain_length;
+};
+
+static struct result run(const char* frame, int length, char* code, char* plain, int iterations)
+{
+	struct result r;
+	double start;
+	int i;
+
+	start = now_s();
+	for (i = 0; i < iterations; ++i)
+		r.code_length = encode(frame, length, code);
+	r.encode_s = (now_s() - start) / iterations;
+
+	start = now_s();
+	for (i = 0; i < iterations; ++i)
+		r.plain_length = decode(code, r.code_length, plain);
+	r.decode_s = (now_s() - start) / iterations;
+	return r;
+}
+
+static void report(const char* name, struct result r, int length)
+{
+	printf("%-8s encode %7.3f ms %8.1f MB/s   decode %7.3f ms %8.1f MB/s\n", name,
+		r.encode_s * 1e3, length / r.encode_s / 1e6,
+		r.decode_s * 1e3, length / r.decode_s / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 100;
+	/* every frame length from FRAME_SIZE-2 up, so all three tails are covered */
+	int tails[] = { FRAME_SIZE, FRAME_SIZE - 1, FRAME_SIZE - 2 };
+	char* frame = malloc(FRAME_SIZE);
+	char* scalar_code = malloc(FRAME_SIZE * 2);
+	char* simd_code = malloc(FRAME_SIZE * 2);
+	char* plain = malloc(FRAME_SIZE);
+	unsigned seed = 12345;
+	struct result scalar, simd;
+	int i, t, failed = 0;
+
+	if (iterations < 1) iterations = 1;
+	for (i = 0; i < FRAME_SIZE; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		frame[i] = (char)(seed >> 16);
+	}
+
+	for (t = 0; t < 3; ++t)
+	{
+		int length = tails[t];
+
+		base64_simd_enable(0);
+		scalar = run(frame, length, scalar_code, plain, t == 0 ? iterations : 1);
+		base64_simd_enable(1);
+		simd = run(frame, length, simd_code, plain, t == 0 ? iterations : 1);
+
+		if (scalar.code_length != simd.code_length || memcmp(scalar_code, simd_code, simd.code_length) != 0)
+		{
+			printf("length %d: vectorised encoding differs from scalar\n", length);
+			failed = 1;
+		}
+		if (simd.plain_length != length || memcmp(plain, frame, length) != 0)
+		{
+			printf("length %d: round trip failed\n", length);
+			failed = 1;
+		}
+
+		if (t == 0)
+		{
+			printf("%d byte frame, %d iterations, %s\n", length, iterations, base64_simd_name());
+			report("scalar", scalar, length);
+			report(base64_simd_name(), simd, length);
+			printf("speedup  encode %.1fx   decode %.1fx\n",
+				scalar.encode_s / simd.encode_s, scalar.decode_s / simd.decode_s);
+		}
+	}
+
+	free(frame);
+	free(scalar_code);
+	free(simd_code);
+	free(plain);
+	return failed;
+}
@@ -0,0 +1,353 @@
+/*
+base64_simd.c - vectorised inner loops for the libb64 encoder and decoder
+
+Encoding follows Wojciech Mula's pshufb/multiply-shift method on x86: the
+3-byte groups are spread into 32-bit lanes, the four 6-bit indices are
+extracted with two multiplies, and a 16-entry pshufb table turns indices into
+characters. Decoding classifies each character by range (A-Z, a-z, 0-9, +, /)
+with compares, which also validates the block, and packs the 6-bit values
+back with multiply-adds. NEON uses the interleaving loads/stores instead of
+shuffles and the same range arithmetic.
+*/
+
+#include "base64_simd.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BASE64_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BASE64_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef int (*encode_fn)(const char*, int, char*);
+typedef int (*decode_fn)(const char*, int, char*);
+
+static int encode_none(const char* in, int length, char* out)
+{
+	(void)in; (void)length; (void)out;
+	return 0;
+}
+
+static int decode_none(const char* in, int length, char* out)
+{
+	(void)in; (void)length; (void)out;
+	return 0;
+}
+
+#if BASE64_SIMD_X86
+
+/* code character offsets indexed by the range of a 6-bit value:
+   26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12, 0..25 -> 13 */
+#define BASE64_OFFSETS 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+
+/* spreads the 3-byte groups in the low 12 bytes of a lane into 32-bit words */
+#define BASE64_SPREAD 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+
+/* gathers three bytes out of every 32-bit word into the low 12 bytes */
+#define BASE64_GATHER 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static inline __m128i encode_lane_ssse3(__m128i src)
+{
+	__m128i in = _mm_shuffle_epi8(src, _mm_setr_epi8(BASE64_SPREAD));
+	__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	__m128i indices = _mm_or_si128(t0, t1);
+	__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+	return _mm_add_epi8(_mm_shuffle_epi8(_mm_setr_epi8(BASE64_OFFSETS), range), indices);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i encode_lane_avx2(__m256i src)
+{
+	__m256i in = _mm256_shuffle_epi8(src, _mm256_setr_epi8(BASE64_SPREAD, BASE64_SPREAD));
+	__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+	__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+	__m256i indices = _mm256_or_si256(t0, t1);
+	__m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+	range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+	return _mm256_add_epi8(_mm256_shuffle_epi8(_mm256_setr_epi8(BASE64_OFFSETS, BASE64_OFFSETS), range), indices);
+}
+
+__attribute__((target("ssse3")))
+static int encode_ssse3(const char* in, int length, char* out)
+{
+	int done = 0;
+
+	/* each step loads 16 bytes but only consumes 12 */
+	while (length - done >= 16)
+	{
+		__m128i src = _mm_loadu_si128((const __m128i*)(in + done));
+		_mm_storeu_si128((__m128i*)out, encode_lane_ssse3(src));
+		done += 12;
+		out += 16;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static int encode_avx2(const char* in, int length, char* out)
+{
+	int done = 0;
+
+	/* 24 bytes per step, 12 per lane; the upper lane's load reaches byte 28 */
+	while (length - done >= 28)
+	{
+		__m128i lo = _mm_loadu_si128((const __m128i*)(in + done));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(in + done + 12));
+		__m256i src = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		_mm256_storeu_si256((__m256i*)out, encode_lane_avx2(src));
+		done += 24;
+		out += 32;
+	}
+	return done + encode_ssse3(in + done, length - done, out);
+}
+
+/* Characters -> 6-bit values, classified by range. Bytes >= 0x80 compare as
+   negative and so fall in no range. *valid gets 0xff for every character of
+   the alphabet. */
+__attribute__((target("ssse3")))
+static inline __m128i decode_values_ssse3(__m128i c, __m128i* valid)
+{
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+	__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i plus  = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+	__m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+	__m128i shift = _mm_or_si128(
+		_mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+		_mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+			_mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')), _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+	*valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+	return _mm_add_epi8(c, shift);
+}
+
+/* four 6-bit values per 32-bit word -> three bytes, in the low 12 bytes */
+__attribute__((target("ssse3")))
+static inline __m128i decode_pack_ssse3(__m128i values)
+{
+	__m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	__m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(words, _mm_setr_epi8(BASE64_GATHER));
+}
+
+/* store exactly 12 bytes, so the output buffer needs no slack */
+static inline void store12(char* out, __m128i v)
+{
+	uint32_t tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	_mm_storel_epi64((__m128i*)out, v);
+	memcpy(out + 8, &tail, 4);
+}
+
+__attribute__((target("ssse3")))
+static int decode_ssse3(const char* in, int length, char* out)
+{
+	int done = 0;
+
+	while (length - done >= 16)
+	{
+		__m128i valid;
+		__m128i values = decode_values_ssse3(_mm_loadu_si128((const __m128i*)(in + done)), &valid);
+		if (_mm_movemask_epi8(valid) != 0xffff) break;
+		store12(out, decode_pack_ssse3(values));
+		done += 16;
+		out += 12;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static int decode_avx2(const char* in, int length, char* out)
+{
+	int done = 0;
+
+	while (length - done >= 32)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i*)(in + done));
+		__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+		__m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+		__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+		__m256i plus  = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('+'));
+		__m256i slash = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'));
+		__m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+		if (_mm256_movemask_epi8(valid) != -1) break;
+
+		__m256i shift = _mm256_or_si256(
+			_mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')), _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+			_mm256_or_si256(_mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+				_mm256_or_si256(_mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')), _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')))));
+		__m256i values = _mm256_add_epi8(c, shift);
+		__m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+		__m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+		__m256i packed = _mm256_shuffle_epi8(words, _mm256_setr_epi8(BASE64_GATHER, BASE64_GATHER));
+		store12(out, _mm256_castsi256_si128(packed));
+		store12(out + 12, _mm256_extracti128_si256(packed, 1));
+		done += 32;
+		out += 24;
+	}
+	return done + decode_ssse3(in + done, length - done, out);
+}
+
+#endif /* BASE64_SIMD_X86 */
+
+#if BASE64_SIMD_NEON
+
+static inline uint8x16_t neon_encode_chars(uint8x16_t i)
+{
+	/* start from 'A' + i and correct the offset for each higher range */
+	uint8x16_t r = vaddq_u8(i, vdupq_n_u8('A'));
+	r = vaddq_u8(r, vandq_u8(vcgeq_u8(i, vdupq_n_u8(26)), vdupq_n_u8('a' - 26 - 'A')));
+	r = vaddq_u8(r, vandq_u8(vcgeq_u8(i, vdupq_n_u8(52)), vdupq_n_u8((uint8_t)(('0' - 52) - ('a' - 26)))));
+	r = vaddq_u8(r, vandq_u8(vcgeq_u8(i, vdupq_n_u8(62)), vdupq_n_u8((uint8_t)(('+' - 62) - ('0' - 52)))));
+	r = vaddq_u8(r, vandq_u8(vceqq_u8(i, vdupq_n_u8(63)), vdupq_n_u8((uint8_t)(('/' - 63) - ('+' - 62)))));
+	return r;
+}
+
+static int encode_neon(const char* in, int length, char* out)
+{
+	const uint8x16_t mask = vdupq_n_u8(0x3f);
+	int done = 0;
+
+	while (length - done >= 48)
+	{
+		uint8x16x3_t src = vld3q_u8((const uint8_t*)in + done);
+		uint8x16x4_t idx;
+		idx.val[0] = vshrq_n_u8(src.val[0], 2);
+		idx.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(src.val[0], 4), vshrq_n_u8(src.val[1], 4)), mask);
+		idx.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(src.val[1], 2), vshrq_n_u8(src.val[2], 6)), mask);
+		idx.val[3] = vandq_u8(src.val[2], mask);
+		idx.val[0] = neon_encode_chars(idx.val[0]);
+		idx.val[1] = neon_encode_chars(idx.val[1]);
+		idx.val[2] = neon_encode_chars(idx.val[2]);
+		idx.val[3] = neon_encode_chars(idx.val[3]);
+		vst4q_u8((uint8_t*)out, idx);
+		done += 48;
+		out += 64;
+	}
+	return done;
+}
+
+static inline uint8x16_t neon_in_range(uint8x16_t c, uint8_t lo, uint8_t hi)
+{
+	return vandq_u8(vcgeq_u8(c, vdupq_n_u8(lo)), vcleq_u8(c, vdupq_n_u8(hi)));
+}
+
+static inline uint8x16_t neon_decode_values(uint8x16_t c, uint8x16_t* invalid)
+{
+	uint8x16_t upper = neon_in_range(c, 'A', 'Z');
+	uint8x16_t lower = neon_in_range(c, 'a', 'z');
+	uint8x16_t digit = neon_in_range(c, '0', '9');
+	uint8x16_t plus  = vceqq_u8(c, vdupq_n_u8('+'));
+	uint8x16_t slash = vceqq_u8(c, vdupq_n_u8('/'));
+	uint8x16_t shift = vorrq_u8(
+		vorrq_u8(vandq_u8(upper, vdupq_n_u8((uint8_t)-'A')), vandq_u8(lower, vdupq_n_u8((uint8_t)(26 - 'a')))),
+		vorrq_u8(vandq_u8(digit, vdupq_n_u8((uint8_t)(52 - '0'))),
+			vorrq_u8(vandq_u8(plus, vdupq_n_u8((uint8_t)(62 - '+'))), vandq_u8(slash, vdupq_n_u8((uint8_t)(63 - '/'))))));
+	uint8x16_t valid = vorrq_u8(vorrq_u8(upper, lower), vorrq_u8(digit, vorrq_u8(plus, slash)));
+	*invalid = vorrq_u8(*invalid, vmvnq_u8(valid));
+	return vaddq_u8(c, shift);
+}
+
+static int decode_neon(const char* in, int length, char* out)
+{
+	int done = 0;
+
+	while (length - done >= 64)
+	{
+		uint8x16x4_t c = vld4q_u8((const uint8_t*)in + done);
+		uint8x16_t invalid = vdupq_n_u8(0);
+		uint8x16_t v0 = neon_decode_values(c.val[0], &invalid);
+		uint8x16_t v1 = neon_decode_values(c.val[1], &invalid);
+		uint8x16_t v2 = neon_decode_values(c.val[2], &invalid);
+		uint8x16_t v3 = neon_decode_values(c.val[3], &invalid);
+
+		uint64x2_t any = vreinterpretq_u64_u8(invalid);
+		if (vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) break;
+
+		uint8x16x3_t plain;
+		plain.val[0] = vorrq_u8(vshlq_n_u8(v0, 2), vshrq_n_u8(v1, 4));
+		plain.val[1] = vorrq_u8(vshlq_n_u8(v1, 4), vshrq_n_u8(v2, 2));
+		plain.val[2] = vorrq_u8(vshlq_n_u8(v2, 6), v3);
+		vst3q_u8((uint8_t*)out, plain);
+		done += 64;
+		out += 48;
+	}
+	return done;
+}
+
+#endif /* BASE64_SIMD_NEON */
+
+/* The best implementation for this CPU is found once, under pthread_once, so
+   parallel encoders starting together never see a half-written choice and
+   the pointers are never rewritten afterwards. base64_simd_enable only flips
+   an atomic flag that each call reads once to pick between the two. */
+struct impl
+{
+	encode_fn encode;
+	decode_fn decode;
+	const char* name;
+};
+
+static const struct impl scalar_impl = { encode_none, decode_none, "scalar" };
+static struct impl best_impl;
+static pthread_once_t best_once = PTHREAD_ONCE_INIT;
+static int simd_enabled = 1;
+
+static void select_impl(void)
+{
+	best_impl = scalar_impl;
+
+#if BASE64_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		best_impl.encode = encode_avx2;
+		best_impl.decode = decode_avx2;
+		best_impl.name = "avx2";
+	}
+	else if (__builtin_cpu_supports("ssse3"))
+	{
+		best_impl.encode = encode_ssse3;
+		best_impl.decode = decode_ssse3;
+		best_impl.name = "ssse3";
+	}
+#elif BASE64_SIMD_NEON
+	best_impl.encode = encode_neon;
+	best_impl.decode = decode_neon;
+	best_impl.name = "neon";
+#endif
+}
+
+static const struct impl* current_impl(void)
+{
+	pthread_once(&best_once, select_impl);
+	if (!__atomic_load_n(&simd_enabled, __ATOMIC_RELAXED)) return &scalar_impl;
+	return &best_impl;
+}
+
+int base64_encode_simd(const char* plaintext_in, int length_in, char* code_out)
+{
+	return current_impl()->encode(plaintext_in, length_in, code_out);
+}
+
+int base64_decode_simd(const char* code_in, int length_in, char* plaintext_out)
+{
+	return current_impl()->decode(code_in, length_in, plaintext_out);
+}
+
+int base64_simd_enable(int enabled)
+{
+	return __atomic_exchange_n(&simd_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+const char* base64_simd_name(void)
+{
+	return current_impl()->name;
+}
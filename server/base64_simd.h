@@ -0,0 +1,35 @@
+/*
+base64_simd.h - vectorised inner loops for the libb64 encoder and decoder
+
+These only ever handle whole groups (3 plain bytes <-> 4 code characters) in
+the middle of a stream; base64_encode_block and base64_decode_block call them
+when their state machine is at a group boundary and finish the tail with the
+scalar code, so the streaming state API is unchanged.
+
+The implementation is picked at run time on x86 (AVX2, then SSSE3) and at
+compile time on ARM (NEON). Without any of them both functions return 0.
+All functions here may be called from several threads at once.
+*/
+
+#ifndef BASE64_SIMD_H
+#define BASE64_SIMD_H
+
+/* Encode a prefix of plaintext_in[0..length_in). Returns the number of plain
+   bytes consumed, always a multiple of 3; code_out receives 4/3 as many. */
+int base64_encode_simd(const char* plaintext_in, int length_in, char* code_out);
+
+/* Decode a prefix of code_in[0..length_in), stopping before the first block
+   that contains anything but the 64 code characters (padding, newlines, ...).
+   Returns the number of code characters consumed, always a multiple of 4;
+   plaintext_out receives 3/4 as many bytes. */
+int base64_decode_simd(const char* code_in, int length_in, char* plaintext_out);
+
+/* Enable or disable the vectorised paths, e.g. to benchmark against the
+   scalar code. Returns the previous setting. Safe while other threads are
+   encoding: each call uses one implementation from start to end. */
+int base64_simd_enable(int enabled);
+
+/* Name of the implementation in use: "avx2", "ssse3", "neon" or "scalar". */
+const char* base64_simd_name(void);
+
+#endif /* BASE64_SIMD_H */
@@ -0,0 +1,300 @@
+/*
+bridgebench.cpp - serial to WebSocket latency of the IMU bridges
+
+Plays the Teensy on a pseudo terminal: writes binary IMU packets
+(vrduino/ImuPacket.h) of quaternion samples at 1 kHz, starts a bridge on the
+other end of the pty, connects to it like a browser does and times every
+sample from the write of its packet to the arrival of the WebSocket message
+holding its line. Reports the median, 99th percentile and maximum latency,
+and the messages per second the browser has to handle.
+
+Without a command it runs imubridge with -c 0 (a message per read) and with
+the default 2 ms coalescing, for packets of 1 and of 4 samples. A command
+is run instead with the tty appended, e.g. for the node bridge:
+
+	make bench
+	./bridgebench [-n samples] [-p port] [command ...]
+	./bridgebench -p 8081 node server.js
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ImuPacket.h"
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int recv_all(int sockfd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = recv(sockfd, p, len, 0);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// A browser: the opening handshake, then text messages. -1 if the bridge is
+// not (yet) listening.
+static int ws_connect(const char *port)
+{
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", port, &hints, &info) != 0) return -1;
+    int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd == -1 || connect(fd, info->ai_addr, info->ai_addrlen) == -1) {
+        if (fd != -1) close(fd);
+        freeaddrinfo(info);
+        return -1;
+    }
+    freeaddrinfo(info);
+
+    char request[256];
+    int n = snprintf(request, sizeof request,
+        "GET / HTTP/1.1\r\n"
+        "Host: 127.0.0.1:%s\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n", port);
+    if (send(fd, request, n, MSG_NOSIGNAL) != n) {
+        close(fd);
+        return -1;
+    }
+
+    char response[1024];
+    size_t len = 0;
+    while (len < sizeof response - 1) {
+        if (recv_all(fd, response + len, 1) == -1) break;
+        len++;
+        if (len >= 4 && !memcmp(response + len - 4, "\r\n\r\n", 4)) break;
+    }
+    response[len] = 0;
+    // RFC 6455 example key and its accept value
+    if (strncmp(response, "HTTP/1.1 101", 12) != 0 || !strstr(response, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")) {
+        fprintf(stderr, "bridgebench: websocket handshake failed\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// One message; returns the opcode, -1 when the connection is gone.
+static int ws_read(int fd, std::vector<char> &payload)
+{
+    uint8_t head[10];
+    if (recv_all(fd, head, 2) == -1) return -1;
+    uint64_t len = head[1] & 0x7f;
+    if (len == 126) {
+        if (recv_all(fd, head + 2, 2) == -1) return -1;
+        len = (uint64_t)head[2] << 8 | head[3];
+    } else if (len == 127) {
+        if (recv_all(fd, head + 2, 8) == -1) return -1;
+        len = 0;
+        for (int i = 0; i < 8; i++) len = len << 8 | head[2 + i];
+    }
+    payload.resize(len);
+    if (len && recv_all(fd, payload.data(), len) == -1) return -1;
+    return head[0] & 0x0f;
+}
+
+struct result
+{
+    std::vector<double> latencies_us;
+    unsigned long messages;
+    double seconds;
+};
+
+static result run(const std::vector<std::string> &command, const char *port, int samples, int batch)
+{
+    result r;
+    r.messages = 0;
+    r.seconds = 0;
+
+    int master, slave;
+    char tty[256];
+    if (openpty(&master, &slave, tty, NULL, NULL) == -1) {
+        perror("openpty");
+        return r;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::vector<char *> argv;
+        for (size_t i = 0; i < command.size(); i++) argv.push_back(const_cast<char *>(command[i].c_str()));
+        argv.push_back(tty);
+        argv.push_back(NULL);
+        close(master);
+        // no keyboard for the bridge, and its chatter stays out of the table
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        execvp(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    int fd = -1;
+    for (int tries = 0; tries < 300 && fd == -1; tries++) {
+        fd = ws_connect(port);
+        if (fd == -1) usleep(10000);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "bridgebench: no bridge on port %s\n", port);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        close(master);
+        close(slave);
+        return r;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    std::vector<uint64_t> written(samples, 0), received(samples, 0);
+    std::thread reader([&] {
+        std::vector<char> payload;
+        int next = 0;
+        while (next < samples) {
+            int opcode = ws_read(fd, payload);
+            if (opcode == -1 || opcode == 8) break;
+            if (opcode != 1) continue;
+            const uint64_t now = monotonic_us();
+            r.messages++;
+            // count the estimates; a sample is the n-th QC line. server.js
+            // sends each line as a JSON string, in quotes.
+            for (size_t p = 0; p + 2 < payload.size() + 1; ) {
+                size_t end = std::find(payload.begin() + p, payload.end(), '\n') - payload.begin();
+                const size_t q = p < end && payload[p] == '"' ? p + 1 : p;
+                if (end - q > 3 && payload[q] == 'Q' && payload[q + 1] == 'C' && next < samples)
+                    received[next++] = now;
+                p = end + 1;
+            }
+        }
+    });
+
+    // let the bridge settle before the clock starts
+    usleep(100000);
+
+    ImuPacketWriter writer;
+    uint8_t frame[IMU_PACKET_MAX_FRAME];
+    const uint64_t start = monotonic_us();
+    int pending_first = 0;
+    for (int i = 0; i < samples; i++) {
+        const uint64_t due = start + (uint64_t)i * 1000;
+        while (monotonic_us() < due) {}
+
+        const double angle = i * 0.001;
+        const float q[4] = { (float)cos(angle / 2), 0, (float)sin(angle / 2), 0 };
+        writer.add(IMU_PACKET_QUATERNION, (uint32_t)(due - start), q);
+        if (writer.samples() < batch && i + 1 < samples) continue;
+
+        size_t n = writer.frame(frame);
+        const uint64_t now = monotonic_us();
+        if (write(master, frame, n) != (ssize_t)n) break;
+        for (int k = pending_first; k <= i; k++) written[k] = now;
+        pending_first = i + 1;
+    }
+
+    // the last messages get half a second
+    const uint64_t deadline = monotonic_us() + 500000;
+    while (monotonic_us() < deadline && received[samples - 1] == 0) usleep(1000);
+    r.seconds = (monotonic_us() - start) / 1e6;
+
+    shutdown(fd, SHUT_RDWR);
+    reader.join();
+    close(fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(master);
+    close(slave);
+
+    for (int i = 0; i < samples; i++)
+        if (received[i] && written[i]) r.latencies_us.push_back((double)(received[i] - written[i]));
+    return r;
+}
+
+static void report(const char *name, int batch, int samples, result r)
+{
+    if (r.latencies_us.empty()) {
+        printf("%-24s %5d %10s\n", name, batch, "failed");
+        return;
+    }
+    std::sort(r.latencies_us.begin(), r.latencies_us.end());
+    const size_t n = r.latencies_us.size();
+    printf("%-24s %5d %10.0f %10.0f %10.0f %10.0f %8zu/%d\n", name, batch, r.latencies_us[n / 2],
+           r.latencies_us[n * 99 / 100], r.latencies_us[n - 1], r.messages / r.seconds, n, samples);
+}
+
+int main(int argc, char *argv[])
+{
+    int samples = 5000;
+    const char *port = "18081";
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        if (i + 1 >= argc) break;
+        if (!strcmp(argv[i], "-n")) samples = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-p")) port = argv[i + 1];
+        else break;
+    }
+    if (samples <= 0 || (i < argc && argv[i][0] == '-')) {
+        fprintf(stderr, "usage: %s [-n samples] [-p port] [command ...]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%d quaternion samples at 1 kHz through a pty\n\n", samples);
+    printf("%-24s %5s %10s %10s %10s %10s %10s\n", "bridge", "batch", "p50 us", "p99 us", "max us",
+           "msgs/s", "received");
+
+    bool ok = true;
+    const int batches[] = { 1, 4 };
+    if (i < argc) {
+        std::vector<std::string> command(argv + i, argv + argc);
+        for (int batch : batches) report(argv[i], batch, samples, run(command, port, samples, batch));
+        return 0;
+    }
+
+    const char *coalesce[] = { "0", "2000" };
+    for (const char *c : coalesce) {
+        for (int batch : batches) {
+            std::vector<std::string> command = { "./imubridge", "-P", "0", "-p", port, "-c", c };
+            std::string name = std::string("imubridge -c ") + c;
+            result r = run(command, port, samples, batch);
+            ok = ok && r.latencies_us.size() == (size_t)samples;
+            report(name.c_str(), batch, samples, r);
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -6,6 +6,7 @@ For details, see http://sourceforge.net/projects/libb64
 */
 
 #include <b64/cdecode.h>
+#include "base64_simd.h"
 
 int base64_decode_value(char value_in)
 {
@@ -35,11 +36,20 @@ int base64_decode_block(const char* code_in, const int length_in, char* plaintex
 		while (1)
 		{
 	case step_a:
+			/* whole blocks in bulk, up to the first padding or line break */
+			if (code_in+length_in - codechar >= 16)
+			{
+				int consumed = base64_decode_simd(codechar, code_in+length_in - codechar, plainchar);
+				codechar += consumed;
+				plainchar += consumed/4*3;
+			}
 			do {
 				if (codechar == code_in+length_in)
 				{
+					/* no partial byte is pending here, and plainchar may
+					   be one past the end of an exactly sized buffer */
 					state_in->step = step_a;
-					state_in->plainchar = *plainchar;
+					state_in->plainchar = 0;
 					return plainchar - plaintext_out;
 				}
 				fragment = (char)base64_decode_value(*codechar++);
@@ -6,6 +6,7 @@ For details, see http://sourceforge.net/projects/libb64
 */
 
 #include <b64/cencode.h>
+#include "base64_simd.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -40,6 +41,18 @@ int base64_encode_block(const char* plaintext_in, int length_in, char* code_out,
 		while (1)
 		{
 	case step_A:
+			/* whole groups in bulk, stopping one group short of a line break */
+			if (plaintextend - plainchar >= 16)
+			{
+				int groups = CHARS_PER_LINE/4 - 1 - state_in->stepcount;
+				int length = plaintextend - plainchar;
+				int consumed;
+				if (length > groups*3) length = groups*3;
+				consumed = base64_encode_simd(plainchar, length, codechar);
+				plainchar += consumed;
+				codechar += consumed/3*4;
+				state_in->stepcount += consumed/3;
+			}
 			if (plainchar == plaintextend)
 			{
 				state_in->result = result;
@@ -0,0 +1,94 @@
+/*
+frame_header.h - header prepended to every image tile sent to the node server
+
+Frames are sent as one or more tiles. A tile covers a rectangle of the full
+frame, possibly subsampled: each payload pixel stands for scale x scale frame
+pixels. The receiver composites tiles into its copy of the frame and treats the
+frame as complete once the tile with FRAME_TILE_LAST arrives.
+
+All fields are little endian. header_size lets receivers skip fields they do
+not know about, so new fields must only ever be appended.
+*/
+
+#ifndef FRAME_HEADER_H
+#define FRAME_HEADER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define FRAME_MAGIC 0x314d5246 /* "FRM1" */
+
+enum frame_stream
+{
+	FRAME_STREAM_RGB   = 1,
+	FRAME_STREAM_DEPTH = 2,
+	FRAME_STREAM_OCCLUSION = 3	/* bit-packed occlusion mask, see realsense/occlusion_mask.hpp */
+};
+
+enum frame_flags
+{
+	FRAME_TILE_LAST = 1,	/* last tile of this frame */
+	FRAME_TILE_ROI  = 2,	/* tile is the client's region of interest */
+	FRAME_TILE_BASE64 = 4,	/* payload is base64 text; payload_size counts the text */
+	FRAME_TILE_POSE = 8,	/* pose holds the head orientation at timestamp_us */
+	FRAME_TILE_RLE  = 16	/* occlusion payload is run-length coded instead of bit-packed */
+};
+
+/* head pose at capture time, from the IMU (realsense/pose_sync.hpp) */
+struct frame_pose
+{
+	float    q[4];		/* orientation quaternion, w x y z */
+	uint32_t span_us;	/* gap between the IMU samples it was interpolated from */
+	uint32_t sync_us;	/* residual of the IMU clock fit; how far off its time may be */
+};
+
+struct frame_header
+{
+	uint32_t magic;
+	uint16_t header_size;	/* bytes before the payload */
+	uint8_t  stream;	/* enum frame_stream */
+	uint8_t  channels;	/* bytes per pixel */
+	uint32_t sequence;	/* frame number, shared by all tiles of a frame */
+	uint16_t frame_width;
+	uint16_t frame_height;
+	uint16_t x, y;		/* region covered by the tile, in frame pixels */
+	uint16_t width, height;
+	uint8_t  scale;		/* subsampling factor of the payload */
+	uint8_t  flags;		/* enum frame_flags */
+	uint16_t reserved;
+	uint32_t payload_size;	/* bytes following the header */
+	uint64_t timestamp_us;	/* capture time, CLOCK_MONOTONIC */
+	struct frame_pose pose;	/* valid with FRAME_TILE_POSE */
+};
+
+/* bytes per payload row of an occlusion tile: one bit per pixel, rows padded
+   to whole bytes, pixel x in bit (x & 7) of byte x >> 3 */
+static inline uint32_t frame_mask_row_bytes(uint32_t width)
+{
+	return (width + 7) / 8;
+}
+
+/* payload pixels along one axis of a tile of the given extent */
+static inline uint32_t frame_tile_extent(uint32_t extent, uint32_t scale)
+{
+	return (extent + scale - 1) / scale;
+}
+
+static inline void frame_header_init(struct frame_header* header, uint8_t stream, uint8_t channels,
+	uint16_t frame_width, uint16_t frame_height)
+{
+	memset(header, 0, sizeof *header);
+	header->magic = FRAME_MAGIC;
+	header->header_size = sizeof *header;
+	header->stream = stream;
+	header->channels = channels;
+	header->frame_width = frame_width;
+	header->frame_height = frame_height;
+	header->width = frame_width;
+	header->height = frame_height;
+	header->scale = 1;
+	header->flags = FRAME_TILE_LAST;
+	header->payload_size = (uint32_t)frame_width * frame_height * channels;
+}
+
+#endif /* FRAME_HEADER_H */
@@ -0,0 +1,176 @@
+/**
+ * @file Decoder for the binary IMU stream of the VRduino sketch
+ * The packet layout is documented in vrduino/ImuPacket.h. Frames are COBS
+ * encoded and end with a 0 byte; each packet holds a CRC-16/CCITT-FALSE.
+ */
+
+/* Packet types, equal to the streaming modes of the sketch */
+var TYPES = {
+
+	1: { name: "EC", values: 3 },
+	2: { name: "QC", values: 4, quaternion: true },
+	3: { name: "GYR", values: 3 },
+	4: { name: "ACC", values: 3 },
+	5: { name: "MAG", values: 3 },
+	6: { name: "GYRINT", values: 3 },
+	8: { name: "RAW", values: 9 },
+	9: { name: "QP", values: 8, quaternion: true },
+
+};
+
+var HEADER_SIZE = 8;
+
+/* 8 RAW samples of 2 + 36 bytes, CRC; COBS adds a byte per 254 */
+var MAX_SIZE = HEADER_SIZE + 8 * 38 + 2;
+
+var MAX_FRAME = MAX_SIZE + Math.floor( MAX_SIZE / 254 ) + 1;
+
+function crc16( bytes, end ) {
+
+	var crc = 0xffff;
+
+	for ( var i = 0; i < end; i ++ ) {
+
+		crc ^= bytes[ i ] << 8;
+
+		for ( var bit = 0; bit < 8; bit ++ ) {
+
+			crc = ( crc & 0x8000 ) ? ( ( crc << 1 ) ^ 0x1021 ) & 0xffff : ( crc << 1 ) & 0xffff;
+
+		}
+
+	}
+
+	return crc;
+
+}
+
+/* Returns the decoded bytes, or null for a malformed frame */
+function cobsDecode( frame ) {
+
+	var out = Buffer.alloc( frame.length );
+	var i = 0, o = 0;
+
+	while ( i < frame.length ) {
+
+		var run = frame[ i ++ ];
+
+		if ( run === 0 || i + run - 1 > frame.length ) return null;
+
+		for ( var k = 1; k < run; k ++ ) out[ o ++ ] = frame[ i ++ ];
+
+		if ( run !== 0xff && i < frame.length ) out[ o ++ ] = 0;
+
+	}
+
+	return out.slice( 0, o );
+
+}
+
+/**
+ * Parses one frame without its delimiter.
+ * Returns { type, name, sequence, samples: [ { time, values } ] } or null.
+ */
+function parseFrame( frame ) {
+
+	var packet = cobsDecode( frame );
+
+	if ( packet === null || packet.length < HEADER_SIZE + 2 ) return null;
+
+	if ( crc16( packet, packet.length - 2 ) !== packet.readUInt16LE( packet.length - 2 ) ) return null;
+
+	var type = TYPES[ packet[ 0 ] ];
+	var count = packet[ 1 ];
+
+	if ( type === undefined || count < 1 || count > 8 ) return null;
+
+	var valueSize = type.quaternion ? 2 : 4;
+	var sampleSize = 2 + type.values * valueSize;
+
+	if ( packet.length !== HEADER_SIZE + count * sampleSize + 2 ) return null;
+
+	var firstTime = packet.readUInt32LE( 4 );
+	var samples = [];
+	var p = HEADER_SIZE;
+
+	for ( var s = 0; s < count; s ++ ) {
+
+		var sample = { time: ( firstTime + packet.readUInt16LE( p ) ) >>> 0, values: [] };
+		p += 2;
+
+		for ( var v = 0; v < type.values; v ++ ) {
+
+			sample.values.push( valueSize === 2 ? packet.readInt16LE( p ) / 16384 : packet.readFloatLE( p ) );
+			p += valueSize;
+
+		}
+
+		samples.push( sample );
+
+	}
+
+	return { type: packet[ 0 ], name: type.name, sequence: packet.readUInt16LE( 2 ), samples: samples };
+
+}
+
+/**
+ * Splits a byte stream into packets. onPacket gets each valid packet,
+ * onBadFrame (optional) the raw bytes of everything else, e.g. text the
+ * sketch printed before switching to binary.
+ */
+function Decoder( onPacket, onBadFrame ) {
+
+	var pending = [];
+	var pendingLength = 0;
+
+	this.push = function ( data ) {
+
+		var start = 0;
+
+		for ( var i = 0; i < data.length; i ++ ) {
+
+			if ( data[ i ] !== 0 ) continue;
+
+			pending.push( data.slice( start, i ) );
+			var frame = Buffer.concat( pending );
+			pending = [];
+			pendingLength = 0;
+			start = i + 1;
+
+			if ( frame.length === 0 ) continue;
+
+			var packet = frame.length <= MAX_FRAME ? parseFrame( frame ) : null;
+
+			if ( packet !== null ) {
+
+				onPacket( packet );
+
+			} else if ( onBadFrame ) {
+
+				onBadFrame( frame );
+
+			}
+
+		}
+
+		if ( start < data.length ) {
+
+			pending.push( data.slice( start ) );
+			pendingLength += data.length - start;
+
+			/* text output has no delimiters; do not let it pile up */
+			if ( pendingLength > 4096 ) {
+
+				if ( onBadFrame ) onBadFrame( Buffer.concat( pending ) );
+				pending = [];
+				pendingLength = 0;
+
+			}
+
+		}
+
+	};
+
+}
+
+module.exports = { Decoder: Decoder, parseFrame: parseFrame };
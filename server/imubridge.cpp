@@ -0,0 +1,584 @@
+/*
+imubridge.cpp - native serial to WebSocket bridge for the VRduino IMU stream
+
+Does what server.js does for the binary stream (vrduino/ImuPacket.h), with
+less latency on the way: the tty is opened raw with low-latency settings,
+every read is stamped with CLOCK_MONOTONIC as it returns, and packets are
+decoded in place (vrduino/host/ImuDecoder.h). The browsers on the WebSocket
+port get the same text lines server.js sends ("QC w x y z", and "QC" plus
+"QP" for predicted poses), several per message: samples are collected for
+at most -c microseconds after the first one arrived, then broadcast as one
+message with the lines separated by '\n' (js/axisRender.js takes either).
+The camera's pose feed (realsense/pose_sync.hpp) gets its POSE lines on
+-P as it does from server.js.
+
+All buffers are allocated up front. A message is framed once and sent to
+every client with a non-blocking send; what a client cannot take right away
+waits in its fixed outbox, and a client whose outbox overflows is dropped.
+Keys typed on a terminal go to the Teensy, as with server.js.
+
+	imubridge [-p 8081] [-P 3493] [-c 2000] <tty>
+
+-c 0 sends every read as soon as it is decoded; -P 0 disables the pose feed.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#include "ImuDecoder.h"
+
+extern "C" {
+#include "libb64-1.2/include/b64/cencode.h"
+}
+
+#define MAX_CLIENTS 16
+#define OUTBOX_SIZE 65536
+#define MESSAGE_SIZE 16384
+// a name and up to 9 values, with room to spare
+#define MAX_LINE 160
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+//================= Serial port =====================
+
+// Raw 8N1, reads return as soon as there is a byte. On a real UART the
+// driver is also asked for low latency, which drops the up to 10 ms the
+// FTDI-style drivers otherwise hold bytes back; USB CDC (the Teensy) and
+// ptys do not support it, which is fine.
+static int open_serial(const char *path)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, B115200);
+        cfsetospeed(&tio, B115200);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cc[VMIN] = 1;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+#ifdef __linux__
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+#endif
+    tcflush(fd, TCIFLUSH);
+    return fd;
+}
+
+
+//================= WebSocket handshake =====================
+
+static uint32_t rol(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+// SHA-1, only for Sec-WebSocket-Accept
+static void sha1(const uint8_t *data, size_t length, uint8_t digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    uint8_t block[64];
+    const uint64_t bits = (uint64_t)length * 8;
+    const size_t total = (length + 9 + 63) / 64 * 64;
+
+    for (size_t offset = 0; offset < total; offset += 64) {
+        for (int i = 0; i < 64; i++) {
+            size_t p = offset + i;
+            if (p < length) block[i] = data[p];
+            else if (p == length) block[i] = 0x80;
+            else if (p >= total - 8) block[i] = (uint8_t)(bits >> (8 * (total - 1 - p)));
+            else block[i] = 0;
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+                   (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5a827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ed9eba1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+            else { f = b ^ c ^ d; k = 0xca62c1d6; }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rol(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (int i = 0; i < 20; i++) digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+// Sec-WebSocket-Accept for a key: base64(sha1(key + GUID)), 28 characters
+static void websocket_accept(const char *key, size_t key_length, char out[29])
+{
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char joined[128];
+    if (key_length > sizeof joined - sizeof guid) key_length = sizeof joined - sizeof guid;
+    memcpy(joined, key, key_length);
+    memcpy(joined + key_length, guid, sizeof guid - 1);
+
+    uint8_t digest[20];
+    sha1((const uint8_t *)joined, key_length + sizeof guid - 1, digest);
+
+    base64_encodestate state;
+    base64_init_encodestate(&state);
+    int n = base64_encode_block((const char *)digest, 20, out, &state);
+    n += base64_encode_blockend(out + n, &state) - 1;  // without its newline
+    out[n] = 0;
+}
+
+
+//================= Clients =====================
+
+enum client_kind { CLIENT_NONE, CLIENT_WEBSOCKET, CLIENT_POSE };
+
+struct client
+{
+    int fd;
+    enum client_kind kind;
+    int open;             // websocket: handshake done
+    char request[1024];   // websocket: handshake, then incoming frames
+    size_t request_length;
+    uint8_t outbox[OUTBOX_SIZE];
+    size_t outbox_start, outbox_length;
+};
+
+static struct client clients[MAX_CLIENTS];
+
+static void drop_client(struct client *c, const char *why)
+{
+    printf("%s client dropped: %s\n", c->kind == CLIENT_POSE ? "pose" : "websocket", why);
+    close(c->fd);
+    c->fd = -1;
+    c->kind = CLIENT_NONE;
+}
+
+// Send what the outbox holds, then as much of data as the socket takes, and
+// keep the rest. Returns -1 if the client was dropped.
+static int client_send(struct client *c, const void *data, size_t length)
+{
+    while (c->outbox_length > 0) {
+        const size_t chunk = c->outbox_start + c->outbox_length > OUTBOX_SIZE
+                           ? OUTBOX_SIZE - c->outbox_start : c->outbox_length;
+        ssize_t n = send(c->fd, c->outbox + c->outbox_start, chunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n <= 0) {
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+            drop_client(c, "send failed");
+            return -1;
+        }
+        c->outbox_start = (c->outbox_start + n) % OUTBOX_SIZE;
+        c->outbox_length -= n;
+    }
+
+    const uint8_t *p = (const uint8_t *)data;
+    if (c->outbox_length == 0) {
+        while (length > 0) {
+            ssize_t n = send(c->fd, p, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n <= 0) {
+                if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+                drop_client(c, "send failed");
+                return -1;
+            }
+            p += n;
+            length -= n;
+        }
+    }
+
+    if (length > OUTBOX_SIZE - c->outbox_length) {
+        drop_client(c, "not reading");
+        return -1;
+    }
+    for (size_t i = 0; i < length; i++)
+        c->outbox[(c->outbox_start + c->outbox_length + i) % OUTBOX_SIZE] = p[i];
+    c->outbox_length += length;
+    return 0;
+}
+
+static void accept_client(int listener, enum client_kind kind)
+{
+    int fd = accept(listener, NULL, NULL);
+    if (fd == -1) return;
+
+    struct client *c = NULL;
+    for (int i = 0; i < MAX_CLIENTS && !c; i++)
+        if (clients[i].kind == CLIENT_NONE) c = &clients[i];
+    if (!c) {
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    c->fd = fd;
+    c->kind = kind;
+    c->open = kind == CLIENT_POSE;
+    c->request_length = 0;
+    c->outbox_start = c->outbox_length = 0;
+    printf("%s client connected\n", kind == CLIENT_POSE ? "pose" : "websocket");
+}
+
+// The opening handshake; the request path and any subprotocols are ignored.
+static void websocket_handshake(struct client *c)
+{
+    c->request[c->request_length] = 0;
+    if (!strstr(c->request, "\r\n\r\n")) {
+        if (c->request_length == sizeof c->request - 1) drop_client(c, "request too long");
+        return;
+    }
+
+    const char *key = strcasestr(c->request, "Sec-WebSocket-Key:");
+    if (!key) {
+        drop_client(c, "not a websocket request");
+        return;
+    }
+    key += strlen("Sec-WebSocket-Key:");
+    while (*key == ' ') key++;
+    size_t key_length = strcspn(key, "\r\n ");
+
+    char accept_key[29];
+    websocket_accept(key, key_length, accept_key);
+    char response[256];
+    int n = snprintf(response, sizeof response,
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "\r\n", accept_key);
+
+    size_t used = strstr(c->request, "\r\n\r\n") + 4 - c->request;
+    memmove(c->request, c->request + used, c->request_length - used);
+    c->request_length -= used;
+    c->open = 1;
+    client_send(c, response, n);
+}
+
+// Frames from the browser: answer pings and closes, ignore the rest (the
+// text it sends on open).
+static void websocket_frames(struct client *c)
+{
+    uint8_t *buf = (uint8_t *)c->request;
+    while (c->request_length >= 2) {
+        const int opcode = buf[0] & 0x0f;
+        size_t length = buf[1] & 0x7f, head = 2;
+        if (length == 126) {
+            if (c->request_length < 4) return;
+            length = (size_t)buf[2] << 8 | buf[3];
+            head = 4;
+        } else if (length == 127) {
+            drop_client(c, "message too long");
+            return;
+        }
+        if (buf[1] & 0x80) head += 4;
+        if (head + length > sizeof c->request) {
+            drop_client(c, "message too long");
+            return;
+        }
+        if (c->request_length < head + length) return;
+
+        uint8_t *payload = buf + head;
+        if (buf[1] & 0x80)
+            for (size_t i = 0; i < length; i++) payload[i] ^= buf[head - 4 + (i & 3)];
+
+        if (opcode == 8) {
+            uint8_t reply[2] = { 0x88, 0 };
+            client_send(c, reply, 2);
+            drop_client(c, "closed");
+            return;
+        }
+        if (opcode == 9 && length <= 125) {
+            uint8_t pong[2 + 125] = { 0x8a, (uint8_t)length };
+            memcpy(pong + 2, payload, length);
+            if (client_send(c, pong, 2 + length) == -1) return;
+        }
+
+        memmove(buf, buf + head + length, c->request_length - head - length);
+        c->request_length -= head + length;
+    }
+}
+
+static void read_client(struct client *c)
+{
+    ssize_t n = recv(c->fd, c->request + c->request_length, sizeof c->request - 1 - c->request_length, 0);
+    if (n <= 0) {
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+        drop_client(c, "disconnected");
+        return;
+    }
+    if (c->kind == CLIENT_POSE) {
+        c->request_length = 0;  // the feed only goes one way
+        return;
+    }
+    c->request_length += n;
+    if (!c->open) websocket_handshake(c);
+    if (c->kind != CLIENT_NONE && c->open) websocket_frames(c);
+}
+
+static int listen_on(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(fd, 8) == -1) {
+        fprintf(stderr, "cannot listen on port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+//================= Messages =====================
+
+// the line names of server/imuPacket.js, by packet type
+static const char *packet_name(uint8_t type)
+{
+    switch (type) {
+    case IMU_PACKET_EULER: return "EC";
+    case IMU_PACKET_QUATERNION: return "QC";
+    case IMU_PACKET_GYR: return "GYR";
+    case IMU_PACKET_ACC: return "ACC";
+    case IMU_PACKET_MAG: return "MAG";
+    case IMU_PACKET_GYRINT: return "GYRINT";
+    case IMU_PACKET_RAW: return "RAW";
+    case IMU_PACKET_QUATERNION_PREDICTED: return "QP";
+    }
+    return "?";
+}
+
+// Lines waiting to go out as one message, behind room for the largest
+// WebSocket header, so the frame is built in place.
+struct message
+{
+    uint8_t buffer[10 + MESSAGE_SIZE];
+    size_t length;          // of the text
+    uint64_t first_us;      // arrival of its first sample
+    unsigned long samples;
+};
+
+// the caller makes sure there are MAX_LINE bytes left
+static void append_line(struct message *m, const char *name, const float *values, int count, int quaternion)
+{
+    char *p = (char *)m->buffer + 10 + m->length;
+    if (m->length > 0) *p++ = '\n';
+    p += sprintf(p, "%s", name);
+    for (int i = 0; i < count; i++)
+        p += sprintf(p, quaternion ? " %.5f" : " %.6g", values[i]);
+    m->length = p - ((char *)m->buffer + 10);
+}
+
+// Frame the text as one unmasked WebSocket text message and send it to every
+// open browser.
+static void broadcast(struct message *m, unsigned long *messages)
+{
+    if (m->length == 0) return;
+
+    uint8_t *start;
+    if (m->length < 126) {
+        start = m->buffer + 8;
+        start[1] = (uint8_t)m->length;
+    } else {
+        start = m->buffer + 6;
+        start[1] = 126;
+        start[2] = (uint8_t)(m->length >> 8);
+        start[3] = (uint8_t)m->length;
+    }
+    start[0] = 0x81;
+    const size_t total = m->buffer + 10 + m->length - start;
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].kind == CLIENT_WEBSOCKET && clients[i].open) client_send(&clients[i], start, total);
+
+    m->length = 0;
+    m->samples = 0;
+    ++*messages;
+}
+
+static void send_pose(uint32_t device_us, uint64_t host_us, const float *q)
+{
+    char line[MAX_LINE];
+    int n = snprintf(line, sizeof line, "POSE %lu %llu %.5f %.5f %.5f %.5f\n", (unsigned long)device_us,
+                     (unsigned long long)host_us, q[0], q[1], q[2], q[3]);
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].kind == CLIENT_POSE) client_send(&clients[i], line, n);
+}
+
+
+//================= Main loop =====================
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int ws_port = 8081, pose_port = 3493;
+    long coalesce_us = 2000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:P:c:")) != -1) {
+        if (opt == 'p') ws_port = atoi(optarg);
+        else if (opt == 'P') pose_port = atoi(optarg);
+        else if (opt == 'c') coalesce_us = atol(optarg);
+        else optind = argc + 1;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-p websocket port] [-P pose port, 0 for none] [-c coalesce us] <tty>\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    int serial = open_serial(argv[optind]);
+    int ws_listener = listen_on(ws_port);
+    int pose_listener = pose_port ? listen_on(pose_port) : -1;
+    if (serial == -1 || ws_listener == -1 || (pose_port && pose_listener == -1)) return 1;
+    for (int i = 0; i < MAX_CLIENTS; i++) clients[i].fd = -1;
+
+    // keys go to the Teensy unbuffered, as with server.js
+    struct termios saved_tio;
+    const int keyboard = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved_tio) == 0;
+    if (keyboard) {
+        struct termios tio = saved_tio;
+        tio.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+    }
+
+    printf("bridging %s to websocket port %d", argv[optind], ws_port);
+    if (pose_listener != -1) printf(", poses on %d", pose_port);
+    printf(", coalescing %ld us\n", coalesce_us);
+    fflush(stdout);
+
+    static ImuDecoder decoder;
+    static struct message message;
+    static uint8_t input[4096];
+    unsigned long messages = 0;
+
+    while (!stop_requested) {
+        struct pollfd fds[4 + MAX_CLIENTS];
+        int n = 0;
+        fds[n++] = { serial, POLLIN, 0 };
+        fds[n++] = { ws_listener, POLLIN, 0 };
+        fds[n++] = { pose_listener, (short)(pose_listener != -1 ? POLLIN : 0), 0 };
+        fds[n++] = { keyboard ? STDIN_FILENO : -1, POLLIN, 0 };
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            short events = clients[i].outbox_length ? POLLIN | POLLOUT : POLLIN;
+            fds[n++] = { clients[i].kind != CLIENT_NONE ? clients[i].fd : -1, events, 0 };
+        }
+
+        // wake up when the pending message is due
+        int timeout = -1;
+        if (message.samples > 0) {
+            const uint64_t now = monotonic_us(), due = message.first_us + coalesce_us;
+            timeout = due > now ? (int)((due - now + 999) / 1000) : 0;
+        }
+        if (poll(fds, n, timeout) == -1 && errno != EINTR) break;
+
+        if (fds[0].revents & POLLIN) {
+            ssize_t got = read(serial, input, sizeof input);
+            const uint64_t arrival = monotonic_us();
+            if (got <= 0 && !(got == -1 && (errno == EAGAIN || errno == EINTR))) {
+                fprintf(stderr, "serial port closed\n");
+                break;
+            }
+
+            const uint8_t *data = input;
+            size_t size = got > 0 ? (size_t)got : 0;
+            ImuPacketContents packet;
+            while (decoder.next(data, size, packet)) {
+                const int count = imuPacketValueCount(packet.type);
+                const int quaternion = imuPacketIsQuaternion(packet.type);
+                const bool predicted = packet.type == IMU_PACKET_QUATERNION_PREDICTED;
+                for (int s = 0; s < packet.count; s++) {
+                    const ImuPacketSample &sample = packet.samples[s];
+                    if (quaternion) send_pose(sample.time, arrival, sample.values);
+
+                    if (message.length + 2 * MAX_LINE > MESSAGE_SIZE) broadcast(&message, &messages);
+                    if (message.samples == 0) message.first_us = arrival;
+                    if (predicted) {
+                        // the estimate and the pose predicted for display, as two lines
+                        append_line(&message, "QC", sample.values, 4, 1);
+                        append_line(&message, "QP", sample.values + 4, 4, 1);
+                    } else {
+                        append_line(&message, packet_name(packet.type), sample.values, count, quaternion);
+                    }
+                    message.samples++;
+                }
+            }
+            if (coalesce_us <= 0) broadcast(&message, &messages);
+        }
+        if (message.samples > 0 && monotonic_us() >= message.first_us + coalesce_us) broadcast(&message, &messages);
+
+        if (fds[1].revents & POLLIN) accept_client(ws_listener, CLIENT_WEBSOCKET);
+        if (fds[2].revents & POLLIN) accept_client(pose_listener, CLIENT_POSE);
+        if (fds[3].revents & POLLIN) {
+            char keys[64];
+            ssize_t k = read(STDIN_FILENO, keys, sizeof keys);
+            if (k > 0 && write(serial, keys, k) != k) fprintf(stderr, "cannot write to the serial port\n");
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            struct client *c = &clients[i];
+            const short revents = fds[4 + i].revents;
+            if (c->kind == CLIENT_NONE || fds[4 + i].fd != c->fd) continue;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) read_client(c);
+            if (c->kind != CLIENT_NONE && (revents & POLLOUT)) client_send(c, NULL, 0);
+        }
+    }
+
+    if (keyboard) tcsetattr(STDIN_FILENO, TCSANOW, &saved_tio);
+    const ImuDecoderStats &stats = decoder.stats();
+    printf("%llu packets, %llu samples in %lu messages, %llu bad frames, %llu lost packets\n",
+           (unsigned long long)stats.packets, (unsigned long long)stats.samples, messages,
+           (unsigned long long)stats.badFrames, (unsigned long long)stats.lostPackets);
+    return 0;
+}
@@ -9,6 +9,7 @@ For details, see http://sourceforge.net/projects/libb64
 #define BASE64_DECODE_H
 
 #include <iostream>
+#include <vector>
 
 namespace base64
 {
@@ -21,6 +22,8 @@ namespace base64
 	{
 		base64_decodestate _state;
 		int _buffersize;
+		// stream buffers, allocated on first use and reused
+		std::vector<char> _code, _plaintext;
 
 		decoder(int buffersize_in = BUFFERSIZE)
 		: _buffersize(buffersize_in)
@@ -41,8 +44,10 @@ namespace base64
 			base64_init_decodestate(&_state);
 			//
 			const int N = _buffersize;
-			char* code = new char[N];
-			char* plaintext = new char[N];
+			_code.resize(N);
+			_plaintext.resize(N);
+			char* code = &_code[0];
+			char* plaintext = &_plaintext[0];
 			int codelength;
 			int plainlength;
 
@@ -56,9 +61,6 @@ namespace base64
 			while (istream_in.good() && codelength > 0);
 			//
 			base64_init_decodestate(&_state);
-
-			delete [] code;
-			delete [] plaintext;
 		}
 	};
 
@@ -9,6 +9,7 @@ For details, see http://sourceforge.net/projects/libb64
 #define BASE64_ENCODE_H
 
 #include <iostream>
+#include <vector>
 
 namespace base64
 {
@@ -21,6 +22,8 @@ namespace base64
 	{
 		base64_encodestate _state;
 		int _buffersize;
+		// stream buffers, allocated on first use and reused
+		std::vector<char> _plaintext, _code;
 
 		encoder(int buffersize_in = BUFFERSIZE)
 		: _buffersize(buffersize_in)
@@ -46,8 +49,10 @@ namespace base64
 			base64_init_encodestate(&_state);
 			//
 			const int N = _buffersize;
-			char* plaintext = new char[N];
-			char* code = new char[2*N];
+			_plaintext.resize(N);
+			_code.resize(2*N);
+			char* plaintext = &_plaintext[0];
+			char* code = &_code[0];
 			int plainlength;
 			int codelength;
 
@@ -65,9 +70,6 @@ namespace base64
 			ostream_in.write(code, codelength);
 			//
 			base64_init_encodestate(&_state);
-
-			delete [] code;
-			delete [] plaintext;
 		}
 	};
 
@@ -0,0 +1,223 @@
+// :mode=c++:
+/*
+span.h - allocation-free c++ interface to the base64 encoder and decoder
+
+encode() and decode() work on caller-provided buffers and never allocate.
+parallel_encoder encodes a frame in chunks on worker threads, into a fixed
+ring of slots that it allocates once, and hands each chunk to a sink (e.g. a
+socket send) in order while the following chunks are still being encoded.
+Chunks start on 3-byte boundaries, so they encode independently and their
+concatenation is the encoding of the whole frame.
+
+The output has no line breaks as long as the input stays below the libb64
+line length (7.5 MB per encode() call or chunk).
+*/
+#ifndef BASE64_SPAN_H
+#define BASE64_SPAN_H
+
+#include <stddef.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace base64
+{
+	extern "C"
+	{
+		#include "cencode.h"
+		#include "cdecode.h"
+	}
+
+	struct const_span
+	{
+		const char* data;
+		size_t size;
+	};
+
+	struct span
+	{
+		char* data;
+		size_t size;
+	};
+
+	// code characters for size plain bytes, including padding
+	inline size_t encoded_size(size_t size)
+	{
+		return (size + 2) / 3 * 4;
+	}
+
+	// upper bound on the plain bytes decoded from size code characters
+	inline size_t decoded_size(size_t size)
+	{
+		return (size + 3) / 4 * 3;
+	}
+
+	// Encode all of in, padded and without a trailing newline. Returns the
+	// number of characters written, or -1 if out is too small.
+	inline long encode(const_span in, span out)
+	{
+		if (out.size < encoded_size(in.size)) return -1;
+
+		base64_encodestate state;
+		base64_init_encodestate(&state);
+		long length = base64_encode_block(in.data, (int)in.size, out.data, &state);
+
+		// base64_encode_blockend always ends with a newline; drop it
+		char tail[4];
+		int tail_length = base64_encode_blockend(tail, &state) - 1;
+		memcpy(out.data + length, tail, tail_length);
+		return length + tail_length;
+	}
+
+	// Decode all of in, skipping anything outside the alphabet. Returns the
+	// number of bytes written, or -1 if out is too small. out may be exactly
+	// decoded_size(in.size) bytes; nothing past that is read or written.
+	inline long decode(const_span in, span out)
+	{
+		if (in.size == 0) return 0;
+		if (out.size < decoded_size(in.size)) return -1;
+
+		base64_decodestate state;
+		base64_init_decodestate(&state);
+		return base64_decode_block(in.data, (int)in.size, out.data, &state);
+	}
+
+	class parallel_encoder
+	{
+	public:
+		// threads == 0 encodes on the calling thread. chunk_size is rounded
+		// down to a multiple of 3.
+		explicit parallel_encoder(int threads = 2, size_t chunk_size = 3 * 16384, int slots = 8)
+		: chunk_size(chunk_size < 3 ? 3 : chunk_size / 3 * 3), ring(slots > 0 ? slots : 1)
+		{
+			for (size_t i = 0; i < ring.size(); ++i)
+				ring[i].code.resize(encoded_size(this->chunk_size));
+			for (int i = 0; i < threads; ++i)
+				workers.push_back(std::thread(&parallel_encoder::work, this));
+		}
+
+		~parallel_encoder()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			work_ready.notify_all();
+			for (size_t i = 0; i < workers.size(); ++i)
+				workers[i].join();
+		}
+
+		// Encode in and pass the code to sink(const char* data, size_t size)
+		// chunk by chunk, in order. Stops at the first chunk sink returns
+		// false for, and returns false. Not reentrant.
+		template <class Sink>
+		bool encode(const_span in, Sink sink)
+		{
+			long total = (long)((in.size + chunk_size - 1) / chunk_size);
+			if (workers.empty())
+			{
+				slot & s = ring[0];
+				for (long c = 0; c < total; ++c)
+					if (!sink(s.code.data(), encode_chunk(in, c, s))) return false;
+				return true;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				input = in;
+				chunks = total;
+				next_chunk = 0;
+				released = 0;
+				for (size_t i = 0; i < ring.size(); ++i)
+					ring[i].chunk = -1;
+			}
+			work_ready.notify_all();
+
+			bool ok = true;
+			for (long c = 0; c < total; ++c)
+			{
+				slot & s = ring[c % ring.size()];
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					chunk_done.wait(lock, [&] { return s.chunk == c; });
+				}
+
+				if (ok) ok = sink(s.code.data(), s.length);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				released = c + 1;
+				if (!ok)
+				{
+					// claim nothing new, but wait for chunks already being
+					// encoded before the input goes away
+					chunks = next_chunk;
+					total = chunks;
+				}
+				work_ready.notify_all();
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			chunks = 0;
+			return ok;
+		}
+
+		// the worker threads, to pin them to cores
+		size_t thread_count() const { return workers.size(); }
+		std::thread::native_handle_type native_handle(size_t i) { return workers[i].native_handle(); }
+
+	private:
+		struct slot
+		{
+			std::vector<char> code;
+			size_t length = 0;
+			long chunk = -1;	// chunk whose code the slot holds
+		};
+
+		size_t chunk_size;
+		std::vector<slot> ring;
+		std::vector<std::thread> workers;
+
+		std::mutex mutex;
+		std::condition_variable work_ready, chunk_done;
+		const_span input = const_span();
+		long chunks = 0, next_chunk = 0, released = 0;
+		bool stopping = false;
+
+		size_t encode_chunk(const_span in, long c, slot & s)
+		{
+			size_t offset = (size_t)c * chunk_size;
+			size_t size = in.size - offset < chunk_size ? in.size - offset : chunk_size;
+			const_span part = { in.data + offset, size };
+			span out = { s.code.data(), s.code.size() };
+			return (size_t)base64::encode(part, out);
+		}
+
+		void work()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (;;)
+			{
+				// a chunk may only be claimed once its slot has been sent
+				work_ready.wait(lock, [&] {
+					return stopping || (next_chunk < chunks && next_chunk < released + (long)ring.size());
+				});
+				if (stopping) return;
+
+				long c = next_chunk++;
+				slot & s = ring[c % ring.size()];
+				const_span in = input;
+				lock.unlock();
+				size_t length = encode_chunk(in, c, s);
+				lock.lock();
+				s.length = length;
+				s.chunk = c;
+				chunk_done.notify_all();
+			}
+		}
+	};
+
+} // namespace base64
+
+#endif // BASE64_SPAN_H
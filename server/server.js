@@ -23,8 +23,16 @@ Stanford Junior University
 /* Import serialport library */
 const SerialPort = require( "serialport" );
 
-/* Put your serial port name here */
-const portName = "/dev/cu.usbmodem2815011";
+/* Put your serial port name here, or pass it as the first argument */
+const portName = process.argv[ 2 ] || "/dev/cu.usbmodem2815011";
+
+/**
+ * Set to match binaryStream in vrduino.ino. Binary packets are decoded here
+ * and forwarded to the browsers in the same text form as before.
+ */
+const binaryProtocol = true;
+
+const ImuPacket = require( "./imuPacket" );
 
 /* Instanciate SerialPort */
 const serialPort = new SerialPort( portName, {
@@ -35,7 +43,7 @@ const serialPort = new SerialPort( portName, {
 	 * The output of Arduino's println() ends with \r\n.
 	 * https://www.arduino.cc/en/serial/println
 	 */
-	parser: SerialPort.parsers.readline( "\n" ),
+	parser: binaryProtocol ? SerialPort.parsers.raw : SerialPort.parsers.readline( "\n" ),
 
 } );
 
@@ -60,7 +68,8 @@ var wssConnections = [];
  */
 var stdin = process.openStdin();
 
-stdin.setRawMode( true );
+/* not a terminal when run by bridgebench */
+if ( stdin.isTTY ) stdin.setRawMode( true );
 
 stdin.setEncoding( "utf8" );
 
@@ -95,16 +104,115 @@ serialPort.on( "error", function ( err ) {
 
 } );
 
+function broadcast( line ) {
+
+	wssConnections.forEach( function ( socket ) {
+
+		socket.send( JSON.stringify( line ) );
+
+	} );
+
+}
+
+/**
+ * Pose feed for the camera (realsense/pose_sync.hpp) on port 3493: every
+ * orientation as "POSE device_us host_us w x y z", with the sample's Teensy
+ * timestamp and the time its serial data arrived. process.hrtime() reads
+ * CLOCK_MONOTONIC, the clock the camera stamps its frames with.
+ */
+const net = require( "net" );
+
+var poseClients = [];
+
+var poseServer = net.createServer( function ( socket ) {
+
+	console.log( "The camera is connected to the pose feed." );
+
+	socket.setNoDelay( true );
+
+	poseClients.push( socket );
+
+	socket.on( "close", function () {
+
+		poseClients.splice( poseClients.indexOf( socket ), 1 );
+
+	} );
+
+	socket.on( "error", function () {} );
+
+} );
+
+poseServer.listen( 3493, "127.0.0.1" );
+
+/* arrival time of the serial data being decoded, in microseconds */
+var arrivalUs = 0;
+
+function sendPose( sample ) {
+
+	if ( poseClients.length === 0 ) return;
+
+	var q = sample.values;
+	var line = "POSE " + sample.time + " " + arrivalUs + " " + q[ 0 ] + " " + q[ 1 ] + " " + q[ 2 ] + " " + q[ 3 ] + "\n";
+
+	poseClients.forEach( function ( socket ) {
+
+		socket.write( line );
+
+	} );
+
+}
+
+var lastSequence = null;
+
+const packetDecoder = new ImuPacket.Decoder( function ( packet ) {
+
+	if ( lastSequence !== null && packet.sequence !== ( ( lastSequence + 1 ) & 0xffff ) ) {
+
+		console.log( "Lost " + ( ( packet.sequence - lastSequence - 1 ) & 0xffff ) + " IMU packets" );
+
+	}
+
+	lastSequence = packet.sequence;
+
+	packet.samples.forEach( function ( sample ) {
+
+		if ( packet.name === "QC" || packet.name === "QP" ) sendPose( sample );
+
+		/* the estimate and the pose predicted for display, as two lines */
+		if ( packet.name === "QP" ) {
+
+			broadcast( "QC " + sample.values.slice( 0, 4 ).join( " " ) );
+			broadcast( "QP " + sample.values.slice( 4 ).join( " " ) );
+			return;
+
+		}
+
+		broadcast( packet.name + " " + sample.values.join( " " ) );
+
+	} );
+
+}, function ( frame ) {
+
+	/* text from setup() and DEBUG mode */
+	process.stdout.write( frame.toString( "latin1" ) );
+
+} );
+
 /* For checking the data without any connection */
 serialPort.on( "data", function ( data ) {
 
-	console.log( data );
+	if ( binaryProtocol ) {
 
-	wssConnections.forEach( function ( socket ) {
+		var now = process.hrtime();
+		arrivalUs = Math.round( now[ 0 ] * 1e6 + now[ 1 ] / 1e3 );
+		packetDecoder.push( data );
+		return;
 
-		socket.send( JSON.stringify( data ) );
+	}
 
-	} );
+	console.log( data );
+
+	broadcast( data );
 
 } );
 
@@ -4,20 +4,124 @@
 #include <errno.h>
 #include <string.h>
 #include <netdb.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
 #include "libb64-1.2/include/b64/cencode.h"
 #include "libb64-1.2/include/b64/cdecode.h"
+#include "frame_header.h"
 
 #include <arpa/inet.h>
-#define IMAGE_SIZE (640*480*3)
 #define PORT "3490" // the port RGB client will be connecting to
+#define DEPTH_PORT "3491"
+#define WS_PORT "8081" // the ports the browser reads the RGB and depth streams from
+#define WS_DEPTH_PORT "8082"
 
 
 // Whether or not we should use base64
 #define USE_BASE64 0
+// plain bytes encoded per send in base64 mode; a multiple of 3
+#define B64_CHUNK (3*4096)
+
+// The producer index goes in the top byte of the frame sequence number, so
+// the consumers can tell the producers apart.
+#define PRODUCER_SHIFT 24
+#define FRAME_MASK ((1u << PRODUCER_SHIFT) - 1)
+#define MAX_PRODUCERS 256
+
+// how long consumers keep reading after the producers stop
+#define DRAIN_MS 1000
+
+
+/*
+ * Load generator for the node relay (app.js).
+ *
+ * Each producer connects to the relay like the camera does, on 3490 (RGB)
+ * and/or 3491 (depth), and sends full-frame tiles at a fixed rate. Frames
+ * are synthetic patterns, or raw frames replayed from a file. A consumer
+ * per stream connects to the relay's WebSocket port like a browser does
+ * and matches what arrives against what was sent, using the sequence
+ * numbers and capture timestamps in the tile headers.
+ *
+ * The report gives, per stream, the offered and delivered frame rate and
+ * throughput, frame loss and end-to-end latency percentiles. Latency uses
+ * CLOCK_MONOTONIC on both ends, so the consumer must run on the same
+ * machine as the producers, which it does.
+ *
+ *     test_executable <host> [--fps=30] [--width=640] [--height=480]
+ *         [--producers=1] [--duration=10] [--stream=rgb|depth|both]
+ *         [--replay=file] [--report=file.json] [--no-consumer]
+ *
+ * A replay file holds raw frames back to back, width*height*channels bytes
+ * each, and is looped.
+ */
+
+enum { STREAM_RGB, STREAM_DEPTH, STREAM_COUNT };
+
+static const char *stream_names[STREAM_COUNT] = { "rgb", "depth" };
+static const char *stream_ports[STREAM_COUNT] = { PORT, DEPTH_PORT };
+static const char *stream_ws_ports[STREAM_COUNT] = { WS_PORT, WS_DEPTH_PORT };
+static const int stream_channels[STREAM_COUNT] = { 3, 1 };
+
+struct loadgen_options
+{
+    const char *host;
+    double fps;
+    int width, height;
+    int producers;
+    double duration;
+    int streams[STREAM_COUNT];
+    const char *replay;
+    const char *report;
+    int consumer;
+};
+
+// what one producer did on one stream
+struct producer_stats
+{
+    uint64_t frames_sent, bytes_sent;
+    uint64_t late_frames; // frames sent more than a frame interval behind schedule
+    int failed;
+};
+
+// what one consumer saw, for all producers on one stream
+struct consumer_stats
+{
+    uint64_t frames, bytes, duplicates, reordered;
+    uint32_t *next_frame; // per producer, next expected frame number
+    uint8_t *seen_any;
+    uint32_t *latencies_us;
+    size_t latency_count, latency_capacity;
+    double first_s, last_s; // first and last arrival
+    int connected;
+};
+
+struct producer
+{
+    const struct loadgen_options *options;
+    int index;
+    const uint8_t *replay_frames[STREAM_COUNT];
+    size_t replay_count[STREAM_COUNT];
+    struct producer_stats stats[STREAM_COUNT];
+    pthread_t thread;
+};
+
+struct consumer
+{
+    const struct loadgen_options *options;
+    int stream;
+    int sockfd;
+    struct consumer_stats stats;
+    pthread_t thread;
+};
+
+static volatile int consumers_stop = 0;
 
 
 // get sockaddr, IPv4 or IPv6:
@@ -30,11 +134,11 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int main(int argc, char *argv[])
+// connect to host:port, trying every address it resolves to. Returns the
+// socket, or -1.
+static int connect_to(const char *host, const char *port)
 {
-    base64_encodestate b64_state;
-    base64_init_encodestate(&b64_state);
-    int sockfd, numbytes, sockfd2;
+    int sockfd = -1;
     struct addrinfo hints, *servinfo, *p;
     int rv;
     char s[INET6_ADDRSTRLEN];
@@ -43,9 +147,9 @@ int main(int argc, char *argv[])
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    if ((rv = getaddrinfo(argv[1], "3490", &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+        return -1;
     }
 
     // loop through all the results and connect to the first we can
@@ -66,122 +170,612 @@ int main(int argc, char *argv[])
     }
 
     if (p == NULL) {
-        fprintf(stderr, "client: failed to connect\n");
-        return 2;
+        fprintf(stderr, "client: failed to connect to port %s\n", port);
+        freeaddrinfo(servinfo);
+        return -1;
     }
 
     inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
             s, sizeof s);
-    printf("client: connecting to %s\n", s);
+    printf("client: connecting to %s:%s\n", s, port);
 
-    freeaddrinfo(servinfo);
+    freeaddrinfo(servinfo); // all done with this structure
+    return sockfd;
+}
 
-    // Get second socket with port 3491
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-    if ((rv = getaddrinfo(argv[1], "3491", &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int send_all(int sockfd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sockfd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
     }
+    return 0;
+}
 
-    // loop through all the results and connect to the first we can
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sockfd2 = socket(p->ai_family, p->ai_socktype,
-                p->ai_protocol)) == -1) {
-            perror("client: socket");
-            continue;
+static int recv_all(int sockfd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sockfd, p, len, 0);
+        if (n == 0) return -1;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
         }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
 
-        if (connect(sockfd2, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd2);
-            perror("client: connect");
-            continue;
+
+//================= Producers =====================
+
+// Test patterns. The RGB gradient scrolls by one byte per frame and the depth
+// frame occludes the Waddle Dee in the bottom half of the screen, so the
+// browser shows something recognisable while under load.
+static void synthetic_frame(uint8_t *frame, int stream, int width, int height, uint32_t n)
+{
+    int size = width * height * stream_channels[stream];
+    if (stream == STREAM_RGB) {
+        for (int i = 0; i < size; i++)
+            frame[i] = (i + n) % 255;
+    } else {
+        memset(frame, 20, size / 2);
+        memset(frame + size / 2, 255, size - size / 2);
+    }
+}
+
+// send one frame as a single full-frame tile
+static int send_frame(int sockfd, struct frame_header *header, const uint8_t *frame, int size)
+{
+#if USE_BASE64
+    // Base64 takes 4/3 the bandwidth. The frame is encoded in chunks of a
+    // multiple of 3 bytes straight into a small buffer that is sent right
+    // away, so nothing the size of the frame is staged.
+    header->flags |= FRAME_TILE_BASE64;
+    header->payload_size = (size + 2) / 3 * 4;
+    if (send_all(sockfd, header, sizeof *header) == -1)
+        return -1;
+
+    base64_encodestate b64_state;
+    base64_init_encodestate(&b64_state);
+    char code[B64_CHUNK / 3 * 4 + 4];
+    for (int offset = 0; offset < size; offset += B64_CHUNK)
+    {
+        int length = size - offset < B64_CHUNK ? size - offset : B64_CHUNK;
+        int code_length = base64_encode_block((const char *)frame + offset, length, code, &b64_state);
+        if (offset + length == size)
+            code_length += base64_encode_blockend(code + code_length, &b64_state) - 1; // no newline
+
+        // double-check base64 encoding; every chunk decodes on its own
+        base64_decodestate outstate;
+        base64_init_decodestate(&outstate);
+        uint8_t decoded[B64_CHUNK + 3];
+        base64_decode_block(code, code_length, (char*)decoded, &outstate);
+        for (int i = 0; i < length; i++)
+        {
+            if (frame[offset + i] != decoded[i])
+                printf("incorrect at %d: %d \n", offset + i, decoded[i]);
         }
 
-        break;
+        if (send_all(sockfd, code, code_length) == -1)
+            return -1;
     }
+    return 0;
+#else
+    if (send_all(sockfd, header, sizeof *header) == -1 ||
+        send_all(sockfd, frame, size) == -1)
+        return -1;
+    return 0;
+#endif
+}
 
-    if (p == NULL) {
-        fprintf(stderr, "client: failed to connect\n");
-        return 2;
+static void *producer_main(void *arg)
+{
+    struct producer *producer = arg;
+    const struct loadgen_options *options = producer->options;
+    int sockfds[STREAM_COUNT];
+    uint8_t *frames[STREAM_COUNT];
+    int sizes[STREAM_COUNT];
+    char drain[256];
+
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        sockfds[s] = -1;
+        frames[s] = NULL;
+        sizes[s] = options->width * options->height * stream_channels[s];
+        if (!options->streams[s]) continue;
+
+        if ((sockfds[s] = connect_to(options->host, stream_ports[s])) == -1) {
+            producer->stats[s].failed = 1;
+            continue;
+        }
+        frames[s] = malloc(sizes[s]);
+        if (!producer->replay_count[s])
+            synthetic_frame(frames[s], s, options->width, options->height, 0);
     }
 
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
-            s, sizeof s);
-    printf("client: connecting to %s\n", s);
+    const double interval = 1.0 / options->fps;
+    const double start = now_s();
+    const uint64_t total = (uint64_t)(options->duration * options->fps);
+    double next = start;
+
+    for (uint64_t n = 0; n < total; n++) {
+        // fixed-rate schedule; a producer that falls behind sends right away
+        // instead of bursting to catch up
+        double now = now_s();
+        if (next > now) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)next;
+            ts.tv_nsec = (long)((next - ts.tv_sec) * 1e9);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
 
-    freeaddrinfo(servinfo); // all done with this structure
+        int sent = 0;
+        for (int s = 0; s < STREAM_COUNT; s++) {
+            struct producer_stats *stats = &producer->stats[s];
+            if (sockfds[s] == -1) continue;
+
+            const uint8_t *frame = frames[s];
+            if (producer->replay_count[s])
+                frame = producer->replay_frames[s] + (n % producer->replay_count[s]) * sizes[s];
+            else if (s == STREAM_RGB)
+                synthetic_frame(frames[s], s, options->width, options->height, (uint32_t)n);
+
+            struct frame_header header;
+            frame_header_init(&header, s == STREAM_RGB ? FRAME_STREAM_RGB : FRAME_STREAM_DEPTH,
+                stream_channels[s], options->width, options->height);
+            header.sequence = ((uint32_t)producer->index << PRODUCER_SHIFT) | ((uint32_t)n & FRAME_MASK);
+            header.timestamp_us = now_us();
+
+            if (send_frame(sockfds[s], &header, frame, sizes[s]) == -1) {
+                perror("send");
+                close(sockfds[s]);
+                sockfds[s] = -1;
+                stats->failed = 1;
+                continue;
+            }
+            stats->frames_sent++;
+            stats->bytes_sent += sizeof header + header.payload_size;
+            if (now_s() - next > interval) stats->late_frames++;
+            sent = 1;
+
+            // the relay writes the browser's region of interest back to the
+            // camera sockets; nobody reads it here
+            while (recv(sockfds[s], drain, sizeof drain, MSG_DONTWAIT) > 0) {}
+        }
+        if (!sent) break;
 
-    // have first socket for rgb stored in sockfd and
-    // second socket for depth in sockfd2
+        next += interval;
+        if (now_s() - next > interval) next = now_s();
+    }
 
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        if (sockfds[s] != -1) close(sockfds[s]);
+        free(frames[s]);
+    }
+    return NULL;
+}
 
-    // for use with base64
-    // NOTE: Base64 encoding requires 4/3 the amount of memory to encode the data
-#if USE_BASE64
-    uint8_t img_out[4*640*480];
-    printf("%d", base64_encode_block((const char *)img_test, IMAGE_SIZE, (char*)img_out, &b64_state));
-    base64_decodestate outstate;
-    base64_init_decodestate(&outstate);
-    uint8_t img_decoded[3*640*480];
-    base64_decode_block((const char*)img_out, 4*640*480, (char*)img_decoded, &outstate);
-
-    // double-check base64 encoding
-    for (int i = 0; i < IMAGE_SIZE; i++)
-    {
-        if (img_test[i] != img_decoded[i])
-            printf("incorrect at %d: %d \n", i, img_decoded[i]);
+
+//================= Consumers =====================
+
+// Minimal WebSocket client: the opening handshake and unfragmented frames are
+// all the relay uses.
+static int ws_connect(const char *host, const char *port)
+{
+    int sockfd = connect_to(host, port);
+    if (sockfd == -1) return -1;
+
+    char request[512];
+    int n = snprintf(request, sizeof request,
+        "GET / HTTP/1.1\r\n"
+        "Host: %s:%s\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n", host, port);
+    if (send_all(sockfd, request, n) == -1) {
+        close(sockfd);
+        return -1;
     }
 
-    if ((numbytes = send(sockfd, img_out, 4*640*480, 0)) == -1) {
-        perror("send");
-        exit(1);
+    // read the response headers byte by byte, so no frame data is consumed
+    char response[1024];
+    size_t len = 0;
+    while (len < sizeof response - 1) {
+        if (recv_all(sockfd, response + len, 1) == -1) break;
+        len++;
+        if (len >= 4 && !memcmp(response + len - 4, "\r\n\r\n", 4)) break;
     }
-    send(sockfd, "\n", 1, 0);
-#endif
+    response[len] = 0;
+    if (strncmp(response, "HTTP/1.1 101", 12) != 0) {
+        fprintf(stderr, "consumer: websocket handshake on port %s failed\n", port);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
 
-    // test RGB pattern
-    uint8_t img_test[IMAGE_SIZE];
-    for (int i = 0; i < IMAGE_SIZE; i++)
-    {
-        img_test[i] = i % 255;
+// Read one message into *buf. Returns the opcode, or -1 when the connection
+// is gone.
+static int ws_read(int sockfd, uint8_t **buf, size_t *capacity, size_t *length)
+{
+    uint8_t head[14];
+    if (recv_all(sockfd, head, 2) == -1) return -1;
+
+    int opcode = head[0] & 0x0f;
+    int masked = head[1] & 0x80;
+    uint64_t len = head[1] & 0x7f;
+    if (len == 126) {
+        if (recv_all(sockfd, head + 2, 2) == -1) return -1;
+        len = ((uint64_t)head[2] << 8) | head[3];
+    } else if (len == 127) {
+        if (recv_all(sockfd, head + 2, 8) == -1) return -1;
+        len = 0;
+        for (int i = 0; i < 8; i++) len = (len << 8) | head[2 + i];
     }
-    // send RGB pattern
-    if ((numbytes = send(sockfd, img_test, 3*640*480, 0)) == -1) {
-        perror("send");
-        exit(1);
+
+    uint8_t mask[4] = { 0, 0, 0, 0 };
+    if (masked && recv_all(sockfd, mask, 4) == -1) return -1;
+
+    if (len > *capacity) {
+        uint8_t *grown = realloc(*buf, len);
+        if (!grown) return -1;
+        *buf = grown;
+        *capacity = len;
+    }
+    if (recv_all(sockfd, *buf, len) == -1) return -1;
+    for (uint64_t i = 0; masked && i < len; i++) (*buf)[i] ^= mask[i & 3];
+    *length = len;
+
+    // answer pings; client frames must be masked, an all-zero mask will do
+    if (opcode == 9) {
+        uint8_t pong[6 + 125] = { 0x8a, 0x80 | (uint8_t)(len & 0x7f), 0, 0, 0, 0 };
+        if (len <= 125) {
+            memcpy(pong + 6, *buf, len);
+            send_all(sockfd, pong, 6 + len);
+        }
     }
-    send(sockfd, "\n", 1, 0);
+    return opcode;
+}
 
+static void record_tile(struct consumer_stats *stats, const uint8_t *tile, size_t length, int producers)
+{
+    struct frame_header header;
+    if (length < sizeof header) return;
+    memcpy(&header, tile, sizeof header);
+    if (header.magic != FRAME_MAGIC) return;
+
+    double now = now_s();
+    uint64_t arrival = now_us();
+    if (!stats->frames) stats->first_s = now;
+    stats->last_s = now;
+    stats->frames++;
+    stats->bytes += length;
+
+    int producer = header.sequence >> PRODUCER_SHIFT;
+    uint32_t frame = header.sequence & FRAME_MASK;
+    if (producer < producers) {
+        if (stats->seen_any[producer] && frame < stats->next_frame[producer]) {
+            // older than the newest frame seen: a duplicate or out of order
+            if (frame + 1 == stats->next_frame[producer]) stats->duplicates++;
+            else stats->reordered++;
+        } else {
+            stats->next_frame[producer] = frame + 1;
+        }
+        stats->seen_any[producer] = 1;
+    }
 
-    // Generate example depth data: the Waddle Dee will be occluded
-    // in the bottom half of the screen
-    uint8_t img_depth[640*480];
-    for (int i = 0; i < 240*640; i++)
-    {
-        img_depth[i] = 20;
+    if (stats->latency_count == stats->latency_capacity) {
+        size_t capacity = stats->latency_capacity ? stats->latency_capacity * 2 : 4096;
+        uint32_t *grown = realloc(stats->latencies_us, capacity * sizeof *grown);
+        if (!grown) return;
+        stats->latencies_us = grown;
+        stats->latency_capacity = capacity;
     }
+    stats->latencies_us[stats->latency_count++] =
+        arrival > header.timestamp_us ? (uint32_t)(arrival - header.timestamp_us) : 0;
+}
 
-    for (int i = 240*640; i < 480*640; i++)
-    {
-        img_depth[i] = 255;
+static void *consumer_main(void *arg)
+{
+    struct consumer *consumer = arg;
+    uint8_t *buf = NULL;
+    size_t capacity = 0, length;
+
+    while (!consumers_stop) {
+        // wake up now and then to notice when to stop
+        struct pollfd pfd = { consumer->sockfd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        int opcode = ws_read(consumer->sockfd, &buf, &capacity, &length);
+        if (opcode == -1) break;
+        if (opcode == 8) break;
+        if (opcode == 2) record_tile(&consumer->stats, buf, length, consumer->options->producers);
     }
 
+    free(buf);
+    return NULL;
+}
 
-    if ((numbytes = send(sockfd2, img_depth, 1*640*480, 0)) == -1) {
-        perror("send");
-        exit(1);
+
+//================= Report =====================
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint32_t *sorted, size_t count, double p)
+{
+    if (!count) return 0;
+    size_t i = (size_t)(p / 100 * (count - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+static void write_report(FILE *out, const struct loadgen_options *options, struct producer *producers,
+    struct consumer *consumers, double elapsed_s)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"host\": \"%s\",\n", options->host);
+    fprintf(out, "  \"fps\": %g,\n  \"width\": %d,\n  \"height\": %d,\n", options->fps, options->width, options->height);
+    fprintf(out, "  \"producers\": %d,\n  \"duration_s\": %g,\n  \"elapsed_s\": %.3f,\n",
+        options->producers, options->duration, elapsed_s);
+    fprintf(out, "  \"source\": \"%s\",\n  \"base64\": %s,\n", options->replay ? options->replay : "synthetic",
+        USE_BASE64 ? "true" : "false");
+    fprintf(out, "  \"streams\": {");
+
+    int first = 1;
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        if (!options->streams[s]) continue;
+
+        uint64_t sent = 0, bytes_sent = 0, late = 0;
+        int failed = 0;
+        for (int i = 0; i < options->producers; i++) {
+            sent += producers[i].stats[s].frames_sent;
+            bytes_sent += producers[i].stats[s].bytes_sent;
+            late += producers[i].stats[s].late_frames;
+            failed += producers[i].stats[s].failed;
+        }
+
+        fprintf(out, "%s\n    \"%s\": {\n", first ? "" : ",", stream_names[s]);
+        first = 0;
+        fprintf(out, "      \"frames_sent\": %llu,\n      \"bytes_sent\": %llu,\n",
+            (unsigned long long)sent, (unsigned long long)bytes_sent);
+        fprintf(out, "      \"offered_fps\": %.2f,\n      \"sent_fps\": %.2f,\n      \"sent_mbps\": %.2f,\n",
+            options->fps * options->producers, sent / elapsed_s, bytes_sent * 8 / elapsed_s / 1e6);
+        fprintf(out, "      \"late_frames\": %llu,\n      \"failed_producers\": %d",
+            (unsigned long long)late, failed);
+
+        struct consumer *consumer = &consumers[s];
+        if (consumer->stats.connected) {
+            struct consumer_stats *stats = &consumer->stats;
+            double window = stats->last_s > stats->first_s ? stats->last_s - stats->first_s : elapsed_s;
+            uint64_t unique = stats->frames - stats->duplicates;
+            uint64_t lost = sent > unique ? sent - unique : 0;
+
+            qsort(stats->latencies_us, stats->latency_count, sizeof *stats->latencies_us, compare_u32);
+            fprintf(out, ",\n      \"frames_received\": %llu,\n      \"bytes_received\": %llu,\n",
+                (unsigned long long)stats->frames, (unsigned long long)stats->bytes);
+            fprintf(out, "      \"received_fps\": %.2f,\n      \"received_mbps\": %.2f,\n",
+                stats->frames / window, stats->bytes * 8 / window / 1e6);
+            fprintf(out, "      \"frames_lost\": %llu,\n      \"loss_ratio\": %.6f,\n",
+                (unsigned long long)lost, sent ? (double)lost / sent : 0.0);
+            fprintf(out, "      \"duplicates\": %llu,\n      \"reordered\": %llu,\n",
+                (unsigned long long)stats->duplicates, (unsigned long long)stats->reordered);
+            fprintf(out, "      \"latency_ms\": {");
+            for (size_t i = 0; i < sizeof percentiles / sizeof *percentiles; i++)
+                fprintf(out, "%s\"%s\": %.3f", i ? ", " : " ", percentile_names[i],
+                    percentile_ms(stats->latencies_us, stats->latency_count, percentiles[i]));
+            fprintf(out, ", \"max\": %.3f }",
+                stats->latency_count ? stats->latencies_us[stats->latency_count - 1] / 1000.0 : 0.0);
+        }
+        fprintf(out, "\n    }");
     }
-    send(sockfd2, "\n", 1, 0);
+    fprintf(out, "\n  }\n}\n");
+}
 
 
-    // cleanup
-    close(sockfd);
-    close(sockfd2);
+//================= Setup =====================
 
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s <host> [--fps=30] [--width=640] [--height=480] [--producers=1]\n"
+        "          [--duration=10] [--stream=rgb|depth|both] [--replay=file]\n"
+        "          [--report=file.json] [--no-consumer]\n", name);
+}
 
+static int parse_options(int argc, char *argv[], struct loadgen_options *options)
+{
+    static const struct option long_options[] = {
+        { "fps",         required_argument, 0, 'f' },
+        { "width",       required_argument, 0, 'w' },
+        { "height",      required_argument, 0, 'h' },
+        { "producers",   required_argument, 0, 'p' },
+        { "duration",    required_argument, 0, 'd' },
+        { "stream",      required_argument, 0, 's' },
+        { "replay",      required_argument, 0, 'r' },
+        { "report",      required_argument, 0, 'o' },
+        { "no-consumer", no_argument,       0, 'n' },
+        { 0, 0, 0, 0 }
+    };
+
+    options->host = NULL;
+    options->fps = 30;
+    options->width = 640;
+    options->height = 480;
+    options->producers = 1;
+    options->duration = 10;
+    options->streams[STREAM_RGB] = options->streams[STREAM_DEPTH] = 1;
+    options->replay = NULL;
+    options->report = NULL;
+    options->consumer = 1;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'f': options->fps = atof(optarg); break;
+        case 'w': options->width = atoi(optarg); break;
+        case 'h': options->height = atoi(optarg); break;
+        case 'p': options->producers = atoi(optarg); break;
+        case 'd': options->duration = atof(optarg); break;
+        case 'r': options->replay = optarg; break;
+        case 'o': options->report = optarg; break;
+        case 'n': options->consumer = 0; break;
+        case 's':
+            options->streams[STREAM_RGB] = !strcmp(optarg, "rgb") || !strcmp(optarg, "both");
+            options->streams[STREAM_DEPTH] = !strcmp(optarg, "depth") || !strcmp(optarg, "both");
+            break;
+        default: return -1;
+        }
+    }
+    if (optind != argc - 1) return -1;
+    options->host = argv[optind];
+
+    if (options->fps <= 0 || options->duration <= 0 || options->width <= 0 || options->height <= 0 ||
+        options->width > 65535 || options->height > 65535 ||
+        options->producers < 1 || options->producers > MAX_PRODUCERS ||
+        !(options->streams[STREAM_RGB] || options->streams[STREAM_DEPTH])) {
+        fprintf(stderr, "invalid options\n");
+        return -1;
+    }
     return 0;
 }
 
+// Read a replay file whole. It is only used for the streams selected; when
+// both are, its frames are RGB and the depth stream stays synthetic.
+static uint8_t *load_replay(const char *path, size_t frame_size, size_t *count)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    *count = size > 0 ? (size_t)size / frame_size : 0;
+    if (!*count) {
+        fprintf(stderr, "%s: no whole %zu byte frame in the file\n", path, frame_size);
+        fclose(f);
+        return NULL;
+    }
+
+    uint8_t *frames = malloc(*count * frame_size);
+    if (!frames || fread(frames, frame_size, *count, f) != *count) {
+        fprintf(stderr, "%s: read failed\n", path);
+        free(frames);
+        frames = NULL;
+    }
+    fclose(f);
+    return frames;
+}
+
+int main(int argc, char *argv[])
+{
+    struct loadgen_options options;
+    if (parse_options(argc, argv, &options) == -1) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // replayed frames are shared by all producers
+    uint8_t *replay = NULL;
+    size_t replay_count = 0;
+    int replay_stream = options.streams[STREAM_RGB] ? STREAM_RGB : STREAM_DEPTH;
+    if (options.replay) {
+        size_t frame_size = (size_t)options.width * options.height * stream_channels[replay_stream];
+        if (!(replay = load_replay(options.replay, frame_size, &replay_count)))
+            return 1;
+        printf("replaying %zu %s frames from %s\n", replay_count, stream_names[replay_stream], options.replay);
+    }
+
+    // consumers connect first, so they see every frame
+    struct consumer consumers[STREAM_COUNT];
+    memset(consumers, 0, sizeof consumers);
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        struct consumer *consumer = &consumers[s];
+        consumer->options = &options;
+        consumer->stream = s;
+        if (!options.consumer || !options.streams[s]) continue;
+        if ((consumer->sockfd = ws_connect(options.host, stream_ws_ports[s])) == -1) continue;
+
+        consumer->stats.next_frame = calloc(options.producers, sizeof *consumer->stats.next_frame);
+        consumer->stats.seen_any = calloc(options.producers, 1);
+        consumer->stats.connected = 1;
+        pthread_create(&consumer->thread, NULL, consumer_main, consumer);
+    }
+
+    struct producer *producers = calloc(options.producers, sizeof *producers);
+    double start = now_s();
+    for (int i = 0; i < options.producers; i++) {
+        producers[i].options = &options;
+        producers[i].index = i;
+        producers[i].replay_frames[replay_stream] = replay;
+        producers[i].replay_count[replay_stream] = replay_count;
+        pthread_create(&producers[i].thread, NULL, producer_main, &producers[i]);
+    }
+    for (int i = 0; i < options.producers; i++)
+        pthread_join(producers[i].thread, NULL);
+    double elapsed = now_s() - start;
+
+    // let frames still in the relay arrive before counting them as lost
+    usleep(DRAIN_MS * 1000);
+    consumers_stop = 1;
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        if (!consumers[s].stats.connected) continue;
+        pthread_join(consumers[s].thread, NULL);
+        close(consumers[s].sockfd);
+    }
+
+    write_report(stdout, &options, producers, consumers, elapsed);
+    if (options.report) {
+        FILE *out = fopen(options.report, "w");
+        if (!out) {
+            perror(options.report);
+        } else {
+            write_report(out, &options, producers, consumers, elapsed);
+            fclose(out);
+        }
+    }
+
+    // cleanup
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        free(consumers[s].stats.next_frame);
+        free(consumers[s].stats.seen_any);
+        free(consumers[s].stats.latencies_us);
+    }
+    free(producers);
+    free(replay);
+
+    return 0;
+}
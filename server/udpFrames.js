@@ -0,0 +1,223 @@
+/**
+ * @file Reassembly of frames sent over UDP by cpp-headless --udp
+ * The datagram layout is documented in server/udp_fragment.h; this follows
+ * udp_frame_receiver in realsense/udp_transport.hpp. A frame that is not
+ * complete within the deadline, or once a newer one is, is given up.
+ */
+
+var MAGIC = 0x4655;
+var HEADER_SIZE = 20;
+var PARITY = 1;
+
+/* frames reassembled at once; the oldest is given up for a new one */
+var SLOTS = 4;
+
+var MAX_FRAME = 64 << 20;
+
+/* a sender that started over counts from 0 again */
+var RESTART_GAP = 1000;
+
+/* signed distance between two frame ids, which wrap at 2^32 */
+function idDiff( a, b ) {
+
+	return ( a - b ) | 0;
+
+}
+
+function fragmentLength( slot, fragment ) {
+
+	return Math.min( slot.size - fragment * slot.fragmentSize, slot.fragmentSize );
+
+}
+
+/**
+ * Reassembler for the datagrams of one sender. onFrame gets the Buffer of
+ * every frame completed; push takes every datagram received.
+ */
+function Reassembler( deadlineMs, onFrame ) {
+
+	var slots = [];
+	var lastDelivered = null;
+
+	this.stats = { delivered: 0, recovered: 0, late: 0, superseded: 0, ignored: 0 };
+	var stats = this.stats;
+
+	function expire( now ) {
+
+		slots = slots.filter( function ( slot ) {
+
+			if ( now - slot.start <= deadlineMs ) return true;
+			stats.late ++;
+			return false;
+
+		} );
+
+	}
+
+	function find( h, now ) {
+
+		for ( var i = 0; i < slots.length; i ++ ) {
+
+			var s = slots[ i ];
+			if ( s.id !== h.frameId ) continue;
+			if ( s.size !== h.frameSize || s.fragmentSize !== h.fragmentSize || s.fecGroup !== h.fecGroup ) return null;
+			return s;
+
+		}
+
+		if ( slots.length >= SLOTS ) {
+
+			slots.sort( function ( a, b ) { return idDiff( a.id, b.id ); } );
+			slots.shift();
+			stats.superseded ++;
+
+		}
+
+		var groups = h.fecGroup ? Math.ceil( h.fragmentCount / h.fecGroup ) : 0;
+		var slot = {
+			id: h.frameId, size: h.frameSize, count: h.fragmentCount, received: 0,
+			fragmentSize: h.fragmentSize, fecGroup: h.fecGroup, start: now, recovered: false,
+			data: Buffer.alloc( h.frameSize ), have: new Uint8Array( h.fragmentCount ),
+			parity: Buffer.alloc( groups * h.fragmentSize ), haveParity: new Uint8Array( groups ),
+			groupReceived: new Uint32Array( groups )
+		};
+		slots.push( slot );
+		return slot;
+
+	}
+
+	/* with the parity of group g and all but one of its fragments, the
+	   missing one is the XOR of the others and the parity */
+	function recover( s, g ) {
+
+		var first = g * s.fecGroup, end = Math.min( first + s.fecGroup, s.count );
+		if ( ! s.haveParity[ g ] || s.groupReceived[ g ] + 1 !== end - first ) return;
+
+		var missing = first;
+		while ( s.have[ missing ] ) missing ++;
+		var length = fragmentLength( s, missing );
+		var out = s.data.slice( missing * s.fragmentSize, missing * s.fragmentSize + length );
+		s.parity.copy( out, 0, g * s.fragmentSize, g * s.fragmentSize + length );
+
+		for ( var i = first; i < end; i ++ ) {
+
+			if ( i === missing ) continue;
+			var n = Math.min( length, fragmentLength( s, i ) );
+			var offset = i * s.fragmentSize;
+			for ( var k = 0; k < n; k ++ ) out[ k ] ^= s.data[ offset + k ];
+
+		}
+
+		s.have[ missing ] = 1;
+		s.received ++;
+		s.groupReceived[ g ] ++;
+		s.recovered = true;
+
+	}
+
+	this.push = function ( datagram ) {
+
+		var now = Date.now();
+		expire( now );
+
+		if ( datagram.length < HEADER_SIZE ) {
+
+			stats.ignored ++;
+			return;
+
+		}
+
+		var h = {
+			magic: datagram.readUInt16LE( 0 ),
+			headerSize: datagram.readUInt8( 2 ),
+			flags: datagram.readUInt8( 3 ),
+			frameId: datagram.readUInt32LE( 4 ),
+			frameSize: datagram.readUInt32LE( 8 ),
+			fragment: datagram.readUInt16LE( 12 ),
+			fragmentCount: datagram.readUInt16LE( 14 ),
+			fragmentSize: datagram.readUInt16LE( 16 ),
+			fecGroup: datagram.readUInt8( 18 )
+		};
+
+		if ( lastDelivered !== null && idDiff( h.frameId, lastDelivered ) < - RESTART_GAP ) lastDelivered = null;
+
+		var groups = h.fecGroup ? Math.ceil( h.fragmentCount / h.fecGroup ) : 0;
+		var isParity = ( h.flags & PARITY ) !== 0;
+		var expectedCount = h.frameSize ? Math.ceil( h.frameSize / h.fragmentSize ) : 1;
+
+		if ( h.magic !== MAGIC || h.headerSize < HEADER_SIZE || h.headerSize > datagram.length ||
+			! h.fragmentSize || h.frameSize > MAX_FRAME || h.fragmentCount !== expectedCount ||
+			( isParity ? h.fragment >= groups : h.fragment >= h.fragmentCount ) ||
+			( lastDelivered !== null && idDiff( h.frameId, lastDelivered ) <= 0 ) ) {
+
+			stats.ignored ++;
+			return;
+
+		}
+
+		var s = find( h, now );
+		if ( s === null ) {
+
+			stats.ignored ++;
+			return;
+
+		}
+
+		var payload = datagram.slice( h.headerSize );
+
+		if ( isParity ) {
+
+			if ( payload.length !== h.fragmentSize || s.haveParity[ h.fragment ] ) {
+
+				stats.ignored ++;
+				return;
+
+			}
+			payload.copy( s.parity, h.fragment * h.fragmentSize );
+			s.haveParity[ h.fragment ] = 1;
+			recover( s, h.fragment );
+
+		} else {
+
+			if ( payload.length !== fragmentLength( s, h.fragment ) || s.have[ h.fragment ] ) {
+
+				stats.ignored ++;
+				return;
+
+			}
+			payload.copy( s.data, h.fragment * h.fragmentSize );
+			s.have[ h.fragment ] = 1;
+			s.received ++;
+			if ( s.fecGroup ) {
+
+				var g = Math.floor( h.fragment / s.fecGroup );
+				s.groupReceived[ g ] ++;
+				recover( s, g );
+
+			}
+
+		}
+
+		if ( s.received !== s.count ) return;
+
+		lastDelivered = s.id;
+		stats.delivered ++;
+		if ( s.recovered ) stats.recovered ++;
+
+		/* anything older can only come out later than this one */
+		slots = slots.filter( function ( other ) {
+
+			if ( other === s ) return false;
+			if ( idDiff( other.id, s.id ) > 0 ) return true;
+			stats.superseded ++;
+			return false;
+
+		} );
+
+		onFrame( s.data );
+
+	};
+
+}
+
+module.exports = { Reassembler: Reassembler };
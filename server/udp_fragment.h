@@ -0,0 +1,54 @@
+/*
+udp_fragment.h - header of the datagrams of the UDP frame transport
+
+Over Wi-Fi a lost TCP segment holds up everything behind it until it is
+retransmitted. With --udp the camera sends each frame (the tiles of one
+stream, see frame_header.h) as numbered datagrams instead, and the receiver
+reassembles what arrives in time and drops what does not
+(realsense/udp_transport.hpp, server/udpFrames.js).
+
+A frame of frame_size bytes is cut into fragment_count data fragments of
+fragment_size bytes, the last one shorter. With fec_group > 0, every
+fec_group consecutive data fragments are followed by a parity fragment, the
+XOR of the group padded to fragment_size, from which any one lost fragment of
+the group can be rebuilt. A parity fragment has UDP_FRAGMENT_PARITY set and
+the group number in fragment.
+
+All fields are little endian.
+*/
+
+#ifndef UDP_FRAGMENT_H
+#define UDP_FRAGMENT_H
+
+#include <stdint.h>
+
+#define UDP_FRAGMENT_MAGIC 0x4655 /* "UF" */
+
+/* fits a 1500 byte MTU with the IP and UDP headers */
+#define UDP_FRAGMENT_PAYLOAD 1400
+
+enum udp_fragment_flags
+{
+	UDP_FRAGMENT_PARITY = 1	/* XOR of a group of data fragments */
+};
+
+struct udp_fragment_header
+{
+	uint16_t magic;
+	uint8_t  header_size;	/* bytes before the payload */
+	uint8_t  flags;		/* enum udp_fragment_flags */
+	uint32_t frame_id;	/* counts up by one per frame and sender */
+	uint32_t frame_size;	/* bytes in the whole frame */
+	uint16_t fragment;	/* index of a data fragment, or the group of a parity one */
+	uint16_t fragment_count;	/* data fragments in the frame */
+	uint16_t fragment_size;	/* payload bytes of every data fragment but the last */
+	uint8_t  fec_group;	/* data fragments per parity fragment; 0 for none */
+	uint8_t  reserved;
+};
+
+static inline uint32_t udp_fragment_count(uint32_t frame_size, uint32_t fragment_size)
+{
+	return frame_size ? (frame_size + fragment_size - 1) / fragment_size : 1;
+}
+
+#endif /* UDP_FRAGMENT_H */
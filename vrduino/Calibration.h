@@ -0,0 +1,364 @@
+/**
+ * Online sensor calibration
+ *
+ * RunningStats3 is Welford's running mean and variance of 3-axis samples,
+ * in one pass and without the cancellation of sum-of-squares formulas.
+ *
+ * GyroBiasTracker re-estimates the gyro bias whenever the board is at rest,
+ * so the startup measurement is only needed once and temperature drift is
+ * followed. A stretch of samples counts as rest when every sample turns
+ * less than maxRate after the current bias is removed, sees gravity within
+ * maxAccError, and the whole window has a variance below maxVariance.
+ *
+ * MagCalibrator fits an ellipsoid to the magnetometer samples collected
+ * while the board is turned in all directions, and MagCalibration applies
+ * the result: the hard-iron offset is its center, the soft-iron correction
+ * the symmetric matrix mapping it onto a sphere of the same mean radius.
+ * Only the normal equations of the fit are accumulated, so it needs no
+ * sample buffer; fit() solves them in a few thousand operations.
+ */
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <math.h>
+#include <stdint.h>
+
+/* Welford's running mean and variance, per axis */
+struct RunningStats3 {
+  unsigned long count;
+  double mean[3];
+  double m2[3];
+
+  RunningStats3() { reset(); }
+
+  void reset() {
+    count = 0;
+    for (int k = 0; k < 3; k++) mean[k] = m2[k] = 0;
+  }
+
+  void add(double x, double y, double z) {
+    double v[3] = { x, y, z };
+    count++;
+    for (int k = 0; k < 3; k++) {
+      double delta = v[k] - mean[k];
+      mean[k] += delta / count;
+      m2[k] += delta * (v[k] - mean[k]);
+    }
+  }
+
+  /* sample variance, 0 with fewer than 2 samples */
+  double variance(int k) const {
+    return count > 1 ? m2[k] / (count - 1) : 0;
+  }
+};
+
+
+class GyroBiasTracker {
+public:
+
+  /* gyro bias in deg/s and noise variance in (deg/s)^2 */
+  double bias[3];
+  double variance[3];
+
+  /* samples per estimate; 500 is half a second at 1 kHz */
+  unsigned long windowSamples;
+
+  /* rest thresholds, see above; maxVariance must stay above the gyro noise,
+     about 0.02 (deg/s)^2 for the MPU9250 at 1 kHz */
+  double maxRate;      // deg/s
+  double maxAccError;  // m/s^2
+  double maxVariance;  // (deg/s)^2
+
+  /* weight of a new estimate against the current bias */
+  double blend;
+
+  /* estimates since construction or setBias() */
+  unsigned long updates;
+
+  GyroBiasTracker() : windowSamples(500), maxRate(1), maxAccError(0.3), maxVariance(0.05),
+    blend(0.3), updates(0), haveBias(false) {
+    for (int k = 0; k < 3; k++) bias[k] = variance[k] = 0;
+  }
+
+  /* start from a stored or measured bias */
+  void setBias(const double* b, const double* var) {
+    for (int k = 0; k < 3; k++) {
+      bias[k] = b[k];
+      variance[k] = var[k];
+    }
+    haveBias = true;
+    updates = 0;
+    window.reset();
+  }
+
+  bool hasBias() const { return haveBias; }
+
+  /* one raw sample; returns true when it completed a new estimate */
+  bool add(double gyrX, double gyrY, double gyrZ, double accX, double accY, double accZ) {
+    double acc2 = accX * accX + accY * accY + accZ * accZ;
+    double lo = 9.80665 - maxAccError, hi = 9.80665 + maxAccError;
+    bool quiet = acc2 > lo * lo && acc2 < hi * hi;
+    if (haveBias) {
+      quiet = quiet && fabs(gyrX - bias[0]) < maxRate && fabs(gyrY - bias[1]) < maxRate &&
+              fabs(gyrZ - bias[2]) < maxRate;
+    }
+    if (!quiet) {
+      window.reset();
+      return false;
+    }
+
+    window.add(gyrX, gyrY, gyrZ);
+    if (window.count < windowSamples) return false;
+
+    bool still = true;
+    for (int k = 0; k < 3; k++) still = still && window.variance(k) < maxVariance;
+    if (still) {
+      double weight = haveBias ? blend : 1;
+      for (int k = 0; k < 3; k++) {
+        bias[k] += weight * (window.mean[k] - bias[k]);
+        variance[k] += weight * (window.variance(k) - variance[k]);
+      }
+      haveBias = true;
+      updates++;
+    }
+    window.reset();
+    return still;
+  }
+
+private:
+  bool haveBias;
+  RunningStats3 window;
+};
+
+
+/* hard- and soft-iron correction: corrected = matrix * (raw - offset) */
+struct MagCalibration {
+  double offset[3];
+  double matrix[3][3];
+
+  MagCalibration() { reset(); }
+
+  void reset() {
+    for (int i = 0; i < 3; i++) {
+      offset[i] = 0;
+      for (int j = 0; j < 3; j++) matrix[i][j] = i == j ? 1 : 0;
+    }
+  }
+
+  void apply(double x, double y, double z, double* out) const {
+    double d[3] = { x - offset[0], y - offset[1], z - offset[2] };
+    for (int i = 0; i < 3; i++) out[i] = matrix[i][0] * d[0] + matrix[i][1] * d[1] + matrix[i][2] * d[2];
+  }
+};
+
+
+class MagCalibrator {
+public:
+
+  /* accepted samples and covered octants (around their mean) before fitting */
+  unsigned long minSamples;
+  int minOctants;
+
+  /* a sample is only accepted this far (micro Tesla) from the last accepted one */
+  double minDistance;
+
+  /* accepted range of the field strength and of the soft-iron axis ratio */
+  double minRadius, maxRadius, maxAxisRatio;
+
+  MagCalibrator() : minSamples(150), minOctants(7), minDistance(4), minRadius(15),
+    maxRadius(150), maxAxisRatio(2) { reset(); }
+
+  void reset() {
+    for (int i = 0; i < 9; i++) {
+      rhs[i] = 0;
+      for (int j = 0; j < 9; j++) normal[i][j] = 0;
+    }
+    accepted = 0;
+    octants = 0;
+    spread.reset();
+    haveLast = false;
+  }
+
+  unsigned long samples() const { return accepted; }
+
+  /* number of octants around the mean that have samples */
+  int coverage() const {
+    int n = 0;
+    for (int i = 0; i < 8; i++) n += (octants >> i) & 1;
+    return n;
+  }
+
+  /* enough samples in enough directions to fit */
+  bool ready() const { return accepted >= minSamples && coverage() >= minOctants; }
+
+  /* one raw measurement; returns true if it was accepted */
+  bool add(double x, double y, double z) {
+    if (haveLast && sq3(x - last[0], y - last[1], z - last[2]) < minDistance * minDistance) return false;
+    last[0] = x; last[1] = y; last[2] = z;
+    haveLast = true;
+
+    // x^2 y^2 z^2 2xy 2xz 2yz 2x 2y 2z, fitted to 1
+    double d[9] = { x * x, y * y, z * z, 2 * x * y, 2 * x * z, 2 * y * z, 2 * x, 2 * y, 2 * z };
+    for (int i = 0; i < 9; i++) {
+      rhs[i] += d[i];
+      for (int j = i; j < 9; j++) normal[i][j] += d[i] * d[j];
+    }
+
+    spread.add(x, y, z);
+    if (spread.count > 10) {
+      int octant = (x > spread.mean[0]) | (y > spread.mean[1]) << 1 | (z > spread.mean[2]) << 2;
+      octants |= uint8_t(1 << octant);
+    }
+    accepted++;
+    return true;
+  }
+
+  /***
+   * Solves the fit into out. Returns false, leaving out alone, if the
+   * samples do not describe a plausible ellipsoid.
+   */
+  bool fit(MagCalibration& out) const {
+    double a[9][10];
+    for (int i = 0; i < 9; i++) {
+      for (int j = 0; j < 9; j++) a[i][j] = j >= i ? normal[i][j] : normal[j][i];
+      a[i][9] = rhs[i];
+    }
+    double p[9];
+    if (!solve(a, p)) return false;
+
+    // quadric m^T A m + 2 b^T m = 1
+    double A[3][3] = { { p[0], p[3], p[4] }, { p[3], p[1], p[5] }, { p[4], p[5], p[2] } };
+    double b[3] = { p[6], p[7], p[8] };
+
+    // center c = -A^-1 b, then (m - c)^T (A / s) (m - c) = 1; s and A are
+    // both negative when the origin is outside the ellipsoid
+    double inv[3][3];
+    if (!invert3(A, inv)) return false;
+    double c[3], s = 1;
+    for (int i = 0; i < 3; i++) c[i] = -(inv[i][0] * b[0] + inv[i][1] * b[1] + inv[i][2] * b[2]);
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) s += c[i] * A[i][j] * c[j];
+    if (!(fabs(s) > 0)) return false;
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) A[i][j] /= s;
+
+    // symmetric square root, so the correction does not rotate the field
+    double values[3], vectors[3][3];
+    eigenSymmetric3(A, values, vectors);
+    double lo = values[0], hi = values[0];
+    for (int k = 1; k < 3; k++) {
+      if (values[k] < lo) lo = values[k];
+      if (values[k] > hi) hi = values[k];
+    }
+    if (!(lo > 0) || hi / lo > maxAxisRatio * maxAxisRatio) return false;
+
+    // keep the mean radius, so the field stays in micro Tesla
+    double radius = pow(values[0] * values[1] * values[2], -1.0 / 6);
+    if (radius < minRadius || radius > maxRadius) return false;
+
+    for (int i = 0; i < 3; i++) {
+      out.offset[i] = c[i];
+      for (int j = 0; j < 3; j++) {
+        double w = 0;
+        for (int k = 0; k < 3; k++) w += vectors[i][k] * sqrt(values[k]) * vectors[j][k];
+        out.matrix[i][j] = radius * w;
+      }
+    }
+    return true;
+  }
+
+private:
+  double normal[9][9];  // upper triangle of D^T D
+  double rhs[9];        // D^T 1
+  unsigned long accepted;
+  uint8_t octants;
+  RunningStats3 spread;
+  double last[3];
+  bool haveLast;
+
+  static double sq3(double x, double y, double z) { return x * x + y * y + z * z; }
+
+  /* Gaussian elimination with partial pivoting on an augmented 9x10 matrix */
+  static bool solve(double a[9][10], double* x) {
+    for (int col = 0; col < 9; col++) {
+      int pivot = col;
+      for (int row = col + 1; row < 9; row++)
+        if (fabs(a[row][col]) > fabs(a[pivot][col])) pivot = row;
+      if (a[pivot][col] == 0) return false;
+      if (pivot != col) {
+        for (int k = 0; k < 10; k++) {
+          double t = a[col][k];
+          a[col][k] = a[pivot][k];
+          a[pivot][k] = t;
+        }
+      }
+      for (int row = col + 1; row < 9; row++) {
+        double f = a[row][col] / a[col][col];
+        for (int k = col; k < 10; k++) a[row][k] -= f * a[col][k];
+      }
+    }
+    for (int row = 8; row >= 0; row--) {
+      double v = a[row][9];
+      for (int k = row + 1; k < 9; k++) v -= a[row][k] * x[k];
+      x[row] = v / a[row][row];
+    }
+    return true;
+  }
+
+  static bool invert3(const double m[3][3], double inv[3][3]) {
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                 m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                 m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (det == 0) return false;
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+        // cofactor of m[j][i]
+        int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+        inv[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+      }
+    }
+    return true;
+  }
+
+  /* Jacobi rotations: m = V diag(values) V^T, eigenvectors in the columns of V */
+  static void eigenSymmetric3(const double m[3][3], double* values, double v[3][3]) {
+    double a[3][3];
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) {
+        a[i][j] = m[i][j];
+        v[i][j] = i == j ? 1 : 0;
+      }
+
+    for (int sweep = 0; sweep < 20; sweep++) {
+      double off = fabs(a[0][1]) + fabs(a[0][2]) + fabs(a[1][2]);
+      if (off < 1e-15 * (fabs(a[0][0]) + fabs(a[1][1]) + fabs(a[2][2]))) break;
+      for (int p = 0; p < 2; p++) {
+        for (int q = p + 1; q < 3; q++) {
+          if (a[p][q] == 0) continue;
+          double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+          double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+          double c = 1 / sqrt(t * t + 1), s = t * c;
+          for (int k = 0; k < 3; k++) {
+            double akp = a[k][p], akq = a[k][q];
+            a[k][p] = c * akp - s * akq;
+            a[k][q] = s * akp + c * akq;
+          }
+          for (int k = 0; k < 3; k++) {
+            double apk = a[p][k], aqk = a[q][k];
+            a[p][k] = c * apk - s * aqk;
+            a[q][k] = s * apk + c * aqk;
+          }
+          for (int k = 0; k < 3; k++) {
+            double vkp = v[k][p], vkq = v[k][q];
+            v[k][p] = c * vkp - s * vkq;
+            v[k][q] = s * vkp + c * vkq;
+          }
+        }
+      }
+    }
+    for (int k = 0; k < 3; k++) values[k] = a[k][k];
+  }
+};
+
+#endif // ifndef CALIBRATION_H
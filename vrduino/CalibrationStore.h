@@ -0,0 +1,66 @@
+/**
+ * Calibration kept in EEPROM across power cycles
+ *
+ * One StoredCalibration record at CALIBRATION_EEPROM_ADDRESS, checked by a
+ * magic number and a CRC-16 (the one of ImuPacket.h). EEPROM.put() only
+ * writes bytes that changed, so saving an unchanged record costs no wear;
+ * the Teensy's emulated EEPROM lasts about 100000 writes per byte.
+ */
+
+#ifndef CALIBRATION_STORE_H
+#define CALIBRATION_STORE_H
+
+#include <EEPROM.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ImuPacket.h"
+
+const int CALIBRATION_EEPROM_ADDRESS = 0;
+
+/* "VRC1" */
+const uint32_t CALIBRATION_MAGIC = 0x31435256;
+
+/* StoredCalibration::flags */
+const uint8_t CALIBRATION_GYRO = 0x01;
+const uint8_t CALIBRATION_MAG  = 0x02;
+
+/* value-initialize (StoredCalibration()) so the padding is 0 for the CRC */
+struct StoredCalibration {
+  uint32_t magic;
+  uint8_t flags;
+  uint8_t reserved[3];
+  float gyrBias[3];      // deg/s
+  float gyrVariance[3];  // (deg/s)^2
+  float magOffset[3];    // micro Tesla
+  float magMatrix[9];    // row major
+  uint16_t crc;
+  uint8_t padding[2];
+};
+
+inline uint16_t calibrationCrc(const StoredCalibration& c) {
+  return imuPacketCrc(reinterpret_cast<const uint8_t*>(&c), offsetof(StoredCalibration, crc));
+}
+
+/* returns false if there is no valid record */
+inline bool loadCalibration(StoredCalibration& out) {
+  StoredCalibration c;
+  EEPROM.get(CALIBRATION_EEPROM_ADDRESS, c);
+  if (c.magic != CALIBRATION_MAGIC || c.crc != calibrationCrc(c)) return false;
+  out = c;
+  return true;
+}
+
+inline void saveCalibration(StoredCalibration& c) {
+  c.magic = CALIBRATION_MAGIC;
+  c.crc = calibrationCrc(c);
+  EEPROM.put(CALIBRATION_EEPROM_ADDRESS, c);
+}
+
+/* invalidate the record, so the next start measures again */
+inline void clearCalibration() {
+  uint32_t erased = 0xffffffff;
+  EEPROM.put(CALIBRATION_EEPROM_ADDRESS, erased);
+}
+
+#endif // ifndef CALIBRATION_STORE_H
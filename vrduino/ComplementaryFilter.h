@@ -0,0 +1,64 @@
+/**
+ * Quaternion complementary filter, templated on the scalar type
+ *
+ * This is the QUATERNION branch of loop(), pulled out so the same code runs
+ * on the Teensy and in the host benchmark (host/quaternion-bench.cpp) for
+ * double, float and Q16.
+ *
+ * The order of the operations is chosen so intermediates stay small enough
+ * for Q16.16 (max 32767): the gyro is converted to rad/s before squaring,
+ * the accelerometer to g, and the time step stays in integer milliseconds.
+ */
+
+#ifndef COMPLEMENTARY_FILTER_H
+#define COMPLEMENTARY_FILTER_H
+
+#include "Quaternion.h"
+
+/***
+ * One filter update.
+ *
+ * qCmp: current estimate
+ * gyrX, gyrY, gyrZ: bias corrected gyro rates in degrees per second
+ * accX, accY, accZ: accelerometer in m/s^2
+ * timeDeltaMs: time since the last update in milliseconds
+ * a: weight of the gyro estimate (1 - a is the tilt correction)
+ */
+template <typename T>
+QuaternionT<T> complementaryFilterUpdate(const QuaternionT<T>& qCmp,
+                                         T gyrX, T gyrY, T gyrZ,
+                                         T accX, T accY, T accZ,
+                                         T timeDeltaMs, T a) {
+  T rateX = gyrX * T(PI / 180);
+  T rateY = gyrY * T(PI / 180);
+  T rateZ = gyrZ * T(PI / 180);
+  T rate = scalarSqrt(sq(rateX) + sq(rateY) + sq(rateZ)); // rad per second
+  if (rate == T(0)) return qCmp;
+
+  // setFromAngleAxis wants degrees
+  T angle = rate * timeDeltaMs * T(180 / (PI * 1000));
+  QuaternionT<T> qdel = QuaternionT<T>().setFromAngleAxis(angle, rateX / rate, rateY / rate, rateZ / rate);
+  QuaternionT<T> qGyro = QuaternionT<T>::product(qCmp, qdel);
+  qGyro.normalizeFast();
+
+  // gravity direction in the world frame: qCmp * acc * qCmp^-1
+  T toG = T(1 / 9.80665);
+  QuaternionT<T> qAlpha = QuaternionT<T>(T(0), accX * toG, accY * toG, accZ * toG);
+  qAlpha.normalize();
+  T up[3];
+  qCmp.rotateVector(qAlpha.q[1], qAlpha.q[2], qAlpha.q[3], up);
+  QuaternionT<T> qRotNorm = QuaternionT<T>(T(0), up[0], up[1], up[2]).normalize();
+
+  // the tilt axis is undefined when the rotated gravity points straight up
+  T horizontal = scalarSqrt(sq(qRotNorm.q[1]) + sq(qRotNorm.q[3]));
+  if (horizontal == T(0)) return qGyro;
+
+  // (-z, 0, x) / horizontal is a unit vector already
+  T tilt = scalarAcos(qRotNorm.q[2]) * T(180 / PI);
+  QuaternionT<T> qTiltCorrect = QuaternionT<T>().setFromAngleAxis(tilt * (T(1) - a),
+    -qRotNorm.q[3] / horizontal, T(0), qRotNorm.q[1] / horizontal);
+
+  return qGyro.premultiplyBy(qTiltCorrect).normalizeFast();
+}
+
+#endif // ifndef COMPLEMENTARY_FILTER_H
@@ -0,0 +1,51 @@
+/**
+ * CPU cycle counter, for measuring the cost of code on the target
+ *
+ * On the Teensy 3.x (Cortex-M4) this is the DWT cycle counter, which
+ * cycleCounterBegin() switches on. On x86 hosts it is the time stamp counter.
+ * Differences of two readings are valid across one wrap of 32 bits.
+ */
+
+#ifndef CYCLE_COUNTER_H
+#define CYCLE_COUNTER_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#if defined(ARM_DWT_CYCCNT)
+
+inline void cycleCounterBegin() {
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+}
+
+inline uint32_t cycleCount() {
+  return ARM_DWT_CYCCNT;
+}
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+#include <x86intrin.h>
+
+inline void cycleCounterBegin() {}
+
+inline uint32_t cycleCount() {
+  return uint32_t(__rdtsc());
+}
+
+#else
+
+/* no cycle counter: microseconds scaled by the clock */
+inline void cycleCounterBegin() {}
+
+inline uint32_t cycleCount() {
+#ifdef F_CPU
+  return uint32_t(micros() * (F_CPU / 1000000UL));
+#else
+  return uint32_t(micros());
+#endif
+}
+
+#endif
+
+#endif // ifndef CYCLE_COUNTER_H
@@ -11,17 +11,22 @@
 
 #include "Arduino.h"
 
-class Euler {
+/* templated on the scalar type like QuaternionT, see Quaternion.h */
+template <typename T>
+class EulerT {
 public:
 
-  double pitch, yaw, roll;
+  T pitch, yaw, roll;
 
-  Euler(double _pitch, double _yaw, double _roll)
+  EulerT(T _pitch, T _yaw, T _roll)
     : pitch(_pitch), yaw(_yaw), roll(_roll) {}
 
 
-  Euler()
+  EulerT()
     : pitch(0), yaw(0), roll(0) {}
 };
 
+typedef EulerT<double> Euler;
+typedef EulerT<float>  Eulerf;
+
 #endif // ifndef EULER_H
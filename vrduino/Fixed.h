@@ -0,0 +1,227 @@
+/**
+ * Q-format fixed-point scalar
+ *
+ * Fixed<F> stores a number as a 32 bit integer with F fractional bits, so
+ * Fixed<16> (Q16.16) covers +-32768 with a resolution of 1.5e-5. That is
+ * enough for gyro rates in degrees per second and for unit quaternions, and
+ * every operation is a few integer instructions, which matters on boards
+ * without an FPU where float and double are both emulated in software.
+ *
+ * Products and quotients go through 64 bit intermediates and round to
+ * nearest; truncating instead biases every normalize() the same way, and the
+ * filter drifts by degrees per minute. Nothing saturates: keep values inside
+ * the range of the format.
+ *
+ * The math functions (sqrt, sin, cos, acos, atan2) are overloads of the ones
+ * in Scalar.h. Trigonometry is evaluated in Q2.30 with polynomials accurate
+ * to about 1e-7, well below the resolution of Q16.16.
+ */
+
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <stdint.h>
+
+#include "Scalar.h"
+
+template <int F>
+class Fixed {
+public:
+
+  static_assert(F > 0 && F < 31, "Fixed needs 1 to 30 fractional bits");
+
+  /* raw two's complement value, scaled by 2^F */
+  int32_t raw;
+
+  constexpr Fixed() : raw(0) {}
+
+  /* conversions from built-in numbers; meant for constants and inputs */
+  constexpr Fixed(int v) : raw(int32_t(int64_t(v) * (int64_t(1) << F))) {}
+  constexpr Fixed(double v) : raw(int32_t(v * double(int64_t(1) << F) + (v < 0 ? -0.5 : 0.5))) {}
+  constexpr Fixed(float v) : Fixed(double(v)) {}
+
+  static constexpr Fixed fromRaw(int32_t r) {
+    return Fixed(r, RawTag());
+  }
+
+  explicit constexpr operator double() const {
+    return double(raw) / double(int64_t(1) << F);
+  }
+
+  explicit constexpr operator float() const {
+    return float(raw) / float(int64_t(1) << F);
+  }
+
+  friend constexpr Fixed operator+(Fixed a, Fixed b) {
+    return fromRaw(a.raw + b.raw);
+  }
+
+  friend constexpr Fixed operator-(Fixed a, Fixed b) {
+    return fromRaw(a.raw - b.raw);
+  }
+
+  friend constexpr Fixed operator-(Fixed a) {
+    return fromRaw(-a.raw);
+  }
+
+  friend constexpr Fixed operator*(Fixed a, Fixed b) {
+    return fromRaw(int32_t((int64_t(a.raw) * b.raw + (int64_t(1) << (F - 1))) >> F));
+  }
+
+  friend Fixed operator/(Fixed a, Fixed b) {
+    int64_t n = int64_t(a.raw) * (int64_t(1) << F);
+    int64_t half = (b.raw < 0 ? -int64_t(b.raw) : int64_t(b.raw)) / 2;
+    return fromRaw(int32_t(((n < 0) == (b.raw < 0) ? n + half : n - half) / b.raw));
+  }
+
+  Fixed& operator+=(Fixed b) { return *this = *this + b; }
+  Fixed& operator-=(Fixed b) { return *this = *this - b; }
+  Fixed& operator*=(Fixed b) { return *this = *this * b; }
+  Fixed& operator/=(Fixed b) { return *this = *this / b; }
+
+  friend constexpr bool operator==(Fixed a, Fixed b) { return a.raw == b.raw; }
+  friend constexpr bool operator!=(Fixed a, Fixed b) { return a.raw != b.raw; }
+  friend constexpr bool operator<(Fixed a, Fixed b)  { return a.raw < b.raw; }
+  friend constexpr bool operator>(Fixed a, Fixed b)  { return a.raw > b.raw; }
+  friend constexpr bool operator<=(Fixed a, Fixed b) { return a.raw <= b.raw; }
+  friend constexpr bool operator>=(Fixed a, Fixed b) { return a.raw >= b.raw; }
+
+private:
+  struct RawTag {};
+  constexpr Fixed(int32_t r, RawTag) : raw(r) {}
+};
+
+/* Q16.16, the default fixed-point format for the fusion math */
+typedef Fixed<16> Q16;
+
+
+/***
+ * Fixed-point math. Internally angles and polynomial terms use Q2.30 in 64
+ * bit integers.
+ */
+namespace fixedmath {
+
+const int64_t ONE      = int64_t(1) << 30;
+const int64_t HALF_PI  = 1686629713;  // pi/2 in Q2.30
+const int64_t PI_Q30   = 3373259426;  // pi
+const int64_t TWO_PI   = 6746518852;  // 2 pi
+const int64_t PI_6     = 562209904;   // pi/6
+const int64_t SQRT3    = 1859775393;  // sqrt(3)
+const int64_t TAN_PI12 = 287708255;   // tan(pi/12)
+
+inline int64_t mul30(int64_t a, int64_t b) {
+  return (a * b) >> 30;
+}
+
+inline int64_t toQ30(int32_t raw, int f) {  // f <= 30
+  return int64_t(raw) * (int64_t(1) << (30 - f));
+}
+
+inline int32_t fromQ30(int64_t v, int f) {  // rounds to nearest
+  return int32_t((v + (int64_t(1) << (29 - f))) >> (30 - f));
+}
+
+/* sin(x) for x in [-pi/2, pi/2], Taylor series to x^11, error < 1e-7 */
+inline int64_t sinHalfRange(int64_t x) {
+  int64_t x2 = mul30(x, x);
+  int64_t p = ONE - x2 / 110;
+  p = ONE - mul30(x2, p) / 72;
+  p = ONE - mul30(x2, p) / 42;
+  p = ONE - mul30(x2, p) / 20;
+  p = ONE - mul30(x2, p) / 6;
+  return mul30(x, p);
+}
+
+/* sin(x) for any x in Q2.30 radians held in 64 bits */
+inline int64_t sinQ30(int64_t x) {
+  x %= TWO_PI;
+  if (x > PI_Q30) x -= TWO_PI;
+  if (x < -PI_Q30) x += TWO_PI;
+  // fold [-pi, pi] onto [-pi/2, pi/2]
+  if (x > HALF_PI) x = PI_Q30 - x;
+  if (x < -HALF_PI) x = -PI_Q30 - x;
+  return sinHalfRange(x);
+}
+
+/* atan(z) for z in [0, 1] */
+inline int64_t atanUnit(int64_t z) {
+  int64_t offset = 0;
+  if (z > TAN_PI12) {
+    // atan(z) = pi/6 + atan((sqrt(3) z - 1) / (z + sqrt(3)))
+    z = (mul30(SQRT3, z) - ONE) * ONE / (z + SQRT3);
+    offset = PI_6;
+  }
+  int64_t z2 = mul30(z, z);
+  int64_t p = ONE / 9;
+  p = ONE / 7 - mul30(z2, p);
+  p = ONE / 5 - mul30(z2, p);
+  p = ONE / 3 - mul30(z2, p);
+  p = ONE - mul30(z2, p);
+  return offset + mul30(z, p);
+}
+
+/* atan2 on any two values of the same scale */
+inline int64_t atan2Q30(int64_t y, int64_t x) {
+  if (x == 0 && y == 0) return 0;
+  int64_t ax = x < 0 ? -x : x, ay = y < 0 ? -y : y;
+  int64_t a = ay <= ax ? atanUnit((ay << 30) / ax) : HALF_PI - atanUnit((ax << 30) / ay);
+  if (x < 0) a = PI_Q30 - a;
+  return y < 0 ? -a : a;
+}
+
+inline uint64_t isqrt64(uint64_t v) {
+  uint64_t result = 0, bit = uint64_t(1) << 62;
+  while (bit > v) bit >>= 2;
+  while (bit) {
+    if (v >= result + bit) {
+      v -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return result;
+}
+
+} // namespace fixedmath
+
+
+template <int F>
+inline Fixed<F> scalarSqrt(Fixed<F> x) {
+  if (x.raw <= 0) return Fixed<F>();
+  return Fixed<F>::fromRaw(int32_t(fixedmath::isqrt64(uint64_t(x.raw) << F)));
+}
+
+template <int F>
+inline Fixed<F> scalarSin(Fixed<F> x) {
+  return Fixed<F>::fromRaw(fixedmath::fromQ30(fixedmath::sinQ30(fixedmath::toQ30(x.raw, F)), F));
+}
+
+template <int F>
+inline Fixed<F> scalarCos(Fixed<F> x) {
+  int64_t shifted = fixedmath::toQ30(x.raw, F) + fixedmath::HALF_PI;
+  return Fixed<F>::fromRaw(fixedmath::fromQ30(fixedmath::sinQ30(shifted), F));
+}
+
+template <int F>
+inline Fixed<F> scalarAtan2(Fixed<F> y, Fixed<F> x) {
+  return Fixed<F>::fromRaw(fixedmath::fromQ30(fixedmath::atan2Q30(y.raw, x.raw), F));
+}
+
+template <int F>
+inline Fixed<F> scalarAcos(Fixed<F> x) {
+  // acos(x) = atan2(sqrt(1 - x^2), x), clamped to the domain
+  int64_t c = fixedmath::toQ30(x.raw, F);
+  if (c > fixedmath::ONE) c = fixedmath::ONE;
+  if (c < -fixedmath::ONE) c = -fixedmath::ONE;
+  int64_t s = int64_t(fixedmath::isqrt64(uint64_t(fixedmath::ONE - fixedmath::mul30(c, c)) << 30));
+  return Fixed<F>::fromRaw(fixedmath::fromQ30(fixedmath::atan2Q30(s, c), F));
+}
+
+template <int F>
+inline double scalarToDouble(Fixed<F> x) {
+  return double(x);
+}
+
+#endif // ifndef FIXED_H
@@ -0,0 +1,259 @@
+/**
+ * Orientation fusion engines
+ *
+ * FusionEngine is the interface loop() talks to; MadgwickFusion.h,
+ * MahonyFusion.h and EkfFusion.h implement it. Every engine splits an
+ * update into predict(), which integrates the gyro, and correct(), which
+ * pulls the estimate towards the accelerometer (tilt) and magnetometer
+ * (yaw).
+ *
+ * The split is what the cycle budget works with: the base class measures
+ * both parts with the cycle counter, and if predict plus correct do not fit
+ * into the budget, correct() only runs every correctionInterval() updates,
+ * with the time since its last run. The gyro is integrated at the full
+ * rate either way.
+ *
+ * Engines work in a frame with z up and magnetic north along x, as in the
+ * papers, and orientation() converts to the y-up world of
+ * ComplementaryFilter.h and the renderer, with magnetic north along -z (into
+ * the screen). Like qCmp, the orientation rotates sensor coordinates into
+ * world coordinates. The first update sets the tilt from the accelerometer
+ * and, with the magnetometer, the yaw; without it yaw starts at 0.
+ */
+
+#ifndef FUSION_H
+#define FUSION_H
+
+#include "CycleCounter.h"
+#include "Euler.h"
+#include "Quaternion.h"
+
+/* one IMU sample in the units of the Imu class */
+template <typename T>
+struct FusionInput {
+  T gyrX, gyrY, gyrZ;  // bias corrected, degrees per second
+  T accX, accY, accZ;  // m/s^2; only the direction is used
+  T magX, magY, magZ;  // micro Tesla; only the direction is used
+  bool hasMag;         // the magnetometer values are a new measurement
+};
+
+template <typename T>
+class FusionEngine {
+public:
+
+  FusionEngine() : budget(0), interval(1), skipped(0), skippedTime(0),
+    predictCost(0), correctCost(0), useMag(true), haveMag(false), freshMag(false),
+    aligned(false) {
+    q = toInternal();
+  }
+
+  virtual ~FusionEngine() {}
+
+  virtual const char* name() const = 0;
+
+  /* back to the identity; the next update aligns with gravity and north */
+  void reset() {
+    q = toInternal();
+    aligned = false;
+    haveMag = freshMag = false;
+    skipped = 0;
+    skippedTime = T(0);
+    resetState();
+  }
+
+  /* dt is the time since the last update in seconds */
+  void update(const FusionInput<T>& in, T dt) {
+    if (in.hasMag) {
+      mag = in;
+      haveMag = freshMag = true;
+    }
+
+    if (!aligned) {
+      align(in, useMag && haveMag);
+      return;
+    }
+
+    uint32_t start = cycleCount();
+    predict(in, dt);
+    uint32_t predicted = cycleCount();
+    average(predictCost, predicted - start);
+
+    skippedTime += dt;
+    if (++skipped < interval) return;
+
+    FusionInput<T> measured = in;
+    measured.magX = mag.magX;
+    measured.magY = mag.magY;
+    measured.magZ = mag.magZ;
+    measured.hasMag = useMag && haveMag;
+    correct(measured, skippedTime, freshMag);
+    average(correctCost, cycleCount() - predicted);
+
+    freshMag = false;
+    skipped = 0;
+    skippedTime = T(0);
+    adaptInterval();
+  }
+
+  /* sensor to world, y up */
+  QuaternionT<T> orientation() const {
+    return QuaternionT<T>::product(toWorld(), q);
+  }
+
+  /***
+   * Cycles one update may take on average, 0 for no limit. Corrections are
+   * spread out until predict() plus the share of correct() fit.
+   */
+  void setCycleBudget(uint32_t cycles) {
+    budget = cycles;
+    adaptInterval();
+  }
+
+  uint32_t cycleBudget() const { return budget; }
+
+  /* updates per correction */
+  int correctionInterval() const { return interval; }
+
+  /* measured average cost of the two parts, in cycles */
+  float predictCycles() const { return predictCost; }
+  float correctCycles() const { return correctCost; }
+
+  /* average cycles per update at the current interval */
+  float cyclesPerUpdate() const { return predictCost + correctCost / interval; }
+
+  /* without the magnetometer, yaw is the integrated gyro */
+  void setUseMagnetometer(bool use) { useMag = use; }
+
+protected:
+
+  /* orientation from sensor to the internal z-up frame */
+  QuaternionT<T> q;
+
+  /* integrate the gyro over dt */
+  virtual void predict(const FusionInput<T>& in, T dt) = 0;
+
+  /***
+   * Correct with the accelerometer, and the magnetometer if in.hasMag. dt is
+   * the time since the last correction; newMag is false when the
+   * magnetometer values were already used by an earlier correction.
+   */
+  virtual void correct(const FusionInput<T>& in, T dt, bool newMag) = 0;
+
+  /* engine state beyond q, e.g. integrators and covariance */
+  virtual void resetState() {}
+
+  static T degToRad(T degrees) { return degrees * T(PI / 180); }
+
+  /* q = q + 0.5 * q * (0, wx, wy, wz) * dt, normalized; the step changes
+     the length so little that normalizeFast() needs no square root */
+  void integrate(T wx, T wy, T wz, T dt) {
+    T h = T(0.5) * dt;
+    T w = q.q[0], x = q.q[1], y = q.q[2], z = q.q[3];
+    q.q[0] = w + h * (-x * wx - y * wy - z * wz);
+    q.q[1] = x + h * (w * wx + y * wz - z * wy);
+    q.q[2] = y + h * (w * wy - x * wz + z * wx);
+    q.q[3] = z + h * (w * wz + x * wy - y * wx);
+    q.normalizeFast();
+  }
+
+private:
+  static const int MAX_INTERVAL = 64;
+
+  uint32_t budget;
+  int interval;
+  int skipped;
+  T skippedTime;
+  float predictCost, correctCost;
+  bool useMag, haveMag, freshMag, aligned;
+  FusionInput<T> mag;
+
+  /* internal z (up) to world y, internal x (north) to world -z */
+  static QuaternionT<T> toWorld() {
+    return QuaternionT<T>(T(0.5), T(-0.5), T(0.5), T(0.5));
+  }
+
+  static QuaternionT<T> toInternal() {
+    return QuaternionT<T>(T(0.5), T(0.5), T(-0.5), T(-0.5));
+  }
+
+  static void average(float& cost, uint32_t cycles) {
+    cost = cost == 0 ? float(cycles) : cost + (float(cycles) - cost) / 16;
+  }
+
+  void adaptInterval() {
+    if (budget == 0 || correctCost == 0) {
+      interval = 1;
+    } else if (float(budget) <= predictCost) {
+      interval = MAX_INTERVAL;
+    } else {
+      float needed = correctCost / (float(budget) - predictCost);
+      interval = needed <= 1 ? 1 : needed >= MAX_INTERVAL ? MAX_INTERVAL : int(needed + 0.999f);
+    }
+  }
+
+  /***
+   * Start from the tilt the accelerometer sees, and the yaw the magnetometer
+   * sees if withMag, instead of converging from the identity.
+   */
+  void align(const FusionInput<T>& in, bool withMag) {
+    T norm = scalarSqrt(sq(in.accX) + sq(in.accY) + sq(in.accZ));
+    if (norm == T(0)) return;
+    T ax = in.accX / norm, ay = in.accY / norm, az = in.accZ / norm;
+
+    // shortest rotation from the measured up (sensor) to world y:
+    // axis a x y = (-az, 0, ax), cos(angle) = ay
+    QuaternionT<T> tilt;
+    T w = T(1) + ay;
+    if (w < T(1e-6)) {
+      tilt = QuaternionT<T>(T(0), T(1), T(0), T(0));  // upside down
+    } else {
+      tilt = QuaternionT<T>(w, -az, T(0), ax).normalize();
+    }
+    q = QuaternionT<T>::product(toInternal(), tilt);
+
+    if (withMag) {
+      // the field in the internal frame; turn about z until it points along x
+      T h[3];
+      q.rotateVector(mag.magX, mag.magY, mag.magZ, h);
+      if (h[0] != T(0) || h[1] != T(0)) {
+        T heading = scalarAtan2(h[1], h[0]);
+        QuaternionT<T> turn(scalarCos(heading / 2), T(0), T(0), -scalarSin(heading / 2));
+        q.premultiplyBy(turn);
+      }
+    }
+    aligned = true;
+  }
+};
+
+
+/***
+ * Euler angles in degrees, in the YXZ order the renderer uses
+ * (THREE.Euler(pitch, yaw, roll, "YXZ"))
+ */
+template <typename T>
+EulerT<T> quaternionToEuler(const QuaternionT<T>& r) {
+  T w = r.q[0], x = r.q[1], y = r.q[2], z = r.q[3];
+  T m13 = T(2) * (x * z + w * y);
+  T m23 = T(2) * (y * z - w * x);
+  T m33 = T(1) - T(2) * (x * x + y * y);
+  T m21 = T(2) * (x * y + w * z);
+  T m22 = T(1) - T(2) * (x * x + z * z);
+  T m11 = T(1) - T(2) * (y * y + z * z);
+  T m31 = T(2) * (x * z - w * y);
+
+  T toDeg = T(180 / PI);
+  if (m23 > T(0.9999999)) m23 = T(0.9999999);
+  if (m23 < T(-0.9999999)) m23 = T(-0.9999999);
+  T pitch = -(scalarAtan2(m23, scalarSqrt(T(1) - m23 * m23)));
+  T yaw, roll;
+  if (m23 < T(0.9999) && m23 > T(-0.9999)) {
+    yaw = scalarAtan2(m13, m33);
+    roll = scalarAtan2(m21, m22);
+  } else {
+    yaw = scalarAtan2(-m31, m11);
+    roll = T(0);
+  }
+  return EulerT<T>(pitch * toDeg, yaw * toDeg, roll * toDeg);
+}
+
+#endif // ifndef FUSION_H
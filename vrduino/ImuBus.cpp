@@ -0,0 +1,44 @@
+/**
+ * I2C implementation of ImuBus
+ */
+
+#include "ImuBus.h"
+
+#include <Arduino.h>
+
+/* for I2C communication */
+#include <Wire.h>
+
+void WireBus::begin() {
+  Wire.begin();
+}
+
+/***
+ * This function reads size bytes from I2C device at address address.
+ * Put read bytes starting at register reg in the data array.
+ */
+void WireBus::read(uint8_t address, uint8_t reg, uint8_t size, uint8_t* data) {
+  // Set register address, with a restart to keep the connection
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  Wire.endTransmission(false);
+
+  // Read size bytes
+  Wire.requestFrom(address, size);
+  uint8_t index = 0;
+
+  while (Wire.available() && index < size) data[index++] = Wire.read();
+}
+
+/* Write a byte (data) in device (address) at register (reg) */
+void WireBus::writeByte(uint8_t address, uint8_t reg, uint8_t data) {
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  Wire.write(data);
+  Wire.endTransmission();
+}
+
+WireBus& defaultWireBus() {
+  static WireBus bus;
+  return bus;
+}
@@ -0,0 +1,50 @@
+/**
+ * Register access to the IMU chips
+ *
+ * The Imu class talks to the MPU9250 and its AK8963 magnetometer only
+ * through this interface. WireBus is the I2C implementation used on the
+ * Teensy; host/SimImuBus.h simulates the registers so the acquisition code
+ * runs on a PC.
+ */
+
+#ifndef IMU_BUS_H
+#define IMU_BUS_H
+
+#include <stdint.h>
+
+class ImuBus {
+public:
+
+  virtual ~ImuBus() {}
+
+  /* called from Imu::init() */
+  virtual void begin() {}
+
+  /* read size bytes starting at register reg of the chip at address */
+  virtual void read(uint8_t address, uint8_t reg, uint8_t size, uint8_t* data) = 0;
+
+  /* write one byte to register reg of the chip at address */
+  virtual void writeByte(uint8_t address, uint8_t reg, uint8_t data) = 0;
+
+  /***
+   * Most bytes one read() may ask for. Wire's buffer is 32 bytes, so FIFO
+   * drains are split into reads of this size.
+   */
+  virtual uint8_t maxRead() const { return 32; }
+};
+
+/* I2C through the Arduino Wire library */
+class WireBus : public ImuBus {
+public:
+
+  virtual void begin();
+
+  virtual void read(uint8_t address, uint8_t reg, uint8_t size, uint8_t* data);
+
+  virtual void writeByte(uint8_t address, uint8_t reg, uint8_t data);
+};
+
+/* the bus the default Imu uses */
+WireBus& defaultWireBus();
+
+#endif // ifndef IMU_BUS_H
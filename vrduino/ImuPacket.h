@@ -0,0 +1,284 @@
+/**
+ * Binary IMU stream protocol
+ *
+ * Replaces the "QC %f %f %f %f\n" text lines with COBS-framed packets that
+ * carry a batch of samples of one kind:
+ *
+ *   offset  size  field
+ *   0       1     type, the streaming mode (QUATERNION, EULER, GYR, ...)
+ *   1       1     number of samples, 1 to IMU_PACKET_MAX_SAMPLES
+ *   2       2     sequence number, +1 per packet, wraps
+ *   4       4     time of the first sample, micros()
+ *   8       ...   samples: 2 bytes time offset from the first sample in us,
+ *                 then the values (see imuPacketValueSize)
+ *   end     2     CRC-16/CCITT-FALSE of everything above
+ *
+ * All fields are little-endian. Quaternions are 4 int16 in Q1.14, and
+ * QUATERNION_PREDICTED samples are two of them, the estimate and the pose
+ * predicted for when it is displayed (PosePredictor.h). RAW samples are 9
+ * floats (gyro, accelerometer, magnetometer), every other type is 3 floats.
+ * The packet is COBS encoded and followed by a 0 byte, so a reader can
+ * resynchronize on any 0 byte.
+ *
+ * One quaternion sample costs 22 bytes on the wire (about 40 as text), a
+ * batch of 4 costs 13 bytes per sample.
+ *
+ * The header only depends on the C library, so the host decoder
+ * (host/ImuDecoder.h) uses it too.
+ */
+
+#ifndef IMU_PACKET_H
+#define IMU_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* packet types, equal to the streaming modes in vrduino.ino */
+const uint8_t IMU_PACKET_EULER      = 1;
+const uint8_t IMU_PACKET_QUATERNION = 2;
+const uint8_t IMU_PACKET_GYR        = 3;
+const uint8_t IMU_PACKET_ACC        = 4;
+const uint8_t IMU_PACKET_MAG        = 5;
+const uint8_t IMU_PACKET_GYRINT     = 6;
+const uint8_t IMU_PACKET_RAW        = 8;
+const uint8_t IMU_PACKET_QUATERNION_PREDICTED = 9;
+
+const int IMU_PACKET_MAX_SAMPLES = 8;
+const int IMU_PACKET_HEADER_SIZE = 8;
+const int IMU_PACKET_MAX_VALUES  = 9;
+
+/* largest packet before COBS: header, 8 RAW samples of 2 + 36 bytes, CRC */
+const int IMU_PACKET_MAX_SIZE = IMU_PACKET_HEADER_SIZE + IMU_PACKET_MAX_SAMPLES * 38 + 2;
+
+/* largest frame on the wire: COBS adds a byte per 254, plus the delimiter */
+const int IMU_PACKET_MAX_FRAME = IMU_PACKET_MAX_SIZE + IMU_PACKET_MAX_SIZE / 254 + 2;
+
+/* Q1.14 scale of quaternion components */
+const float IMU_PACKET_QUATERNION_SCALE = 16384.0f;
+
+/* values are Q1.14 quaternion components */
+inline bool imuPacketIsQuaternion(uint8_t type) {
+  return type == IMU_PACKET_QUATERNION || type == IMU_PACKET_QUATERNION_PREDICTED;
+}
+
+/* number of values per sample, 0 for an unknown type */
+inline int imuPacketValueCount(uint8_t type) {
+  if (type == IMU_PACKET_QUATERNION) return 4;
+  if (type == IMU_PACKET_QUATERNION_PREDICTED) return 8;
+  if (type == IMU_PACKET_RAW) return 9;
+  if (type >= IMU_PACKET_EULER && type <= IMU_PACKET_GYRINT) return 3;
+  return 0;
+}
+
+/* bytes of values per sample */
+inline int imuPacketValueSize(uint8_t type) {
+  return (imuPacketIsQuaternion(type) ? 2 : 4) * imuPacketValueCount(type);
+}
+
+
+/* CRC-16/CCITT-FALSE (poly 0x1021, init 0xffff), bitwise to save flash */
+inline uint16_t imuPacketCrc(const uint8_t* data, size_t size) {
+  uint16_t crc = 0xffff;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= uint16_t(data[i]) << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021) : uint16_t(crc << 1);
+    }
+  }
+  return crc;
+}
+
+
+/***
+ * COBS encoding of in[0, size) into out, which needs size + size / 254 + 1
+ * bytes. Does not add the 0 delimiter. Returns the encoded size.
+ */
+inline size_t cobsEncode(const uint8_t* in, size_t size, uint8_t* out) {
+  size_t code = 0, o = 1;
+  uint8_t run = 1;
+  for (size_t i = 0; i < size; i++) {
+    if (in[i] != 0) {
+      out[o++] = in[i];
+      run++;
+    }
+    if (in[i] == 0 || run == 0xff) {
+      out[code] = run;
+      code = o++;
+      run = 1;
+    }
+  }
+  out[code] = run;
+  return o;
+}
+
+/***
+ * COBS decoding of one frame (without its delimiter) into out, which needs
+ * size bytes. Returns the decoded size, or -1 if the frame is malformed.
+ */
+inline long cobsDecode(const uint8_t* in, size_t size, uint8_t* out) {
+  size_t i = 0, o = 0;
+  while (i < size) {
+    uint8_t run = in[i++];
+    if (run == 0 || i + run - 1 > size) return -1;
+    for (uint8_t k = 1; k < run; k++) {
+      if (in[i] == 0) return -1;
+      out[o++] = in[i++];
+    }
+    if (run != 0xff && i < size) out[o++] = 0;
+  }
+  return long(o);
+}
+
+
+inline void imuPacketPut16(uint8_t* p, uint16_t v) {
+  p[0] = uint8_t(v);
+  p[1] = uint8_t(v >> 8);
+}
+
+inline void imuPacketPut32(uint8_t* p, uint32_t v) {
+  imuPacketPut16(p, uint16_t(v));
+  imuPacketPut16(p + 2, uint16_t(v >> 16));
+}
+
+inline uint16_t imuPacketGet16(const uint8_t* p) {
+  return uint16_t(p[0] | (p[1] << 8));
+}
+
+inline uint32_t imuPacketGet32(const uint8_t* p) {
+  return imuPacketGet16(p) | (uint32_t(imuPacketGet16(p + 2)) << 16);
+}
+
+
+/***
+ * Collects samples of one type into a packet and frames it.
+ *
+ * Usage:
+ *   if (!writer.add(type, micros(), values)) { send(writer.frame()); ... }
+ * add() refuses a sample that does not fit (batch full, other type, or too
+ * far from the first sample for the 16 bit offset); frame() then returns
+ * the finished frame and starts a new packet.
+ */
+class ImuPacketWriter {
+public:
+
+  ImuPacketWriter() : sequence(0), count(0), size(IMU_PACKET_HEADER_SIZE) {}
+
+  /* samples in the current packet */
+  int samples() const { return count; }
+
+  /* time of the first sample in the current packet */
+  uint32_t firstTime() const { return imuPacketGet32(packet + 4); }
+
+  bool add(uint8_t type, uint32_t time, const float* values) {
+    int valueCount = imuPacketValueCount(type);
+    if (valueCount == 0) return false;
+
+    if (count == 0) {
+      packet[0] = type;
+      imuPacketPut16(packet + 2, sequence);
+      imuPacketPut32(packet + 4, time);
+    } else if (count == IMU_PACKET_MAX_SAMPLES || packet[0] != type ||
+               time - firstTime() > 0xffff) {
+      return false;
+    }
+
+    uint8_t* p = packet + size;
+    imuPacketPut16(p, uint16_t(time - firstTime()));
+    p += 2;
+    for (int i = 0; i < valueCount; i++) {
+      if (imuPacketIsQuaternion(type)) {
+        float v = values[i] * IMU_PACKET_QUATERNION_SCALE;
+        v = v > 32767 ? 32767 : v < -32767 ? -32767 : v;
+        imuPacketPut16(p, uint16_t(int16_t(v < 0 ? v - 0.5f : v + 0.5f)));
+        p += 2;
+      } else {
+        uint32_t bits;
+        memcpy(&bits, &values[i], 4);
+        imuPacketPut32(p, bits);
+        p += 4;
+      }
+    }
+    size = p - packet;
+    count++;
+    return true;
+  }
+
+  /***
+   * Finishes the current packet and returns its wire frame (COBS plus
+   * delimiter) in out, which needs IMU_PACKET_MAX_FRAME bytes. Returns the
+   * frame size, 0 if there are no samples.
+   */
+  size_t frame(uint8_t* out) {
+    if (count == 0) return 0;
+    packet[1] = uint8_t(count);
+    imuPacketPut16(packet + size, imuPacketCrc(packet, size));
+    size_t length = cobsEncode(packet, size + 2, out);
+    out[length++] = 0;
+
+    sequence++;
+    count = 0;
+    size = IMU_PACKET_HEADER_SIZE;
+    return length;
+  }
+
+private:
+  uint16_t sequence;
+  int count;
+  size_t size;
+  uint8_t packet[IMU_PACKET_MAX_SIZE];
+};
+
+
+/* one decoded sample */
+struct ImuPacketSample {
+  uint32_t time;  // micros()
+  float values[IMU_PACKET_MAX_VALUES];
+};
+
+/* one decoded packet */
+struct ImuPacketContents {
+  uint8_t type;
+  uint16_t sequence;
+  int count;
+  ImuPacketSample samples[IMU_PACKET_MAX_SAMPLES];
+};
+
+/***
+ * Parses a COBS-decoded packet. Returns false if it is truncated, has a bad
+ * CRC or an unknown type.
+ */
+inline bool imuPacketParse(const uint8_t* packet, size_t size, ImuPacketContents& out) {
+  if (size < size_t(IMU_PACKET_HEADER_SIZE + 2)) return false;
+  if (imuPacketCrc(packet, size - 2) != imuPacketGet16(packet + size - 2)) return false;
+
+  out.type = packet[0];
+  out.count = packet[1];
+  out.sequence = imuPacketGet16(packet + 2);
+  uint32_t firstTime = imuPacketGet32(packet + 4);
+
+  int valueCount = imuPacketValueCount(out.type);
+  size_t sampleSize = 2 + imuPacketValueSize(out.type);
+  if (valueCount == 0 || out.count < 1 || out.count > IMU_PACKET_MAX_SAMPLES) return false;
+  if (size != IMU_PACKET_HEADER_SIZE + out.count * sampleSize + 2) return false;
+
+  const uint8_t* p = packet + IMU_PACKET_HEADER_SIZE;
+  for (int s = 0; s < out.count; s++) {
+    ImuPacketSample& sample = out.samples[s];
+    sample.time = firstTime + imuPacketGet16(p);
+    p += 2;
+    for (int i = 0; i < valueCount; i++) {
+      if (imuPacketIsQuaternion(out.type)) {
+        sample.values[i] = int16_t(imuPacketGet16(p)) / IMU_PACKET_QUATERNION_SCALE;
+        p += 2;
+      } else {
+        uint32_t bits = imuPacketGet32(p);
+        memcpy(&sample.values[i], &bits, 4);
+        p += 4;
+      }
+    }
+  }
+  return true;
+}
+
+#endif // ifndef IMU_PACKET_H
@@ -0,0 +1,86 @@
+/**
+ * Fixed rate IMU sampling from a timer interrupt
+ */
+
+#include "ImuScheduler.h"
+
+ImuScheduler* ImuScheduler::_active = 0;
+
+ImuScheduler::ImuScheduler(Imu& imu, unsigned long (*clock)())
+  : _imu(imu), _clock(clock), _periodUs(1000), _magEvery(10), _sinceMag(0), _lastTick(0),
+    _running(false), _stats() {}
+
+bool ImuScheduler::begin(int rateHz) {
+  if (_active) _active->end();
+
+  if (rateHz < 4) rateHz = 4;
+  if (rateHz > 1000) rateHz = 1000;
+  _periodUs = 1000000UL / rateHz;
+
+  // the magnetometer only has new data every 10 ms
+  _magEvery = 10000 / _periodUs;
+  if (_magEvery < 1) _magEvery = 1;
+  _sinceMag = 0;
+  _imu.startMagnetometer();
+
+  _ring.clear();
+  resetStats();
+  _active = this;
+  _running = _timer.begin(isr, _periodUs);
+  if (!_running) _active = 0;
+  return _running;
+}
+
+void ImuScheduler::end() {
+  _timer.end();
+  _running = false;
+  if (_active == this) _active = 0;
+}
+
+void ImuScheduler::isr() {
+  if (_active) _active->tick();
+}
+
+void ImuScheduler::tick() {
+  unsigned long now = _clock();
+
+  if (_stats.ticks > 0) {
+    long jitter = long(now - _lastTick) - long(_periodUs);
+    if (_stats.intervals == 0 || jitter < _stats.jitterMinUs) _stats.jitterMinUs = jitter;
+    if (_stats.intervals == 0 || jitter > _stats.jitterMaxUs) _stats.jitterMaxUs = jitter;
+    _stats.jitterSquares += uint64_t(int64_t(jitter) * jitter);
+    _stats.intervals++;
+    if (jitter > long(_periodUs / 2)) _stats.late++;
+  }
+  _lastTick = now;
+
+  ScheduledReading r;
+  r.time = now;
+  r.index = _stats.ticks++;
+
+  // keep in step with the magnetometer's 10 ms; if it is not ready yet,
+  // try again on the next tick
+  bool withMag = ++_sinceMag >= _magEvery;
+  _imu.sample(r.reading, withMag);
+  if (r.reading.hasMag) _sinceMag = 0;
+
+  if (!_ring.push(r)) _stats.overruns++;
+  uint16_t queued = _ring.count();
+  if (queued > _stats.maxQueued) _stats.maxQueued = queued;
+
+  unsigned long busy = _clock() - now;
+  if (busy > _stats.busyMaxUs) _stats.busyMaxUs = busy;
+}
+
+ImuSchedulerStats ImuScheduler::stats() const {
+  noInterrupts();
+  ImuSchedulerStats copy = _stats;
+  interrupts();
+  return copy;
+}
+
+void ImuScheduler::resetStats() {
+  noInterrupts();
+  _stats = ImuSchedulerStats();
+  interrupts();
+}
@@ -0,0 +1,107 @@
+/**
+ * Fixed rate IMU sampling from a timer interrupt
+ *
+ * Sampling in loop() takes one sample per iteration, and an iteration
+ * takes as long as its serial output does, so the sample periods are
+ * uneven, and measured with millis() they are off by up to a millisecond
+ * each. The scheduler samples from an IntervalTimer interrupt instead:
+ * every period it stamps the time with micros(), reads the sensors
+ * (Imu::sample()) and pushes the reading into a ring buffer that loop()
+ * drains. Integrating over the differences of the stamps keeps the gyro
+ * integration right however long loop() stalls, up to a ring of readings.
+ *
+ * stats() reports the timing: the interval between ticks against the
+ * period (jitter), ticks more than half a period late because interrupts
+ * were blocked or the previous read overran, readings dropped because the
+ * ring was full, and the longest time spent in the interrupt.
+ *
+ * The interrupt owns the bus while the scheduler runs. At 400 kHz I2C a
+ * read takes about 0.4 ms, and a magnetometer read every 10 ms another
+ * 0.3 ms, so at 1 kHz the interrupt takes about 45% of the CPU.
+ */
+
+#ifndef IMU_SCHEDULER_H
+#define IMU_SCHEDULER_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "SampleRing.h"
+#include "imu.h"
+
+/* readings the ring holds: 63 ms at 1 kHz */
+#define IMU_SCHEDULER_RING 64
+
+/* one tick's reading */
+struct ScheduledReading {
+  unsigned long time;   // micros() at the tick
+  unsigned long index;  // tick number; a gap means dropped readings
+  ImuReading reading;
+};
+
+/* timing of the ticks since begin() or resetStats() */
+struct ImuSchedulerStats {
+  unsigned long ticks;
+  unsigned long overruns;     // readings dropped, the ring being full
+  unsigned long late;         // intervals over 1.5 periods
+  unsigned long intervals;    // intervals measured for the jitter
+  long jitterMinUs;           // shortest interval minus the period
+  long jitterMaxUs;           // longest interval minus the period
+  uint64_t jitterSquares;     // sum of the squared differences, us^2
+  unsigned long busyMaxUs;    // longest interrupt
+  uint16_t maxQueued;         // most readings waiting at once
+
+  float jitterRmsUs() const {
+    return intervals ? sqrtf(float(jitterSquares) / intervals) : 0;
+  }
+};
+
+class ImuScheduler {
+public:
+
+  /* clock is micros() on the board; a simulation passes its own */
+  explicit ImuScheduler(Imu& imu, unsigned long (*clock)() = micros);
+
+  /***
+   * Starts the timer at rateHz (4 to 1000) and puts the magnetometer into
+   * continuous mode. Returns false if no timer is free. Only one scheduler
+   * runs at a time.
+   */
+  bool begin(int rateHz);
+  void end();
+
+  bool running() const { return _running; }
+
+  unsigned long periodUs() const { return _periodUs; }
+
+  /* loop(): the oldest waiting reading; false if there is none */
+  bool pop(ScheduledReading& out) { return _ring.pop(out); }
+
+  uint16_t queued() const { return _ring.count(); }
+
+  /* a consistent copy, taken with interrupts blocked */
+  ImuSchedulerStats stats() const;
+  void resetStats();
+
+  /* the interrupt; a host simulation calls it at its tick times */
+  void tick();
+
+private:
+
+  Imu& _imu;
+  unsigned long (*_clock)();
+  IntervalTimer _timer;
+  SampleRing<ScheduledReading, IMU_SCHEDULER_RING> _ring;
+
+  unsigned long _periodUs;
+  unsigned long _magEvery;   // ticks per magnetometer measurement
+  unsigned long _sinceMag;
+  unsigned long _lastTick;
+  bool _running;
+  ImuSchedulerStats _stats;
+
+  static ImuScheduler* _active;
+  static void isr();
+};
+
+#endif // ifndef IMU_SCHEDULER_H
@@ -0,0 +1,92 @@
+/**
+ * Madgwick's gradient descent orientation filter
+ *
+ * S. Madgwick, "An efficient orientation filter for inertial and
+ * inertial/magnetic sensor arrays", 2010. correct() takes one normalized
+ * gradient step of the error between the measured and the predicted gravity
+ * (and magnetic field) directions, of length beta per second. The magnetic
+ * reference is rebuilt from each measurement, so only its inclination
+ * matters and yaw follows magnetic north.
+ */
+
+#ifndef MADGWICK_FUSION_H
+#define MADGWICK_FUSION_H
+
+#include "Fusion.h"
+
+template <typename T>
+class MadgwickFusion : public FusionEngine<T> {
+public:
+
+  /* beta: correction rate in rad/s; larger converges faster but is noisier */
+  explicit MadgwickFusion(T beta = T(0.1)) : beta(beta) {}
+
+  const char* name() const { return "madgwick"; }
+
+  T beta;
+
+protected:
+  using FusionEngine<T>::q;
+
+  void predict(const FusionInput<T>& in, T dt) {
+    this->integrate(this->degToRad(in.gyrX), this->degToRad(in.gyrY),
+                    this->degToRad(in.gyrZ), dt);
+  }
+
+  void correct(const FusionInput<T>& in, T dt, bool) {
+    T norm = scalarSqrt(sq(in.accX) + sq(in.accY) + sq(in.accZ));
+    if (norm == T(0)) return;
+    T ax = in.accX / norm, ay = in.accY / norm, az = in.accZ / norm;
+
+    T q0 = q.q[0], q1 = q.q[1], q2 = q.q[2], q3 = q.q[3];
+    T s0, s1, s2, s3;
+
+    T magNorm = in.hasMag ? scalarSqrt(sq(in.magX) + sq(in.magY) + sq(in.magZ)) : T(0);
+    if (magNorm == T(0)) {
+      // gravity only
+      T f0 = T(2) * (q1 * q3 - q0 * q2) - ax;
+      T f1 = T(2) * (q0 * q1 + q2 * q3) - ay;
+      T f2 = T(1) - T(2) * (q1 * q1 + q2 * q2) - az;
+      s0 = T(-2) * q2 * f0 + T(2) * q1 * f1;
+      s1 = T(2) * q3 * f0 + T(2) * q0 * f1 - T(4) * q1 * f2;
+      s2 = T(-2) * q0 * f0 + T(2) * q3 * f1 - T(4) * q2 * f2;
+      s3 = T(2) * q1 * f0 + T(2) * q2 * f1;
+    } else {
+      T mx = in.magX / magNorm, my = in.magY / magNorm, mz = in.magZ / magNorm;
+
+      // field direction in the earth frame, rotated into the x-z plane
+      T hx = T(2) * (mx * (T(0.5) - q2 * q2 - q3 * q3) + my * (q1 * q2 - q0 * q3) + mz * (q1 * q3 + q0 * q2));
+      T hy = T(2) * (mx * (q1 * q2 + q0 * q3) + my * (T(0.5) - q1 * q1 - q3 * q3) + mz * (q2 * q3 - q0 * q1));
+      T bx = scalarSqrt(hx * hx + hy * hy);
+      T bz = T(2) * (mx * (q1 * q3 - q0 * q2) + my * (q2 * q3 + q0 * q1) + mz * (T(0.5) - q1 * q1 - q2 * q2));
+
+      T f0 = T(2) * (q1 * q3 - q0 * q2) - ax;
+      T f1 = T(2) * (q0 * q1 + q2 * q3) - ay;
+      T f2 = T(1) - T(2) * (q1 * q1 + q2 * q2) - az;
+      T f3 = T(2) * bx * (T(0.5) - q2 * q2 - q3 * q3) + T(2) * bz * (q1 * q3 - q0 * q2) - mx;
+      T f4 = T(2) * bx * (q1 * q2 - q0 * q3) + T(2) * bz * (q0 * q1 + q2 * q3) - my;
+      T f5 = T(2) * bx * (q0 * q2 + q1 * q3) + T(2) * bz * (T(0.5) - q1 * q1 - q2 * q2) - mz;
+
+      s0 = T(-2) * q2 * f0 + T(2) * q1 * f1
+           - T(2) * bz * q2 * f3 + T(2) * (-bx * q3 + bz * q1) * f4 + T(2) * bx * q2 * f5;
+      s1 = T(2) * q3 * f0 + T(2) * q0 * f1 - T(4) * q1 * f2
+           + T(2) * bz * q3 * f3 + T(2) * (bx * q2 + bz * q0) * f4 + T(2) * (bx * q3 - T(2) * bz * q1) * f5;
+      s2 = T(-2) * q0 * f0 + T(2) * q3 * f1 - T(4) * q2 * f2
+           + T(2) * (T(-2) * bx * q2 - bz * q0) * f3 + T(2) * (bx * q1 + bz * q3) * f4
+           + T(2) * (bx * q0 - T(2) * bz * q2) * f5;
+      s3 = T(2) * q1 * f0 + T(2) * q2 * f1
+           + T(2) * (T(-2) * bx * q3 + bz * q1) * f3 + T(2) * (-bx * q0 + bz * q2) * f4 + T(2) * bx * q1 * f5;
+    }
+
+    T sNorm = scalarSqrt(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3);
+    if (sNorm == T(0)) return;
+    T step = beta * dt / sNorm;
+    q.q[0] = q0 - step * s0;
+    q.q[1] = q1 - step * s1;
+    q.q[2] = q2 - step * s2;
+    q.q[3] = q3 - step * s3;
+    q.normalizeFast();
+  }
+};
+
+#endif // ifndef MADGWICK_FUSION_H
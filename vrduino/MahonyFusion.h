@@ -0,0 +1,86 @@
+/**
+ * Mahony's nonlinear complementary filter
+ *
+ * R. Mahony, T. Hamel, J.-M. Pflimlin, "Nonlinear complementary filters on
+ * the special orthogonal group", 2008. correct() turns the cross product of
+ * the measured and predicted gravity (and magnetic field) directions into a
+ * rotation of kp per second; the integral term ki estimates the gyro bias
+ * left after the startup calibration and is removed in every predict().
+ */
+
+#ifndef MAHONY_FUSION_H
+#define MAHONY_FUSION_H
+
+#include "Fusion.h"
+
+template <typename T>
+class MahonyFusion : public FusionEngine<T> {
+public:
+
+  explicit MahonyFusion(T kp = T(1), T ki = T(0.02)) : kp(kp), ki(ki) { resetState(); }
+
+  const char* name() const { return "mahony"; }
+
+  T kp, ki;
+
+  /* estimated remaining gyro bias in rad/s, negated */
+  T biasX, biasY, biasZ;
+
+protected:
+  using FusionEngine<T>::q;
+
+  void resetState() {
+    biasX = biasY = biasZ = T(0);
+  }
+
+  void predict(const FusionInput<T>& in, T dt) {
+    this->integrate(this->degToRad(in.gyrX) + biasX, this->degToRad(in.gyrY) + biasY,
+                    this->degToRad(in.gyrZ) + biasZ, dt);
+  }
+
+  void correct(const FusionInput<T>& in, T dt, bool) {
+    T norm = scalarSqrt(sq(in.accX) + sq(in.accY) + sq(in.accZ));
+    if (norm == T(0)) return;
+    T ax = in.accX / norm, ay = in.accY / norm, az = in.accZ / norm;
+
+    T q0 = q.q[0], q1 = q.q[1], q2 = q.q[2], q3 = q.q[3];
+
+    // predicted gravity direction in the sensor frame
+    T vx = T(2) * (q1 * q3 - q0 * q2);
+    T vy = T(2) * (q0 * q1 + q2 * q3);
+    T vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+    T ex = ay * vz - az * vy;
+    T ey = az * vx - ax * vz;
+    T ez = ax * vy - ay * vx;
+
+    T magNorm = in.hasMag ? scalarSqrt(sq(in.magX) + sq(in.magY) + sq(in.magZ)) : T(0);
+    if (magNorm != T(0)) {
+      T mx = in.magX / magNorm, my = in.magY / magNorm, mz = in.magZ / magNorm;
+
+      // reference field in the earth frame, rotated into the x-z plane
+      T hx = T(2) * (mx * (T(0.5) - q2 * q2 - q3 * q3) + my * (q1 * q2 - q0 * q3) + mz * (q1 * q3 + q0 * q2));
+      T hy = T(2) * (mx * (q1 * q2 + q0 * q3) + my * (T(0.5) - q1 * q1 - q3 * q3) + mz * (q2 * q3 - q0 * q1));
+      T bx = scalarSqrt(hx * hx + hy * hy);
+      T bz = T(2) * (mx * (q1 * q3 - q0 * q2) + my * (q2 * q3 + q0 * q1) + mz * (T(0.5) - q1 * q1 - q2 * q2));
+
+      // predicted field direction in the sensor frame
+      T wx = T(2) * (bx * (T(0.5) - q2 * q2 - q3 * q3) + bz * (q1 * q3 - q0 * q2));
+      T wy = T(2) * (bx * (q1 * q2 - q0 * q3) + bz * (q0 * q1 + q2 * q3));
+      T wz = T(2) * (bx * (q0 * q2 + q1 * q3) + bz * (T(0.5) - q1 * q1 - q2 * q2));
+
+      ex += my * wz - mz * wy;
+      ey += mz * wx - mx * wz;
+      ez += mx * wy - my * wx;
+    }
+
+    if (ki > T(0)) {
+      biasX += ki * ex * dt;
+      biasY += ki * ey * dt;
+      biasZ += ki * ez * dt;
+    }
+    this->integrate(kp * ex, kp * ey, kp * ez, dt);
+  }
+};
+
+#endif // ifndef MAHONY_FUSION_H
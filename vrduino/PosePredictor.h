@@ -0,0 +1,81 @@
+/**
+ * Pose prediction against motion-to-photon latency
+ *
+ * An orientation takes tens of milliseconds from the IMU sample to the
+ * screen: batching and serial, the Node bridge, the WebSocket and the wait
+ * for the next frame. predict() extrapolates it over that time, rotating on
+ * at the current angular rate:
+ *
+ *   q(t + h) = q(t) * exp(h * w / 2),  w = body rate in rad/s
+ *
+ * The rate is the bias corrected gyro, optionally low-pass filtered with
+ * time constant smoothing (seconds) so that noise is not amplified by long
+ * horizons. With accelerationGain > 0, the change of the filtered rate adds
+ * a second order term, which helps at the start and end of head turns but
+ * amplifies noise more. host/prediction-bench.cpp compares the settings.
+ */
+
+#ifndef POSE_PREDICTOR_H
+#define POSE_PREDICTOR_H
+
+#include "Quaternion.h"
+
+template <typename T>
+class PosePredictor {
+public:
+
+  explicit PosePredictor(T smoothing = T(0.005), T accelerationGain = T(0))
+    : smoothing(smoothing), accelerationGain(accelerationGain) { reset(); }
+
+  T smoothing;
+  T accelerationGain;
+
+  /* filtered rate in rad/s, and its change in rad/s^2 */
+  T rateX, rateY, rateZ;
+  T accX, accY, accZ;
+
+  void reset() {
+    rateX = rateY = rateZ = T(0);
+    accX = accY = accZ = T(0);
+    started = false;
+  }
+
+  /* gyr in degrees per second (bias corrected), dt in seconds */
+  void update(T gyrX, T gyrY, T gyrZ, T dt) {
+    T x = gyrX * T(PI / 180), y = gyrY * T(PI / 180), z = gyrZ * T(PI / 180);
+    if (!started || dt <= T(0)) {
+      rateX = x; rateY = y; rateZ = z;
+      started = true;
+      return;
+    }
+
+    T a = dt / (smoothing + dt);
+    T dx = a * (x - rateX), dy = a * (y - rateY), dz = a * (z - rateZ);
+    rateX += dx; rateY += dy; rateZ += dz;
+
+    if (accelerationGain > T(0)) {
+      accX += a * (dx / dt - accX);
+      accY += a * (dy / dt - accY);
+      accZ += a * (dz / dt - accZ);
+    }
+  }
+
+  /* q extrapolated by horizon seconds */
+  QuaternionT<T> predict(const QuaternionT<T>& q, T horizon) const {
+    T k = accelerationGain * horizon / T(2);
+    T wx = (rateX + k * accX) * horizon;
+    T wy = (rateY + k * accY) * horizon;
+    T wz = (rateZ + k * accZ) * horizon;
+
+    T angle = scalarSqrt(sq(wx) + sq(wy) + sq(wz));
+    if (angle == T(0)) return q;
+    T s = scalarSin(angle / T(2)) / angle;
+    QuaternionT<T> turn(scalarCos(angle / T(2)), wx * s, wy * s, wz * s);
+    return QuaternionT<T>::product(q, turn);
+  }
+
+private:
+  bool started;
+};
+
+#endif // ifndef POSE_PREDICTOR_H
@@ -18,8 +18,17 @@
 #include "Arduino.h"
 
 #include "Euler.h"
+#include "Scalar.h"
+#include "Fixed.h"
 
-class Quaternion {
+/***
+ * The class is templated on its scalar type T: double, float or a Fixed<F>
+ * Q-format type. Quaternion is the double version; on the Teensy, where
+ * double is emulated in software, prefer Quaternionf (or QuaternionQ16 on
+ * boards without an FPU).
+ */
+template <typename T>
+class QuaternionT {
 public:
 
   /***
@@ -28,54 +37,63 @@ public:
    * Definition:
    * q = q[0] + q[1] * i + q[2] * j + q[3] * k
    */
-  double q[4];
+  T q[4];
 
 
   /* Default constructor */
-  Quaternion() :
-    q{1.0, 0.0, 0.0, 0.0} {}
+  constexpr QuaternionT() :
+    q{T(1), T(0), T(0), T(0)} {}
 
 
   /* Cunstructor with some inputs */
-  Quaternion(double q0, double q1, double q2, double q3) :
+  constexpr QuaternionT(T q0, T q1, T q2, T q3) :
     q{q0, q1, q2, q3} {}
 
 
+  /* conversion from a quaternion with another scalar type */
+  template <typename U>
+  explicit QuaternionT(const QuaternionT<U>& other) :
+    q{T(scalarToDouble(other.q[0])), T(scalarToDouble(other.q[1])),
+      T(scalarToDouble(other.q[2])), T(scalarToDouble(other.q[3]))} {}
+
+
   /* function to create anohter quaternion with the same values. */
-  Quaternion clone() {
-    return Quaternion(this->q[0], this->q[1], this->q[2], this->q[3]);
+  QuaternionT clone() {
+    return QuaternionT(this->q[0], this->q[1], this->q[2], this->q[3]);
   }
 
   /* function to construct a quaternion from angle-axis representation */
-  Quaternion& setFromAngleAxis(double angle, double vx, double vy, double vz) {
+  QuaternionT& setFromAngleAxis(T angle, T vx, T vy, T vz) {
     /***
      * TODO: Implement!
      */
 		// this function accepts angles in degrees
-		
-		this->q[0] = cos(angle*PI/360);
-		this->q[1] = vx * sin(angle*PI/360);
-		this->q[2] = vy * sin(angle*PI/360);
-		this->q[3] = vz * sin(angle*PI/360);
+		T halfAngle = angle * T(PI / 360);
+		T s = scalarSin(halfAngle);
+
+		this->q[0] = scalarCos(halfAngle);
+		this->q[1] = vx * s;
+		this->q[2] = vy * s;
+		this->q[3] = vz * s;
 
     return *this;
   }
 
   /* function to compute the length of a quaternion */
-  double length() {
+  T length() {
     /***
      * TODO: Implement!
      */
 		
-    return sqrt(sq(this->q[0]) + sq(this->q[1]) + sq(this->q[2]) + sq(this->q[3]));
+    return scalarSqrt(sq(this->q[0]) + sq(this->q[1]) + sq(this->q[2]) + sq(this->q[3]));
   }
 
   /* function to normalize a quaternion */
-  Quaternion& normalize() {
+  QuaternionT& normalize() {
     /***
      * TODO: Implement!
      */
-		double length = this->length();
+		T length = this->length();
 
 		this->q[0] /= length;
 		this->q[1] /= length;
@@ -86,52 +104,158 @@ public:
   }
 
   /* function to invert a quaternion */
-  Quaternion& inverse() {
+  QuaternionT& inverse() {
     /***
      * TODO: Implement!
      */
 		
-		double length = this->length();
+		T scale = T(1) / (sq(this->q[0]) + sq(this->q[1]) + sq(this->q[2]) + sq(this->q[3]));
 
-		this->q[0] *= 1.0/sq(length);
-		this->q[1] *= -1.0/sq(length);
-		this->q[2] *= -1.0/sq(length);
-		this->q[3] *= -1.0/sq(length);
+		this->q[0] = this->q[0] * scale;
+		this->q[1] = -this->q[1] * scale;
+		this->q[2] = -this->q[2] * scale;
+		this->q[3] = -this->q[3] * scale;
 
     return *this;
   }
 
   /* function to multiply two quaternions */
-  Quaternion multiply(Quaternion& a, Quaternion& b) {
+  QuaternionT multiply(const QuaternionT& a, const QuaternionT& b) {
     /***
      * TODO: Implement!
      */
 		
-		double res[4];
+		T res[4];
 		res[0] = (a.q[0] * b.q[0]) - (a.q[1] * b.q[1]) - (a.q[2] * b.q[2]) - (a.q[3] * b.q[3]);
 		res[1] = (a.q[0] * b.q[1]) + (a.q[1] * b.q[0]) + (a.q[2] * b.q[3]) - (a.q[3] * b.q[2]);
 		res[2] = (a.q[0] * b.q[2]) - (a.q[1] * b.q[3]) + (a.q[2] * b.q[0]) + (a.q[3] * b.q[1]);
 		res[3] = (a.q[0] * b.q[3]) + (a.q[1] * b.q[2]) - (a.q[2] * b.q[1]) + (a.q[3] * b.q[0]);
-    return Quaternion(res[0], res[1], res[2], res[3]);
+    return QuaternionT(res[0], res[1], res[2], res[3]);
   }
 
   /* function to rotate a quaternion by r * q * r^{-1} */
-  Quaternion rotate(Quaternion& r) {
+  QuaternionT rotate(QuaternionT& r) {
     /***
      * TODO: Implement!
      */
 
-   	Quaternion one = multiply(r, *this);
-		Quaternion two = r.clone().inverse();	
+   	QuaternionT one = multiply(r, *this);
+		QuaternionT two = r.clone().inverse();	
 		return multiply(one, two);
 		
 		//return Quaternion();
   }
 
+  /***
+   * Hot-path operations
+   *
+   * The functions above follow the textbook definitions; these are the ones
+   * for filters running at 1 kHz. They assume unit quaternions where noted,
+   * so the inverse is the conjugate and no length or division is needed,
+   * and the constexpr ones can be evaluated at compile time.
+   */
+
+  /* the inverse of a unit quaternion */
+  constexpr QuaternionT conjugate() const {
+    return QuaternionT(q[0], -q[1], -q[2], -q[3]);
+  }
+
+  constexpr T dot(const QuaternionT& b) const {
+    return q[0] * b.q[0] + q[1] * b.q[1] + q[2] * b.q[2] + q[3] * b.q[3];
+  }
+
+  constexpr T lengthSquared() const { return dot(*this); }
+
+  /* a * b, as multiply() but without an object to call it on */
+  static constexpr QuaternionT product(const QuaternionT& a, const QuaternionT& b) {
+    return QuaternionT(a.q[0] * b.q[0] - a.q[1] * b.q[1] - a.q[2] * b.q[2] - a.q[3] * b.q[3],
+                       a.q[0] * b.q[1] + a.q[1] * b.q[0] + a.q[2] * b.q[3] - a.q[3] * b.q[2],
+                       a.q[0] * b.q[2] - a.q[1] * b.q[3] + a.q[2] * b.q[0] + a.q[3] * b.q[1],
+                       a.q[0] * b.q[3] + a.q[1] * b.q[2] - a.q[2] * b.q[1] + a.q[3] * b.q[0]);
+  }
+
+  /* this = this * b */
+  QuaternionT& multiplyBy(const QuaternionT& b) {
+    return *this = product(*this, b);
+  }
+
+  /* this = a * this */
+  QuaternionT& premultiplyBy(const QuaternionT& a) {
+    return *this = product(a, *this);
+  }
+
+  /***
+   * The vector (x, y, z) rotated by this unit quaternion, q v q^-1, in the
+   * cross product form: t = 2 u x v, v' = v + w t + u x t, with u the vector
+   * part: 18 multiplications, against an inverse and the 32 of two
+   * products for rotate().
+   */
+  void rotateVector(T x, T y, T z, T* out) const {
+    T tx = T(2) * (q[2] * z - q[3] * y);
+    T ty = T(2) * (q[3] * x - q[1] * z);
+    T tz = T(2) * (q[1] * y - q[2] * x);
+    out[0] = x + q[0] * tx + (q[2] * tz - q[3] * ty);
+    out[1] = y + q[0] * ty + (q[3] * tx - q[1] * tz);
+    out[2] = z + q[0] * tz + (q[1] * ty - q[2] * tx);
+  }
+
+  /***
+   * normalize() for a quaternion that is already close to unit length, as
+   * after an integration step. It is left alone while |1 - |q|^2| is at
+   * most tolerance, and within 1e-3 it is scaled by (3 - |q|^2) / 2, the
+   * first order of 1 / sqrt, which leaves a relative error of about
+   * 4e-7; further off it takes the full normalize().
+   */
+  QuaternionT& normalizeFast(T tolerance = T(1e-6)) {
+    T n = lengthSquared();
+    T d = T(1) - n;
+    if (d <= tolerance && -d <= tolerance) return *this;
+    if (d > T(1e-3) || -d > T(1e-3)) return normalize();
+
+    T scale = (T(3) - n) * T(0.5);
+    q[0] *= scale;
+    q[1] *= scale;
+    q[2] *= scale;
+    q[3] *= scale;
+    return *this;
+  }
+
+  /* linear interpolation from a (t = 0) to b (t = 1) the short way round, normalized */
+  static QuaternionT nlerp(const QuaternionT& a, const QuaternionT& b, T t) {
+    T s = a.dot(b) < T(0) ? -t : t;
+    T r = T(1) - t;
+    return QuaternionT(r * a.q[0] + s * b.q[0], r * a.q[1] + s * b.q[1],
+                       r * a.q[2] + s * b.q[2], r * a.q[3] + s * b.q[3]).normalize();
+  }
+
+  /* spherical interpolation of unit quaternions, at constant angular rate */
+  static QuaternionT slerp(const QuaternionT& a, const QuaternionT& b, T t) {
+    T cosAngle = a.dot(b);
+    T sign = T(1);
+    if (cosAngle < T(0)) {
+      cosAngle = -cosAngle;
+      sign = T(-1);
+    }
+    // nearly parallel: sin(angle) vanishes, and nlerp is as accurate
+    if (cosAngle > T(0.9995)) return nlerp(a, b, t);
+
+    T angle = scalarAcos(cosAngle);
+    T sinAngle = scalarSin(angle);
+    T wa = scalarSin((T(1) - t) * angle) / sinAngle;
+    T wb = sign * scalarSin(t * angle) / sinAngle;
+    return QuaternionT(wa * a.q[0] + wb * b.q[0], wa * a.q[1] + wb * b.q[1],
+                       wa * a.q[2] + wb * b.q[2], wa * a.q[3] + wb * b.q[3]);
+  }
+
   /* helper function to print out a quaternion */
   void serialPrint() {
-    Serial.printf("[%f %f %f %f]\n", q[0], q[1], q[2], q[3]);
+    Serial.printf("[%f %f %f %f]\n", scalarToDouble(q[0]), scalarToDouble(q[1]),
+                  scalarToDouble(q[2]), scalarToDouble(q[3]));
   }
 };
 
+typedef QuaternionT<double> Quaternion;
+typedef QuaternionT<float>  Quaternionf;
+typedef QuaternionT<Q16>    QuaternionQ16;
+
 #endif // ifndef QUATERNION_H
@@ -0,0 +1,66 @@
+/**
+ * Single producer, single consumer ring buffer for handing samples from an
+ * interrupt to loop()
+ *
+ * push() is only called by the producer (the interrupt) and pop() only by
+ * the consumer, so neither needs to block interrupts: each side writes its
+ * own index, and an element is complete before the index that publishes it
+ * moves. On the single core Teensy a compiler barrier is all the ordering
+ * this takes. Size must be a power of two; one slot stays empty to tell a
+ * full ring from an empty one.
+ */
+
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <stdint.h>
+
+/* keep the compiler from moving memory accesses across this point */
+#define SAMPLE_RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+template <typename T, uint16_t Size>
+class SampleRing {
+public:
+
+  SampleRing() : head(0), tail(0) {}
+
+  /* producer: false, dropping value, if the ring is full */
+  bool push(const T& value) {
+    uint16_t h = head;
+    uint16_t next = uint16_t((h + 1) & MASK);
+    if (next == tail) return false;
+    items[h] = value;
+    SAMPLE_RING_BARRIER();
+    head = next;
+    return true;
+  }
+
+  /* consumer: false if the ring is empty */
+  bool pop(T& value) {
+    uint16_t t = tail;
+    if (t == head) return false;
+    SAMPLE_RING_BARRIER();
+    value = items[t];
+    SAMPLE_RING_BARRIER();
+    tail = uint16_t((t + 1) & MASK);
+    return true;
+  }
+
+  /* elements waiting; exact only from the consumer's side */
+  uint16_t count() const { return uint16_t((head - tail) & MASK); }
+
+  uint16_t capacity() const { return Size - 1; }
+
+  /* consumer: drop everything waiting */
+  void clear() { tail = head; }
+
+private:
+  static const uint16_t MASK = Size - 1;
+  static_assert((Size & (Size - 1)) == 0 && Size >= 2, "SampleRing size must be a power of two");
+
+  T items[Size];
+  volatile uint16_t head;
+  volatile uint16_t tail;
+};
+
+#endif // ifndef SAMPLE_RING_H
@@ -0,0 +1,36 @@
+/**
+ * Scalar math for the templated Quaternion and Euler classes
+ *
+ * Overloads of sqrt, sin, cos, acos and atan2 per scalar type, so templated
+ * code calls the single precision functions for float instead of silently
+ * promoting to double (which the Teensy emulates in software). Fixed.h adds
+ * the fixed-point versions.
+ *
+ * Angles are in radians here, as in math.h.
+ */
+
+#ifndef SCALAR_H
+#define SCALAR_H
+
+#include <math.h>
+
+inline float  scalarSqrt(float x)  { return sqrtf(x); }
+inline double scalarSqrt(double x) { return sqrt(x); }
+
+inline float  scalarSin(float x)  { return sinf(x); }
+inline double scalarSin(double x) { return sin(x); }
+
+inline float  scalarCos(float x)  { return cosf(x); }
+inline double scalarCos(double x) { return cos(x); }
+
+inline float  scalarAcos(float x)  { return acosf(x); }
+inline double scalarAcos(double x) { return acos(x); }
+
+inline float  scalarAtan2(float y, float x)   { return atan2f(y, x); }
+inline double scalarAtan2(double y, double x) { return atan2(y, x); }
+
+/* for printing and comparing against the double reference */
+inline double scalarToDouble(float x)  { return x; }
+inline double scalarToDouble(double x) { return x; }
+
+#endif // ifndef SCALAR_H
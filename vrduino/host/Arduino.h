@@ -0,0 +1,124 @@
+/**
+ * Minimal stand-in for the Arduino core, so the sketch and its headers
+ * compile on the host for benchmarking and replay (see Makefile). Only
+ * what the sketch uses is here.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef PI
+#define PI 3.1415926535897932384626433832795
+#endif
+
+#define sq(x) ((x)*(x))
+
+typedef uint8_t byte;
+
+/* pins and interrupts: attachInterrupt() only records the handler, which a
+   simulation can call through hostInterrupt() */
+#define INPUT  0
+#define OUTPUT 1
+#define RISING 3
+
+inline int digitalPinToInterrupt(int pin) { return pin; }
+
+inline void pinMode(int, int) {}
+
+const int HOST_INTERRUPTS = 64;
+
+inline void (*&hostInterruptHandler(int interrupt))() {
+  static void (*handlers[HOST_INTERRUPTS])() = {};
+  return handlers[interrupt];
+}
+
+inline void attachInterrupt(int interrupt, void (*handler)(), int) {
+  if (interrupt >= 0 && interrupt < HOST_INTERRUPTS) hostInterruptHandler(interrupt) = handler;
+}
+
+inline void hostInterrupt(int interrupt) {
+  if (interrupt >= 0 && interrupt < HOST_INTERRUPTS && hostInterruptHandler(interrupt)) {
+    hostInterruptHandler(interrupt)();
+  }
+}
+
+/* nothing preempts the host code, so there is nothing to block */
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+/* the Teensy's periodic timer interrupt; a simulation calls the handler */
+class IntervalTimer {
+public:
+  void (*handler)();
+  unsigned long periodUs;
+
+  IntervalTimer() : handler(0), periodUs(0) {}
+
+  bool begin(void (*function)(), unsigned long microseconds) {
+    handler = function;
+    periodUs = microseconds;
+    return true;
+  }
+
+  void end() { handler = 0; }
+
+  void priority(uint8_t) {}
+};
+
+inline unsigned long micros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+inline unsigned long millis() {
+  return micros() / 1000;
+}
+
+/* no waiting on the host */
+inline void delay(unsigned long) {}
+
+/* Serial writes to stdout, unless muted */
+class HostSerial {
+public:
+  bool muted;
+
+  HostSerial() : muted(false) {}
+
+  void begin(unsigned long) {}
+  int available() { return 0; }
+  long parseInt() { return 0; }
+  int read() { return -1; }
+  int peek() { return -1; }
+
+  void println() { if (!muted) putchar('\n'); }
+  void println(const char* s) { if (!muted) puts(s); }
+  void print(const char* s) { if (!muted) fputs(s, stdout); }
+  size_t write(uint8_t b) { return muted ? 1 : fwrite(&b, 1, 1, stdout); }
+  size_t write(const uint8_t* data, size_t size) { return muted ? size : fwrite(data, 1, size, stdout); }
+
+  int printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+    if (muted) return 0;
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+  }
+};
+
+/* one instance shared by all translation units */
+inline HostSerial& hostSerial() {
+  static HostSerial serial;
+  return serial;
+}
+
+#define Serial hostSerial()
+
+#endif // ifndef HOST_ARDUINO_H
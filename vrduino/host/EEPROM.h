@@ -0,0 +1,58 @@
+/**
+ * Stand-in for the Arduino EEPROM library on the host
+ *
+ * 2 KB like the Teensy 3.2, erased to 0xff. put() only writes bytes that
+ * change, as on the board; writes counts them, to see the wear.
+ */
+
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+class HostEeprom {
+public:
+  static const int SIZE = 2048;
+
+  uint8_t data[SIZE];
+  unsigned long writes;
+
+  HostEeprom() : writes(0) { memset(data, 0xff, SIZE); }
+
+  int length() const { return SIZE; }
+
+  uint8_t read(int address) const { return data[address]; }
+
+  void write(int address, uint8_t value) {
+    data[address] = value;
+    writes++;
+  }
+
+  void update(int address, uint8_t value) {
+    if (data[address] != value) write(address, value);
+  }
+
+  template <typename T>
+  T& get(int address, T& value) const {
+    memcpy(&value, data + address, sizeof(T));
+    return value;
+  }
+
+  template <typename T>
+  const T& put(int address, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    for (size_t i = 0; i < sizeof(T); i++) update(address + int(i), bytes[i]);
+    return value;
+  }
+};
+
+/* one EEPROM for all translation units */
+inline HostEeprom& hostEeprom() {
+  static HostEeprom eeprom;
+  return eeprom;
+}
+
+#define EEPROM hostEeprom()
+
+#endif // ifndef HOST_EEPROM_H
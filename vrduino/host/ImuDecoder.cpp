@@ -0,0 +1,68 @@
+/**
+ * Host-side decoder for the binary IMU stream
+ */
+
+#include "ImuDecoder.h"
+
+#include <string.h>
+
+ImuDecoder::ImuDecoder()
+  : length(0), overflow(false), haveSequence(false), lastSequence(0) {
+  memset(&counters, 0, sizeof(counters));
+}
+
+void ImuDecoder::reset() {
+  length = 0;
+  overflow = false;
+  haveSequence = false;
+}
+
+bool ImuDecoder::next(const uint8_t*& data, size_t& size, ImuPacketContents& out) {
+  while (size > 0) {
+    const uint8_t* end = (const uint8_t*)memchr(data, 0, size);
+    size_t run = end ? size_t(end - data) : size;
+
+    // collect the frame, remembering if it got longer than any valid one
+    if (!overflow) {
+      if (length + run <= sizeof(frame)) {
+        memcpy(frame + length, data, run);
+        length += run;
+      } else {
+        overflow = true;
+      }
+    }
+
+    counters.bytes += run + (end ? 1 : 0);
+    data += run + (end ? 1 : 0);
+    size -= run + (end ? 1 : 0);
+
+    if (end && finishFrame(out)) return true;
+  }
+  return false;
+}
+
+bool ImuDecoder::finishFrame(ImuPacketContents& out) {
+  bool overlong = overflow;
+  size_t frameLength = length;
+  length = 0;
+  overflow = false;
+
+  // back-to-back delimiters are harmless padding
+  if (frameLength == 0 && !overlong) return false;
+
+  long packetLength = overlong ? -1 : cobsDecode(frame, frameLength, packet);
+  if (packetLength < 0 || !imuPacketParse(packet, size_t(packetLength), out)) {
+    counters.badFrames++;
+    return false;
+  }
+
+  if (haveSequence) {
+    counters.lostPackets += uint16_t(out.sequence - lastSequence - 1);
+  }
+  haveSequence = true;
+  lastSequence = out.sequence;
+
+  counters.packets++;
+  counters.samples += out.count;
+  return true;
+}
@@ -0,0 +1,56 @@
+/**
+ * Host-side decoder for the binary IMU stream (see ../ImuPacket.h)
+ *
+ * Feed it whatever the serial port returns; it splits the bytes into frames
+ * on the 0 delimiters, undoes COBS, checks the CRC and hands back one packet
+ * at a time. Corrupted or overlong frames are dropped and counted, and the
+ * decoder picks up again at the next delimiter. Anything else on the line,
+ * e.g. the text the sketch prints in setup(), ends up as a dropped frame.
+ */
+
+#ifndef IMU_DECODER_H
+#define IMU_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ImuPacket.h"
+
+struct ImuDecoderStats {
+  uint64_t bytes;
+  uint64_t packets;
+  uint64_t samples;
+  uint64_t badFrames;       // COBS, CRC or layout errors, and overlong frames
+  uint64_t lostPackets;     // gaps in the sequence numbers
+};
+
+class ImuDecoder {
+public:
+
+  ImuDecoder();
+
+  /***
+   * Consumes bytes from data until a packet is complete. Returns true with
+   * the packet in out and data and size advanced past the bytes used; call
+   * again with the rest. Returns false once all bytes are used up.
+   */
+  bool next(const uint8_t*& data, size_t& size, ImuPacketContents& out);
+
+  /* forget a partial frame, e.g. after reopening the port */
+  void reset();
+
+  const ImuDecoderStats& stats() const { return counters; }
+
+private:
+  uint8_t frame[IMU_PACKET_MAX_FRAME];
+  uint8_t packet[IMU_PACKET_MAX_FRAME];
+  size_t length;
+  bool overflow;
+  bool haveSequence;
+  uint16_t lastSequence;
+  ImuDecoderStats counters;
+
+  bool finishFrame(ImuPacketContents& out);
+};
+
+#endif // ifndef IMU_DECODER_H
@@ -0,0 +1,164 @@
+/**
+ * IMU logs for replaying recordings through the filters on the host
+ *
+ * A log is a text file with one sample per line:
+ *
+ *   time_us gyrX gyrY gyrZ accX accY accZ magX magY magZ [qw qx qy qz]
+ *
+ * in the units of the Imu class (gyro bias corrected, deg/s; m/s^2; micro
+ * Tesla). Lines starting with # are comments. The magnetometer repeats its
+ * last measurement between updates; a sample has a new one when the values
+ * change. The optional quaternion is the true orientation (sensor to world,
+ * y up), which only synthetic logs have.
+ *
+ * imu-record writes logs from the sketch's RAW stream; makeSyntheticLog()
+ * generates head motion with known truth.
+ */
+
+#ifndef IMU_LOG_H
+#define IMU_LOG_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <random>
+#include <vector>
+
+#include "Quaternion.h"
+
+struct ImuLogSample {
+  uint32_t time;  // micros()
+  float gyr[3], acc[3], mag[3];
+  bool hasMag;    // mag is a new measurement
+  bool hasTruth;
+  Quaternion truth;
+};
+
+inline void writeImuLogHeader(FILE* file) {
+  fprintf(file, "# time_us gyrX gyrY gyrZ accX accY accZ magX magY magZ [qw qx qy qz]\n");
+}
+
+inline void writeImuLogSample(FILE* file, const ImuLogSample& s) {
+  fprintf(file, "%lu %.6g %.6g %.6g %.6g %.6g %.6g %.6g %.6g %.6g", (unsigned long)s.time,
+          s.gyr[0], s.gyr[1], s.gyr[2], s.acc[0], s.acc[1], s.acc[2], s.mag[0], s.mag[1], s.mag[2]);
+  if (s.hasTruth) {
+    fprintf(file, " %.9f %.9f %.9f %.9f", s.truth.q[0], s.truth.q[1], s.truth.q[2], s.truth.q[3]);
+  }
+  fprintf(file, "\n");
+}
+
+/* reads a whole log; returns false if the file cannot be opened or a line is malformed */
+inline bool readImuLog(const char* path, std::vector<ImuLogSample>& log) {
+  FILE* file = fopen(path, "r");
+  if (!file) return false;
+
+  char line[512];
+  bool ok = true;
+  int number = 0;
+  while (fgets(line, sizeof(line), file)) {
+    number++;
+    if (line[0] == '#' || line[0] == '\n') continue;
+
+    ImuLogSample s;
+    unsigned long time;
+    double q[4];
+    int n = sscanf(line, "%lu %f %f %f %f %f %f %f %f %f %lf %lf %lf %lf", &time,
+                   &s.gyr[0], &s.gyr[1], &s.gyr[2], &s.acc[0], &s.acc[1], &s.acc[2],
+                   &s.mag[0], &s.mag[1], &s.mag[2], &q[0], &q[1], &q[2], &q[3]);
+    if (n != 10 && n != 14) {
+      fprintf(stderr, "%s:%d: expected 10 or 14 values\n", path, number);
+      ok = false;
+      break;
+    }
+    s.time = uint32_t(time);
+    s.hasTruth = n == 14;
+    if (s.hasTruth) s.truth = Quaternion(q[0], q[1], q[2], q[3]);
+    s.hasMag = log.empty() || s.mag[0] != log.back().mag[0] || s.mag[1] != log.back().mag[1] ||
+               s.mag[2] != log.back().mag[2];
+    log.push_back(s);
+  }
+  fclose(file);
+  return ok;
+}
+
+
+/* parameters of the synthetic log, defaults close to the MPU9250 at 1 kHz */
+struct SyntheticImuOptions {
+  double seconds = 120;
+  int rateHz = 1000;
+  int magRateHz = 100;
+  double gyrBias[3] = { 0.2, -0.3, 0.25 };  // left after calibration, deg/s
+  double gyrNoise = 0.15;                    // deg/s per sample
+  double accNoise = 0.05;                    // m/s^2
+  double magNoise = 0.4;                     // micro Tesla
+  double magField[3] = { 0, -43, -20 };      // world, y up: down and north (-z)
+  unsigned seed = 36;
+};
+
+/* head motion: yaw sweeps, nods and some roll, as YXZ Euler angles in degrees */
+inline Quaternion syntheticOrientation(double t) {
+  const double tau = 2 * PI;
+  double yaw = 70 * sin(tau * 0.15 * t) + 20 * sin(tau * 0.7 * t);
+  double pitch = 25 * sin(tau * 0.4 * t + 1);
+  double roll = 10 * sin(tau * 0.3 * t + 2);
+  Quaternion qy = Quaternion().setFromAngleAxis(yaw, 0, 1, 0);
+  Quaternion qx = Quaternion().setFromAngleAxis(pitch, 1, 0, 0);
+  Quaternion qz = Quaternion().setFromAngleAxis(roll, 0, 0, 1);
+  return Quaternion().multiply(Quaternion().multiply(qy, qx), qz);
+}
+
+/* v rotated from world into sensor coordinates by the orientation q */
+inline void syntheticToSensor(const Quaternion& q, const double* v, double* out) {
+  Quaternion p(0, v[0], v[1], v[2]);
+  Quaternion inv = Quaternion(q.q[0], q.q[1], q.q[2], q.q[3]).inverse();
+  Quaternion r = Quaternion().multiply(Quaternion().multiply(inv, p), q);
+  out[0] = r.q[1];
+  out[1] = r.q[2];
+  out[2] = r.q[3];
+}
+
+inline std::vector<ImuLogSample> makeSyntheticLog(const SyntheticImuOptions& options = SyntheticImuOptions()) {
+  std::mt19937 random(options.seed);
+  std::normal_distribution<double> normal(0, 1);
+
+  std::vector<ImuLogSample> log;
+  int samples = int(options.seconds * options.rateHz);
+  int magEvery = options.rateHz / options.magRateHz;
+  double dt = 1.0 / options.rateHz;
+  double mag[3] = { 0, 0, 0 };
+  const double gravity[3] = { 0, 9.80665, 0 };
+
+  for (int i = 0; i < samples; i++) {
+    double t = i * dt;
+    ImuLogSample s;
+    s.time = uint32_t(llround(t * 1e6));
+    s.hasTruth = true;
+    s.truth = syntheticOrientation(t);
+
+    // body rate from the rotation over the sample period around t
+    Quaternion a = syntheticOrientation(t - dt / 2).inverse();
+    Quaternion d = Quaternion().multiply(a, syntheticOrientation(t + dt / 2));
+    double sinHalf = sqrt(sq(d.q[1]) + sq(d.q[2]) + sq(d.q[3]));
+    double angle = 2 * atan2(sinHalf, d.q[0]);
+    double scale = sinHalf > 0 ? angle / sinHalf / dt * 180 / PI : 0;
+    for (int k = 0; k < 3; k++) {
+      s.gyr[k] = float(d.q[k + 1] * scale + options.gyrBias[k] + options.gyrNoise * normal(random));
+    }
+
+    double acc[3];
+    syntheticToSensor(s.truth, gravity, acc);
+    for (int k = 0; k < 3; k++) s.acc[k] = float(acc[k] + options.accNoise * normal(random));
+
+    s.hasMag = i % magEvery == 0;
+    if (s.hasMag) {
+      syntheticToSensor(s.truth, options.magField, mag);
+      for (int k = 0; k < 3; k++) mag[k] += options.magNoise * normal(random);
+    }
+    for (int k = 0; k < 3; k++) s.mag[k] = float(mag[k]);
+    log.push_back(s);
+  }
+  return log;
+}
+
+#endif // ifndef IMU_LOG_H
@@ -0,0 +1,182 @@
+/**
+ * Simulated MPU9250 and AK8963 behind the ImuBus interface
+ *
+ * Models the registers the Imu class uses: the data registers, sample rate
+ * divider, FIFO (512 bytes, oldest bytes overwritten when full, as the chip
+ * does by default), FIFO count, data ready interrupt, and the AK8963 in
+ * single and continuous mode with its data ready flag.
+ *
+ * Time is simulated. Every bus transaction advances the clock by its I2C
+ * duration at the configured clock, and the chips take their samples as the
+ * clock passes their sample times. Sample n has accelerometer x = n (mod
+ * 32768), so a reader can check for lost, repeated or reordered samples.
+ */
+
+#ifndef SIM_IMU_BUS_H
+#define SIM_IMU_BUS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <deque>
+
+#include "Arduino.h"
+#include "ImuBus.h"
+
+class SimImuBus : public ImuBus {
+public:
+
+  /* I2C transaction counters */
+  struct Stats {
+    unsigned long reads, writes, bytes;
+    double busyUs;              // time spent on the bus
+    unsigned long samples;      // samples taken by the MPU9250
+    unsigned long fifoDropped;  // bytes overwritten in the full FIFO
+  };
+
+  explicit SimImuBus(long i2cHz = 400000, uint8_t maxReadBytes = 32, int interruptPin = -1)
+    : i2cHz(i2cHz), maxReadBytes(maxReadBytes), interruptPin(interruptPin),
+      now(0), nextSample(0), nextMag(0), sampleCount(0), magMode(0), magReady(false) {
+    memset(mpu, 0, sizeof(mpu));
+    memset(ak, 0, sizeof(ak));
+    memset(&counters, 0, sizeof(counters));
+    mpu[0x75] = 0x71;                       // WHO_AM_I
+    ak[0x10] = ak[0x11] = ak[0x12] = 128;   // ASA: no adjustment
+  }
+
+  virtual uint8_t maxRead() const { return maxReadBytes; }
+
+  virtual void read(uint8_t address, uint8_t reg, uint8_t size, uint8_t* data) {
+    transaction(4 + size);
+    counters.reads++;
+    for (uint8_t i = 0; i < size; i++) {
+      if (address == MPU) {
+        data[i] = readMpu(reg);
+        if (reg != FIFO_R_W) reg++;
+      } else {
+        data[i] = readAk(reg++);
+      }
+    }
+  }
+
+  virtual void writeByte(uint8_t address, uint8_t reg, uint8_t value) {
+    transaction(3);
+    counters.writes++;
+    if (address == MPU) {
+      if (reg == USER_CTRL && (value & 0x04)) fifo.clear();
+      mpu[reg] = reg == USER_CTRL ? uint8_t(value & ~0x04) : value;
+    } else if (reg == 0x0A) {
+      magMode = value & 0x1f;
+      if (magMode == 0x11) nextMag = now + 7200;  // single measurement: 7.2 ms
+      else if (magMode == 0x16) nextMag = now + 10000;
+    }
+  }
+
+  /* let time pass without bus traffic, e.g. for the fusion math */
+  void advance(double us) {
+    now += us;
+    catchUp();
+  }
+
+  double time() const { return now; }
+
+  const Stats& stats() const { return counters; }
+
+  /* accelerometer x of sample n, as the chip reports it */
+  static int16_t pattern(unsigned long n) { return int16_t(n & 0x7fff); }
+
+private:
+  static const uint8_t MPU = 0x68;
+  static const uint8_t USER_CTRL = 0x6A;
+  static const uint8_t FIFO_R_W = 0x74;
+
+  long i2cHz;
+  uint8_t maxReadBytes;
+  int interruptPin;
+
+  double now, nextSample, nextMag;
+  unsigned long sampleCount;
+  uint8_t magMode;
+  bool magReady;
+
+  uint8_t mpu[128];
+  uint8_t ak[0x13];
+  std::deque<uint8_t> fifo;
+  Stats counters;
+
+  /* start, address, register, restart/address and stop, 9 clocks a byte */
+  void transaction(int bytes) {
+    double us = bytes * 9.0 * 1e6 / i2cHz + 5;
+    counters.bytes += bytes;
+    counters.busyUs += us;
+    advance(us);
+  }
+
+  double samplePeriod() const {
+    // 1 kHz internal rate divided by SMPLRT_DIV + 1
+    return 1000.0 * (mpu[0x19] + 1);
+  }
+
+  void catchUp() {
+    while (nextSample <= now) {
+      takeSample();
+      nextSample += samplePeriod();
+    }
+    while ((magMode == 0x11 || magMode == 0x16) && nextMag <= now) {
+      int16_t m[3] = { int16_t(sampleCount), 200, -300 };
+      for (int i = 0; i < 3; i++) {
+        ak[0x03 + 2 * i] = uint8_t(m[i]);
+        ak[0x04 + 2 * i] = uint8_t(m[i] >> 8);
+      }
+      magReady = true;
+      if (magMode == 0x11) magMode = 0;
+      else nextMag += 10000;
+    }
+  }
+
+  void takeSample() {
+    int16_t values[7] = { pattern(sampleCount), 100, -16000, 0, 5, -5, 50 };
+    for (int i = 0; i < 7; i++) {
+      mpu[0x3B + 2 * i] = uint8_t(values[i] >> 8);
+      mpu[0x3C + 2 * i] = uint8_t(values[i]);
+    }
+    sampleCount++;
+    counters.samples++;
+
+    // FIFO_EN bits 0x78 and USER_CTRL FIFO_EN: accelerometer then gyro
+    if ((mpu[USER_CTRL] & 0x40) && (mpu[0x23] & 0x78) == 0x78) {
+      for (int i = 0; i < 14; i++) {
+        if (i == 6 || i == 7) continue;  // no temperature
+        fifo.push_back(mpu[0x3B + i]);
+      }
+      while (fifo.size() > 512) {
+        fifo.pop_front();
+        counters.fifoDropped++;
+      }
+    }
+
+    if ((mpu[0x38] & 0x01) && interruptPin >= 0) hostInterrupt(interruptPin);
+  }
+
+  uint8_t readMpu(uint8_t reg) {
+    if (reg == 0x72) return uint8_t(fifo.size() >> 8);
+    if (reg == 0x73) return uint8_t(fifo.size());
+    if (reg == FIFO_R_W) {
+      if (fifo.empty()) return 0xff;
+      uint8_t value = fifo.front();
+      fifo.pop_front();
+      return value;
+    }
+    return mpu[reg & 0x7f];
+  }
+
+  uint8_t readAk(uint8_t reg) {
+    if (reg == 0x02) return magReady ? 0x01 : 0x00;
+    // reading the data or ST2 clears data ready
+    if (reg >= 0x03 && reg <= 0x09) magReady = false;
+    if (reg == 0x09) return 0x10;  // ST2: 16 bit output, no overflow
+    return reg < sizeof(ak) ? ak[reg] : 0;
+  }
+};
+
+#endif // ifndef SIM_IMU_BUS_H
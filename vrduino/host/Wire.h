@@ -0,0 +1,38 @@
+/**
+ * Stand-in for the Arduino Wire library on the host, so ImuBus.cpp and with
+ * it the whole sketch link. There is nothing on the bus: transmissions are
+ * not acknowledged and reads return no bytes. Simulations use SimImuBus.h
+ * instead of WireBus.
+ */
+
+#ifndef HOST_WIRE_H
+#define HOST_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class HostWire {
+public:
+  void begin() {}
+  void setClock(uint32_t) {}
+
+  void beginTransmission(uint8_t) {}
+  size_t write(uint8_t) { return 1; }
+
+  /* 2: address not acknowledged */
+  uint8_t endTransmission(bool = true) { return 2; }
+
+  uint8_t requestFrom(uint8_t, uint8_t) { return 0; }
+  int available() { return 0; }
+  int read() { return -1; }
+};
+
+/* one bus for all translation units */
+inline HostWire& hostWire() {
+  static HostWire wire;
+  return wire;
+}
+
+#define Wire hostWire()
+
+#endif // ifndef HOST_WIRE_H
@@ -0,0 +1,336 @@
+/**
+ * Evaluation of the online calibration (Calibration.h, CalibrationStore.h)
+ *
+ * Magnetometer: turns a simulated board through all directions in a field
+ * of 47 micro Tesla, distorted by a hard-iron offset and a soft-iron matrix,
+ * and feeds MagCalibrator until it is ready. Reports how long that took, the
+ * fit time, and on a fresh set of directions the angle and the field
+ * strength spread of the raw and the corrected measurements.
+ *
+ * Gyro bias: two minutes at 1 kHz alternating 4 s of rest and 6 s of head
+ * motion while the bias drifts as the board warms up. Reports the estimates
+ * made, any that motion in its window moved by more than 0.05 deg/s, and the
+ * bias error over time against the bias measured once at startup and never
+ * updated.
+ *
+ * EEPROM: round trip of the record through host/EEPROM.h, detection of a
+ * flipped bit, and the bytes written by saving changed and unchanged
+ * records.
+ *
+ * Startup: time from power-up to the first fused sample with the old
+ * fixed delays and two bias passes, a single bias pass, and a stored
+ * record, with the IMU reads timed on SimImuBus.
+ *
+ * The exit code is nonzero if the corrected field is off by more than 1
+ * degree RMS or 2% in strength, an estimate is taken over motion, the
+ * tracked bias is off by more than 0.05 deg/s RMS, or the EEPROM checks
+ * fail.
+ *
+ * Usage: calibration-bench
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "Calibration.h"
+#include "CalibrationStore.h"
+#include "SimImuBus.h"
+#include "imu.h"
+
+const double FIELD[3] = { 0, -43, -19 };  // micro Tesla, y-up world
+const double HARD_IRON[3] = { 25, -40, 12 };
+const double SOFT_IRON[3][3] = { { 1.15, 0.06, -0.03 }, { 0.06, 0.88, 0.04 }, { -0.03, 0.04, 1.02 } };
+const double MAG_NOISE = 0.4;
+const double MAG_RATE = 100;
+
+const double GYRO_NOISE = 0.15;
+const double BIAS_START[3] = { 0.5, -0.8, 0.3 };
+const double BIAS_END[3] = { 0.9, -0.5, 0.1 };
+const double MAX_MOTION_ERROR = 0.05;  // deg/s
+
+static std::mt19937 rng(1);
+
+static double gaussian(double sigma) {
+  return std::normal_distribution<double>(0, sigma)(rng);
+}
+
+/* rotation matrix of a slowly tumbling board, sensor to world */
+struct Tumble {
+  double r[3][3];
+
+  Tumble() {
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) r[i][j] = i == j ? 1 : 0;
+  }
+
+  /* turn by the body rate w (rad/s) for dt seconds */
+  void step(const double* w, double dt) {
+    double angle = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]) * dt;
+    if (angle == 0) return;
+    double k[3] = { w[0] * dt / angle, w[1] * dt / angle, w[2] * dt / angle };
+    double c = cos(angle), s = sin(angle), t = 1 - c;
+    double turn[3][3] = {
+      { t * k[0] * k[0] + c, t * k[0] * k[1] - s * k[2], t * k[0] * k[2] + s * k[1] },
+      { t * k[0] * k[1] + s * k[2], t * k[1] * k[1] + c, t * k[1] * k[2] - s * k[0] },
+      { t * k[0] * k[2] - s * k[1], t * k[1] * k[2] + s * k[0], t * k[2] * k[2] + c },
+    };
+    double n[3][3];
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) n[i][j] = r[i][0] * turn[0][j] + r[i][1] * turn[1][j] + r[i][2] * turn[2][j];
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) r[i][j] = n[i][j];
+  }
+
+  /* world vector in the sensor frame */
+  void toSensor(const double* v, double* out) const {
+    for (int i = 0; i < 3; i++) out[i] = r[0][i] * v[0] + r[1][i] * v[1] + r[2][i] * v[2];
+  }
+};
+
+/* true field in the sensor frame and the distorted measurement of it */
+static void measureField(const Tumble& board, double* truth, double* raw) {
+  board.toSensor(FIELD, truth);
+  for (int i = 0; i < 3; i++) {
+    raw[i] = HARD_IRON[i] + gaussian(MAG_NOISE);
+    for (int j = 0; j < 3; j++) raw[i] += SOFT_IRON[i][j] * truth[j];
+  }
+}
+
+static double norm(const double* v) {
+  return sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+}
+
+static double angleDegrees(const double* a, const double* b) {
+  double dot = (a[0] * b[0] + a[1] * b[1] + a[2] * b[2]) / (norm(a) * norm(b));
+  return acos(dot > 1 ? 1 : dot < -1 ? -1 : dot) * 180 / PI;
+}
+
+struct FieldError {
+  double angleRms, strengthSpread;  // degrees, relative standard deviation
+};
+
+static FieldError fieldError(const std::vector<double>& angles, const std::vector<double>& strengths) {
+  FieldError e = FieldError();
+  RunningStats3 s;
+  double sum = 0;
+  for (size_t i = 0; i < angles.size(); i++) {
+    sum += angles[i] * angles[i];
+    s.add(strengths[i], 0, 0);
+  }
+  e.angleRms = sqrt(sum / angles.size());
+  e.strengthSpread = sqrt(s.variance(0)) / s.mean[0];
+  return e;
+}
+
+static bool magnetometer() {
+  printf("magnetometer: field %.0f uT, hard iron (%.0f, %.0f, %.0f) uT, soft iron axes within %.0f%%\n",
+         norm(FIELD), HARD_IRON[0], HARD_IRON[1], HARD_IRON[2], 15.0);
+
+  // turn the board about a wandering axis until the calibrator is satisfied
+  MagCalibrator calibrator;
+  Tumble board;
+  double t = 0, dt = 1 / MAG_RATE;
+  unsigned long offered = 0;
+  while (!calibrator.ready() && t < 600) {
+    double w[3] = { 1.5 * sin(0.7 * t), 1.5 * cos(0.5 * t), 1.5 * sin(0.3 * t + 1) };
+    board.step(w, dt);
+    double truth[3], raw[3];
+    measureField(board, truth, raw);
+    calibrator.add(raw[0], raw[1], raw[2]);
+    offered++;
+    t += dt;
+  }
+  printf("  ready after %.1f s: %lu of %lu measurements accepted, %d octants\n", t,
+         calibrator.samples(), offered, calibrator.coverage());
+
+  MagCalibration calibration;
+  if (!calibrator.fit(calibration)) {
+    fprintf(stderr, "magnetometer fit failed\n");
+    return false;
+  }
+  printf("  offset (%.2f, %.2f, %.2f) uT\n", calibration.offset[0], calibration.offset[1],
+         calibration.offset[2]);
+
+  const int FITS = 2000;
+  double check = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < FITS; i++) {
+    MagCalibration c;
+    calibrator.fit(c);
+    check += c.offset[0];
+  }
+  double us = double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count()) / FITS / 1000;
+  printf("  fit: %.2f us on the host%s\n", us, check == 12345 ? " " : "");
+
+  // fresh directions; the corrected field keeps the mean radius, not 47 uT
+  std::vector<double> rawAngles, rawStrengths, angles, strengths;
+  for (int i = 0; i < 5000; i++) {
+    double w[3] = { 2 * cos(0.9 * t), 2 * sin(0.4 * t + 2), 2 * cos(0.6 * t) };
+    board.step(w, dt);
+    t += dt;
+    double truth[3], raw[3], corrected[3];
+    measureField(board, truth, raw);
+    calibration.apply(raw[0], raw[1], raw[2], corrected);
+    rawAngles.push_back(angleDegrees(raw, truth));
+    rawStrengths.push_back(norm(raw));
+    angles.push_back(angleDegrees(corrected, truth));
+    strengths.push_back(norm(corrected));
+  }
+  FieldError before = fieldError(rawAngles, rawStrengths), after = fieldError(angles, strengths);
+  printf("  %-10s %12s %14s\n", "", "angle rms", "strength sd");
+  printf("  %-10s %8.2f deg %13.2f%%\n", "raw", before.angleRms, 100 * before.strengthSpread);
+  printf("  %-10s %8.2f deg %13.2f%%\n\n", "corrected", after.angleRms, 100 * after.strengthSpread);
+
+  if (after.angleRms > 1 || after.strengthSpread > 0.02) {
+    fprintf(stderr, "corrected field off by %.2f degrees RMS, %.2f%% in strength\n", after.angleRms,
+            100 * after.strengthSpread);
+    return false;
+  }
+  return true;
+}
+
+static bool gyroBias() {
+  const double RATE = 1000, SECONDS = 120, REST = 4, CYCLE = 10;
+  printf("gyro bias: %.0f s at %.0f Hz, %.0f s rest in every %.0f s, bias drifting by "
+         "(%.1f, %.1f, %.1f) deg/s\n", SECONDS, RATE, REST, CYCLE, BIAS_END[0] - BIAS_START[0],
+         BIAS_END[1] - BIAS_START[1], BIAS_END[2] - BIAS_START[2]);
+
+  GyroBiasTracker tracker;
+  double variance[3] = { GYRO_NOISE * GYRO_NOISE, GYRO_NOISE * GYRO_NOISE, GYRO_NOISE * GYRO_NOISE };
+  tracker.setBias(BIAS_START, variance);
+
+  unsigned long n = (unsigned long)(SECONDS * RATE), falseEstimates = 0;
+  std::vector<double> turns(3 * n, 0.0);
+  double trackedSum = 0, fixedSum = 0, finalError = 0;
+  for (unsigned long i = 0; i < n; i++) {
+    double t = i / RATE;
+    double phase = fmod(t, CYCLE);
+    bool rest = phase < REST;
+    double heat = 1 - exp(-t / 40);
+    double bias[3], gyr[3], acc[3] = { 0, 9.80665, 0 };
+    for (int k = 0; k < 3; k++) {
+      bias[k] = BIAS_START[k] + heat * (BIAS_END[k] - BIAS_START[k]) / (1 - exp(-SECONDS / 40));
+      gyr[k] = bias[k] + gaussian(GYRO_NOISE);
+      acc[k] += gaussian(0.02);
+    }
+    if (!rest) {
+      // head turns and nods, ramping in and out of the rest
+      double m = phase - REST, envelope = sin(PI * m / (CYCLE - REST));
+      double turn[3] = { 40 * envelope * sin(2.1 * m), 60 * envelope * sin(1.3 * m + 0.5),
+                         15 * envelope * cos(3.0 * m) };
+      for (int k = 0; k < 3; k++) {
+        gyr[k] += turn[k];
+        turns[3 * i + k] = turn[k];
+      }
+      acc[0] += 1.5 * envelope * sin(5 * m);
+      acc[2] += 1.0 * envelope * cos(4 * m);
+    }
+
+    // an estimate over motion is off by the mean turn rate in its window
+    if (tracker.add(gyr[0], gyr[1], gyr[2], acc[0], acc[1], acc[2])) {
+      double turned[3] = { 0, 0, 0 };
+      for (unsigned long j = i + 1 - tracker.windowSamples; j <= i; j++)
+        for (int k = 0; k < 3; k++) turned[k] += turns[3 * j + k] / tracker.windowSamples;
+      if (norm(turned) > MAX_MOTION_ERROR) falseEstimates++;
+    }
+
+    double tracked = 0, fixed = 0;
+    for (int k = 0; k < 3; k++) {
+      tracked += (tracker.bias[k] - bias[k]) * (tracker.bias[k] - bias[k]);
+      fixed += (BIAS_START[k] - bias[k]) * (BIAS_START[k] - bias[k]);
+    }
+    trackedSum += tracked;
+    fixedSum += fixed;
+    finalError = sqrt(tracked);
+  }
+  double trackedRms = sqrt(trackedSum / n), fixedRms = sqrt(fixedSum / n);
+  printf("  %lu estimates, %lu over motion\n", tracker.updates, falseEstimates);
+  printf("  %-10s %12s\n", "", "error rms");
+  printf("  %-10s %6.3f deg/s\n", "startup", fixedRms);
+  printf("  %-10s %6.3f deg/s (%.3f at the end)\n\n", "tracked", trackedRms, finalError);
+
+  if (falseEstimates > 0 || trackedRms > 0.05) {
+    fprintf(stderr, "bias tracking: %lu estimates over motion, %.3f deg/s RMS\n", falseEstimates,
+            trackedRms);
+    return false;
+  }
+  return true;
+}
+
+static bool eeprom() {
+  bool ok = true;
+  StoredCalibration c = StoredCalibration();
+  c.flags = CALIBRATION_GYRO | CALIBRATION_MAG;
+  for (int k = 0; k < 3; k++) {
+    c.gyrBias[k] = float(BIAS_START[k]);
+    c.gyrVariance[k] = 0.02f;
+    c.magOffset[k] = float(HARD_IRON[k]);
+  }
+  for (int k = 0; k < 9; k++) c.magMatrix[k] = k % 4 == 0 ? 1.0f : 0.0f;
+
+  StoredCalibration loaded;
+  ok = !loadCalibration(loaded) && ok;  // erased EEPROM
+
+  unsigned long writes = EEPROM.writes;
+  saveCalibration(c);
+  unsigned long first = EEPROM.writes - writes;
+  ok = loadCalibration(loaded) && memcmp(&loaded, &c, sizeof(c)) == 0 && ok;
+
+  writes = EEPROM.writes;
+  saveCalibration(c);
+  unsigned long unchanged = EEPROM.writes - writes;
+  ok = unchanged == 0 && ok;
+
+  writes = EEPROM.writes;
+  c.gyrBias[1] += 0.01f;
+  saveCalibration(c);
+  unsigned long changed = EEPROM.writes - writes;
+
+  // a flipped bit in the payload
+  EEPROM.data[CALIBRATION_EEPROM_ADDRESS + offsetof(StoredCalibration, magOffset) + 2] ^= 0x10;
+  bool corrupt = !loadCalibration(loaded);
+  ok = corrupt && ok;
+  EEPROM.data[CALIBRATION_EEPROM_ADDRESS + offsetof(StoredCalibration, magOffset) + 2] ^= 0x10;
+
+  clearCalibration();
+  ok = !loadCalibration(loaded) && ok;
+
+  printf("eeprom: %zu byte record; bytes written: %lu first save, %lu unchanged, %lu for a new bias; "
+         "flipped bit %s\n\n", sizeof(StoredCalibration), first, unchanged, changed,
+         corrupt ? "detected" : "NOT detected");
+  if (!ok) fprintf(stderr, "EEPROM round trip failed\n");
+  return ok;
+}
+
+/* simulated time of n Imu::read() calls, in ms */
+static double readTime(int n) {
+  SimImuBus bus;
+  Imu imu(bus);
+  imu.init();
+  double start = bus.time();
+  for (int i = 0; i < n; i++) imu.read();
+  return (bus.time() - start) / 1000;
+}
+
+static void startup() {
+  // delays of setup() and Imu::init()
+  const double OLD_DELAYS_MS = 1000 + 100 + 1000 + 2000 + 1000, INIT_MS = 100;
+  double pass = readTime(1000);
+  printf("startup to the first fused sample (bias pass of 1000 reads: %.0f ms at 400 kHz)\n", pass);
+  printf("  %-26s %7.0f ms\n", "fixed delays, two passes", OLD_DELAYS_MS + 2 * pass);
+  printf("  %-26s %7.0f ms\n", "no record, one pass", INIT_MS + pass);
+  printf("  %-26s %7.0f ms\n", "stored record", INIT_MS);
+}
+
+int main() {
+  bool ok = magnetometer();
+  ok = gyroBias() && ok;
+  ok = eeprom() && ok;
+  startup();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+/**
+ * Benchmark of the orientation fusion engines: drift against cost
+ *
+ * Replays an IMU log (see ImuLog.h) through the complementary filter of
+ * ComplementaryFilter.h and the Madgwick, Mahony and EKF engines in float,
+ * each with and without the magnetometer, and once more with a cycle budget
+ * of a quarter of their correction cost. Without a log it generates two
+ * minutes of synthetic head motion at 1 kHz with a residual gyro bias.
+ *
+ * Reports per run the host ns and cycles per update (the engines' own
+ * cycle count, which includes reading the counter), the updates per
+ * correction, and the error after the first 2 s of settling: RMS and
+ * maximum angle to the true orientation, and the yaw error at the end. A
+ * recorded log has no truth, so there the reference is the estimate at 2 s
+ * and the numbers are the drift from it; record such a log starting and
+ * ending in the same pose.
+ *
+ * On the synthetic log every engine with the magnetometer must stay within
+ * 3 degrees RMS and end within 3 degrees of yaw without a budget; the exit
+ * code is nonzero if one does not. The budgeted runs are only reported:
+ * their correction interval follows the cycles measured on this host, so
+ * their error changes from run to run.
+ *
+ * Usage: fusion-bench [log]
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <vector>
+
+#include "ComplementaryFilter.h"
+#include "EkfFusion.h"
+#include "ImuLog.h"
+#include "MadgwickFusion.h"
+#include "MahonyFusion.h"
+
+const double SETTLE_SECONDS = 2;
+const double MAX_RMS_DEGREES = 3;
+const double MAX_YAW_DEGREES = 3;
+
+struct Result {
+  double ns, cycles;
+  int interval;
+  double rms, max, yaw;
+};
+
+static double toDegrees(double radians) {
+  return radians * 180 / PI;
+}
+
+/* rotation angle and yaw (about world y) of estimate * reference^-1 */
+static void difference(const Quaternionf& estimate, const Quaternion& reference,
+                       double& angle, double& yaw) {
+  Quaternion inv = Quaternion(reference.q[0], reference.q[1], reference.q[2], reference.q[3]).inverse();
+  Quaternion e = Quaternion().multiply(Quaternion(estimate), inv);
+  double w = fabs(e.q[0]);
+  angle = toDegrees(2 * atan2(sqrt(sq(e.q[1]) + sq(e.q[2]) + sq(e.q[3])), w));
+  yaw = toDegrees(2 * atan2(e.q[0] < 0 ? -e.q[2] : e.q[2], w));
+}
+
+static FusionInput<float> input(const ImuLogSample& s) {
+  FusionInput<float> in;
+  in.gyrX = s.gyr[0]; in.gyrY = s.gyr[1]; in.gyrZ = s.gyr[2];
+  in.accX = s.acc[0]; in.accY = s.acc[1]; in.accZ = s.acc[2];
+  in.magX = s.mag[0]; in.magY = s.mag[1]; in.magZ = s.mag[2];
+  in.hasMag = s.hasMag;
+  return in;
+}
+
+static Result evaluate(const std::vector<ImuLogSample>& log, const std::vector<Quaternionf>& estimates,
+                       double ns) {
+  Result result = Result();
+  result.ns = ns / log.size();
+  result.interval = 1;
+
+  uint32_t start = log.front().time;
+  size_t settled = 0;
+  while (settled < log.size() && (log[settled].time - start) < SETTLE_SECONDS * 1e6) settled++;
+  if (settled == log.size()) return result;
+
+  bool truth = log[settled].hasTruth;
+  Quaternion startPose(estimates[settled]);
+  double sum = 0, angle = 0, yaw = 0;
+  for (size_t i = settled; i < log.size(); i++) {
+    difference(estimates[i], truth ? log[i].truth : startPose, angle, yaw);
+    sum += angle * angle;
+    if (angle > result.max) result.max = angle;
+  }
+  result.rms = sqrt(sum / (log.size() - settled));
+  result.yaw = yaw;
+  return result;
+}
+
+static void printRow(const char* name, const char* mag, const Result& r) {
+  char cycles[16] = "-";
+  if (r.cycles > 0) snprintf(cycles, sizeof(cycles), "%.0f", r.cycles);
+  printf("%-14s %4s %9.1f %9s %9d %9.2f %9.2f %9.2f\n", name, mag, r.ns, cycles, r.interval,
+         r.rms, r.max, r.yaw);
+}
+
+static Result runComplementary(const std::vector<ImuLogSample>& log) {
+  std::vector<Quaternionf> estimates(log.size());
+  Quaternionf q;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < log.size(); i++) {
+    float dtMs = i == 0 ? 0.0f : float(log[i].time - log[i - 1].time) / 1000;
+    const ImuLogSample& s = log[i];
+    q = complementaryFilterUpdate<float>(q, s.gyr[0], s.gyr[1], s.gyr[2],
+                                         s.acc[0], s.acc[1], s.acc[2], dtMs, 0.95f);
+    estimates[i] = q;
+  }
+  double ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count());
+  return evaluate(log, estimates, ns);
+}
+
+static Result runEngine(FusionEngine<float>& engine, const std::vector<ImuLogSample>& log,
+                        bool useMag, uint32_t budget) {
+  engine.reset();
+  engine.setUseMagnetometer(useMag);
+  engine.setCycleBudget(budget);
+
+  std::vector<Quaternionf> estimates(log.size());
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < log.size(); i++) {
+    float dt = i == 0 ? 0.0f : float(log[i].time - log[i - 1].time) / 1e6f;
+    engine.update(input(log[i]), dt);
+    estimates[i] = engine.orientation();
+  }
+  double ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count());
+
+  Result result = evaluate(log, estimates, ns);
+  result.cycles = engine.cyclesPerUpdate();
+  result.interval = engine.correctionInterval();
+  return result;
+}
+
+static bool check(const char* name, const Result& r) {
+  if (r.rms <= MAX_RMS_DEGREES && fabs(r.yaw) <= MAX_YAW_DEGREES) return true;
+  fprintf(stderr, "%s: %.2f degrees RMS, %.2f degrees yaw at the end\n", name, r.rms, r.yaw);
+  return false;
+}
+
+int main(int argc, char** argv) {
+  std::vector<ImuLogSample> log;
+  if (argc > 1) {
+    if (!readImuLog(argv[1], log)) {
+      fprintf(stderr, "cannot read %s\n", argv[1]);
+      return 1;
+    }
+    if (log.size() < 2) {
+      fprintf(stderr, "%s: too few samples\n", argv[1]);
+      return 1;
+    }
+    printf("%s: %zu samples, %.1f s\n\n", argv[1], log.size(),
+           (log.back().time - log.front().time) / 1e6);
+  } else {
+    log = makeSyntheticLog();
+    printf("synthetic head motion: %zu samples, %.0f s, gyro bias left (0.2, -0.3, 0.25) deg/s\n\n",
+           log.size(), (log.back().time - log.front().time) / 1e6);
+  }
+  bool truth = log.back().hasTruth;
+
+  printf("%-14s %4s %9s %9s %9s %9s %9s %9s\n", "filter", "mag", "ns/upd", "cyc/upd", "upd/corr",
+         truth ? "rms deg" : "drift rms", truth ? "max deg" : "drift max", "yaw end");
+
+  printRow("complementary", "no", runComplementary(log));
+
+  MadgwickFusion<float> gyro(0);
+  printRow("gyro only", "no", runEngine(gyro, log, false, 0));
+
+  MadgwickFusion<float> madgwick;
+  MahonyFusion<float> mahony;
+  EkfFusion<float> ekf;
+  FusionEngine<float>* engines[] = { &madgwick, &mahony, &ekf };
+
+  bool ok = true;
+  for (int e = 0; e < 3; e++) {
+    FusionEngine<float>& engine = *engines[e];
+    printRow(engine.name(), "no", runEngine(engine, log, false, 0));
+
+    Result full = runEngine(engine, log, true, 0);
+    printRow(engine.name(), "yes", full);
+    if (truth) ok = check(engine.name(), full) && ok;
+
+    // room for every fourth correction
+    uint32_t budget = uint32_t(engine.predictCycles() + engine.correctCycles() / 4);
+    Result budgeted = runEngine(engine, log, true, budget);
+    char name[32];
+    snprintf(name, sizeof(name), "%s/%u", engine.name(), budget);
+    printRow(name, "yes", budgeted);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+/**
+ * Benchmark of IMU acquisition against the simulated MPU9250 (SimImuBus.h)
+ *
+ * Runs the Imu class for 10 simulated seconds with the chip sampling at
+ * 1 kHz, in four modes: read() once per loop iteration as before, FIFO
+ * batches polled every iteration, FIFO batches on the data ready
+ * interrupt, and the same waiting for at least 4 samples. The loop spends
+ * FILTER_US per sample on fusion plus a fixed time per iteration on serial
+ * output, once short (binary packets) and once long (text lines).
+ *
+ * Reports per mode the distinct samples per second that reached the loop,
+ * samples lost or seen twice, I2C transactions per sample and the share of
+ * time spent waiting on I2C. FIFO modes must deliver every sample exactly
+ * once, in order; the exit code is nonzero if they do not.
+ *
+ * Usage: imu-acquisition-bench
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include "imu.h"
+#include "SimImuBus.h"
+
+const double SECONDS = 10;
+const double FILTER_US = 60;
+const int INTERRUPT_PIN = 2;
+
+enum Mode { POLL, FIFO, FIFO_INTERRUPT, FIFO_INTERRUPT_4 };
+
+static const char* modeName(Mode mode) {
+  const char* names[] = { "read()", "fifo", "fifo+int", "fifo+int4" };
+  return names[mode];
+}
+
+/* sample index encoded by SimImuBus in the accelerometer x axis */
+static long sampleIndex(double accX) {
+  return lround(-accX / (9.80665 * 16.0 / 32767.0));
+}
+
+static bool run(Mode mode, double streamUs) {
+  int pin = mode >= FIFO_INTERRUPT ? INTERRUPT_PIN : -1;
+  SimImuBus bus(400000, 32, pin);
+  Imu imu(bus);
+  Serial.muted = true;
+  imu.init();
+  Serial.muted = false;
+  if (mode != POLL) imu.startFifo(1000, pin, mode == FIFO_INTERRUPT_4 ? 4 : 1);
+
+  double start = bus.time();
+  SimImuBus::Stats before = bus.stats();
+  long last = -1;
+  unsigned long delivered = 0, lost = 0, repeated = 0, reordered = 0;
+  unsigned long magUpdates = 0;
+  double lastMag = imu.magX + imu.magY + imu.magZ;
+
+  ImuSample samples[IMU_MAX_BATCH];
+  while (bus.time() - start < SECONDS * 1e6) {
+    int n = 1;
+    if (mode == POLL) {
+      imu.read();
+      samples[0].accX = imu.accX;
+    } else {
+      n = imu.readBatch(samples, IMU_MAX_BATCH);
+    }
+
+    for (int i = 0; i < n; i++) {
+      long index = sampleIndex(samples[i].accX);
+      long expected = (last + 1) & 0x7fff;
+      if (last >= 0 && index == last) {
+        repeated++;
+        continue;
+      }
+      if (last >= 0 && index != expected) {
+        long gap = (index - expected) & 0x7fff;
+        if (gap > 0x4000) reordered++;
+        else lost += gap;
+      }
+      last = index;
+      delivered++;
+    }
+
+    // the simulated magnetometer changes with every measurement
+    if (imu.magX + imu.magY + imu.magZ != lastMag) {
+      magUpdates++;
+      lastMag = imu.magX + imu.magY + imu.magZ;
+    }
+
+    bus.advance(n * FILTER_US + streamUs);
+  }
+
+  const SimImuBus::Stats& after = bus.stats();
+  double elapsed = (bus.time() - start) / 1e6;
+  unsigned long transactions = after.reads + after.writes - before.reads - before.writes;
+  double busy = (after.busyUs - before.busyUs) / (bus.time() - start);
+  printf("%-9s %8.0f %10.0f %8lu %8lu %10.2f %8.1f%% %8.0f\n", modeName(mode), streamUs,
+         delivered / elapsed, lost, repeated, delivered ? double(transactions) / delivered : 0.0,
+         busy * 100, magUpdates / elapsed);
+
+  bool ok = mode == POLL || (lost == 0 && repeated == 0 && reordered == 0 &&
+                             imu.fifoStats().overflows == 0);
+  if (!ok) {
+    fprintf(stderr, "%s: %lu lost, %lu repeated, %lu reordered, %lu overflows\n", modeName(mode),
+            lost, repeated, reordered, imu.fifoStats().overflows);
+  }
+  return ok;
+}
+
+int main() {
+  printf("MPU9250 at 1 kHz, I2C at 400 kHz, %.0f s simulated, fusion %.0f us per sample\n\n",
+         SECONDS, FILTER_US);
+  printf("%-9s %8s %10s %8s %8s %10s %9s %8s\n", "mode", "out us", "samples/s", "lost",
+         "repeated", "i2c/sample", "i2c busy", "mag/s");
+
+  bool ok = true;
+  const double streamUs[] = { 100, 3500 };
+  for (int s = 0; s < 2; s++) {
+    for (int m = POLL; m <= FIFO_INTERRUPT_4; m++) ok = run(Mode(m), streamUs[s]) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,172 @@
+/**
+ * Benchmark of the binary IMU stream against the "QC %f %f %f %f" text lines
+ *
+ * Encodes a quaternion stream as text and as packets of 1, 2, 4 and 8
+ * samples, and reports per sample: bytes on the wire, the sample rate that
+ * fits through a 115200 baud port, the time one sample spends on the wire
+ * plus the average wait for its batch to fill at that rate, and the host time
+ * to parse it (strtof on the text, ImuDecoder on the packets). It also checks
+ * that the decoder returns every sample within the Q1.14 resolution, and that
+ * it drops frames with flipped bits.
+ *
+ * Usage: imu-protocol-bench [samples]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "ImuDecoder.h"
+
+/* 8N1: 10 bits per byte */
+const double BAUD_BYTES_PER_SECOND = 115200 / 10.0;
+
+struct Quat {
+  float q[4];
+};
+
+static std::vector<Quat> makeStream(int n) {
+  std::vector<Quat> stream(n);
+  for (int i = 0; i < n; ++i) {
+    double t = i / 1000.0;
+    double angle = 2 * sin(t), half = angle / 2;
+    double ax = cos(0.3 * t), ay = sin(0.3 * t) * 0.6, az = sin(0.3 * t) * 0.8;
+    stream[i].q[0] = float(cos(half));
+    stream[i].q[1] = float(ax * sin(half));
+    stream[i].q[2] = float(ay * sin(half));
+    stream[i].q[3] = float(az * sin(half));
+  }
+  return stream;
+}
+
+static double nsSince(std::chrono::steady_clock::time_point start) {
+  return double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count());
+}
+
+static void printRow(const char* name, double bytesPerSample, int batch, double parseNs) {
+  double rate = BAUD_BYTES_PER_SECOND / bytesPerSample;
+  // the last sample of a batch waits for the whole frame; at the line rate
+  // the first one also waits batch - 1 sample periods before it is sent
+  double wireMs = bytesPerSample * batch / BAUD_BYTES_PER_SECOND * 1000;
+  double waitMs = (batch - 1) / 2.0 / rate * 1000;
+  printf("%-10s %10.2f %12.0f %12.2f %12.1f\n", name, bytesPerSample, rate, wireMs + waitMs, parseNs);
+}
+
+static void benchText(const std::vector<Quat>& stream) {
+  std::string text;
+  char line[96];
+  for (size_t i = 0; i < stream.size(); ++i) {
+    const float* q = stream[i].q;
+    text += std::string(line, snprintf(line, sizeof(line), "QC %f %f %f %f\n", q[0], q[1], q[2], q[3]));
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  double check = 0;
+  const char* p = text.c_str();
+  while (*p) {
+    char* end;
+    p += 3;
+    for (int k = 0; k < 4; ++k) {
+      check += strtof(p, &end);
+      p = end;
+    }
+    p++;
+  }
+  double ns = nsSince(start) / stream.size();
+
+  printRow("text", double(text.size()) / stream.size(), 1, ns);
+  if (check == 12345) printf("\n");  // keep the parse
+}
+
+static bool benchBinary(const std::vector<Quat>& stream, int batch) {
+  std::vector<uint8_t> wire;
+  ImuPacketWriter writer;
+  uint8_t frame[IMU_PACKET_MAX_FRAME];
+  for (size_t i = 0; i < stream.size(); ++i) {
+    uint32_t time = uint32_t(i * 1000);
+    writer.add(IMU_PACKET_QUATERNION, time, stream[i].q);
+    if (writer.samples() == batch || i + 1 == stream.size()) {
+      size_t n = writer.frame(frame);
+      wire.insert(wire.end(), frame, frame + n);
+    }
+  }
+
+  ImuDecoder decoder;
+  ImuPacketContents packet;
+  const uint8_t* data = wire.data();
+  size_t size = wire.size();
+  float worst = 0;
+  size_t sample = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while (decoder.next(data, size, packet)) {
+    for (int s = 0; s < packet.count; ++s, ++sample) {
+      for (int k = 0; k < 4; ++k)
+        worst = fmaxf(worst, fabsf(packet.samples[s].values[k] - stream[sample].q[k]));
+      if (packet.samples[s].time != uint32_t(sample * 1000)) worst = 1;
+    }
+  }
+  double ns = nsSince(start) / stream.size();
+
+  char name[32];
+  snprintf(name, sizeof(name), "binary x%d", batch);
+  printRow(name, double(wire.size()) / stream.size(), batch, ns);
+
+  bool ok = sample == stream.size() && worst <= 0.5f / IMU_PACKET_QUATERNION_SCALE + 1e-7f &&
+            decoder.stats().badFrames == 0 && decoder.stats().lostPackets == 0;
+  if (!ok) {
+    fprintf(stderr, "binary x%d: decoded %zu of %zu samples, max error %g\n",
+            batch, sample, stream.size(), worst);
+  }
+  return ok;
+}
+
+/* flip one random bit in each of many frames; the decoder must drop them */
+static bool benchCorruption() {
+  ImuPacketWriter writer;
+  ImuDecoder decoder;
+  ImuPacketContents packet;
+  uint8_t frame[IMU_PACKET_MAX_FRAME];
+  unsigned seed = 34;
+  const int frames = 100000;
+  int accepted = 0;
+  for (int i = 0; i < frames; ++i) {
+    float q[4] = { 1, 0, 0, 0 };
+    for (int s = 0; s < 4; ++s) writer.add(IMU_PACKET_QUATERNION, i * 4 + s, q);
+    size_t n = writer.frame(frame);
+
+    seed = seed * 1103515245 + 12345;
+    size_t bit = (seed >> 8) % ((n - 1) * 8);
+    frame[bit / 8] ^= uint8_t(1 << (bit % 8));
+    const uint8_t* data = frame;
+    size_t size = n;
+    while (decoder.next(data, size, packet)) accepted++;
+  }
+  // a flip that creates a 0 splits the frame in two, so there can be more
+  // bad frames than corrupted ones
+  printf("\n%d frames with one flipped bit: %d accepted, %llu dropped\n", frames, accepted,
+         (unsigned long long)decoder.stats().badFrames);
+  return accepted == 0;
+}
+
+int main(int argc, char** argv) {
+  int samples = argc > 1 ? atoi(argv[1]) : 200000;
+  if (samples <= 0) {
+    fprintf(stderr, "usage: %s [samples]\n", argv[0]);
+    return 1;
+  }
+  std::vector<Quat> stream = makeStream(samples);
+
+  printf("%d quaternion samples, 115200 baud\n\n", samples);
+  printf("%-10s %10s %12s %12s %12s\n", "format", "bytes/smp", "max smp/s", "latency ms", "parse ns");
+  benchText(stream);
+  bool ok = true;
+  const int batches[] = { 1, 2, 4, 8 };
+  for (int i = 0; i < 4; ++i) ok = benchBinary(stream, batches[i]) && ok;
+  ok = benchCorruption() && ok;
+  return ok ? 0 : 1;
+}
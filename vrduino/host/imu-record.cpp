@@ -0,0 +1,62 @@
+/**
+ * Records an IMU log (see ImuLog.h) from the sketch's RAW stream
+ *
+ * Set streamingMode to RAW (8, or send "8" over the serial monitor) and
+ * capture the port, e.g.
+ *
+ *   stty -F /dev/ttyACM0 raw && imu-record /dev/ttyACM0 > walk.log
+ *
+ * or decode a capture made earlier with cat. Packets of other types and the
+ * text from setup() are skipped. Lines are flushed per packet, so stopping
+ * with Ctrl-C loses nothing.
+ *
+ * Usage: imu-record [capture]   (default: stdin)
+ */
+
+#include <stdio.h>
+
+#include "ImuDecoder.h"
+#include "ImuLog.h"
+
+int main(int argc, char** argv) {
+  FILE* input = argc > 1 ? fopen(argv[1], "rb") : stdin;
+  if (!input) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  ImuDecoder decoder;
+  ImuPacketContents packet;
+  uint8_t buffer[4096];
+  unsigned long samples = 0;
+  writeImuLogHeader(stdout);
+
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+    const uint8_t* data = buffer;
+    size_t size = n;
+    while (decoder.next(data, size, packet)) {
+      if (packet.type != IMU_PACKET_RAW) continue;
+      for (int s = 0; s < packet.count; s++) {
+        ImuLogSample sample;
+        sample.time = packet.samples[s].time;
+        const float* v = packet.samples[s].values;
+        for (int k = 0; k < 3; k++) {
+          sample.gyr[k] = v[k];
+          sample.acc[k] = v[3 + k];
+          sample.mag[k] = v[6 + k];
+        }
+        sample.hasTruth = false;
+        writeImuLogSample(stdout, sample);
+        samples++;
+      }
+      fflush(stdout);
+    }
+  }
+
+  const ImuDecoderStats& stats = decoder.stats();
+  fprintf(stderr, "%lu samples, %llu packets lost, %llu bad frames\n", samples,
+          (unsigned long long)stats.lostPackets, (unsigned long long)stats.badFrames);
+  if (input != stdin) fclose(input);
+  return 0;
+}
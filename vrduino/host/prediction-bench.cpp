@@ -0,0 +1,173 @@
+/**
+ * Evaluation of pose prediction (PosePredictor.h) on recorded motion
+ *
+ * Runs an IMU log (see ImuLog.h; without one, two minutes of synthetic head
+ * motion) through MadgwickFusion as the sketch does, and treats the
+ * estimate at time t + L as what the renderer should show when a pose from
+ * time t reaches the screen L later. For each latency L it reports the RMS
+ * and 99th percentile angle between that target and the stale pose from t,
+ * and the RMS of the predicted pose for several predictor settings.
+ *
+ * "hidden" is the latency a stale pose would need to be as wrong as the
+ * predicted one, subtracted from L: the latency the default setting hides.
+ * On the synthetic log the default must reduce the error at every latency
+ * and hide at least half of it up to 50 ms; the exit code is nonzero if it
+ * does not.
+ *
+ * Usage: prediction-bench [log]
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "ImuLog.h"
+#include "MadgwickFusion.h"
+#include "PosePredictor.h"
+
+struct Setting {
+  const char* name;
+  float smoothing, accelerationGain;
+};
+
+/* the first is the default of PosePredictor */
+const Setting SETTINGS[] = {
+  { "lp 5ms", 0.005f, 0 },
+  { "raw rate", 0, 0 },
+  { "lp 20ms", 0.02f, 0 },
+  { "2nd order", 0.02f, 1 },
+};
+const int SETTING_COUNT = sizeof(SETTINGS) / sizeof(SETTINGS[0]);
+
+const int LATENCIES_MS[] = { 10, 20, 30, 50, 80, 120 };
+const int LATENCY_COUNT = sizeof(LATENCIES_MS) / sizeof(LATENCIES_MS[0]);
+
+/* angle between two orientations in degrees */
+static double angleBetween(const Quaternionf& a, const Quaternionf& b) {
+  double dot = fabs(double(a.q[0]) * b.q[0] + double(a.q[1]) * b.q[1] +
+                    double(a.q[2]) * b.q[2] + double(a.q[3]) * b.q[3]);
+  return 2 * acos(dot > 1 ? 1 : dot) * 180 / PI;
+}
+
+static double rms(const std::vector<double>& v) {
+  double sum = 0;
+  for (size_t i = 0; i < v.size(); i++) sum += v[i] * v[i];
+  return v.empty() ? 0 : sqrt(sum / v.size());
+}
+
+static double percentile99(std::vector<double> v) {
+  if (v.empty()) return 0;
+  size_t k = v.size() * 99 / 100;
+  std::nth_element(v.begin(), v.begin() + k, v.end());
+  return v[k];
+}
+
+int main(int argc, char** argv) {
+  std::vector<ImuLogSample> log;
+  if (argc > 1) {
+    if (!readImuLog(argv[1], log) || log.size() < 2) {
+      fprintf(stderr, "cannot read %s\n", argv[1]);
+      return 1;
+    }
+  } else {
+    log = makeSyntheticLog();
+  }
+  bool synthetic = argc <= 1;
+  size_t n = log.size();
+  double period = double(log.back().time - log.front().time) / (n - 1) / 1e6;
+  printf("%s: %zu samples at %.0f Hz\n\n", synthetic ? "synthetic head motion" : argv[1], n,
+         1 / period);
+
+  // the fused orientation, as streamed, and the rate the predictor sees
+  std::vector<Quaternionf> pose(n);
+  MadgwickFusion<float> fusion;
+  for (size_t i = 0; i < n; i++) {
+    const ImuLogSample& s = log[i];
+    FusionInput<float> in;
+    in.gyrX = s.gyr[0]; in.gyrY = s.gyr[1]; in.gyrZ = s.gyr[2];
+    in.accX = s.acc[0]; in.accY = s.acc[1]; in.accZ = s.acc[2];
+    in.magX = s.mag[0]; in.magY = s.mag[1]; in.magZ = s.mag[2];
+    in.hasMag = s.hasMag;
+    fusion.update(in, i == 0 ? 0.0f : float(log[i].time - log[i - 1].time) / 1e6f);
+    pose[i] = fusion.orientation();
+  }
+  size_t first = size_t(2 / period);  // skip the settling
+  if (first >= n) first = 0;
+
+  // stale error per millisecond of latency, to convert errors back to latency
+  int maxMs = LATENCIES_MS[LATENCY_COUNT - 1];
+  std::vector<double> staleRms(maxMs + 1, 0);
+  for (int ms = 1; ms <= maxMs; ms++) {
+    size_t shift = size_t(lround(ms / 1000.0 / period));
+    std::vector<double> errors;
+    for (size_t i = first; i + shift < n; i += 7) errors.push_back(angleBetween(pose[i], pose[i + shift]));
+    staleRms[ms] = rms(errors);
+  }
+
+  printf("%-8s %9s %9s", "latency", "stale rms", "stale p99");
+  for (int s = 0; s < SETTING_COUNT; s++) printf(" %10s", SETTINGS[s].name);
+  printf(" %9s %9s\n", "p99", "hidden");
+
+  bool ok = true;
+  for (int l = 0; l < LATENCY_COUNT; l++) {
+    int ms = LATENCIES_MS[l];
+    size_t shift = size_t(lround(ms / 1000.0 / period));
+    float horizon = float(shift * period);
+
+    std::vector<double> stale;
+    for (size_t i = first; i + shift < n; i++) stale.push_back(angleBetween(pose[i], pose[i + shift]));
+    printf("%5d ms %9.3f %9.3f", ms, rms(stale), percentile99(stale));
+
+    double defaultRms = 0, defaultP99 = 0;
+    for (int s = 0; s < SETTING_COUNT; s++) {
+      PosePredictor<float> predictor(SETTINGS[s].smoothing, SETTINGS[s].accelerationGain);
+      std::vector<double> predicted;
+      for (size_t i = 0; i + shift < n; i++) {
+        const ImuLogSample& sample = log[i];
+        predictor.update(sample.gyr[0], sample.gyr[1], sample.gyr[2], float(period));
+        if (i < first) continue;
+        Quaternionf q = predictor.predict(pose[i], horizon);
+        predicted.push_back(angleBetween(q, pose[i + shift]));
+      }
+      printf(" %10.3f", rms(predicted));
+      if (s == 0) {
+        defaultRms = rms(predicted);
+        defaultP99 = percentile99(predicted);
+      }
+    }
+
+    // latency at which the stale pose is as wrong as the prediction
+    double equivalent = 0;
+    for (int k = 1; k <= maxMs; k++) {
+      if (staleRms[k] >= defaultRms) {
+        equivalent = k - 1 + (defaultRms - staleRms[k - 1]) / (staleRms[k] - staleRms[k - 1]);
+        break;
+      }
+      equivalent = maxMs;
+    }
+    double hidden = ms - equivalent;
+    printf(" %9.3f %6.1f ms\n", defaultP99, hidden);
+
+    if (synthetic && (defaultRms >= rms(stale) || (ms <= 50 && hidden < ms / 2.0))) {
+      fprintf(stderr, "%d ms: prediction %.3f degrees RMS against %.3f stale, hides %.1f ms\n", ms,
+              defaultRms, rms(stale), hidden);
+      ok = false;
+    }
+  }
+
+  // cost of the default setting alone, at 30 ms
+  PosePredictor<float> predictor;
+  float check = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++) {
+    predictor.update(log[i].gyr[0], log[i].gyr[1], log[i].gyr[2], float(period));
+    check += predictor.predict(pose[i], 0.03f).q[0];
+  }
+  double ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count()) / n;
+  printf("\nupdate + predict: %.1f ns per sample%s\n", ns, check == 12345 ? " " : "");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,413 @@
+/**
+ * Host benchmark of the templated Quaternion class and the complementary
+ * filter, for double, float and Q16.
+ *
+ * Feeds the same synthetic gyro and accelerometer trace (1 kHz, 60 s) through
+ * complementaryFilterUpdate<T> and reports the time per update and the
+ * orientation error against the double version. The quaternion operations
+ * the sketch's setup() used to print for checking are compared against
+ * double as well, and in double against their known results.
+ *
+ * A second table times the hot-path operations against the general ones
+ * they replace on 4096 random unit quaternions: rotateVector() against
+ * rotate() on a pure quaternion, conjugate() against inverse(),
+ * multiplyBy() against multiply(), normalizeFast() against normalize() on
+ * a quaternion one integration step off unit length, and slerp() and
+ * nlerp(). Each pair must agree to within the type's precision, and slerp
+ * must hit its endpoints and halve the angle at t = 0.5; the exit code is
+ * nonzero if a check fails.
+ *
+ * Host timings only rank the types; absolute numbers on the Teensy differ,
+ * in particular double, which the host does in hardware.
+ *
+ * Usage: quaternion-bench [updates]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "ComplementaryFilter.h"
+
+struct Sample {
+  double gyr[3];
+  double acc[3];
+};
+
+/* angle between two orientations in degrees */
+static double angleBetween(Quaternion a, Quaternion b) {
+  // rotation from a to b; atan2 stays accurate for tiny angles, acos does not
+  Quaternion d = Quaternion().multiply(a.inverse(), b);
+  double v = sqrt(sq(d.q[1]) + sq(d.q[2]) + sq(d.q[3]));
+  return 2 * atan2(v, fabs(d.q[0])) * 180 / PI;
+}
+
+/***
+ * Synthetic trace: a smooth rotation driven by the gyro rates, with the
+ * accelerometer seeing gravity (along +y, as the filter expects) in the
+ * sensor frame, plus noise on both.
+ */
+static std::vector<Sample> makeTrace(int n) {
+  std::vector<Sample> trace(n);
+  Quaternion truth;
+  unsigned seed = 267;
+  for (int i = 0; i < n; ++i) {
+    double t = i / 1000.0;
+    Sample& s = trace[i];
+    s.gyr[0] = 90 * sin(2 * PI * 0.5 * t);
+    s.gyr[1] = 180 * sin(2 * PI * 0.3 * t + 1);
+    s.gyr[2] = 60 * cos(2 * PI * 0.7 * t);
+
+    double rate = sqrt(sq(s.gyr[0]) + sq(s.gyr[1]) + sq(s.gyr[2]));
+    Quaternion step = Quaternion().setFromAngleAxis(rate / 1000, s.gyr[0] / rate, s.gyr[1] / rate, s.gyr[2] / rate);
+    truth = Quaternion().multiply(truth, step).normalize();
+
+    Quaternion gravity(0, 0, 9.80665, 0);
+    Quaternion inv = truth.clone().inverse();
+    Quaternion local = gravity.rotate(inv);
+
+    for (int k = 0; k < 3; ++k) {
+      seed = seed * 1103515245 + 12345;
+      s.gyr[k] += (int((seed >> 16) % 1000) - 500) / 1000.0;   // +-0.5 deg/s
+      seed = seed * 1103515245 + 12345;
+      s.acc[k] = local.q[k + 1] + (int((seed >> 16) % 1000) - 500) / 5000.0;
+    }
+  }
+  return trace;
+}
+
+template <typename T>
+struct Result {
+  std::vector<Quaternion> orientations;
+  double nsPerUpdate;
+  double cyclesPerUpdate;
+};
+
+template <typename T>
+static Result<T> run(const std::vector<Sample>& trace) {
+  // convert up front so only the filter is timed
+  std::vector<T> inputs(trace.size() * 6);
+  for (size_t i = 0; i < trace.size(); ++i)
+    for (int k = 0; k < 3; ++k) {
+      inputs[6 * i + k] = T(trace[i].gyr[k]);
+      inputs[6 * i + 3 + k] = T(trace[i].acc[k]);
+    }
+
+  std::vector<QuaternionT<T> > states(trace.size());
+  QuaternionT<T> q;
+  T timeDelta = T(1), a = T(.95);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#ifdef HAVE_RDTSC
+  unsigned long long cycles = __rdtsc();
+#endif
+  for (size_t i = 0; i < trace.size(); ++i) {
+    const T* in = &inputs[6 * i];
+    q = complementaryFilterUpdate<T>(q, in[0], in[1], in[2], in[3], in[4], in[5], timeDelta, a);
+    states[i] = q;
+  }
+#ifdef HAVE_RDTSC
+  cycles = __rdtsc() - cycles;
+#endif
+  std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+
+  Result<T> result;
+  result.nsPerUpdate = double(elapsed.count()) / trace.size();
+#ifdef HAVE_RDTSC
+  result.cyclesPerUpdate = double(cycles) / trace.size();
+#else
+  result.cyclesPerUpdate = 0;
+#endif
+  result.orientations.reserve(states.size());
+  for (size_t i = 0; i < states.size(); ++i)
+    result.orientations.push_back(Quaternion(states[i]));
+  return result;
+}
+
+/* largest component difference of the setup() checks against double */
+template <typename T>
+static double operationError() {
+  typedef QuaternionT<T> Q;
+  double worst = 0;
+  Quaternion expected[6];
+  Q actual[6];
+
+  expected[0] = Quaternion(2.3, 1.2, 2.1, 3.0).normalize();
+  actual[0] = Q(T(2.3), T(1.2), T(2.1), T(3.0)).normalize();
+
+  expected[1] = Quaternion(3.2, 3.3, 5.2, 0.1).inverse();
+  actual[1] = Q(T(3.2), T(3.3), T(5.2), T(0.1)).inverse();
+
+  expected[2] = Quaternion().setFromAngleAxis(2, 1 / sqrt(14), 2 / sqrt(14), 3 / sqrt(14));
+  actual[2] = Q().setFromAngleAxis(T(2), T(1 / sqrt(14)), T(2 / sqrt(14)), T(3 / sqrt(14)));
+
+  Quaternion q1(0.512505, 0.267394, 0.467939, 0.668485);
+  Quaternion q2(0.461017, -0.475423, -0.749152, -0.014407);
+  Q t1(q1), t2(q2);
+  expected[3] = Quaternion().multiply(q1, q2);
+  actual[3] = Q().multiply(t1, t2);
+
+  expected[4] = q1.rotate(q2);
+  actual[4] = t1.rotate(t2);
+
+  expected[5] = Quaternion(scalarSqrt(30.0), scalarAcos(0.3), scalarAtan2(-2.0, 1.5), scalarCos(2.5));
+  actual[5] = Q(scalarSqrt(T(30)), scalarAcos(T(.3)), scalarAtan2(T(-2), T(1.5)), scalarCos(T(2.5)));
+
+  for (int i = 0; i < 6; ++i)
+    for (int k = 0; k < 4; ++k) {
+      double e = fabs(expected[i].q[k] - scalarToDouble(actual[i].q[k]));
+      if (e > worst) worst = e;
+    }
+  return worst;
+}
+
+/* the known results of the operations, to 6 decimals */
+static bool checkOperations() {
+  struct Check {
+    const char* name;
+    Quaternion actual;
+    double expected[4];
+  };
+  Quaternion q1(0.512505, 0.267394, 0.467939, 0.668485);
+  Quaternion q2(0.461017, -0.475423, -0.749152, -0.014407);
+  const Check checks[] = {
+    { "length", Quaternion(Quaternion(2.3, 1.2, 2.1, 3.0).length(), 0, 0, 0), { 4.487761, 0, 0, 0 } },
+    { "normalize", Quaternion(2.3, 1.2, 2.1, 3.0).normalize(), { 0.512505, 0.267394, 0.467939, 0.668485 } },
+    { "inverse", Quaternion(3.2, 3.3, 5.2, 0.1).inverse(), { 0.066418, -0.068493, -0.107929, -0.002076 } },
+    { "setFromAngleAxis", Quaternion().setFromAngleAxis(2, 1 / sqrt(14), 2 / sqrt(14), 3 / sqrt(14)),
+      { 0.999848, 0.004664, 0.009329, 0.013993 } },
+    { "multiply", Quaternion().multiply(q1, q2), { 0.723587, 0.373672, -0.482177, 0.322949 } },
+    { "rotate", q1.clone().rotate(q2), { 0.512505, -0.145908, 0.750596, -0.390712 } },
+  };
+
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); ++i) {
+    const Check& c = checks[i];
+    for (int k = 0; k < 4; ++k) {
+      if (fabs(c.actual.q[k] - c.expected[k]) > 1.5e-6) {
+        fprintf(stderr, "%s: component %d is %f, expected %f\n", c.name, k, c.actual.q[k], c.expected[k]);
+        ok = false;
+      }
+    }
+  }
+  return ok;
+}
+
+/* unit quaternions spread over the sphere, the same for every type */
+static std::vector<Quaternion> randomRotations(int n) {
+  std::vector<Quaternion> out(n);
+  unsigned seed = 41;
+  for (int i = 0; i < n; ++i) {
+    double c[4], n2 = 0;
+    do {
+      n2 = 0;
+      for (int k = 0; k < 4; ++k) {
+        seed = seed * 1103515245 + 12345;
+        c[k] = int((seed >> 8) % 20001) / 10000.0 - 1;
+        n2 += c[k] * c[k];
+      }
+    } while (n2 > 1 || n2 < 0.01);
+    out[i] = Quaternion(c[0], c[1], c[2], c[3]).normalize();
+  }
+  return out;
+}
+
+/* ns per call of op over all the inputs, repeated until 20 ms have passed */
+template <typename Op>
+static double timeOp(Op op, size_t n) {
+  size_t rounds = 0;
+  std::chrono::nanoseconds elapsed(0);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  do {
+    for (size_t i = 0; i < n; ++i) op(i);
+    ++rounds;
+    elapsed = std::chrono::steady_clock::now() - start;
+  } while (elapsed.count() < 20000000);
+  return double(elapsed.count()) / (rounds * n);
+}
+
+/* the larger component difference between two quaternions */
+template <typename T>
+static double difference(const QuaternionT<T>& a, const QuaternionT<T>& b) {
+  double worst = 0;
+  for (int k = 0; k < 4; ++k) {
+    double e = fabs(scalarToDouble(a.q[k]) - scalarToDouble(b.q[k]));
+    if (e > worst) worst = e;
+  }
+  return worst;
+}
+
+/* keeps the optimizer from dropping the timed work */
+static volatile double sink;
+
+/***
+ * Times the hot-path operations for T against the ones they replace and
+ * returns false if a pair disagrees by more than tolerance.
+ */
+template <typename T>
+static bool reportOperations(const char* name, const std::vector<Quaternion>& rotations, double tolerance) {
+  typedef QuaternionT<T> Q;
+  const size_t n = rotations.size();
+  std::vector<Q> a(n), b(n), off(n);
+  for (size_t i = 0; i < n; ++i) {
+    a[i] = Q(rotations[i]);
+    b[i] = Q(rotations[(i * 7 + 3) % n]);
+    // about what one 1 ms integration step leaves
+    off[i] = Q(rotations[i].q[0] * 1.0001, rotations[i].q[1] * 1.0001, rotations[i].q[2] * 1.0001,
+               rotations[i].q[3] * 1.0001);
+  }
+
+  struct Row {
+    const char* name;
+    double oldNs, newNs, difference;
+  };
+  Row rows[6];
+  T acc = T(0);
+  double worst;
+
+  // rotate: a * (0, v) * a^-1
+  worst = 0;
+  for (size_t i = 0; i < n; ++i) {
+    T v[3];
+    a[i].rotateVector(b[i].q[1], b[i].q[2], b[i].q[3], v);
+    Q r = Q(T(0), b[i].q[1], b[i].q[2], b[i].q[3]).rotate(a[i]);
+    double e = difference(r, Q(T(0), v[0], v[1], v[2]));
+    if (e > worst) worst = e;
+  }
+  rows[0].name = "rotate";
+  rows[0].oldNs = timeOp([&](size_t i) { acc += Q(T(0), b[i].q[1], b[i].q[2], b[i].q[3]).rotate(a[i]).q[1]; }, n);
+  rows[0].newNs = timeOp([&](size_t i) {
+    T v[3];
+    a[i].rotateVector(b[i].q[1], b[i].q[2], b[i].q[3], v);
+    acc += v[0];
+  }, n);
+  rows[0].difference = worst;
+
+  worst = 0;
+  for (size_t i = 0; i < n; ++i) {
+    double e = difference(a[i].clone().inverse(), a[i].conjugate());
+    if (e > worst) worst = e;
+  }
+  rows[1].name = "inverse";
+  rows[1].oldNs = timeOp([&](size_t i) { acc += a[i].clone().inverse().q[1]; }, n);
+  rows[1].newNs = timeOp([&](size_t i) { acc += a[i].conjugate().q[1]; }, n);
+  rows[1].difference = worst;
+
+  worst = 0;
+  for (size_t i = 0; i < n; ++i) {
+    double e = difference(Q().multiply(a[i], b[i]), a[i].clone().multiplyBy(b[i]));
+    if (e > worst) worst = e;
+  }
+  rows[2].name = "multiply";
+  rows[2].oldNs = timeOp([&](size_t i) { acc += Q().multiply(a[i], b[i]).q[0]; }, n);
+  rows[2].newNs = timeOp([&](size_t i) { acc += a[i].clone().multiplyBy(b[i]).q[0]; }, n);
+  rows[2].difference = worst;
+
+  worst = 0;
+  for (size_t i = 0; i < n; ++i) {
+    double e = difference(off[i].clone().normalize(), off[i].clone().normalizeFast());
+    if (e > worst) worst = e;
+  }
+  rows[3].name = "normalize";
+  rows[3].oldNs = timeOp([&](size_t i) { acc += off[i].clone().normalize().q[0]; }, n);
+  rows[3].newNs = timeOp([&](size_t i) { acc += off[i].clone().normalizeFast().q[0]; }, n);
+  rows[3].difference = worst;
+
+  // interpolation has nothing to replace; nlerp against slerp
+  worst = 0;
+  for (size_t i = 0; i < n; ++i) {
+    double e = difference(Q::nlerp(a[i], b[i], T(0.5)), Q::slerp(a[i], b[i], T(0.5)));
+    if (e > worst) worst = e;
+  }
+  rows[4].name = "slerp/nlerp";
+  rows[4].oldNs = timeOp([&](size_t i) { acc += Q::slerp(a[i], b[i], T(0.3)).q[0]; }, n);
+  rows[4].newNs = timeOp([&](size_t i) { acc += Q::nlerp(a[i], b[i], T(0.3)).q[0]; }, n);
+  rows[4].difference = worst;
+  sink = scalarToDouble(acc);
+
+  bool ok = true;
+  for (int r = 0; r < 4; ++r) {
+    printf("%-7s %-12s %10.1f %10.1f %14.2e\n", name, rows[r].name, rows[r].oldNs, rows[r].newNs,
+           rows[r].difference);
+    // normalizeFast() is a series, good to 4e-7 at its 1e-3 limit
+    double limit = r == 3 ? tolerance + 4e-7 : tolerance;
+    if (rows[r].difference > limit) {
+      fprintf(stderr, "%s %s: off by %.2e\n", name, rows[r].name, rows[r].difference);
+      ok = false;
+    }
+  }
+  // at t = 0.5 nlerp matches slerp exactly
+  printf("%-7s %-12s %10.1f %10.1f %14.2e\n", name, rows[4].name, rows[4].oldNs, rows[4].newNs,
+         rows[4].difference);
+  if (rows[4].difference > tolerance) {
+    fprintf(stderr, "%s nlerp: off by %.2e from slerp at t = 0.5\n", name, rows[4].difference);
+    ok = false;
+  }
+
+  // slerp keeps its endpoints and moves at a constant rate
+  worst = 0;
+  for (size_t i = 0; i < n; ++i) {
+    Q b2 = b[i];
+    if (a[i].dot(b2) < T(0)) b2 = Q(-b2.q[0], -b2.q[1], -b2.q[2], -b2.q[3]);
+    double e = difference(Q::slerp(a[i], b2, T(0)), a[i]);
+    if (e > worst) worst = e;
+    e = difference(Q::slerp(a[i], b2, T(1)), b2);
+    if (e > worst) worst = e;
+    Quaternion qa(a[i]), qb(b2), qm(Q::slerp(a[i], b2, T(0.5)));
+    e = fabs(angleBetween(qa, qm) - angleBetween(qm, qb)) * PI / 180;
+    if (e > worst) worst = e;
+  }
+  if (worst > tolerance) {
+    fprintf(stderr, "%s slerp: endpoints or midpoint off by %.2e\n", name, worst);
+    ok = false;
+  }
+  return ok;
+}
+
+template <typename T>
+static void report(const char* name, const std::vector<Sample>& trace, const Result<double>& reference) {
+  Result<T> result = run<T>(trace);
+  double worst = 0, last = 0;
+  for (size_t i = 0; i < trace.size(); ++i) {
+    last = angleBetween(result.orientations[i], reference.orientations[i]);
+    if (last > worst) worst = last;
+  }
+  printf("%-7s %10.1f %12.0f %14.2e %14.2e %14.2e\n", name, result.nsPerUpdate,
+         result.cyclesPerUpdate, worst, last, operationError<T>());
+}
+
+int main(int argc, char** argv) {
+  int updates = argc > 1 ? atoi(argv[1]) : 60000;
+  if (updates <= 0) {
+    fprintf(stderr, "usage: %s [updates]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<Sample> trace = makeTrace(updates);
+  Result<double> reference = run<double>(trace);
+
+  printf("%d updates at 1 kHz; errors are against the double filter\n\n", updates);
+  printf("%-7s %10s %12s %14s %14s %14s\n", "scalar", "ns/update", "cycles/upd",
+         "max err (deg)", "end err (deg)", "op err (abs)");
+  report<double>("double", trace, reference);
+  report<float>("float", trace, reference);
+  report<Q16>("Q16", trace, reference);
+
+  bool ok = checkOperations();
+  printf("\nquaternion operations against their known results: %s\n", ok ? "ok" : "FAILED");
+
+  std::vector<Quaternion> rotations = randomRotations(4096);
+  printf("\nhot-path operations against the general ones, ns per call\n\n");
+  printf("%-7s %-12s %10s %10s %14s\n", "scalar", "operation", "general", "hot path", "difference");
+  ok = reportOperations<double>("double", rotations, 1e-12) && ok;
+  ok = reportOperations<float>("float", rotations, 2e-6) && ok;
+  ok = reportOperations<Q16>("Q16", rotations, 2e-3) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,230 @@
+/**
+ * Benchmark of timer-driven IMU sampling (ImuScheduler.h) against sampling
+ * in loop()
+ *
+ * Simulates a minute of the sketch on SimImuBus time: loop() spends 60 us
+ * of math per sample and then writes its output, which usually takes
+ * 50 us, a third of the time 2 to 6 ms (a text line at 115200 baud), and
+ * now and then 20 ms (the host not reading). The gyro reads a known head
+ * motion, 200 deg/s at 0.8 Hz plus 50 deg/s at 3 Hz, evaluated at the time
+ * of each sample, and every method integrates it the way the sketch does.
+ *
+ *   polled millis  read once per loop(), dt from millis() (the old sketch)
+ *   polled micros  read once per loop(), dt from micros()
+ *   timer          ImuScheduler at 1 kHz, dt from the readings' stamps,
+ *                  the interrupt delayed by 0 to 1 us, and by 20 us in 2%
+ *                  of the ticks (a USB interrupt)
+ *
+ * Reports the samples per second, the RMS error of dt against the time
+ * that really passed, and the RMS and final error of the integrated angle.
+ * For the timer it also prints the scheduler's statistics, once more for a
+ * run with a 100 ms stall, which must drop readings and account for each
+ * in the overruns. The exit code is nonzero if the timer does not beat
+ * polled millis tenfold in angle error, drops readings without a stall, or
+ * miscounts the drops.
+ *
+ * Usage: scheduler-bench
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <random>
+
+#include "ImuScheduler.h"
+#include "SimImuBus.h"
+
+const double SECONDS = 60;
+const double MATH_US = 60;
+const int RATE = 1000;
+
+static SimImuBus* simBus = 0;
+
+static unsigned long simMicros() {
+  return (unsigned long)simBus->time();
+}
+
+/* head motion about one axis, deg/s, and its integral in degrees */
+static double rate(double t) {
+  return 200 * sin(2 * PI * 0.8 * t) + 50 * sin(2 * PI * 3 * t);
+}
+
+static double angle(double t) {
+  return 200 * (1 - cos(2 * PI * 0.8 * t)) / (2 * PI * 0.8) + 50 * (1 - cos(2 * PI * 3 * t)) / (2 * PI * 3);
+}
+
+struct Result {
+  double samplesPerSecond;
+  double dtRmsUs;
+  double angleRms, angleEnd;
+};
+
+/* integration in the sketch's update(): the rate at a sample times dt,
+   both in microseconds */
+struct Integrator {
+  double value, dtSquares, angleSquares;
+  unsigned long samples;
+  double lastTime;
+
+  Integrator() : value(0), dtSquares(0), angleSquares(0), samples(0), lastTime(0) {}
+
+  void add(double time, double dt) {
+    value += rate(time / 1e6) * dt / 1e6;
+    double trueDt = time - lastTime;
+    lastTime = time;
+    dtSquares += (dt - trueDt) * (dt - trueDt);
+    double error = value - angle(time / 1e6);
+    angleSquares += error * error;
+    samples++;
+  }
+
+  Result result(double seconds) const {
+    Result r;
+    r.samplesPerSecond = samples / seconds;
+    r.dtRmsUs = sqrt(dtSquares / samples);
+    r.angleRms = sqrt(angleSquares / samples);
+    r.angleEnd = value - angle(lastTime / 1e6);
+    return r;
+  }
+};
+
+/* time loop() spends writing its output */
+struct Output {
+  std::mt19937 rng;
+  std::uniform_real_distribution<double> uniform;
+
+  Output() : rng(1), uniform(0, 1) {}
+
+  double stallUs() {
+    double us = 50;
+    if (uniform(rng) < 0.3) us += 2000 + 4000 * uniform(rng);
+    if (uniform(rng) < 0.01) us += 20000;
+    return us;
+  }
+};
+
+static Result polled(bool useMicros) {
+  SimImuBus bus;
+  simBus = &bus;
+  Imu imu(bus);
+  imu.init();
+  Output output;
+  Integrator integrator;
+
+  double start = bus.time(), last = start;
+  while (bus.time() - start < SECONDS * 1e6) {
+    double now = bus.time();
+    double dt = useMicros ? double((unsigned long)now - (unsigned long)last)
+                          : 1000.0 * (floor(now / 1000) - floor(last / 1000));
+    last = now;
+    imu.read();
+    integrator.add(now - start, dt);
+    bus.advance(MATH_US + output.stallUs());
+  }
+  return integrator.result(SECONDS);
+}
+
+static Result timed(double longStallAt, ImuSchedulerStats& stats, unsigned long& gaps) {
+  SimImuBus bus;
+  simBus = &bus;
+  Imu imu(bus);
+  imu.init();
+  ImuScheduler scheduler(imu, simMicros);
+  scheduler.begin(RATE);
+  Output output;
+  Integrator integrator;
+  std::mt19937 rng(2);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  double start = bus.time(), nextTick = start + scheduler.periodUs();
+
+  // loop() works for us microseconds, preempted by the ticks that fall in it
+  struct Loop {
+    static void work(SimImuBus& bus, ImuScheduler& scheduler, double& nextTick, double us,
+                     std::mt19937& rng, std::uniform_real_distribution<double>& uniform) {
+      double end = bus.time() + us;
+      while (nextTick <= end) {
+        double latency = uniform(rng) + (uniform(rng) < 0.02 ? 20 : 0);
+        if (nextTick + latency > bus.time()) bus.advance(nextTick + latency - bus.time());
+        double before = bus.time();
+        scheduler.tick();
+        end += bus.time() - before;
+        nextTick += scheduler.periodUs();
+      }
+      if (end > bus.time()) bus.advance(end - bus.time());
+    }
+  };
+
+  ScheduledReading r;
+  unsigned long expected = 0, last = 0;
+  bool haveLast = false, stalled = false;
+  gaps = 0;
+  while (bus.time() - start < SECONDS * 1e6) {
+    while (scheduler.pop(r)) {
+      if (r.index != expected) gaps += r.index - expected;
+      expected = r.index + 1;
+      unsigned long dt = haveLast ? r.time - last : scheduler.periodUs();
+      last = r.time;
+      haveLast = true;
+      integrator.add(r.time - start, dt);
+      Loop::work(bus, scheduler, nextTick, MATH_US, rng, uniform);
+    }
+    double stall = output.stallUs();
+    if (longStallAt > 0 && !stalled && bus.time() - start > longStallAt * 1e6) {
+      stall += 100000;
+      stalled = true;
+    }
+    Loop::work(bus, scheduler, nextTick, stall, rng, uniform);
+  }
+  stats = scheduler.stats();
+  scheduler.end();
+  return integrator.result(SECONDS);
+}
+
+static void printRow(const char* name, const Result& r) {
+  printf("%-14s %9.0f %9.1f %9.3f %9.3f\n", name, r.samplesPerSecond, r.dtRmsUs, r.angleRms, r.angleEnd);
+}
+
+static void printStats(const char* name, const ImuSchedulerStats& s, unsigned long gaps) {
+  printf("%-14s %7lu %5lu %8lu %6lu %+5ld..%+ld us, rms %.1f us %7lu us %6u\n", name, s.ticks, s.late,
+         s.overruns, gaps, s.jitterMinUs, s.jitterMaxUs, double(s.jitterRmsUs()), s.busyMaxUs,
+         unsigned(s.maxQueued));
+}
+
+int main() {
+  Serial.muted = true;  // Imu::init() reports the communication check
+
+  printf("%.0f s of head motion, loop() output stalls of up to 26 ms\n\n", SECONDS);
+  printf("%-14s %9s %9s %9s %9s\n", "sampling", "samples/s", "dt rms us", "angle rms", "angle end");
+  Result millisResult = polled(false);
+  printRow("polled millis", millisResult);
+  printRow("polled micros", polled(true));
+
+  ImuSchedulerStats stats, stallStats;
+  unsigned long gaps = 0, stallGaps = 0;
+  Result timer = timed(0, stats, gaps);
+  printRow("timer", timer);
+  timed(SECONDS / 2, stallStats, stallGaps);
+
+  printf("\n%-14s %7s %5s %8s %6s %24s %10s %6s\n", "scheduler", "ticks", "late", "overruns", "gaps",
+         "jitter", "busy max", "queued");
+  printStats("timer", stats, gaps);
+  printStats("100 ms stall", stallStats, stallGaps);
+
+  bool ok = true;
+  if (timer.angleRms * 10 > millisResult.angleRms) {
+    fprintf(stderr, "timer: %.3f degrees RMS against %.3f polled with millis()\n", timer.angleRms,
+            millisResult.angleRms);
+    ok = false;
+  }
+  if (stats.overruns > 0 || gaps > 0) {
+    fprintf(stderr, "timer: %lu readings dropped without a stall\n", stats.overruns);
+    ok = false;
+  }
+  if (stallStats.overruns == 0 || stallStats.overruns != stallGaps) {
+    fprintf(stderr, "100 ms stall: %lu overruns counted, %lu readings missing\n", stallStats.overruns,
+            stallGaps);
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
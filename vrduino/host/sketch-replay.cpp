@@ -0,0 +1,171 @@
+/**
+ * The sketch's own update() on the host, replaying an IMU log
+ *
+ * Includes vrduino.ino itself, built against host/Arduino.h, Wire.h and
+ * EEPROM.h, and feeds every sample of a log (ImuLog.h; without one, two
+ * minutes of synthetic head motion) into update() as loop() does after a
+ * read, so calibration, pose prediction and fusion run as on the board.
+ * For each engine of the sketch and the quaternion complementary filter it
+ * reports the ns per update() and, when the log has the true orientation,
+ * the RMS and maximum error after 2 s of settling.
+ *
+ * -o writes the time and every filter's orientation per sample as CSV, for
+ * plotting. On the synthetic log every engine must stay within 3 degrees
+ * RMS; the exit code is nonzero if one does not.
+ *
+ * Usage: sketch-replay [-o file.csv] [log]
+ */
+
+#include "vrduino.ino"
+
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#include "ImuLog.h"
+
+const double SETTLE_SECONDS = 2;
+const double MAX_RMS_DEGREES = 3;
+
+struct Filter {
+  const char* name;
+  FusionEngine<Real>* engine;  // 0: the complementary filter
+};
+
+/* the state setup() restores or measures and loop() resets */
+static void resetSketch(FusionEngine<Real>* engine) {
+  fusion = engine;
+  streamingMode = QUATERNION;
+
+  gyrIntX = gyrIntY = gyrIntZ = 0;
+  gyrBiasX = gyrBiasY = gyrBiasZ = 0;
+  eulerCmp = EulerT<Real>();
+  qCmp = QuaternionT<Real>();
+  predictor.reset();
+  if (fusion) fusion->reset();
+
+  biasTracker = GyroBiasTracker();
+  magCalibrator.reset();
+  magCalibration.reset();
+  calibration = StoredCalibration();
+  calibrationChanged = false;
+  lastCalibrationSave = 0;
+  magFresh = false;
+}
+
+/* angle between two orientations in degrees */
+static double angleBetween(const Quaternion& a, const Quaternion& b) {
+  double dot = fabs(a.q[0] * b.q[0] + a.q[1] * b.q[1] + a.q[2] * b.q[2] + a.q[3] * b.q[3]);
+  return 2 * acos(dot > 1 ? 1 : dot) * 180 / PI;
+}
+
+/* replays the log through update(); returns ns per update */
+static double replay(const std::vector<ImuLogSample>& log, std::vector<Quaternion>& out) {
+  out.resize(log.size());
+  std::chrono::nanoseconds elapsed(0);
+  for (size_t i = 0; i < log.size(); i++) {
+    const ImuLogSample& s = log[i];
+    ImuReading r;
+    r.imu.gyrX = s.gyr[0]; r.imu.gyrY = s.gyr[1]; r.imu.gyrZ = s.gyr[2];
+    r.imu.accX = s.acc[0]; r.imu.accY = s.acc[1]; r.imu.accZ = s.acc[2];
+    r.magX = s.mag[0]; r.magY = s.mag[1]; r.magZ = s.mag[2];
+    r.hasMag = s.hasMag;
+    double dt = i == 0 ? 0 : (log[i].time - log[i - 1].time) / 1000.0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    imu.setReading(r);
+    magFresh = magFresh || r.hasMag;
+    sampleTime = s.time;
+    update(dt);
+    elapsed += std::chrono::steady_clock::now() - start;
+    maintainCalibration();
+
+    out[i] = Quaternion(qCmp);
+  }
+  return double(elapsed.count()) / log.size();
+}
+
+int main(int argc, char** argv) {
+  const char* csvPath = 0;
+  const char* logPath = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) csvPath = argv[++i];
+    else if (argv[i][0] != '-' && !logPath) logPath = argv[i];
+    else {
+      fprintf(stderr, "usage: %s [-o file.csv] [log]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<ImuLogSample> log;
+  if (logPath) {
+    if (!readImuLog(logPath, log) || log.size() < 2) {
+      fprintf(stderr, "cannot read %s\n", logPath);
+      return 1;
+    }
+  } else {
+    log = makeSyntheticLog();
+  }
+  printf("%s: %zu samples, %.1f s\n\n", logPath ? logPath : "synthetic head motion", log.size(),
+         (log.back().time - log.front().time) / 1e6);
+
+  Serial.muted = true;  // storeCalibration() reports
+  Filter filters[] = {
+    { "madgwick", &madgwick }, { "mahony", &mahony }, { "ekf", &ekf }, { "complementary", 0 },
+  };
+  const int FILTERS = sizeof(filters) / sizeof(filters[0]);
+
+  bool truth = log.back().hasTruth;
+  size_t settled = 0;
+  while (settled < log.size() && log[settled].time - log.front().time < SETTLE_SECONDS * 1e6) settled++;
+
+  printf("%-14s %10s %10s %10s\n", "filter", "ns/update", "rms deg", "max deg");
+  std::vector<std::vector<Quaternion> > orientations(FILTERS);
+  bool ok = true;
+  for (int f = 0; f < FILTERS; f++) {
+    resetSketch(filters[f].engine);
+    double ns = replay(log, orientations[f]);
+
+    if (!truth || settled == log.size()) {
+      printf("%-14s %10.1f %10s %10s\n", filters[f].name, ns, "-", "-");
+      continue;
+    }
+    double sum = 0, max = 0;
+    for (size_t i = settled; i < log.size(); i++) {
+      double e = angleBetween(orientations[f][i], log[i].truth);
+      sum += e * e;
+      if (e > max) max = e;
+    }
+    double rms = sqrt(sum / (log.size() - settled));
+    printf("%-14s %10.1f %10.2f %10.2f\n", filters[f].name, ns, rms, max);
+    if (filters[f].engine && rms > MAX_RMS_DEGREES) {
+      fprintf(stderr, "%s: %.2f degrees RMS\n", filters[f].name, rms);
+      ok = false;
+    }
+  }
+
+  if (csvPath) {
+    FILE* csv = fopen(csvPath, "w");
+    if (!csv) {
+      fprintf(stderr, "cannot write %s\n", csvPath);
+      return 1;
+    }
+    fprintf(csv, "time_us");
+    for (int f = 0; f < FILTERS; f++) {
+      const char* n = filters[f].name;
+      fprintf(csv, ",%s_w,%s_x,%s_y,%s_z", n, n, n, n);
+    }
+    fprintf(csv, "\n");
+    for (size_t i = 0; i < log.size(); i++) {
+      fprintf(csv, "%lu", (unsigned long)log[i].time);
+      for (int f = 0; f < FILTERS; f++) {
+        const Quaternion& q = orientations[f][i];
+        fprintf(csv, ",%.6f,%.6f,%.6f,%.6f", q.q[0], q.q[1], q.q[2], q.q[3]);
+      }
+      fprintf(csv, "\n");
+    }
+    fclose(csv);
+  }
+  return ok ? 0 : 1;
+}
@@ -42,11 +42,62 @@
 #define ACC_FULL_SCALE_8_G 0x10
 #define ACC_FULL_SCALE_16_G 0x18
 
+/* MPU9250 registers used for FIFO acquisition */
+#define MPU9250_SMPLRT_DIV   0x19
+#define MPU9250_CONFIG       0x1A
+#define MPU9250_ACCEL_CONFIG2 0x1D
+#define MPU9250_FIFO_EN      0x23
+#define MPU9250_INT_PIN_CFG  0x37
+#define MPU9250_INT_ENABLE   0x38
+#define MPU9250_USER_CTRL    0x6A
+#define MPU9250_FIFO_COUNTH  0x72
+#define MPU9250_FIFO_R_W     0x74
+
+/* FIFO_EN: accelerometer and the three gyro axes */
+#define FIFO_EN_ACCEL_GYRO   0x78
+
+/* USER_CTRL bits */
+#define USER_CTRL_FIFO_EN    0x40
+#define USER_CTRL_FIFO_RST   0x04
+
+/* INT_PIN_CFG: magnetometer bypass, interrupt latched until any read */
+#define INT_PIN_CFG_BYPASS   0x02
+#define INT_PIN_CFG_ANYRD    0x30
+
+/* FIFO size, and bytes per sample (accelerometer then gyro, no temperature) */
+#define MPU9250_FIFO_SIZE    512
+#define FIFO_SAMPLE_SIZE     12
+
+/* AK8963 registers and modes */
+#define AK8963_ST1           0x02
+#define AK8963_CNTL1         0x0A
+#define AK8963_SINGLE_16BIT  0x11
+#define AK8963_CONT2_16BIT   0x16   // continuous, 100 Hz
+
+/* all measurements are converted to 16 bits by the IMU-internal ADC */
+static const double max16BitValue = 32767.0;
+
+/* scale of the accelerometer to m/s^2, for the range set in init() */
+static const double accScale = 9.80665 * 16.0 / max16BitValue;
+
+/* scale of the gyro to degrees per second, for the range set in init() */
+static const double gyrScale = 2000.0 / max16BitValue;
+
+/* scale of the magnetometer to micro Tesla */
+static const double magScale = 4912.0 / max16BitValue;
+
+volatile uint16_t Imu::_readySamples = 0;
+
+Imu::Imu(ImuBus& bus)
+  : magUpdated(false), _bus(bus), _fifo(false), _samplePeriodUs(1000), _interruptPin(-1),
+    _minBatch(1), _magEvery(10), _samplesSinceMag(0), _fifoStats() {}
+
 
 void Imu::init()
 {
-  Wire.begin();
-  delay(2000);
+  _bus.begin();
+  // MPU9250 start-up time for register access is 100 ms at most
+  delay(100);
   checkCommunication();
 
 
@@ -67,7 +118,7 @@ void Imu::init()
   this->_magnetometerAdjustmentScaleZ = 0.5 * (double(buf[2]) - 128) / 128 + 1;
 
   // Request first magnetometer single 16 bit measurement
-  this->I2CwriteByte(MAG_ADDRESS, 0x0A, B00010001);
+  this->I2CwriteByte(MAG_ADDRESS, AK8963_CNTL1, AK8963_SINGLE_16BIT);
 
   //  uint8_t cntl_reg;
   //  I2Cread(MAG_ADDRESS,0x0A,1,&cntl_reg);
@@ -81,26 +132,51 @@ void Imu::init()
 void Imu::I2Cread(uint8_t Address, uint8_t Register, uint8_t Nbytes,
                   uint8_t *Data)
 {
-  // Set register address
-  Wire.beginTransmission(Address);
-  Wire.write(Register);
-  Wire.endTransmission();
-
-  // Read Nbytes
-  Wire.requestFrom(Address, Nbytes);
-  uint8_t index = 0;
-
-  while (Wire.available()) Data[index++] = Wire.read();
+  _bus.read(Address, Register, Nbytes, Data);
 }
 
 /* Write a byte (Data) in device (Address) at register (Register) */
 void Imu::I2CwriteByte(uint8_t Address, uint8_t Register, uint8_t Data)
 {
-  // Set register address
-  Wire.beginTransmission(Address);
-  Wire.write(Register);
-  Wire.write(Data);
-  Wire.endTransmission();
+  _bus.writeByte(Address, Register, Data);
+}
+
+/* convert 16 bit raw accelerometer measurements to metric units */
+static void decodeAcc(const uint8_t* data, double* acc) {
+  int16_t ax = data[0] << 8 | data[1];
+  int16_t ay = data[2] << 8 | data[3];
+  int16_t az = data[4] << 8 | data[5];
+
+  acc[0] = -double(ax) * accScale;
+  acc[1] = double(ay) * accScale;
+  acc[2] = -double(az) * accScale;
+}
+
+/* convert 16 bit raw gyroscope measurements to degrees per second */
+static void decodeGyr(const uint8_t* data, double* gyr) {
+  int16_t gx = data[0] << 8 | data[1];
+  int16_t gy = data[2] << 8 | data[3];
+  int16_t gz = data[4] << 8 | data[5];
+
+  gyr[0] = -double(gx) * gyrScale;
+  gyr[1] = double(gy) * gyrScale;
+  gyr[2] = -double(gz) * gyrScale;
+}
+
+void Imu::setAcc(const uint8_t* data) {
+  double acc[3];
+  decodeAcc(data, acc);
+  accX = acc[0];
+  accY = acc[1];
+  accZ = acc[2];
+}
+
+void Imu::setGyr(const uint8_t* data) {
+  double gyr[3];
+  decodeGyr(data, gyr);
+  gyrX = gyr[0];
+  gyrY = gyr[1];
+  gyrZ = gyr[2];
 }
 
 /***
@@ -109,58 +185,23 @@ void Imu::I2CwriteByte(uint8_t Address, uint8_t Register, uint8_t Data)
  *        which may be different for gyro, accelerometer, and magnetometer
  */
 void Imu::read() {
-  // all measurements are converted to 16 bits by the IMU-internal ADC
-  double max16BitValue = 32767.0;
-
-
   uint8_t Buf[14];
 
+  magUpdated = false;
   this->I2Cread(MPU9250_ADDRESS, 0x3B, 14, Buf);
 
-  /* Read accelerometer */
-
-  /* 16 bit accelerometer data */
-  int16_t ax = Buf[0] << 8 | Buf[1];
-  int16_t ay = Buf[2] << 8 | Buf[3];
-  int16_t az = Buf[4] << 8 | Buf[5];
-
-  /* scale to get metric data in m/s^2 */
-
-  // float maxAccRange   = 2.0; // in g
-  double maxAccRange = 16.0;                             // max range (in g)
-                                                         // as set in setup()
-                                                         // function
-  double g2ms2    = 9.80665;
-  double accScale = g2ms2 * maxAccRange / max16BitValue; // convert 16 bit to
-                                                         // float
-
-  /* convert 16 bit raw measurement to metric float */
-  accX = -double(ax) * accScale;
-  accY = double(ay) * accScale;
-  accZ = -double(az) * accScale;
-
-
-  /* Read gyroscope */
-
-  /* 16 bit gyroscope raw data */
-  int16_t gx = Buf[8] << 8 | Buf[9];
-  int16_t gy = Buf[10] << 8 | Buf[11];
-  int16_t gz = Buf[12] << 8 | Buf[13];
-
-  double maxGyrRange = 2000.0;                   // max range (in deg per sec)
-                                                 // as set in setup() function
-  // float maxGyrRange = 500.0;
-  double gyrScale = maxGyrRange / max16BitValue; // convert 16 bit to float
-
-  /* convert 16 bit raw measurement to metric float */
-  gyrX = -double(gx) * gyrScale;
-  gyrY = double(gy) * gyrScale;
-  gyrZ = -double(gz) * gyrScale;
-
+  /* accelerometer in m/s^2, then (after the temperature) gyro in deg/s */
+  setAcc(Buf);
+  setGyr(Buf + 8);
 
   /* Read magnetometer */
+  if (_fifo) {
+    readMagnetometer();
+    return;
+  }
+
   uint8_t ST1;
-  I2Cread(MAG_ADDRESS, 0x02, 1, &ST1);
+  I2Cread(MAG_ADDRESS, AK8963_ST1, 1, &ST1);
 
   /* new measurement available (otherwise just move on) */
   if (ST1 & 0x01) {
@@ -179,14 +220,204 @@ void Imu::read() {
     int16_t mmz = -m[5] << 8 | m[4];
 
     /* convert 16 bit raw measurement to metric float */
-    double magScale = 4912.0 / max16BitValue;
     this->magX = double(mmx) * magScale * this->_magnetometerAdjustmentScaleX;
     this->magY = double(mmy) * magScale * this->_magnetometerAdjustmentScaleY;
     this->magZ = double(mmz) * magScale * this->_magnetometerAdjustmentScaleZ;
+    magUpdated = true;
 
     /* request next reading on magnetometer */
-    I2CwriteByte(MAG_ADDRESS, 0x0A, B00010001);
+    I2CwriteByte(MAG_ADDRESS, AK8963_CNTL1, AK8963_SINGLE_16BIT);
+  }
+}
+
+void Imu::dataReadyIsr() {
+  if (_readySamples < 0xffff) _readySamples++;
+}
+
+void Imu::startFifo(int rateHz, int interruptPin, int minBatch) {
+  if (rateHz < 4) rateHz = 4;
+  if (rateHz > 1000) rateHz = 1000;
+
+  // 1 kHz internal rate with the 184 Hz low pass filters, divided down
+  uint8_t divider = uint8_t(1000 / rateHz - 1);
+  I2CwriteByte(MPU9250_ADDRESS, MPU9250_CONFIG, 0x01);
+  I2CwriteByte(MPU9250_ADDRESS, MPU9250_ACCEL_CONFIG2, 0x01);
+  I2CwriteByte(MPU9250_ADDRESS, MPU9250_SMPLRT_DIV, divider);
+  _samplePeriodUs = 1000UL * (divider + 1);
+
+  // the magnetometer only has new data every 10 ms
+  _magEvery = 10000 / _samplePeriodUs;
+  if (_magEvery < 1) _magEvery = 1;
+  _samplesSinceMag = 0;
+
+  // keep the bypass, and let the interrupt clear on any read
+  I2CwriteByte(MPU9250_ADDRESS, MPU9250_INT_PIN_CFG, INT_PIN_CFG_BYPASS | INT_PIN_CFG_ANYRD);
+
+  _interruptPin = interruptPin;
+  _minBatch = minBatch < 1 ? 1 : minBatch > IMU_MAX_BATCH ? IMU_MAX_BATCH : minBatch;
+  if (interruptPin >= 0) {
+    pinMode(interruptPin, INPUT);
+    attachInterrupt(digitalPinToInterrupt(interruptPin), dataReadyIsr, RISING);
+    I2CwriteByte(MPU9250_ADDRESS, MPU9250_INT_ENABLE, 0x01);
   }
+
+  startMagnetometer();
+
+  I2CwriteByte(MPU9250_ADDRESS, MPU9250_FIFO_EN, FIFO_EN_ACCEL_GYRO);
+  resetFifo();
+  _fifo = true;
+  _readySamples = 0;
+}
+
+void Imu::resetFifo() {
+  I2CwriteByte(MPU9250_ADDRESS, MPU9250_USER_CTRL, USER_CTRL_FIFO_RST);
+  I2CwriteByte(MPU9250_ADDRESS, MPU9250_USER_CTRL, USER_CTRL_FIFO_EN);
+}
+
+/* magnetometer measures continuously, so reading it is a single burst */
+void Imu::startMagnetometer() {
+  I2CwriteByte(MAG_ADDRESS, AK8963_CNTL1, 0x00);
+  delay(1);
+  I2CwriteByte(MAG_ADDRESS, AK8963_CNTL1, AK8963_CONT2_16BIT);
+}
+
+/***
+ * ST1, the six data bytes and ST2 in one burst. Reading ST2 releases the
+ * data registers for the next measurement.
+ */
+bool Imu::readMagnetometer(double* mag) {
+  uint8_t m[8];
+  I2Cread(MAG_ADDRESS, AK8963_ST1, 8, m);
+
+  /* no new measurement, or magnetic sensor overflow */
+  if (!(m[0] & 0x01) || (m[7] & 0x08)) return false;
+
+  int16_t mmy =  m[2] << 8 | m[1];
+  int16_t mmx =  m[4] << 8 | m[3];
+  int16_t mmz = -m[6] << 8 | m[5];
+
+  mag[0] = double(mmx) * magScale * this->_magnetometerAdjustmentScaleX;
+  mag[1] = double(mmy) * magScale * this->_magnetometerAdjustmentScaleY;
+  mag[2] = double(mmz) * magScale * this->_magnetometerAdjustmentScaleZ;
+  return true;
+}
+
+bool Imu::readMagnetometer() {
+  double mag[3];
+  if (!readMagnetometer(mag)) return false;
+
+  this->magX = mag[0];
+  this->magY = mag[1];
+  this->magZ = mag[2];
+  magUpdated = true;
+  _fifoStats.magReads++;
+  return true;
+}
+
+void Imu::sample(ImuReading& reading, bool withMagnetometer) {
+  uint8_t Buf[14];
+  I2Cread(MPU9250_ADDRESS, 0x3B, 14, Buf);
+
+  double acc[3], gyr[3];
+  decodeAcc(Buf, acc);
+  decodeGyr(Buf + 8, gyr);
+  reading.imu.accX = acc[0];
+  reading.imu.accY = acc[1];
+  reading.imu.accZ = acc[2];
+  reading.imu.gyrX = gyr[0];
+  reading.imu.gyrY = gyr[1];
+  reading.imu.gyrZ = gyr[2];
+
+  double mag[3];
+  reading.hasMag = withMagnetometer && readMagnetometer(mag);
+  if (reading.hasMag) {
+    reading.magX = mag[0];
+    reading.magY = mag[1];
+    reading.magZ = mag[2];
+  }
+}
+
+void Imu::setReading(const ImuReading& reading) {
+  setSample(reading.imu);
+  magUpdated = reading.hasMag;
+  if (reading.hasMag) {
+    magX = reading.magX;
+    magY = reading.magY;
+    magZ = reading.magZ;
+  }
+}
+
+int Imu::readBatch(ImuSample* samples, int maxSamples) {
+  magUpdated = false;
+  if (!_fifo) return 0;
+
+  // samples arriving from here on are counted for the next call
+  if (_interruptPin >= 0) {
+    if (_readySamples < _minBatch) return 0;
+    _readySamples = 0;
+  }
+
+  uint8_t countBytes[2];
+  I2Cread(MPU9250_ADDRESS, MPU9250_FIFO_COUNTH, 2, countBytes);
+  int count = (countBytes[0] & 0x1F) << 8 | countBytes[1];
+
+  // a full FIFO has dropped samples, and a partial sample means we lost
+  // track of where samples start; both need a reset
+  if (count > MPU9250_FIFO_SIZE - FIFO_SAMPLE_SIZE || count % FIFO_SAMPLE_SIZE != 0) {
+    resetFifo();
+    _fifoStats.overflows++;
+    return 0;
+  }
+
+  int n = count / FIFO_SAMPLE_SIZE;
+  if (n > maxSamples) n = maxSamples;
+  if (n > IMU_MAX_BATCH) n = IMU_MAX_BATCH;
+  if (n == 0) return 0;
+
+  // whole samples per burst, as many as the bus takes at once
+  int perRead = _bus.maxRead() / FIFO_SAMPLE_SIZE;
+  if (perRead < 1) perRead = 1;
+
+  uint8_t data[IMU_MAX_BATCH * FIFO_SAMPLE_SIZE];
+  for (int i = 0; i < n; i += perRead) {
+    int chunk = n - i < perRead ? n - i : perRead;
+    I2Cread(MPU9250_ADDRESS, MPU9250_FIFO_R_W, uint8_t(chunk * FIFO_SAMPLE_SIZE),
+            data + i * FIFO_SAMPLE_SIZE);
+  }
+
+  for (int i = 0; i < n; i++) {
+    setAcc(data + i * FIFO_SAMPLE_SIZE);
+    setGyr(data + i * FIFO_SAMPLE_SIZE + 6);
+    samples[i].accX = accX;
+    samples[i].accY = accY;
+    samples[i].accZ = accZ;
+    samples[i].gyrX = gyrX;
+    samples[i].gyrY = gyrY;
+    samples[i].gyrZ = gyrZ;
+  }
+
+  // more left than we took: come back without waiting for the interrupt
+  if (_interruptPin >= 0 && n * FIFO_SAMPLE_SIZE < count) _readySamples = uint16_t(_minBatch);
+
+  // keep in step with the magnetometer's 10 ms; if it is not ready yet,
+  // try again with the next batch
+  _samplesSinceMag += n;
+  if (_samplesSinceMag >= _magEvery) {
+    if (readMagnetometer()) _samplesSinceMag %= _magEvery;
+  }
+
+  _fifoStats.drains++;
+  _fifoStats.samples += n;
+  return n;
+}
+
+void Imu::setSample(const ImuSample& sample) {
+  accX = sample.accX;
+  accY = sample.accY;
+  accZ = sample.accZ;
+  gyrX = sample.gyrX;
+  gyrY = sample.gyrY;
+  gyrZ = sample.gyrZ;
 }
 
 void Imu::checkCommunication()
@@ -201,14 +432,6 @@ void Imu::checkCommunication()
 uint8_t Imu::readByte(uint8_t address, uint8_t readRegister)
 {
   uint8_t data;                          // `data` will store the register data
-
-  Wire.beginTransmission(address);       // Initialize the Tx buffer
-  Wire.write(readRegister);              // Put slave register address in Tx
-                                         // buffer
-  Wire.endTransmission(false);           // Send the Tx buffer, but send a
-                                         // restart to keep connection alive
-  Wire.requestFrom(address, (uint8_t)1); // Read one byte from slave register
-                                         // address
-  data = Wire.read();                    // Fill Rx buffer with result
+  _bus.read(address, readRegister, 1, &data);
   return data;                           // Return data read from slave register
 }
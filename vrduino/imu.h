@@ -12,8 +12,32 @@
 
 #include <Arduino.h>
 
-/* for I2C and serial communication */
-#include <Wire.h>
+/* register access, I2C on the Teensy */
+#include "ImuBus.h"
+
+/* most samples readBatch() returns at once */
+#define IMU_MAX_BATCH 32
+
+/* one accelerometer and gyroscope sample from the FIFO, in metric units */
+struct ImuSample {
+  float accX, accY, accZ;  // m/s^2
+  float gyrX, gyrY, gyrZ;  // degrees per second
+};
+
+/* all sensors at one time, from Imu::sample() */
+struct ImuReading {
+  ImuSample imu;
+  float magX, magY, magZ;  // micro Tesla, when hasMag
+  bool hasMag;
+};
+
+/* counters of the FIFO acquisition */
+struct ImuFifoStats {
+  unsigned long samples;    // samples delivered
+  unsigned long overflows;  // FIFO resets after an overflow, losing samples
+  unsigned long drains;     // readBatch() calls that found samples
+  unsigned long magReads;   // new magnetometer measurements
+};
 
 class Imu {
 public:
@@ -22,8 +46,17 @@ public:
   double accX, accY, accZ;
   double magX, magY, magZ;
 
+  /* magX..magZ are a new measurement from the last read() or readBatch() */
+  bool magUpdated;
+
   bool communication;
 
+  /* on the Teensy's I2C bus */
+  Imu() : Imu(defaultWireBus()) {}
+
+  /* on another bus, e.g. the simulated one on the host */
+  explicit Imu(ImuBus& bus);
+
   /* initialize imu */
   void init();
 
@@ -33,8 +66,70 @@ public:
   /* hardware connection check */
   void checkCommunication();
 
+  /***
+   * FIFO acquisition
+   *
+   * startFifo() has the MPU9250 sample accelerometer and gyroscope at
+   * rateHz (4 to 1000) into its FIFO and puts the magnetometer into 100 Hz
+   * continuous mode. readBatch() then drains all samples collected since
+   * the last call with a few burst reads, oldest first, and updates
+   * accX..gyrZ to the newest sample and magX..magZ when the magnetometer
+   * has a new measurement.
+   *
+   * With interruptPin >= 0 (wired to the MPU9250 INT pin), the data ready
+   * interrupt counts the samples, and readBatch() only touches the bus once
+   * at least minBatch of them are waiting. Without it, each call reads the
+   * FIFO count. The magnetometer is read once per 10 ms of samples.
+   */
+  void startFifo(int rateHz, int interruptPin = -1, int minBatch = 1);
+
+  /* returns the number of samples written to samples, up to maxSamples */
+  int readBatch(ImuSample* samples, int maxSamples);
+
+  /* copy a FIFO sample into accX..gyrZ */
+  void setSample(const ImuSample& sample);
+
+  /***
+   * Timed acquisition (ImuScheduler.h)
+   *
+   * sample() reads accelerometer and gyro, and with withMagnetometer the
+   * magnetometer if it has a new measurement, into reading. It leaves
+   * accX..magZ alone, so a timer interrupt can sample while loop() works on
+   * the previous sample; setReading() then copies it over in loop(). Call
+   * startMagnetometer() first, for 100 Hz continuous mode. Nothing else may
+   * use the bus while an interrupt samples.
+   */
+  void startMagnetometer();
+  void sample(ImuReading& reading, bool withMagnetometer);
+  void setReading(const ImuReading& reading);
+
+  /* time between FIFO samples */
+  unsigned long samplePeriodUs() const { return _samplePeriodUs; }
+
+  const ImuFifoStats& fifoStats() const { return _fifoStats; }
+
 private:
 
+  ImuBus& _bus;
+
+  bool _fifo;
+  unsigned long _samplePeriodUs;
+  int _interruptPin;
+  int _minBatch;
+  unsigned long _magEvery;          // samples per magnetometer measurement
+  unsigned long _samplesSinceMag;
+  ImuFifoStats _fifoStats;
+
+  /* samples signalled by the data ready interrupt since the last drain */
+  static volatile uint16_t _readySamples;
+  static void dataReadyIsr();
+
+  void resetFifo();
+  bool readMagnetometer();
+  bool readMagnetometer(double* mag);
+  void setAcc(const uint8_t* data);
+  void setGyr(const uint8_t* data);
+
   void I2Cread(
     uint8_t  Address,
     uint8_t  Register,
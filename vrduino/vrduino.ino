@@ -26,6 +26,27 @@
 /* Our Euler class */
 #include "Euler.h"
 
+/* Quaternion complementary filter */
+#include "ComplementaryFilter.h"
+
+/* Orientation fusion engines */
+#include "MadgwickFusion.h"
+#include "MahonyFusion.h"
+#include "EkfFusion.h"
+
+/* Extrapolation over the display latency */
+#include "PosePredictor.h"
+
+/* Online calibration and its EEPROM record */
+#include "Calibration.h"
+#include "CalibrationStore.h"
+
+/* Timer-driven sampling */
+#include "ImuScheduler.h"
+
+/* Binary streaming protocol */
+#include "ImuPacket.h"
+
 /* math include */
 #include <math.h>
 
@@ -49,6 +70,28 @@ double accBiasX = 0, accBiasY = 0, accBiasZ = 0;
 double magBiasX = 0, magBiasY = 0, magBiasZ = 0;
 
 
+/***
+ * Calibration (see Calibration.h). The gyro bias is re-estimated whenever
+ * the board rests, and the magnetometer's hard- and soft-iron distortion is
+ * fitted while it is turned around in all directions. Both are kept in
+ * EEPROM (CalibrationStore.h): with a stored record, setup() skips
+ * measureBias() and tracking starts right away. Updates are written at
+ * most every calibrationSaveIntervalMs, the first one at once. Send "C" over
+ * the serial port to erase the record and start the magnetometer fit over.
+ */
+GyroBiasTracker biasTracker;
+MagCalibrator magCalibrator;
+MagCalibration magCalibration;
+StoredCalibration calibration = StoredCalibration();
+
+const unsigned long calibrationSaveIntervalMs = 600000;
+unsigned long lastCalibrationSave = 0;
+bool calibrationChanged = false;
+
+/* calibrated magnetometer in micro Tesla */
+double magCalX = 0, magCalY = 0, magCalZ = 0;
+
+
 /***
  * Integrated gyroscope measurements
  *
@@ -58,10 +101,57 @@ double magBiasX = 0, magBiasY = 0, magBiasZ = 0;
 double gyrIntX = 0, gyrIntY = 0, gyrIntZ = 0;
 
 
+/***
+ * Scalar type of the filter state. The Teensy has a single precision FPU
+ * only, so double math is emulated in software; float is several times
+ * faster and accurate enough (see host/quaternion-bench.cpp). Q16 is there for
+ * boards without an FPU.
+ */
+typedef float Real;
+
 /* Variables for streaming data (euler and quaternion based on complementary
    filter) */
-Euler eulerCmp  = Euler();
-Quaternion qCmp = Quaternion();
+EulerT<Real> eulerCmp  = EulerT<Real>();
+QuaternionT<Real> qCmp = QuaternionT<Real>();
+
+
+/***
+ * Orientation fusion (see Fusion.h). When fusion points to an engine, it
+ * replaces the complementary filters above: QUATERNION streams its
+ * orientation and EULER its Euler angles, with yaw held to magnetic north by
+ * the magnetometer instead of drifting with the integrated gyro. Set it to 0
+ * for the complementary filters.
+ *
+ * fusionCycleBudget limits the average cycles per update (0: no limit); at
+ * 72 MHz and 1 kHz a sample has 72000. Over budget, the engine spreads out
+ * its corrections and keeps integrating the gyro at the full rate.
+ */
+MadgwickFusion<Real> madgwick;
+MahonyFusion<Real> mahony;
+EkfFusion<Real> ekf;
+
+FusionEngine<Real>* fusion = &madgwick;
+const unsigned long fusionCycleBudget = 0;
+
+/* the magnetometer values in imu are new and not yet given to fusion */
+bool magFresh = false;
+
+
+/***
+ * Pose prediction (see PosePredictor.h). In QUATERNION_PREDICTED mode each
+ * sample carries qCmp and qCmp extrapolated with the gyro over the time
+ * until it is on screen: the measured time the sample waits in the sketch
+ * for its packet to go out, plus predictionLatencyUs for serial, the bridge,
+ * the WebSocket and the frame wait. Send "L<microseconds>" over the serial
+ * port to set it at run time, e.g. from a measurement on the host.
+ */
+PosePredictor<Real> predictor;
+unsigned long predictionLatencyUs = 25000;
+
+/* average time from a sample to the packet that carries it being sent */
+float onboardLatencyUs = 0;
+
+QuaternionT<Real> qPredicted = QuaternionT<Real>();
 
 
 /***
@@ -70,6 +160,39 @@ Quaternion qCmp = Quaternion();
  */
 Imu imu = Imu();
 
+/***
+ * How the IMU is sampled:
+ *
+ * POLLED_ACQUISITION reads it once per loop(), timed with micros().
+ *
+ * FIFO_ACQUISITION reads it through the MPU9250 FIFO: samples are taken at
+ * imuSampleRate by the chip and loop() processes all of them, each with
+ * the exact sample period, however long an iteration takes. Set
+ * imuInterruptPin to the pin wired to the MPU9250 INT output to skip the
+ * FIFO polling.
+ *
+ * TIMER_ACQUISITION samples at imuSampleRate from a timer interrupt
+ * (ImuScheduler.h), each reading stamped in microseconds; loop() processes
+ * all readings since the last iteration. Send "S" over the serial port for
+ * the timing statistics.
+ */
+const int POLLED_ACQUISITION = 0;
+const int FIFO_ACQUISITION   = 1;
+const int TIMER_ACQUISITION  = 2;
+
+// the FIFO and timer modes have only run against the simulated MPU9250
+// (host/SimImuBus.h); polling stays the default until they are tried on the
+// board
+const int acquisition = POLLED_ACQUISITION;
+const int imuSampleRate = 1000;
+const int imuInterruptPin = -1;
+
+ImuScheduler scheduler(imu);
+
+/* time of the last reading from the scheduler */
+unsigned long scheduledTime = 0;
+bool haveScheduledTime = false;
+
 
 /***
  * Helper function and variables to stream data
@@ -87,21 +210,156 @@ const int MAG        = 5;
 const int GYRINT     = 6;
 const int DEBUG			 = 7;
 
+/***
+ * Bias corrected gyro, accelerometer and calibrated magnetometer, for
+ * recording logs to replay on the host (host/imu-record). Binary only; at
+ * 1 kHz it needs the Teensy's USB serial, which ignores the baud rate.
+ */
+const int RAW        = 8;
+
+/* QUATERNION plus the pose predicted for display, see predictionLatencyUs */
+const int QUATERNION_PREDICTED = 9;
+
 int streamingMode = 3;
 
+/***
+ * Stream binary packets (see ImuPacket.h) instead of text lines; set
+ * binaryProtocol in server/server.js to match. Samples are batched up to
+ * streamBatch per packet, and a packet is never held back longer than
+ * streamMaxDelayUs. DEBUG output is always text.
+ */
+const bool binaryStream = true;
+const int streamBatch = 4;
+const unsigned long streamMaxDelayUs = 5000;
+
+ImuPacketWriter packetWriter;
+
+/* time of the current IMU sample in microseconds */
+unsigned long sampleTime = 0;
+
+/* time of the newest sample in the pending packet */
+unsigned long packetLastTime = 0;
+
+/* send the pending packet, if any */
+void sendPacket() {
+  if (packetWriter.samples() == 0) return;
+
+  // the samples wait from their time to now, on average from the middle
+  unsigned long first = packetWriter.firstTime();
+  float age = float(micros() - first) - float(packetLastTime - first) / 2;
+  onboardLatencyUs += (age - onboardLatencyUs) / 16;
+
+  uint8_t frame[IMU_PACKET_MAX_FRAME];
+  size_t length = packetWriter.frame(frame);
+  Serial.write(frame, length);
+}
+
+void streamPacket(uint8_t type, const float* values) {
+  if (!packetWriter.add(type, sampleTime, values)) {
+    sendPacket();
+    packetWriter.add(type, sampleTime, values);
+  }
+  packetLastTime = sampleTime;
+  if (packetWriter.samples() >= streamBatch ||
+      sampleTime - packetWriter.firstTime() >= streamMaxDelayUs) {
+    sendPacket();
+  }
+}
+
+void streamPacket(uint8_t type, float v0, float v1, float v2, float v3 = 0) {
+  float values[IMU_PACKET_MAX_VALUES] = { v0, v1, v2, v3 };
+  streamPacket(type, values);
+}
+
+/* after text printed between binary packets: a 0 byte delimits it from the
+   packets around it, so the host decoder resynchronizes */
+void endTextBlock() {
+  if (binaryStream) Serial.write(uint8_t(0));
+}
+
+/* qCmp over the time until it is displayed */
+void predictPose() {
+  float latencyUs = onboardLatencyUs + float(predictionLatencyUs);
+  qPredicted = predictor.predict(qCmp, Real(latencyUs / 1e6f));
+}
+
+void streamBinary() {
+  switch (streamingMode) {
+  case EULER:
+    streamPacket(IMU_PACKET_EULER, eulerCmp.pitch, eulerCmp.yaw, eulerCmp.roll);
+    break;
+
+  case QUATERNION:
+    streamPacket(IMU_PACKET_QUATERNION, qCmp.q[0], qCmp.q[1], qCmp.q[2], qCmp.q[3]);
+    break;
+
+  case QUATERNION_PREDICTED: {
+    predictPose();
+    float values[IMU_PACKET_MAX_VALUES] = {
+      float(qCmp.q[0]), float(qCmp.q[1]), float(qCmp.q[2]), float(qCmp.q[3]),
+      float(qPredicted.q[0]), float(qPredicted.q[1]), float(qPredicted.q[2]), float(qPredicted.q[3])
+    };
+    streamPacket(IMU_PACKET_QUATERNION_PREDICTED, values);
+    break;
+  }
+
+  case GYR:
+    streamPacket(IMU_PACKET_GYR, imu.gyrX, imu.gyrY, imu.gyrZ);
+    break;
+
+  case ACC:
+    streamPacket(IMU_PACKET_ACC, imu.accX, imu.accY, imu.accZ);
+    break;
+
+  case MAG:
+    streamPacket(IMU_PACKET_MAG, imu.magX, imu.magY, imu.magZ);
+    break;
+
+  case GYRINT:
+    streamPacket(IMU_PACKET_GYRINT, gyrIntX, gyrIntY, gyrIntZ);
+    break;
+
+  case RAW: {
+    float values[IMU_PACKET_MAX_VALUES] = {
+      float(imu.gyrX - gyrBiasX), float(imu.gyrY - gyrBiasY), float(imu.gyrZ - gyrBiasZ),
+      float(imu.accX), float(imu.accY), float(imu.accZ),
+      float(magCalX), float(magCalY), float(magCalZ)
+    };
+    streamPacket(IMU_PACKET_RAW, values);
+    break;
+  }
+  }
+}
+
 void streamData() {
+  if (binaryStream && streamingMode != DEBUG) {
+    streamBinary();
+    return;
+  }
+
   switch (streamingMode) {
   case NONE:
     break;
 
   case EULER:
-    Serial.printf("EC %f %f %f\n",
-                  eulerCmp.pitch, eulerCmp.yaw, eulerCmp.roll);
+    Serial.printf("EC %f %f %f\n", scalarToDouble(eulerCmp.pitch),
+                  scalarToDouble(eulerCmp.yaw), scalarToDouble(eulerCmp.roll));
     break;
 
   case QUATERNION:
     Serial.printf("QC %f %f %f %f\n",
-                  qCmp.q[0], qCmp.q[1], qCmp.q[2], qCmp.q[3]);
+                  scalarToDouble(qCmp.q[0]), scalarToDouble(qCmp.q[1]),
+                  scalarToDouble(qCmp.q[2]), scalarToDouble(qCmp.q[3]));
+    break;
+
+  case QUATERNION_PREDICTED:
+    predictPose();
+    Serial.printf("QC %f %f %f %f\n",
+                  scalarToDouble(qCmp.q[0]), scalarToDouble(qCmp.q[1]),
+                  scalarToDouble(qCmp.q[2]), scalarToDouble(qCmp.q[3]));
+    Serial.printf("QP %f %f %f %f\n",
+                  scalarToDouble(qPredicted.q[0]), scalarToDouble(qPredicted.q[1]),
+                  scalarToDouble(qPredicted.q[2]), scalarToDouble(qPredicted.q[3]));
     break;
 
   case GYR:
@@ -121,7 +379,8 @@ void streamData() {
     break;
 
 	case DEBUG:
-		Serial.printf("LALALA %f %f\n", gyrIntX, eulerCmp.pitch);
+		Serial.printf("LALALA %f %f\n", gyrIntX, scalarToDouble(eulerCmp.pitch));
+		endTextBlock();
   }
 }
 
@@ -132,17 +391,12 @@ double sign(double value) {
 
 /**
  * This function is used to measure the bias and variance of the measurements.
- * The estimation is performed by taking 1000 measurements. This function should
- * be executed by placing Arduino stedy.
+ * The estimation is performed by taking 1000 measurements in one pass
+ * (Welford, see Calibration.h). This function should be executed by placing
+ * Arduino stedy.
  */
 void measureBias() {
-  gyrBiasX = 0, gyrBiasY = 0, gyrBiasZ = 0;
-  accBiasX = 0, accBiasY = 0, accBiasZ = 0;
-  magBiasX = 0, magBiasY = 0, magBiasZ = 0;
-
-  double gyrVarX = 0, gyrVarY = 0, gyrVarZ = 0;
-  double accVarX = 0, accVarY = 0, accVarZ = 0;
-  double magVarX = 0, magVarY = 0, magVarZ = 0;
+  RunningStats3 gyr, acc, mag;
 
   /***
    * Read IMU data!
@@ -156,89 +410,121 @@ void measureBias() {
   for (int i = 0; i < 1000; i++)
   {
     imu.read();
-    gyrBiasX += imu.gyrX;
-    gyrBiasY += imu.gyrY;
-    gyrBiasZ += imu.gyrZ;
+    gyr.add(imu.gyrX, imu.gyrY, imu.gyrZ);
+    acc.add(imu.accX, imu.accY, imu.accZ);
+    mag.add(imu.magX, imu.magY, imu.magZ);
+  }
 
-    accBiasX += imu.accX;
-    accBiasY += imu.accY;
-    accBiasZ += imu.accZ;
+  gyrBiasX = gyr.mean[0], gyrBiasY = gyr.mean[1], gyrBiasZ = gyr.mean[2];
+  accBiasX = acc.mean[0], accBiasY = acc.mean[1], accBiasZ = acc.mean[2];
+  magBiasX = mag.mean[0], magBiasY = mag.mean[1], magBiasZ = mag.mean[2];
 
-    magBiasX += imu.magX;
-    magBiasY += imu.magY;
-    magBiasZ += imu.magZ;
+  double gyrVar[3] = { gyr.variance(0), gyr.variance(1), gyr.variance(2) };
+  biasTracker.setBias(gyr.mean, gyrVar);
 
-    // delay(10);
+  Serial.printf("X bias: g: %f, m: %f, a: %f\n",
+                gyrBiasX, magBiasX, accBiasX);
+  Serial.printf("Y bias: g: %f, m: %f, a: %f\n",
+                gyrBiasY, magBiasY, accBiasY);
+  Serial.printf("Z bias: g: %f, m: %f, a: %f\n",
+                gyrBiasZ, magBiasZ, accBiasZ);
 
+  Serial.printf("X variance: g: %f, m: %f, a: %f\n",
+                gyr.variance(0), mag.variance(0), acc.variance(0));
+  Serial.printf("Y variance: g: %f, m: %f, a: %f\n",
+                gyr.variance(1), mag.variance(1), acc.variance(1));
+  Serial.printf("Z variance: g: %f, m: %f, a: %f\n",
+                gyr.variance(2), mag.variance(2), acc.variance(2));
+}
 
+/* write the current calibration to EEPROM */
+void storeCalibration() {
+  if (biasTracker.hasBias()) {
+    calibration.flags |= CALIBRATION_GYRO;
+    for (int k = 0; k < 3; k++) {
+      calibration.gyrBias[k] = float(biasTracker.bias[k]);
+      calibration.gyrVariance[k] = float(biasTracker.variance[k]);
+    }
   }
+  for (int i = 0; i < 3; i++) {
+    calibration.magOffset[i] = float(magCalibration.offset[i]);
+    for (int j = 0; j < 3; j++) calibration.magMatrix[i * 3 + j] = float(magCalibration.matrix[i][j]);
+  }
+  saveCalibration(calibration);
+  lastCalibrationSave = millis();
+  calibrationChanged = false;
+}
 
-  gyrBiasX /= 1000;
-  gyrBiasY /= 1000;
-  gyrBiasZ /= 1000;
-
-  accBiasX /= 1000;
-  accBiasY /= 1000;
-  accBiasZ /= 1000;
-
-  magBiasX /= 1000;
-  magBiasY /= 1000;
-  magBiasZ /= 1000;
-
+/* use the calibration from EEPROM; returns false without a gyro bias there */
+bool restoreCalibration() {
+  if (!loadCalibration(calibration)) {
+    calibration = StoredCalibration();
+    return false;
+  }
 
-  // Variance = 1/(N-1)*(x_i - \bar{mu})
-  for (int i = 0; i < 1000; i++)
-  {
-      imu.read();
-      gyrVarX += (imu.gyrX - gyrBiasX) * (imu.gyrX - gyrBiasX);
-      gyrVarY += (imu.gyrY - gyrBiasY) * (imu.gyrY - gyrBiasY);
-      gyrVarZ += (imu.gyrZ - gyrBiasZ) * (imu.gyrZ - gyrBiasZ);
-
-      accVarX += (imu.accX - accBiasX) * (imu.accX - accBiasX);
-      accVarY += (imu.accY - accBiasY) * (imu.accY - accBiasY);
-      accVarZ += (imu.accZ - accBiasZ) * (imu.accZ - accBiasZ);
-
-      magVarX += (imu.magX - magBiasX) * (imu.magX - magBiasX);
-      magVarY += (imu.magY - magBiasY) * (imu.magY - magBiasY);
-      magVarZ += (imu.magZ - magBiasZ) * (imu.magZ - magBiasZ);
+  if (calibration.flags & CALIBRATION_MAG) {
+    for (int i = 0; i < 3; i++) {
+      magCalibration.offset[i] = calibration.magOffset[i];
+      for (int j = 0; j < 3; j++) magCalibration.matrix[i][j] = calibration.magMatrix[i * 3 + j];
+    }
   }
+  if (!(calibration.flags & CALIBRATION_GYRO)) return false;
 
-  gyrVarX /= 999;
-  gyrVarY /= 999;
-  gyrVarZ /= 999;
+  double bias[3], variance[3];
+  for (int k = 0; k < 3; k++) {
+    bias[k] = calibration.gyrBias[k];
+    variance[k] = calibration.gyrVariance[k];
+  }
+  biasTracker.setBias(bias, variance);
+  gyrBiasX = bias[0], gyrBiasY = bias[1], gyrBiasZ = bias[2];
+  return true;
+}
 
-  accVarX /= 999;
-  accVarY /= 999;
-  accVarZ /= 999;
+/* keep the bias and magnetometer estimates current, with the sample in imu */
+void calibrate() {
+  if (biasTracker.add(imu.gyrX, imu.gyrY, imu.gyrZ, imu.accX, imu.accY, imu.accZ)) {
+    gyrBiasX = biasTracker.bias[0];
+    gyrBiasY = biasTracker.bias[1];
+    gyrBiasZ = biasTracker.bias[2];
+    calibrationChanged = true;
+  }
 
-  magVarX /= 999;
-  magVarY /= 999;
-  magVarZ /= 999;
+  if (magFresh) magCalibrator.add(imu.magX, imu.magY, imu.magZ);
 
+  double mag[3];
+  magCalibration.apply(imu.magX, imu.magY, imu.magZ, mag);
+  magCalX = mag[0], magCalY = mag[1], magCalZ = mag[2];
+}
 
-  Serial.printf("X bias: g: %f, m: %f, a: %f\n",
-                gyrBiasX, magBiasX, accBiasX);
-  Serial.printf("Y bias: g: %f, m: %f, a: %f\n",
-                gyrBiasY, magBiasY, accBiasY);
-  Serial.printf("Z bias: g: %f, m: %f, a: %f\n",
-                gyrBiasZ, magBiasZ, accBiasZ);
+/***
+ * Fit the magnetometer once enough samples are in, and save the calibration
+ * when it is due. The fit solves in double, which the Teensy does in
+ * software, and a save writes EEPROM, so either can take longer than the
+ * sample buffers hold: loop() calls this outside update(), once no samples
+ * are waiting.
+ */
+void maintainCalibration() {
+  if (magCalibrator.ready()) {
+    // the first fit is saved right away, later ones refine it
+    if (magCalibrator.fit(magCalibration)) {
+      if (!(calibration.flags & CALIBRATION_MAG)) lastCalibrationSave = 0;
+      calibration.flags |= CALIBRATION_MAG;
+      calibrationChanged = true;
+    }
+    magCalibrator.reset();
+  }
 
-  Serial.printf("X variance: g: %f, m: %f, a: %f\n",
-                gyrVarX, magVarX, accVarX);
-  Serial.printf("Y variance: g: %f, m: %f, a: %f\n",
-                gyrVarY, magVarY, accVarY);
-  Serial.printf("Z variance: g: %f, m: %f, a: %f\n",
-                gyrVarZ, magVarZ, accVarZ);
+  if (calibrationChanged &&
+      (lastCalibrationSave == 0 || millis() - lastCalibrationSave >= calibrationSaveIntervalMs)) {
+    storeCalibration();
+  }
 }
 
 /* Set up Arduino */
 void setup() {
   /* Initialize serial communication */
-  delay(1000);
   Serial.begin(115200);
-  delay(100);
   Serial.println("Serial communication started...");
-  delay(1000);
 
   /* initialize IMU */
   imu.init();
@@ -250,101 +536,32 @@ void setup() {
   }
   */
 
-  /***
-   * Unit tests for the Quaternion class
-   *
-   * These functions would be helpful for debugging your implementation.
-   */
-  Serial.println("Testing Quaternion class...");
-  Serial.println();
-  Quaternion q = Quaternion(2.3, 1.2, 2.1, 3.0);
-
-  /* length() */
-  double l = q.length();
-  Serial.println("Expected length: 4.487761");
-  Serial.printf("Your result: %f\n\n", l);
-
-  /* normalize() */
-  q.normalize();
-  Serial.println("Expected normalized quaternion:");
-  Serial.println("[0.512505 0.267394 0.467939 0.668485]");
-  Serial.println("Your result: ");
-  q.serialPrint();
-  Serial.println();
-
-  /* inverse() */
-  Quaternion p = Quaternion(3.2, 3.3, 5.2, 0.1);
-  p.inverse();
-  Serial.println("Expected inverse quaternion:");
-  Serial.println("[0.066418 -0.068493 -0.107929 -0.002076]");
-  Serial.println("Your result: ");
-  p.serialPrint();
-  Serial.println();
-
-  /* setFromAngleAxis() */
-  Quaternion q0 = Quaternion().setFromAngleAxis(
-    2, 1 / sqrt(14), 2 / sqrt(14), 3 / sqrt(14));
-  Serial.println("Expected constructed quaternion:");
-  Serial.println("[0.999848 0.004664 0.009329 0.013993]");
-  Serial.println("Your result: ");
-  q0.serialPrint();
-  Serial.println();
-
-  /* multiply() */
-  Quaternion q1   = Quaternion(0.512505, 0.267394, 0.467939, 0.668485);
-  Quaternion q2   = Quaternion(0.461017, -0.475423, -0.749152, -0.014407);
-  Quaternion q1q2 = Quaternion().multiply(q1, q2);
-  Serial.println("Expected multiplied quaternion:");
-  Serial.println("[0.723587 0.373672 -0.482177 0.322949]");
-  Serial.println("Your result: ");
-  q1q2.serialPrint();
-  Serial.println();
-
-  /* rotate() */
-  Quaternion q3 = Quaternion(0.512505, 0.267394, 0.467939, 0.668485);
-  Quaternion q4 = Quaternion(0.461017, -0.475423, -0.749152, -0.014407);
-  Quaternion q5 = q3.rotate(q4);
-  Serial.println("Expected rotated quaternion:");
-  Serial.println("[0.512505 -0.145908 0.750596 -0.390712]");
-  Serial.println("Your result: ");
-  q5.serialPrint();
-  Serial.println();
-
-
-  /* Measure bias */
-  if (findBias) measureBias();
-  delay(1000);
-}
-static double old_time = 0;
-/* Main loop, read and display data */
+  /* the quaternion checks that were printed here run in host/quaternion-bench */
 
-void loop() {
-  /* Reset the estimation if there is a keyboard input. */
-  if (Serial.available()) {
-    streamingMode = Serial.parseInt();
-
-
-
-
-    gyrIntX = 0;
-    gyrIntY = 0;
-    gyrIntZ = 0;
+  /* Stored calibration, or measure the bias (the board must rest) */
+  if (restoreCalibration()) {
+    Serial.println("Using the stored calibration");
+  } else if (findBias) {
+    measureBias();
+    storeCalibration();
+  }
 
-    eulerCmp = Euler();
+  cycleCounterBegin();
+  if (fusion) fusion->setCycleBudget(fusionCycleBudget);
 
-    qCmp = Quaternion();
-		while(Serial.available()) {
-			Serial.read();
-		}
+  if (acquisition == FIFO_ACQUISITION) imu.startFifo(imuSampleRate, imuInterruptPin);
+  if (acquisition == TIMER_ACQUISITION && !scheduler.begin(imuSampleRate)) {
+    Serial.println("No timer for the IMU scheduler");
   }
 
-  /* Get current time in milliseconds */
-  double current_time = millis();
-  double time_delta = current_time - old_time;
-  old_time = current_time;
+  /* end the text above, so the first packet is not taken as part of it */
+  if (binaryStream) Serial.write(uint8_t(0));
+}
+static unsigned long old_time = 0;
 
-  /* Read IMU data! */
-  imu.read();
+/* Update the estimates with the IMU sample in imu, time_delta ms after the last */
+void update(double time_delta) {
+  calibrate();
 
   gyrIntX = gyrIntX + imu.gyrX * time_delta / 1000;
   gyrIntY = gyrIntY + imu.gyrY * time_delta / 1000;
@@ -354,12 +571,31 @@ void loop() {
   double gyrYCorrected = imu.gyrY - gyrBiasY;
 	double gyrZCorrected = imu.gyrZ - gyrBiasZ;
 
+  predictor.update(gyrXCorrected, gyrYCorrected, gyrZCorrected, Real(time_delta / 1000));
 
 	// alpha constant
 	double alpha = .5;
 
+  if (fusion) {
+    FusionInput<Real> in;
+    in.gyrX = gyrXCorrected;
+    in.gyrY = gyrYCorrected;
+    in.gyrZ = gyrZCorrected;
+    in.accX = imu.accX;
+    in.accY = imu.accY;
+    in.accZ = imu.accZ;
+    in.magX = magCalX;
+    in.magY = magCalY;
+    in.magZ = magCalZ;
+    in.hasMag = magFresh;
+
+    fusion->update(in, Real(time_delta / 1000));
+    qCmp = fusion->orientation();
+    if (streamingMode == EULER) eulerCmp = quaternionToEuler(qCmp);
+  }
+
 	/* Use Euler angle to compute the angle  */
-  if (streamingMode == EULER) {
+  else if (streamingMode == EULER) {
     /***
      * TODO
      *
@@ -373,34 +609,133 @@ void loop() {
   }
 
   /* Use quaternion to comptue the angle */
-  else if (streamingMode == QUATERNION) {
-    double a = .95;
-    double length = sqrt(sq(gyrXCorrected) + sq(gyrYCorrected) + sq(gyrZCorrected)); // degrees
-    Quaternion qdel;
-    if (length == 0)
-    {
-      Serial.println("WHATTTTTTTTTTTT");
-      qdel = Quaternion();
+  else if (streamingMode == QUATERNION || streamingMode == QUATERNION_PREDICTED) {
+    qCmp = complementaryFilterUpdate<Real>(qCmp,
+      gyrXCorrected, gyrYCorrected, gyrZCorrected,
+      imu.accX, imu.accY, imu.accZ, time_delta, Real(.95));
+  }
+
+  magFresh = false;
+}
+
+/* one text line with the timing of TIMER_ACQUISITION, then start over */
+void printSchedulerStats() {
+  ImuSchedulerStats stats = scheduler.stats();
+  scheduler.resetStats();
+  Serial.printf("SCHED ticks %lu late %lu overruns %lu jitter %ld..%ld us rms %.1f us "
+                "busy %lu us queued %u\n", stats.ticks, stats.late, stats.overruns,
+                stats.jitterMinUs, stats.jitterMaxUs, double(stats.jitterRmsUs()),
+                stats.busyMaxUs, unsigned(stats.maxQueued));
+  endTextBlock();
+}
+
+/* Main loop, read and display data */
+
+void loop() {
+  /* "L<microseconds>": the display latency to predict over */
+  if (Serial.available() && Serial.peek() == 'L') {
+    Serial.read();
+    predictionLatencyUs = Serial.parseInt();
+    while (Serial.available()) Serial.read();
+  }
+
+  /* "C": forget the stored calibration and start the magnetometer fit over */
+  if (Serial.available() && Serial.peek() == 'C') {
+    while (Serial.available()) Serial.read();
+    clearCalibration();
+    calibration = StoredCalibration();
+    magCalibration.reset();
+    magCalibrator.reset();
+  }
+
+  /* "S": the scheduler's timing since the last "S" */
+  if (Serial.available() && Serial.peek() == 'S') {
+    while (Serial.available()) Serial.read();
+    printSchedulerStats();
+  }
+
+  /* Reset the estimation if there is a keyboard input. */
+
+  if (Serial.available()) {
+    sendPacket();
+    streamingMode = Serial.parseInt();
+
+
+
+
+    gyrIntX = 0;
+    gyrIntY = 0;
+    gyrIntZ = 0;
+
+    eulerCmp = EulerT<Real>();
+
+    qCmp = QuaternionT<Real>();
+		if (fusion) fusion->reset();
+		predictor.reset();
+		while(Serial.available()) {
+			Serial.read();
+		}
+  }
+
+  if (acquisition == TIMER_ACQUISITION) {
+    /* all readings since the last iteration, oldest first */
+    ScheduledReading r;
+    bool any = false;
+    while (scheduler.pop(r)) {
+      imu.setReading(r.reading);
+      magFresh = magFresh || r.reading.hasMag;
+      unsigned long period = haveScheduledTime ? r.time - scheduledTime : scheduler.periodUs();
+      scheduledTime = r.time;
+      haveScheduledTime = true;
+      sampleTime = r.time;
+      update(period / 1000.0);
+      if (streamingMode == RAW) streamData();
+      any = true;
+    }
+
+    /* the newest estimate; a log needs every sample */
+    if (any && streamingMode != RAW) streamData();
+    maintainCalibration();
+    return;
+  }
+
+  if (acquisition == FIFO_ACQUISITION) {
+    /* all samples since the last iteration, oldest first */
+    ImuSample batch[IMU_MAX_BATCH];
+    int count = imu.readBatch(batch, IMU_MAX_BATCH);
+    magFresh = magFresh || imu.magUpdated;
+    if (count == 0) {
+      maintainCalibration();
+      return;
     }
-    else
-    {
-      qdel = Quaternion().setFromAngleAxis((time_delta/1000 * length   /**(180/PI)*/), gyrXCorrected/length, gyrYCorrected/length, gyrZCorrected/length);
-      // qdel.normalize();
-      Quaternion qGyro = qdel.multiply(qCmp, qdel);
-      qGyro.normalize();
-
-			Quaternion qAlpha = Quaternion(0, imu.accX, imu.accY, imu.accZ);
-      qAlpha.normalize();
-			Quaternion qRotated = qAlpha.rotate(qCmp);
-			Quaternion qRotNorm = qRotated.normalize();
-			double angle = acos(qRotNorm.q[2]) * (180/PI);
-			Quaternion axis = Quaternion(0, -qRotNorm.q[3]/sqrt(sq(qRotNorm.q[1]) + sq(qRotNorm.q[3])), 0, qRotNorm.q[1]/sqrt(sq(qRotNorm.q[1]) + sq(qRotNorm.q[3]))).normalize();
-			Quaternion qTiltCorrect = Quaternion().setFromAngleAxis(angle * (1-a), axis.q[1], axis.q[2], axis.q[3]);
-			qCmp = Quaternion().multiply(qTiltCorrect, qGyro);
-      qCmp.normalize();
 
+    unsigned long now = micros();
+    unsigned long period = imu.samplePeriodUs();
+    for (int i = 0; i < count; i++) {
+      imu.setSample(batch[i]);
+      sampleTime = now - (count - 1 - i) * period;
+      update(period / 1000.0);
+      if (streamingMode == RAW) streamData();
     }
+
+    /* the newest estimate; a log needs every sample */
+    if (streamingMode != RAW) streamData();
+    if (count < IMU_MAX_BATCH) maintainCalibration();
+    return;
   }
 
+  /* time since the last sample in milliseconds, measured in microseconds */
+  unsigned long current_time = micros();
+  double time_delta = (current_time - old_time) / 1000.0;
+  old_time = current_time;
+
+  /* Read IMU data! */
+  sampleTime = current_time;
+  imu.read();
+  magFresh = magFresh || imu.magUpdated;
+
+  update(time_delta);
+
   streamData();
+  maintainCalibration();
 }